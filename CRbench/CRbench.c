@@ -0,0 +1,978 @@
+// CRbench.c
+//
+// Scan-path benchmark. Builds synthetic topologies in the simulated backend,
+// serves each one through every user-mode access backend, and times
+// CrScanTopology at several worker counts. Run it before and after a change
+// to the scan path and compare the tables (or the -c CSV output).
+//
+//   CRbench [-t flat|deep|sriov|sparse] [-b sim|ecam|snapfile] [-j 1,2,4]
+//           [-n iterations] [-r read-ns] [-s clients] [-c]
+//
+// -r adds a busy-wait to every backend read, to approximate real config
+// cycles (about 1 us through the HAL) so worker scaling is visible.
+//
+// -s switches to a coalescing run: that many client threads each issue
+// -n topology scans through CrScanCoalesced, as agents polling the driver
+// at the same time would, and the table reports how many scans ran.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // clock_gettime under strict -std=c11
+#endif
+
+#include "../CRcore/crcore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BENCH_MAX_THREAD_COUNTS  8
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_SNAPSHOT_PATH      "CRbench.snap"
+#define BENCH_MAX_ECAM_REGIONS   64
+
+#define BENCH_INTEL  0x8086
+
+//
+// Timing
+//
+
+static uint64_t
+BenchNow(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Ticks per second of BenchNow.
+static uint64_t
+BenchFrequency(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)frequency.QuadPart;
+#else
+    return 1000000000ull;
+#endif
+}
+
+static double
+BenchNanoseconds(
+    _In_ uint64_t Ticks
+)
+{
+    return (double)Ticks * 1e9 / (double)BenchFrequency();
+}
+
+//
+// Synthetic topologies
+//
+
+typedef struct _BENCH_TOPOLOGY {
+    const char* Name;
+    PCR_CONFIG_BACKEND Sim;
+    uint32_t* Keys;          // Every function added, for building the ECAM image
+    uint32_t Count;
+    uint32_t Capacity;
+} BENCH_TOPOLOGY;
+
+static CR_ADDRESS
+BenchAddress(
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_ uint8_t Device,
+    _In_ uint8_t Function
+)
+{
+    CR_ADDRESS address;
+
+    address.Segment = Segment;
+    address.Bus = Bus;
+    address.Device = Device;
+    address.Function = Function;
+    return address;
+}
+
+static CR_STATUS
+BenchRecord(
+    _Inout_ BENCH_TOPOLOGY* Topology,
+    _In_ CR_ADDRESS Address
+)
+{
+    if (Topology->Count == Topology->Capacity) {
+        return CR_E_NO_MEMORY;
+    }
+    Topology->Keys[Topology->Count++] = CrAddressKey(Address);
+    return CR_OK;
+}
+
+static CR_STATUS
+BenchAddDevice(
+    _Inout_ BENCH_TOPOLOGY* Topology,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ uint8_t HeaderType
+)
+{
+    CR_STATUS status = BenchRecord(Topology, Address);
+
+    return (status != CR_OK) ? status :
+        CrSimAddDevice(Topology->Sim, Address, VendorId, DeviceId, ClassCode, HeaderType);
+}
+
+static CR_STATUS
+BenchAddBridge(
+    _Inout_ BENCH_TOPOLOGY* Topology,
+    _In_ CR_ADDRESS Address,
+    _In_ uint8_t SecondaryBus,
+    _In_ uint8_t SubordinateBus
+)
+{
+    CR_STATUS status = BenchRecord(Topology, Address);
+
+    return (status != CR_OK) ? status :
+        CrSimAddBridge(Topology->Sim, Address, BENCH_INTEL, 0x7A38, SecondaryBus, SubordinateBus);
+}
+
+// Bus 0 fully populated: a host bridge and 31 eight-function devices.
+static CR_STATUS
+BenchBuildFlat(
+    _Inout_ BENCH_TOPOLOGY* Topology
+)
+{
+    CR_STATUS status = BenchAddDevice(Topology, BenchAddress(0, 0, 0, 0), BENCH_INTEL, 0x4660, 0x060000, 0);
+    uint8_t device;
+    uint8_t function;
+
+    for (device = 1; device < CR_MAX_DEVICES && status == CR_OK; device++) {
+        for (function = 0; function < CR_MAX_FUNCTIONS && status == CR_OK; function++) {
+            status = BenchAddDevice(Topology, BenchAddress(0, 0, device, function), BENCH_INTEL, 0x7A00 + device,
+                0x0C0330, CR_HEADER_TYPE_MULTIFUNCTION);
+        }
+    }
+    return status;
+}
+
+#define BENCH_SWITCH_FANOUT 4
+#define BENCH_SWITCH_DEPTH  3
+
+// Buses a switch uses below its upstream port's own bus.
+static uint32_t
+BenchSwitchBuses(
+    _In_ uint32_t Depth
+)
+{
+    return 1 + BENCH_SWITCH_FANOUT * (1 + ((Depth > 1) ? BenchSwitchBuses(Depth - 1) : 0));
+}
+
+// A switch whose upstream port sits at Bus:0.0. Each downstream port leads
+// to another switch until Depth runs out, then to an NVMe endpoint.
+static CR_STATUS
+BenchAddSwitch(
+    _Inout_ BENCH_TOPOLOGY* Topology,
+    _In_ uint8_t Bus,
+    _In_ uint32_t Depth
+)
+{
+    uint8_t internal = (uint8_t)(Bus + 1);
+    uint8_t next = (uint8_t)(internal + 1);
+    uint32_t below = (Depth > 1) ? BenchSwitchBuses(Depth - 1) : 0;
+    uint8_t port;
+    CR_STATUS status;
+
+    status = BenchAddBridge(Topology, BenchAddress(0, Bus, 0, 0), internal, (uint8_t)(Bus + BenchSwitchBuses(Depth)));
+    for (port = 0; port < BENCH_SWITCH_FANOUT && status == CR_OK; port++) {
+        status = BenchAddBridge(Topology, BenchAddress(0, internal, port, 0), next, (uint8_t)(next + below));
+        if (status != CR_OK) {
+            break;
+        }
+        status = (Depth > 1) ?
+            BenchAddSwitch(Topology, next, Depth - 1) :
+            BenchAddDevice(Topology, BenchAddress(0, next, 0, 0), 0x144D, 0xA80A, 0x010802, 0);
+        next = (uint8_t)(next + 1 + below);
+    }
+    return status;
+}
+
+// Root port 0:1.0 feeding a three-level tree of four-port switches.
+static CR_STATUS
+BenchBuildDeep(
+    _Inout_ BENCH_TOPOLOGY* Topology
+)
+{
+    CR_STATUS status = BenchAddDevice(Topology, BenchAddress(0, 0, 0, 0), BENCH_INTEL, 0x4660, 0x060000, 0);
+
+    if (status == CR_OK) {
+        status = BenchAddBridge(Topology, BenchAddress(0, 0, 1, 0), 1, (uint8_t)(1 + BenchSwitchBuses(BENCH_SWITCH_DEPTH)));
+    }
+    return (status == CR_OK) ? BenchAddSwitch(Topology, 1, BENCH_SWITCH_DEPTH) : status;
+}
+
+#define BENCH_SRIOV_PFS      16
+#define BENCH_SRIOV_VFS      255     // Every other routing ID on the PF's bus
+
+// Sixteen NIC physical functions behind their own root ports, each followed
+// by 255 virtual functions at consecutive routing IDs. VFs carry the PF's
+// vendor ID here (real ones read 0xFFFF) so the walker reports them the way
+// an OS-enumerated view does.
+static CR_STATUS
+BenchBuildSriov(
+    _Inout_ BENCH_TOPOLOGY* Topology
+)
+{
+    CR_STATUS status = BenchAddDevice(Topology, BenchAddress(0, 0, 0, 0), BENCH_INTEL, 0x4660, 0x060000, 0);
+    uint32_t pf;
+    uint32_t vf;
+
+    for (pf = 0; pf < BENCH_SRIOV_PFS && status == CR_OK; pf++) {
+        uint8_t bus = (uint8_t)(1 + pf);
+
+        status = BenchAddBridge(Topology, BenchAddress(0, 0, (uint8_t)(1 + pf), 0), bus, bus);
+        if (status == CR_OK) {
+            status = BenchAddDevice(Topology, BenchAddress(0, bus, 0, 0), BENCH_INTEL, 0x1593, 0x020000,
+                CR_HEADER_TYPE_MULTIFUNCTION);
+        }
+        for (vf = 1; vf <= BENCH_SRIOV_VFS && status == CR_OK; vf++) {
+            status = BenchAddDevice(Topology, BenchAddress(0, bus, (uint8_t)(vf >> 3), (uint8_t)(vf & 7)),
+                BENCH_INTEL, 0x1889, 0x020000, CR_HEADER_TYPE_MULTIFUNCTION);
+        }
+    }
+    return status;
+}
+
+// Four segments, each with a host bridge and three far-apart root buses of
+// two endpoints. Nearly every bus is empty, so this measures probing cost.
+static CR_STATUS
+BenchBuildSparse(
+    _Inout_ BENCH_TOPOLOGY* Topology
+)
+{
+    static const uint16_t segments[] = { 0, 1, 0x10, 0x20 };
+    static const uint8_t buses[] = { 0x20, 0x80, 0xE0 };
+    CR_STATUS status = CR_OK;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < sizeof(segments) / sizeof(segments[0]) && status == CR_OK; i++) {
+        status = BenchAddDevice(Topology, BenchAddress(segments[i], 0, 0, 0), BENCH_INTEL, 0x09A2, 0x060000, 0);
+        for (j = 0; j < sizeof(buses) / sizeof(buses[0]) && status == CR_OK; j++) {
+            status = BenchAddDevice(Topology, BenchAddress(segments[i], buses[j], 0, 0), 0x15B3, 0x101D, 0x020000, 0);
+            if (status == CR_OK) {
+                status = BenchAddDevice(Topology, BenchAddress(segments[i], buses[j], 0x1F, 0), 0x144D, 0xA80A,
+                    0x010802, 0);
+            }
+        }
+    }
+    return status;
+}
+
+typedef struct _BENCH_TOPOLOGY_TYPE {
+    const char* Name;
+    uint32_t MaxFunctions;
+    CR_STATUS (*Build)(_Inout_ BENCH_TOPOLOGY* Topology);
+} BENCH_TOPOLOGY_TYPE;
+
+static const BENCH_TOPOLOGY_TYPE BenchTopologies[] = {
+    { "flat", 256, BenchBuildFlat },
+    { "deep", 256, BenchBuildDeep },
+    { "sriov", 8192, BenchBuildSriov },
+    { "sparse", 64, BenchBuildSparse },
+};
+
+static void
+BenchFreeTopology(
+    _Inout_ BENCH_TOPOLOGY* Topology
+)
+{
+    CrBackendClose(Topology->Sim);
+    free(Topology->Keys);
+    memset(Topology, 0, sizeof(*Topology));
+}
+
+static CR_STATUS
+BenchCreateTopology(
+    _In_ const BENCH_TOPOLOGY_TYPE* Type,
+    _Out_ BENCH_TOPOLOGY* Topology
+)
+{
+    CR_STATUS status;
+
+    memset(Topology, 0, sizeof(*Topology));
+    Topology->Name = Type->Name;
+    Topology->Capacity = Type->MaxFunctions;
+    Topology->Keys = (uint32_t*)malloc((size_t)Type->MaxFunctions * sizeof(uint32_t));
+    if (Topology->Keys == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    status = CrSimCreate(Type->MaxFunctions, &Topology->Sim);
+    if (status == CR_OK) {
+        status = Type->Build(Topology);
+    }
+    if (status != CR_OK) {
+        BenchFreeTopology(Topology);
+    }
+    return status;
+}
+
+//
+// Backends. Each one serves the same topology the simulated backend holds.
+//
+
+static void*
+BenchImageMap(
+    _In_opt_ void* Context,
+    _In_ uint64_t PhysicalAddress,
+    _In_ size_t Length
+)
+{
+    (void)Length;
+    return (uint8_t*)Context + PhysicalAddress;
+}
+
+static void
+BenchImageUnmap(
+    _In_opt_ void* Context,
+    _In_ void* Mapping,
+    _In_ size_t Length
+)
+{
+    (void)Context;
+    (void)Mapping;
+    (void)Length;
+}
+
+static int
+BenchCompareKeys(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    uint32_t left = *(const uint32_t*)Left;
+    uint32_t right = *(const uint32_t*)Right;
+
+    return (left > right) - (left < right);
+}
+
+// ECAM backend over an in-memory image. Each run of populated buses becomes
+// one MCFG region backed by consecutive 1 MB chunks of *Image; unpopulated
+// slots inside a chunk read as all-ones. Buses outside every region are
+// unreachable, so the sparse topology probes them with one read each
+// instead of 32; its ecam numbers are not comparable with the others.
+static CR_STATUS
+BenchCreateEcam(
+    _In_ const BENCH_TOPOLOGY* Topology,
+    _Out_ PCR_CONFIG_BACKEND* Backend,
+    _Out_ uint8_t** Image
+)
+{
+    CR_ECAM_REGION regions[BENCH_MAX_ECAM_REGIONS];
+    CR_ECAM_MAPPER mapper;
+    uint32_t* keys;
+    uint32_t regionCount = 0;
+    uint32_t chunks = 0;
+    uint32_t i;
+    CR_STATUS status;
+
+    *Backend = NULL;
+    *Image = NULL;
+    keys = (uint32_t*)malloc(((size_t)Topology->Count + 1) * sizeof(uint32_t));
+    if (keys == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    memcpy(keys, Topology->Keys, (size_t)Topology->Count * sizeof(uint32_t));
+    qsort(keys, Topology->Count, sizeof(uint32_t), BenchCompareKeys);
+
+    // Keys >> 8 is segment:bus, so consecutive values are adjacent buses.
+    for (i = 0; i < Topology->Count; i++) {
+        uint32_t bus = keys[i] >> 8;
+        if (i != 0 && bus == keys[i - 1] >> 8) {
+            continue;
+        }
+        if (i != 0 && bus == (keys[i - 1] >> 8) + 1 && (bus & 0xFF) != 0) {
+            regions[regionCount - 1].EndBus = (uint8_t)bus;
+        }
+        else {
+            if (regionCount == BENCH_MAX_ECAM_REGIONS) {
+                free(keys);
+                return CR_E_UNSUPPORTED;
+            }
+            regions[regionCount].Segment = (uint16_t)(bus >> 8);
+            regions[regionCount].StartBus = (uint8_t)bus;
+            regions[regionCount].EndBus = (uint8_t)bus;
+            // BaseAddress is bus 0's address; let it wrap so StartBus lands on this chunk.
+            regions[regionCount].BaseAddress = ((uint64_t)chunks - (bus & 0xFF)) << 20;
+            regionCount++;
+        }
+        chunks++;
+    }
+
+    *Image = (uint8_t*)malloc(((size_t)chunks << 20) + 1);
+    if (*Image == NULL) {
+        free(keys);
+        return CR_E_NO_MEMORY;
+    }
+    memset(*Image, 0xFF, (size_t)chunks << 20);
+    for (i = 0; i < Topology->Count; i++) {
+        CR_ADDRESS address = CrAddressFromKey(keys[i]);
+        uint32_t r;
+
+        for (r = 0; r < regionCount; r++) {
+            if (regions[r].Segment == address.Segment && address.Bus >= regions[r].StartBus &&
+                address.Bus <= regions[r].EndBus) {
+                uint64_t offset = regions[r].BaseAddress + ((uint64_t)address.Bus << 20) +
+                    ((uint64_t)address.Device << 15) + ((uint64_t)address.Function << 12);
+                CrConfigRead(Topology->Sim, address, 0, *Image + offset, CR_CONFIG_SPACE_SIZE);
+                break;
+            }
+        }
+    }
+    free(keys);
+
+    mapper.Map = BenchImageMap;
+    mapper.Unmap = BenchImageUnmap;
+    mapper.Context = *Image;
+    mapper.Flags = CR_ECAM_MAPPING_IS_MEMORY;
+    status = CrEcamCreate(regions, regionCount, &mapper, Backend);
+    if (status != CR_OK) {
+        free(*Image);
+        *Image = NULL;
+    }
+    return status;
+}
+
+static CR_STATUS
+BenchCreateSnapFile(
+    _In_ const BENCH_TOPOLOGY* Topology,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+    PCR_SNAPFILE file;
+    CR_STATUS status;
+
+    *Backend = NULL;
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    status = CrSnapFileCapture(Topology->Sim, &options, BENCH_SNAPSHOT_PATH);
+    if (status == CR_OK) {
+        status = CrSnapFileOpen(BENCH_SNAPSHOT_PATH, &file);
+    }
+    if (status == CR_OK) {
+        *Backend = CrSnapFileBackend(file);
+    }
+    return status;
+}
+
+// Wraps the backend under test to count reads or to charge a fixed cost per
+// read. Counting is only done on single-worker runs, so it is not atomic.
+typedef struct _BENCH_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    PCR_CONFIG_BACKEND Inner;
+    uint64_t DelayTicks;
+    int Counting;
+    uint32_t Reads;
+    uint64_t Bytes;
+} BENCH_BACKEND;
+
+static uint32_t
+BenchRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    BENCH_BACKEND* bench = (BENCH_BACKEND*)Backend;
+
+    if (bench->Counting) {
+        bench->Reads++;
+        bench->Bytes += Length;
+    }
+    if (bench->DelayTicks != 0) {
+        uint64_t until = BenchNow() + bench->DelayTicks;
+        while (BenchNow() < until) {
+            CrCpuRelax();
+        }
+    }
+    return CrConfigRead(bench->Inner, Address, Offset, Buffer, Length);
+}
+
+static uint32_t
+BenchEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    PCR_CONFIG_BACKEND inner = ((BENCH_BACKEND*)Backend)->Inner;
+
+    if (inner->EnumerateSegments == NULL) {
+        if (Capacity != 0) {
+            Segments[0] = 0;
+        }
+        return 1;
+    }
+    return inner->EnumerateSegments(inner, Segments, Capacity);
+}
+
+static void
+BenchEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    PCR_CONFIG_BACKEND inner = ((BENCH_BACKEND*)Backend)->Inner;
+
+    inner->EnumerateBuses(inner, Segment, Buses);
+}
+
+static void
+BenchClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    (void)Backend;
+}
+
+static void
+BenchWrap(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint32_t ReadNs,
+    _Out_ BENCH_BACKEND* Bench
+)
+{
+    memset(Bench, 0, sizeof(*Bench));
+    Bench->Base.Name = Backend->Name;
+    Bench->Base.Read = BenchRead;
+    Bench->Base.Close = BenchClose;
+    Bench->Base.EnumerateSegments = BenchEnumerateSegments;
+    Bench->Base.EnumerateBuses = (Backend->EnumerateBuses != NULL) ? BenchEnumerateBuses : NULL;
+    Bench->Inner = Backend;
+    Bench->DelayTicks = (uint64_t)ReadNs * BenchFrequency() / 1000000000ull;
+}
+
+//
+// Measurement
+//
+
+typedef struct _BENCH_CONFIG {
+    const char* Topology;            // NULL: all
+    const char* Backend;             // NULL: all
+    uint32_t ThreadCounts[BENCH_MAX_THREAD_COUNTS];
+    uint32_t ThreadCountCount;
+    uint32_t Iterations;
+    uint32_t ReadNs;
+    uint32_t Clients;                // Nonzero: coalescing run
+    int Csv;
+} BENCH_CONFIG;
+
+static int
+BenchCompareTicks(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    uint64_t left = *(const uint64_t*)Left;
+    uint64_t right = *(const uint64_t*)Right;
+
+    return (left > right) - (left < right);
+}
+
+static double
+BenchPercentileUs(
+    _In_reads_(Count) const uint64_t* Sorted,
+    _In_ uint32_t Count,
+    _In_ uint32_t Percent
+)
+{
+    uint32_t index = (uint32_t)(((uint64_t)Count * Percent + 99) / 100);
+
+    return BenchNanoseconds(Sorted[(index == 0) ? 0 : index - 1]) / 1000.0;
+}
+
+static int
+BenchRun(
+    _In_ const BENCH_CONFIG* Config,
+    _In_ const char* TopologyName,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint32_t Expected
+)
+{
+    CR_FUNCTION_RECORD* records;
+    CR_TOPOLOGY_OPTIONS options;
+    CR_SCAN_OUTPUT output;
+    CR_EXECUTOR executor;
+    BENCH_BACKEND bench;
+    uint64_t* samples;
+    uint64_t total;
+    uint32_t t;
+    uint32_t i;
+
+    BenchWrap(Backend, Config->ReadNs, &bench);
+
+    records = (CR_FUNCTION_RECORD*)malloc(((size_t)Expected + 1) * sizeof(CR_FUNCTION_RECORD));
+    samples = (uint64_t*)malloc((size_t)Config->Iterations * sizeof(uint64_t));
+    if (records == NULL || samples == NULL) {
+        free(records);
+        free(samples);
+        return 0;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    output.Records = records;
+    output.Capacity = Expected + 1;
+
+    // One counted sequential pass: functions found and reads per function
+    // do not depend on the worker count.
+    bench.Counting = 1;
+    output.Count = 0;
+    output.Total = 0;
+    CrScanTopology(&bench.Base, &options, &output);
+    bench.Counting = 0;
+    if (output.Total != Expected) {
+        fprintf(stderr, "%s/%s: found %u functions, expected %u\n", TopologyName, Backend->Name, output.Total, Expected);
+    }
+
+    for (t = 0; t < Config->ThreadCountCount; t++) {
+        uint32_t threads = Config->ThreadCounts[t];
+        double meanNs;
+
+        CrThreadExecutorInit(&executor, threads);
+        options.Executor = (threads > 1) ? &executor : NULL;
+        options.MaxWorkers = threads;
+
+        total = 0;
+        for (i = 0; i < Config->Iterations; i++) {
+            uint64_t start;
+
+            output.Count = 0;
+            output.Total = 0;
+            start = BenchNow();
+            CrScanTopology(&bench.Base, &options, &output);
+            samples[i] = BenchNow() - start;
+            total += samples[i];
+        }
+        qsort(samples, Config->Iterations, sizeof(uint64_t), BenchCompareTicks);
+        meanNs = BenchNanoseconds(total) / Config->Iterations;
+
+        printf(Config->Csv ?
+            "%s,%s,%u,%u,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f\n" :
+            "%-8s %-9s %3u %6u %8.2f %8.1f %8.1f %9.1f %9.1f %9.1f %9.1f %9.1f %10.0f\n",
+            TopologyName, Backend->Name, threads, output.Total,
+            output.Total ? (double)bench.Reads / output.Total : 0.0,
+            output.Total ? (double)bench.Bytes / output.Total : 0.0,
+            output.Total ? meanNs / output.Total : 0.0,
+            bench.Reads ? meanNs / bench.Reads : 0.0,
+            BenchPercentileUs(samples, Config->Iterations, 50),
+            BenchPercentileUs(samples, Config->Iterations, 90),
+            BenchPercentileUs(samples, Config->Iterations, 99),
+            BenchNanoseconds(samples[Config->Iterations - 1]) / 1000.0,
+            meanNs > 0 ? output.Total * 1e9 / meanNs : 0.0);
+    }
+
+    free(records);
+    free(samples);
+    return 1;
+}
+
+//
+// Coalescing
+//
+
+typedef struct _BENCH_WAITER {
+    CR_FLIGHT_WAITER Base;
+    CR_SEMAPHORE Done;
+    uint32_t Count;
+} BENCH_WAITER;
+
+typedef struct _BENCH_COALESCE {
+    PCR_CONFIG_BACKEND Backend;
+    CR_TOPOLOGY_OPTIONS Options;
+    CR_SCAN_FLIGHTS Flights;
+    uint32_t Iterations;
+    uint32_t Expected;
+    volatile uint32_t Requests;
+    volatile uint32_t Mismatches;
+} BENCH_COALESCE;
+
+static void
+BenchCoalesceComplete(
+    _In_ PCR_FLIGHT_WAITER Waiter,
+    _In_ CR_STATUS Status,
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count
+)
+{
+    BENCH_WAITER* waiter = (BENCH_WAITER*)Waiter;
+
+    (void)Records;
+    waiter->Count = (Status == CR_OK) ? Count : UINT32_MAX;
+    CrSemaphoreRelease(&waiter->Done, 1);
+}
+
+// One client: issues scans back to back, waiting for each like a blocking
+// DeviceIoControl would.
+static void
+BenchCoalesceClient(
+    _In_ void* Context
+)
+{
+    BENCH_COALESCE* run = (BENCH_COALESCE*)Context;
+    BENCH_WAITER waiter;
+    uint32_t i;
+
+    memset(&waiter, 0, sizeof(waiter));
+    if (!CrSemaphoreInit(&waiter.Done)) {
+        CrAtomicIncrement32(&run->Mismatches);
+        return;
+    }
+    for (i = 0; i < run->Iterations; i++) {
+        waiter.Base.Complete = BenchCoalesceComplete;
+        waiter.Base.Next = NULL;
+        CrScanCoalesced(&run->Flights, run->Backend, &run->Options, NULL, 0, &waiter.Base);
+        CrSemaphoreWait(&waiter.Done);
+        if (waiter.Count != run->Expected) {
+            CrAtomicIncrement32(&run->Mismatches);
+        }
+        CrAtomicIncrement32(&run->Requests);
+    }
+    CrSemaphoreDelete(&waiter.Done);
+}
+
+static int
+BenchCoalesce(
+    _In_ const BENCH_CONFIG* Config,
+    _In_ const char* TopologyName,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint32_t Expected
+)
+{
+    BENCH_BACKEND bench;
+    BENCH_COALESCE* run;
+    CR_EXECUTOR clients;
+    uint64_t start;
+    double elapsedNs;
+
+    run = (BENCH_COALESCE*)calloc(1, sizeof(*run));
+    if (run == NULL) {
+        return 0;
+    }
+    BenchWrap(Backend, Config->ReadNs, &bench);
+    run->Backend = &bench.Base;
+    run->Options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    run->Iterations = Config->Iterations;
+    run->Expected = Expected;
+
+    CrThreadExecutorInit(&clients, Config->Clients);
+    start = BenchNow();
+    clients.Run(&clients, Config->Clients, BenchCoalesceClient, run);
+    elapsedNs = BenchNanoseconds(BenchNow() - start);
+
+    if (run->Mismatches != 0) {
+        fprintf(stderr, "%s/%s: %u request(s) got the wrong function count\n", TopologyName, Backend->Name, run->Mismatches);
+    }
+    printf(Config->Csv ?
+        "%s,%s,%u,%u,%llu,%.2f,%.1f,%.0f\n" :
+        "%-8s %-9s %7u %8u %8llu %9.2f %10.1f %10.0f\n",
+        TopologyName, Backend->Name, Config->Clients, run->Requests,
+        (unsigned long long)run->Flights.Scans,
+        run->Flights.Scans ? (double)run->Requests / (double)run->Flights.Scans : 0.0,
+        run->Requests ? elapsedNs / run->Requests / 1000.0 : 0.0,
+        elapsedNs > 0 ? run->Requests * 1e9 / elapsedNs : 0.0);
+    free(run);
+    return 1;
+}
+
+static const char* const BenchBackends[] = { "sim", "ecam", "snapfile" };
+
+static void
+BenchTopology(
+    _In_ const BENCH_CONFIG* Config,
+    _In_ const BENCH_TOPOLOGY_TYPE* Type
+)
+{
+    BENCH_TOPOLOGY topology;
+    PCR_CONFIG_BACKEND backend;
+    uint8_t* image;
+    uint32_t b;
+    CR_STATUS status;
+
+    status = BenchCreateTopology(Type, &topology);
+    if (status != CR_OK) {
+        fprintf(stderr, "%s: could not build topology (%d)\n", Type->Name, (int)status);
+        return;
+    }
+
+    for (b = 0; b < sizeof(BenchBackends) / sizeof(BenchBackends[0]); b++) {
+        if (Config->Backend != NULL && strcmp(Config->Backend, BenchBackends[b]) != 0) {
+            continue;
+        }
+        image = NULL;
+        backend = NULL;
+        switch (b) {
+        case 0:
+            backend = topology.Sim;
+            status = CR_OK;
+            break;
+        case 1:
+            status = BenchCreateEcam(&topology, &backend, &image);
+            break;
+        default:
+            status = BenchCreateSnapFile(&topology, &backend);
+            break;
+        }
+        if (status != CR_OK) {
+            fprintf(stderr, "%s/%s: could not create backend (%d)\n", Type->Name, BenchBackends[b], (int)status);
+            continue;
+        }
+
+        if (Config->Clients != 0) {
+            BenchCoalesce(Config, Type->Name, backend, topology.Count);
+        }
+        else {
+            BenchRun(Config, Type->Name, backend, topology.Count);
+        }
+
+        if (backend != topology.Sim) {
+            CrBackendClose(backend);
+        }
+        free(image);
+    }
+    remove(BENCH_SNAPSHOT_PATH);
+    BenchFreeTopology(&topology);
+}
+
+static int
+BenchParseThreads(
+    _In_ const char* Text,
+    _Out_ BENCH_CONFIG* Config
+)
+{
+    char* end;
+
+    Config->ThreadCountCount = 0;
+    while (*Text != '\0' && Config->ThreadCountCount < BENCH_MAX_THREAD_COUNTS) {
+        unsigned long threads = strtoul(Text, &end, 10);
+        if (end == Text || threads == 0) {
+            return 0;
+        }
+        Config->ThreadCounts[Config->ThreadCountCount++] = (uint32_t)threads;
+        Text = (*end == ',') ? end + 1 : end;
+    }
+    return Config->ThreadCountCount != 0;
+}
+
+static void
+BenchUsage(void)
+{
+    fprintf(stderr,
+        "usage: CRbench [-t flat|deep|sriov|sparse] [-b sim|ecam|snapfile] [-j 1,2,4]\n"
+        "               [-n iterations] [-r read-ns] [-s clients] [-c]\n");
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    BENCH_CONFIG config;
+    uint32_t cpus = CrOnlineCpuCount();
+    uint32_t threads;
+    uint32_t i;
+    int arg;
+
+    memset(&config, 0, sizeof(config));
+    config.Iterations = BENCH_DEFAULT_ITERATIONS;
+    // Default: 1, 2, 4, ... up to the CPU count.
+    for (threads = 1; config.ThreadCountCount < BENCH_MAX_THREAD_COUNTS; threads *= 2) {
+        config.ThreadCounts[config.ThreadCountCount++] = (threads < cpus) ? threads : cpus;
+        if (threads >= cpus) {
+            break;
+        }
+    }
+
+    for (arg = 1; arg < argc; arg++) {
+        const char* value = (arg + 1 < argc) ? argv[arg + 1] : NULL;
+
+        if (strcmp(argv[arg], "-c") == 0) {
+            config.Csv = 1;
+            continue;
+        }
+        if (value == NULL) {
+            BenchUsage();
+            return 1;
+        }
+        if (strcmp(argv[arg], "-t") == 0) {
+            config.Topology = value;
+        }
+        else if (strcmp(argv[arg], "-b") == 0) {
+            config.Backend = value;
+        }
+        else if (strcmp(argv[arg], "-j") == 0) {
+            if (!BenchParseThreads(value, &config)) {
+                BenchUsage();
+                return 1;
+            }
+        }
+        else if (strcmp(argv[arg], "-n") == 0) {
+            config.Iterations = (uint32_t)strtoul(value, NULL, 10);
+        }
+        else if (strcmp(argv[arg], "-r") == 0) {
+            config.ReadNs = (uint32_t)strtoul(value, NULL, 10);
+        }
+        else if (strcmp(argv[arg], "-s") == 0) {
+            config.Clients = (uint32_t)strtoul(value, NULL, 10);
+            if (config.Clients == 0) {
+                BenchUsage();
+                return 1;
+            }
+        }
+        else {
+            BenchUsage();
+            return 1;
+        }
+        arg++;
+    }
+    if (config.Iterations == 0) {
+        BenchUsage();
+        return 1;
+    }
+
+    if (config.Clients != 0) {
+        printf(config.Csv ?
+            "topology,backend,clients,requests,scans,requests_per_scan,us_per_request,requests_per_s\n" :
+            "%-8s %-9s %7s %8s %8s %9s %10s %10s\n",
+            "topology", "backend", "clients", "requests", "scans", "req/scan", "us/request", "requests/s");
+    }
+    else {
+        printf(config.Csv ?
+            "topology,backend,threads,functions,reads_per_fn,bytes_per_fn,ns_per_fn,ns_per_read,p50_us,p90_us,p99_us,max_us,fn_per_s\n" :
+            "%-8s %-9s %3s %6s %8s %8s %8s %9s %9s %9s %9s %9s %10s\n",
+            "topology", "backend", "thr", "funcs", "reads/fn", "bytes/fn", "ns/fn", "ns/read",
+            "p50 us", "p90 us", "p99 us", "max us", "fn/s");
+    }
+    for (i = 0; i < sizeof(BenchTopologies) / sizeof(BenchTopologies[0]); i++) {
+        if (config.Topology == NULL || strcmp(config.Topology, BenchTopologies[i].Name) == 0) {
+            BenchTopology(&config, &BenchTopologies[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,397 @@
+// crasync.cpp
+//
+// CrAsyncClient: a window of outstanding requests over CrTransport::Submit.
+// Requests carry their own buffers and decoders; completions are decoded by
+// whoever calls Poll, while the transport works on the rest of the window.
+
+#include "crclient.h"
+
+#include <string.h>
+
+// Recycled buffers kept beyond this many are freed instead.
+#define CR_ASYNC_MAX_SPARE_BUFFERS 16
+
+struct CrAsyncClient::Request {
+    uint32_t IoControlCode;
+    std::vector<uint8_t> Input;     // Kept for resubmission
+    std::vector<uint8_t> Buffer;    // Reply
+    bool BufferIsInput;             // READ_BATCH: Buffer holds the request too
+    uint32_t HeaderSize;            // Nonzero for list-shaped replies
+    uint32_t ItemSize;
+    uint32_t TotalOffset;
+    uint32_t Attempts;
+    std::function<void(CR_STATUS Status, Request* Request, uint32_t BytesReturned)> Decode;
+};
+
+CrAsyncClient::CrAsyncClient(
+    CrTransport* Transport,
+    uint32_t Depth
+)
+    : m_Transport(Transport), m_Depth((Depth != 0) ? Depth : 1), m_InFlight(0)
+{
+    memset(m_SizeHints, 0, sizeof(m_SizeHints));
+}
+
+CrAsyncClient::~CrAsyncClient()
+{
+    Drain();
+}
+
+CrAsyncClient::Request*
+CrAsyncClient::Allocate(
+    uint32_t IoControlCode,
+    uint32_t ReplySize
+)
+{
+    Request* request = new Request();
+
+    request->IoControlCode = IoControlCode;
+    if (!m_Buffers.empty()) {
+        request->Buffer.swap(m_Buffers.back());
+        m_Buffers.pop_back();
+    }
+    request->Buffer.resize(ReplySize);
+    request->BufferIsInput = false;
+    request->HeaderSize = 0;
+    request->ItemSize = 0;
+    request->TotalOffset = 0;
+    request->Attempts = 0;
+    return request;
+}
+
+void
+CrAsyncClient::Release(
+    Request* Request
+)
+{
+    if (m_Buffers.size() < CR_ASYNC_MAX_SPARE_BUFFERS) {
+        m_Buffers.push_back(std::vector<uint8_t>());
+        m_Buffers.back().swap(Request->Buffer);
+    }
+    delete Request;
+}
+
+CR_STATUS
+CrAsyncClient::Start(
+    Request* Request
+)
+{
+    const std::vector<uint8_t>& input = Request->BufferIsInput ? Request->Buffer : Request->Input;
+
+    Request->Attempts++;
+    return m_Transport->Submit(Request->IoControlCode, input.empty() ? NULL : input.data(), (uint32_t)input.size(),
+        Request->Buffer.empty() ? NULL : Request->Buffer.data(), (uint32_t)Request->Buffer.size(),
+        [this, Request](CR_STATUS Status, uint32_t BytesReturned) {
+            Complete(Request, Status, BytesReturned);
+        });
+}
+
+// Waits for a slot, then submits. Takes ownership of Request either way.
+CR_STATUS
+CrAsyncClient::Issue(
+    Request* Request
+)
+{
+    CR_STATUS status;
+
+    while (m_InFlight >= m_Depth && m_Transport->Outstanding() != 0) {
+        m_Transport->Poll(CR_POLL_INFINITE);
+    }
+    status = Start(Request);
+    if (status != CR_OK) {
+        Release(Request);
+        return status;
+    }
+    m_InFlight++;
+    return CR_OK;
+}
+
+void
+CrAsyncClient::Complete(
+    Request* Request,
+    CR_STATUS Status,
+    uint32_t BytesReturned
+)
+{
+    uint32_t slot = CR_STATS_IOCTL_SLOT(Request->IoControlCode);
+
+    if (Request->HeaderSize != 0 && Status == CR_E_MORE_DATA) {
+        uint32_t needed = 0;
+
+        Status = CrListReplyNeeded(Request->Buffer.data(), BytesReturned, Request->HeaderSize,
+            Request->ItemSize, Request->TotalOffset, &needed);
+        if (Status == CR_OK && Request->Attempts < CR_CLIENT_EXCHANGE_ATTEMPTS) {
+            // Same slot, bigger buffer.
+            Request->Buffer.resize(needed);
+            Status = Start(Request);
+            if (Status == CR_OK) {
+                return;
+            }
+        }
+        else if (Status == CR_OK) {
+            Status = CR_E_IO;
+        }
+    }
+    else if (Request->HeaderSize != 0 && Status == CR_OK) {
+        Status = CrListReplyCheck(Request->Buffer.data(), BytesReturned, Request->HeaderSize, Request->ItemSize);
+        if (Status == CR_OK && slot < CR_STATS_IOCTL_SLOTS) {
+            m_SizeHints[slot] = BytesReturned;
+        }
+    }
+
+    // The slot is free before the callback runs, so a callback can issue the
+    // next request even with a window of one.
+    m_InFlight--;
+    Request->Decode(Status, Request, BytesReturned);
+    Release(Request);
+}
+
+uint32_t
+CrAsyncClient::Poll(
+    uint32_t TimeoutMs
+)
+{
+    return m_Transport->Poll(TimeoutMs);
+}
+
+void
+CrAsyncClient::Drain()
+{
+    while (m_InFlight != 0 && m_Transport->Outstanding() != 0) {
+        m_Transport->Poll(CR_POLL_INFINITE);
+    }
+}
+
+CR_STATUS
+CrAsyncClient::IssueList(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    uint32_t HeaderSize,
+    uint32_t ItemSize,
+    uint32_t TotalOffset,
+    std::function<void(CR_STATUS Status, const uint8_t* Reply)> Decode
+)
+{
+    uint32_t slot = CR_STATS_IOCTL_SLOT(IoControlCode);
+    uint32_t size = HeaderSize;
+    Request* request;
+
+    if (slot < CR_STATS_IOCTL_SLOTS && m_SizeHints[slot] > size) {
+        size = m_SizeHints[slot];
+    }
+    request = Allocate(IoControlCode, size);
+    if (Input != NULL && InputLength != 0) {
+        request->Input.assign((const uint8_t*)Input, (const uint8_t*)Input + InputLength);
+    }
+    request->HeaderSize = HeaderSize;
+    request->ItemSize = ItemSize;
+    request->TotalOffset = TotalOffset;
+    request->Decode = [Decode](CR_STATUS Status, Request* Request, uint32_t BytesReturned) {
+        (void)BytesReturned;
+        Decode(Status, (Status == CR_OK) ? Request->Buffer.data() : NULL);
+    };
+    return Issue(request);
+}
+
+CR_STATUS
+CrAsyncClient::ScanBus0(
+    const CR_FILTER_SPEC* Filter,
+    uint32_t FilterLength,
+    ScanCallback Callback
+)
+{
+    return IssueList(IOCTL_MYPCISCANNER_SCAN_BUS0, Filter, (Filter != NULL) ? FilterLength : 0,
+        sizeof(CR_SCAN_HEADER), sizeof(CR_FUNCTION_RECORD), offsetof(CR_SCAN_HEADER, TotalCount),
+        [Callback](CR_STATUS Status, const uint8_t* Reply) {
+            CR_SCAN_HEADER header;
+
+            if (Status != CR_OK) {
+                Callback(Status, NULL, 0);
+                return;
+            }
+            memcpy(&header, Reply, sizeof(header));
+            Callback(CR_OK, (const CR_FUNCTION_RECORD*)(Reply + sizeof(header)), header.RecordCount);
+        });
+}
+
+CR_STATUS
+CrAsyncClient::ScanTopology(
+    const CR_TOPOLOGY_REQUEST* Request,
+    uint32_t RequestLength,
+    ScanCallback Callback
+)
+{
+    return IssueList(IOCTL_MYPCISCANNER_SCAN_TOPOLOGY, Request, (Request != NULL) ? RequestLength : 0,
+        sizeof(CR_SCAN_HEADER), sizeof(CR_FUNCTION_RECORD), offsetof(CR_SCAN_HEADER, TotalCount),
+        [Callback](CR_STATUS Status, const uint8_t* Reply) {
+            CR_SCAN_HEADER header;
+
+            if (Status != CR_OK) {
+                Callback(Status, NULL, 0);
+                return;
+            }
+            memcpy(&header, Reply, sizeof(header));
+            Callback(CR_OK, (const CR_FUNCTION_RECORD*)(Reply + sizeof(header)), header.RecordCount);
+        });
+}
+
+CR_STATUS
+CrAsyncClient::Delta(
+    uint32_t IoControlCode,
+    uint64_t BaseGeneration,
+    DeltaCallback Callback
+)
+{
+    CR_DELTA_REQUEST request;
+
+    if (IoControlCode != IOCTL_MYPCISCANNER_SCAN_DELTA && IoControlCode != IOCTL_MYPCISCANNER_WAIT_CHANGE) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    memset(&request, 0, sizeof(request));
+    request.Version = CR_PROTOCOL_VERSION;
+    request.BaseGeneration = BaseGeneration;
+    return IssueList(IoControlCode, &request, sizeof(request),
+        sizeof(CR_DELTA_HEADER), sizeof(CR_FUNCTION_RECORD), offsetof(CR_DELTA_HEADER, TotalCount),
+        [Callback](CR_STATUS Status, const uint8_t* Reply) {
+            CR_DELTA_HEADER header;
+
+            if (Status != CR_OK) {
+                Callback(Status, NULL, NULL);
+                return;
+            }
+            memcpy(&header, Reply, sizeof(header));
+            Callback(CR_OK, &header, (const CR_FUNCTION_RECORD*)(Reply + sizeof(header)));
+        });
+}
+
+CR_STATUS
+CrAsyncClient::ReadBatch(
+    const CR_READ_ENTRY* Entries,
+    uint32_t Count,
+    ReadCallback Callback
+)
+{
+    // Shared by the chunks of one batch; the last one to finish reports.
+    struct Batch {
+        std::vector<CR_READ_RESULT> Results;
+        uint32_t Remaining;
+        uint32_t FailedCount;
+        CR_STATUS Status;
+        ReadCallback Callback;
+    };
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    uint32_t chunks = (Count + CR_MAX_BATCH_ENTRIES - 1) / CR_MAX_BATCH_ENTRIES;
+
+    if (Count == 0) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    batch->Results.resize(Count);
+    batch->Remaining = chunks;
+    batch->FailedCount = 0;
+    batch->Status = CR_OK;
+    batch->Callback = Callback;
+
+    for (uint32_t first = 0; first < Count; first += CR_MAX_BATCH_ENTRIES) {
+        uint32_t count = (Count - first < CR_MAX_BATCH_ENTRIES) ? Count - first : CR_MAX_BATCH_ENTRIES;
+        // Entries and results are both 8 bytes, so one buffer serves both directions.
+        uint32_t size = (uint32_t)(sizeof(CR_BATCH_HEADER) + (size_t)count * sizeof(CR_READ_ENTRY));
+        Request* request = Allocate(IOCTL_MYPCISCANNER_READ_BATCH, size);
+        CR_BATCH_HEADER header;
+        CR_STATUS status;
+
+        header.Version = CR_PROTOCOL_VERSION;
+        header.EntrySize = sizeof(CR_READ_ENTRY);
+        header.Count = count;
+        header.FailedCount = 0;
+        memcpy(request->Buffer.data(), &header, sizeof(header));
+        memcpy(request->Buffer.data() + sizeof(header), Entries + first, (size_t)count * sizeof(CR_READ_ENTRY));
+        request->BufferIsInput = true;
+        request->Decode = [batch, first, count, size](CR_STATUS Status, Request* Request, uint32_t BytesReturned) {
+            CR_BATCH_HEADER reply;
+
+            if (Status == CR_OK) {
+                memcpy(&reply, Request->Buffer.data(), sizeof(reply));
+                if (BytesReturned < size || reply.EntrySize != sizeof(CR_READ_RESULT) || reply.Count != count) {
+                    Status = CR_E_IO;
+                }
+                else {
+                    memcpy(&batch->Results[first], Request->Buffer.data() + sizeof(reply),
+                        (size_t)count * sizeof(CR_READ_RESULT));
+                    batch->FailedCount += reply.FailedCount;
+                }
+            }
+            if (Status != CR_OK && batch->Status == CR_OK) {
+                batch->Status = Status;
+            }
+            if (--batch->Remaining == 0) {
+                batch->Callback(batch->Status, (batch->Status == CR_OK) ? batch->Results.data() : NULL,
+                    (batch->Status == CR_OK) ? (uint32_t)batch->Results.size() : 0, batch->FailedCount);
+            }
+        };
+
+        status = Issue(request);
+        if (status != CR_OK) {
+            // Chunks already in flight still complete; only the last of them
+            // reports, and it reports this failure.
+            if (first == 0) {
+                return status;
+            }
+            batch->Status = status;
+            batch->Remaining -= chunks - first / CR_MAX_BATCH_ENTRIES - 1;
+            if (--batch->Remaining == 0) {
+                Callback(status, NULL, 0, batch->FailedCount);
+            }
+            return CR_OK;
+        }
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrAsyncClient::StartSampling(
+    const CR_SAMPLE_REQUEST* Request,
+    const CR_READ_ENTRY* Registers,
+    SampleCallback Callback
+)
+{
+    uint32_t size = (uint32_t)(sizeof(*Request) + (size_t)Request->RegisterCount * sizeof(CR_READ_ENTRY));
+    CrAsyncClient::Request* request;
+
+    if (Request->RegisterCount > CR_MAX_SAMPLE_REGISTERS) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    request = Allocate(IOCTL_MYPCISCANNER_SAMPLE_START, sizeof(CR_SAMPLE_MAPPING));
+    request->Input.resize(size);
+    memcpy(request->Input.data(), Request, sizeof(*Request));
+    memcpy(request->Input.data() + sizeof(*Request), Registers, (size_t)Request->RegisterCount * sizeof(CR_READ_ENTRY));
+    request->Decode = [Callback](CR_STATUS Status, CrAsyncClient::Request* Request, uint32_t BytesReturned) {
+        CR_SAMPLE_MAPPING mapping;
+
+        if (Status == CR_OK && BytesReturned < sizeof(mapping)) {
+            Status = CR_E_IO;
+        }
+        if (Status != CR_OK) {
+            Callback(Status, NULL);
+            return;
+        }
+        memcpy(&mapping, Request->Buffer.data(), sizeof(mapping));
+        Callback(CR_OK, &mapping);
+    };
+    return Issue(request);
+}
+
+CR_STATUS
+CrAsyncClient::StopSampling(
+    StatusCallback Callback
+)
+{
+    Request* request = Allocate(IOCTL_MYPCISCANNER_SAMPLE_STOP, 0);
+
+    request->Decode = [Callback](CR_STATUS Status, Request* Request, uint32_t BytesReturned) {
+        (void)Request;
+        (void)BytesReturned;
+        Callback(Status);
+    };
+    return Issue(request);
+}
@@ -0,0 +1,548 @@
+// crclient.cpp
+//
+// CrClient: request building, the size-probe protocol and reply checks,
+// independent of how requests travel. Also the default, synchronous
+// CrTransport::Submit for transports without asynchronous I/O.
+
+#include "crclient.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Every list-shaped reply (scan, delta, capabilities, VF ranges) starts with
+// these four fields.
+typedef struct _CR_LIST_PREFIX {
+    uint32_t Version;
+    uint32_t ItemSize;
+    uint32_t Count;
+    uint32_t Total;
+} CR_LIST_PREFIX;
+
+// Replies larger than this are refused rather than allocated.
+#define CR_CLIENT_MAX_REPLY 0x7FFFFFFF
+
+CR_STATUS
+CrTransport::Submit(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    CrCompletion Completion
+)
+{
+    Finished finished;
+
+    finished.Status = Control(IoControlCode, Input, InputLength, Output, OutputLength, &finished.BytesReturned);
+    finished.Completion = Completion;
+    m_Finished.push_back(finished);
+    return CR_OK;
+}
+
+uint32_t
+CrTransport::Poll(
+    uint32_t TimeoutMs
+)
+{
+    uint32_t count = 0;
+
+    (void)TimeoutMs;
+    // A completion may submit more work; only what was finished on entry runs.
+    for (size_t n = m_Finished.size(); n != 0 && !m_Finished.empty(); n--) {
+        Finished finished = m_Finished.front();
+        m_Finished.pop_front();
+        finished.Completion(finished.Status, finished.BytesReturned);
+        count++;
+    }
+    return count;
+}
+
+uint32_t
+CrTransport::Outstanding() const
+{
+    return (uint32_t)m_Finished.size();
+}
+
+CR_STATUS
+CrListReplyNeeded(
+    const uint8_t* Reply,
+    uint32_t BytesReturned,
+    uint32_t HeaderSize,
+    uint32_t ItemSize,
+    uint32_t TotalOffset,
+    uint32_t* Needed
+)
+{
+    uint32_t total;
+    uint64_t needed;
+
+    *Needed = 0;
+    if (BytesReturned < HeaderSize) {
+        return CR_E_IO;
+    }
+    memcpy(&total, Reply + TotalOffset, sizeof(total));
+    needed = (uint64_t)HeaderSize + (uint64_t)total * ItemSize;
+    if (needed > CR_CLIENT_MAX_REPLY) {
+        return CR_E_NO_MEMORY;
+    }
+    *Needed = (uint32_t)needed;
+    return CR_OK;
+}
+
+CR_STATUS
+CrListReplyCheck(
+    const uint8_t* Reply,
+    uint32_t BytesReturned,
+    uint32_t HeaderSize,
+    uint32_t ItemSize
+)
+{
+    CR_LIST_PREFIX prefix;
+
+    if (BytesReturned < sizeof(prefix) || BytesReturned < HeaderSize) {
+        return CR_E_IO;
+    }
+    memcpy(&prefix, Reply, sizeof(prefix));
+    if (prefix.Version != CR_PROTOCOL_VERSION || prefix.ItemSize != ItemSize ||
+        (uint64_t)HeaderSize + (uint64_t)prefix.Count * ItemSize > BytesReturned) {
+        return CR_E_IO;
+    }
+    return CR_OK;
+}
+
+CrClient::CrClient(CrTransport* Transport)
+    : m_Transport(Transport)
+{
+    memset(m_SizeHints, 0, sizeof(m_SizeHints));
+}
+
+CR_STATUS
+CrClient::Exchange(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    uint32_t HeaderSize,
+    uint32_t ItemSize,
+    uint32_t TotalOffset,
+    std::vector<uint8_t>& Reply
+)
+{
+    uint32_t slot = CR_STATS_IOCTL_SLOT(IoControlCode);
+    uint32_t size = HeaderSize;
+    uint32_t bytesReturned = 0;
+    CR_STATUS status = CR_E_MORE_DATA;
+
+    if (slot < CR_STATS_IOCTL_SLOTS && m_SizeHints[slot] > size) {
+        size = m_SizeHints[slot];
+    }
+    for (int attempt = 0; attempt < CR_CLIENT_EXCHANGE_ATTEMPTS && status == CR_E_MORE_DATA; attempt++) {
+        Reply.resize(size);
+        status = m_Transport->Control(IoControlCode, Input, InputLength, Reply.data(), size, &bytesReturned);
+        if (status != CR_E_MORE_DATA) {
+            break;
+        }
+        CR_STATUS sizeStatus = CrListReplyNeeded(Reply.data(), bytesReturned, HeaderSize, ItemSize, TotalOffset, &size);
+        if (sizeStatus != CR_OK) {
+            return sizeStatus;
+        }
+    }
+    if (status != CR_OK) {
+        return (status == CR_E_MORE_DATA) ? CR_E_IO : status;
+    }
+
+    status = CrListReplyCheck(Reply.data(), bytesReturned, HeaderSize, ItemSize);
+    if (status != CR_OK) {
+        return status;
+    }
+    Reply.resize(bytesReturned);
+    if (slot < CR_STATS_IOCTL_SLOTS) {
+        m_SizeHints[slot] = bytesReturned;
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::ScanBus0(
+    const CR_FILTER_SPEC* Filter,
+    uint32_t FilterLength,
+    std::vector<CR_FUNCTION_RECORD>& Records
+)
+{
+    CR_SCAN_HEADER header;
+    CR_STATUS status;
+
+    Records.clear();
+    status = Exchange(IOCTL_MYPCISCANNER_SCAN_BUS0, Filter, (Filter != NULL) ? FilterLength : 0,
+        sizeof(CR_SCAN_HEADER), sizeof(CR_FUNCTION_RECORD), offsetof(CR_SCAN_HEADER, TotalCount), m_Reply);
+    if (status != CR_OK) {
+        return status;
+    }
+    memcpy(&header, m_Reply.data(), sizeof(header));
+    const CR_FUNCTION_RECORD* first = (const CR_FUNCTION_RECORD*)(m_Reply.data() + sizeof(header));
+    Records.assign(first, first + header.RecordCount);
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::ScanTopology(
+    const CR_TOPOLOGY_REQUEST* Request,
+    uint32_t RequestLength,
+    std::vector<CR_FUNCTION_RECORD>& Records
+)
+{
+    CR_SCAN_HEADER header;
+    CR_STATUS status;
+
+    Records.clear();
+    status = Exchange(IOCTL_MYPCISCANNER_SCAN_TOPOLOGY, Request, (Request != NULL) ? RequestLength : 0,
+        sizeof(CR_SCAN_HEADER), sizeof(CR_FUNCTION_RECORD), offsetof(CR_SCAN_HEADER, TotalCount), m_Reply);
+    if (status != CR_OK) {
+        return status;
+    }
+    memcpy(&header, m_Reply.data(), sizeof(header));
+    const CR_FUNCTION_RECORD* first = (const CR_FUNCTION_RECORD*)(m_Reply.data() + sizeof(header));
+    Records.assign(first, first + header.RecordCount);
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::Delta(
+    uint32_t IoControlCode,
+    uint64_t BaseGeneration,
+    CR_DELTA_HEADER* Header,
+    std::vector<CR_FUNCTION_RECORD>& Records
+)
+{
+    CR_DELTA_REQUEST request;
+    CR_STATUS status;
+
+    memset(Header, 0, sizeof(*Header));
+    Records.clear();
+    if (IoControlCode != IOCTL_MYPCISCANNER_SCAN_DELTA && IoControlCode != IOCTL_MYPCISCANNER_WAIT_CHANGE) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    memset(&request, 0, sizeof(request));
+    request.Version = CR_PROTOCOL_VERSION;
+    request.BaseGeneration = BaseGeneration;
+    status = Exchange(IoControlCode, &request, sizeof(request),
+        sizeof(CR_DELTA_HEADER), sizeof(CR_FUNCTION_RECORD), offsetof(CR_DELTA_HEADER, TotalCount), m_Reply);
+    if (status != CR_OK) {
+        return status;
+    }
+    memcpy(Header, m_Reply.data(), sizeof(*Header));
+    const CR_FUNCTION_RECORD* first = (const CR_FUNCTION_RECORD*)(m_Reply.data() + sizeof(*Header));
+    Records.assign(first, first + Header->RecordCount);
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::ReadBatch(
+    const CR_READ_ENTRY* Entries,
+    uint32_t Count,
+    CR_READ_RESULT* Results,
+    uint32_t* FailedCount
+)
+{
+    uint32_t failed = 0;
+
+    if (FailedCount != NULL) {
+        *FailedCount = 0;
+    }
+    for (uint32_t first = 0; first < Count; first += CR_MAX_BATCH_ENTRIES) {
+        uint32_t count = (Count - first < CR_MAX_BATCH_ENTRIES) ? Count - first : CR_MAX_BATCH_ENTRIES;
+        // Entries and results are both 8 bytes, so one buffer serves both directions.
+        uint32_t size = (uint32_t)(sizeof(CR_BATCH_HEADER) + (size_t)count * sizeof(CR_READ_ENTRY));
+        uint32_t bytesReturned = 0;
+        CR_BATCH_HEADER header;
+        CR_STATUS status;
+
+        m_Reply.resize(size);
+        header.Version = CR_PROTOCOL_VERSION;
+        header.EntrySize = sizeof(CR_READ_ENTRY);
+        header.Count = count;
+        header.FailedCount = 0;
+        memcpy(m_Reply.data(), &header, sizeof(header));
+        memcpy(m_Reply.data() + sizeof(header), Entries + first, (size_t)count * sizeof(CR_READ_ENTRY));
+
+        status = m_Transport->Control(IOCTL_MYPCISCANNER_READ_BATCH, m_Reply.data(), size,
+            m_Reply.data(), size, &bytesReturned);
+        if (status != CR_OK) {
+            return status;
+        }
+        memcpy(&header, m_Reply.data(), sizeof(header));
+        if (bytesReturned < size || header.EntrySize != sizeof(CR_READ_RESULT) || header.Count != count) {
+            return CR_E_IO;
+        }
+        memcpy(Results + first, m_Reply.data() + sizeof(header), (size_t)count * sizeof(CR_READ_RESULT));
+        failed += header.FailedCount;
+    }
+    if (FailedCount != NULL) {
+        *FailedCount = failed;
+    }
+    return CR_OK;
+}
+
+uint32_t
+CrClient::QueueRead(
+    CR_ADDRESS Address,
+    uint16_t Offset,
+    uint8_t Width
+)
+{
+    CR_READ_ENTRY entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.Segment = Address.Segment;
+    entry.Bus = Address.Bus;
+    entry.Device = Address.Device;
+    entry.Function = Address.Function;
+    entry.Offset = Offset;
+    entry.Width = Width;
+    m_Queued.push_back(entry);
+    return (uint32_t)m_Queued.size() - 1;
+}
+
+CR_STATUS
+CrClient::FlushReads(
+    std::vector<CR_READ_RESULT>& Results
+)
+{
+    CR_STATUS status;
+
+    Results.resize(m_Queued.size());
+    if (m_Queued.empty()) {
+        return CR_OK;
+    }
+    status = ReadBatch(m_Queued.data(), (uint32_t)m_Queued.size(), Results.data(), NULL);
+    m_Queued.clear();
+    return status;
+}
+
+CR_STATUS
+CrClient::Capabilities(
+    CR_ADDRESS Address,
+    std::vector<CR_CAP_ENTRY>& Entries,
+    uint32_t* TotalCount
+)
+{
+    CR_CAP_REQUEST request;
+    CR_CAP_HEADER header;
+    CR_STATUS status;
+
+    Entries.clear();
+    if (TotalCount != NULL) {
+        *TotalCount = 0;
+    }
+    memset(&request, 0, sizeof(request));
+    request.Version = CR_PROTOCOL_VERSION;
+    request.Segment = Address.Segment;
+    request.Bus = Address.Bus;
+    request.Device = Address.Device;
+    request.Function = Address.Function;
+    status = Exchange(IOCTL_MYPCISCANNER_QUERY_CAPS, &request, sizeof(request),
+        sizeof(CR_CAP_HEADER), sizeof(CR_CAP_ENTRY), offsetof(CR_CAP_HEADER, TotalCount), m_Reply);
+    if (status != CR_OK) {
+        return status;
+    }
+    memcpy(&header, m_Reply.data(), sizeof(header));
+    const CR_CAP_ENTRY* first = (const CR_CAP_ENTRY*)(m_Reply.data() + sizeof(header));
+    Entries.assign(first, first + header.EntryCount);
+    if (TotalCount != NULL) {
+        *TotalCount = header.TotalCount;
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::ReadCapability(
+    const CR_CAP_READ_REQUEST* Request,
+    CR_CAP_ENTRY* Capability,
+    void* Data,
+    uint32_t* Length
+)
+{
+    uint32_t size = (uint32_t)sizeof(CR_CAP_READ_REPLY) + *Length;
+    uint32_t bytesReturned = 0;
+    CR_CAP_READ_REPLY reply;
+    CR_STATUS status;
+
+    if (Capability != NULL) {
+        memset(Capability, 0, sizeof(*Capability));
+    }
+    m_Reply.resize(size);
+    status = m_Transport->Control(IOCTL_MYPCISCANNER_READ_CAP, Request, sizeof(*Request),
+        m_Reply.data(), size, &bytesReturned);
+    if (status != CR_OK) {
+        *Length = 0;
+        return status;
+    }
+    memcpy(&reply, m_Reply.data(), sizeof(reply));
+    if (bytesReturned < sizeof(reply) || reply.Version != CR_PROTOCOL_VERSION ||
+        reply.Length > *Length || bytesReturned < sizeof(reply) + reply.Length) {
+        *Length = 0;
+        return CR_E_IO;
+    }
+    memcpy(Data, m_Reply.data() + sizeof(reply), reply.Length);
+    *Length = reply.Length;
+    if (Capability != NULL) {
+        *Capability = reply.Capability;
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::VirtualFunctions(
+    const CR_TOPOLOGY_REQUEST* Request,
+    CR_VF_HEADER* Header,
+    std::vector<CR_VF_RANGE>& Ranges
+)
+{
+    CR_STATUS status;
+
+    memset(Header, 0, sizeof(*Header));
+    Ranges.clear();
+    status = Exchange(IOCTL_MYPCISCANNER_SCAN_VFS, Request, (Request != NULL) ? sizeof(*Request) : 0,
+        sizeof(CR_VF_HEADER), sizeof(CR_VF_RANGE), offsetof(CR_VF_HEADER, TotalCount), m_Reply);
+    if (status != CR_OK) {
+        return status;
+    }
+    memcpy(Header, m_Reply.data(), sizeof(*Header));
+    const CR_VF_RANGE* first = (const CR_VF_RANGE*)(m_Reply.data() + sizeof(*Header));
+    Ranges.assign(first, first + Header->RangeCount);
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::FlushCache(
+    const CR_ADDRESS* Address
+)
+{
+    CR_CACHE_FLUSH_REQUEST request;
+    uint32_t bytesReturned = 0;
+
+    memset(&request, 0, sizeof(request));
+    request.Version = CR_PROTOCOL_VERSION;
+    if (Address == NULL) {
+        request.Flags = CR_CACHE_FLUSH_ALL;
+    }
+    else {
+        request.Segment = Address->Segment;
+        request.Bus = Address->Bus;
+        request.Device = Address->Device;
+        request.Function = Address->Function;
+    }
+    return m_Transport->Control(IOCTL_MYPCISCANNER_FLUSH_CACHE, &request, sizeof(request), NULL, 0, &bytesReturned);
+}
+
+CR_STATUS
+CrClient::QueryStats(
+    CR_STATS_REPLY* Stats
+)
+{
+    uint32_t bytesReturned = 0;
+    CR_STATUS status;
+
+    status = m_Transport->Control(IOCTL_MYPCISCANNER_QUERY_STATS, NULL, 0, Stats, sizeof(*Stats), &bytesReturned);
+    if (status != CR_OK) {
+        return status;
+    }
+    if (bytesReturned < sizeof(*Stats) || Stats->Version != CR_PROTOCOL_VERSION ||
+        Stats->IoctlSlots != CR_STATS_IOCTL_SLOTS || Stats->BucketCount != CR_STATS_BUCKETS) {
+        return CR_E_IO;
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrClient::StartSampling(
+    const CR_SAMPLE_REQUEST* Request,
+    const CR_READ_ENTRY* Registers,
+    CR_SAMPLE_MAPPING* Mapping
+)
+{
+    uint32_t size = (uint32_t)(sizeof(*Request) + (size_t)Request->RegisterCount * sizeof(CR_READ_ENTRY));
+    uint32_t bytesReturned = 0;
+    std::vector<uint8_t> input(size);
+    CR_STATUS status;
+
+    memset(Mapping, 0, sizeof(*Mapping));
+    if (Request->RegisterCount > CR_MAX_SAMPLE_REGISTERS) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    memcpy(input.data(), Request, sizeof(*Request));
+    memcpy(input.data() + sizeof(*Request), Registers, (size_t)Request->RegisterCount * sizeof(CR_READ_ENTRY));
+    status = m_Transport->Control(IOCTL_MYPCISCANNER_SAMPLE_START, input.data(), size,
+        Mapping, sizeof(*Mapping), &bytesReturned);
+    if (status == CR_OK && bytesReturned < sizeof(*Mapping)) {
+        memset(Mapping, 0, sizeof(*Mapping));
+        return CR_E_IO;
+    }
+    return status;
+}
+
+CR_STATUS
+CrClient::StopSampling()
+{
+    uint32_t bytesReturned = 0;
+
+    return m_Transport->Control(IOCTL_MYPCISCANNER_SAMPLE_STOP, NULL, 0, NULL, 0, &bytesReturned);
+}
+
+// Parses one hexadecimal field of at most Max, stopping at Separator.
+static int
+CrParseField(
+    const char** Text,
+    char Separator,
+    unsigned long Max,
+    unsigned long* Value
+)
+{
+    char* end;
+
+    *Value = strtoul(*Text, &end, 16);
+    if (end == *Text || *Value > Max || *end != Separator) {
+        return 0;
+    }
+    *Text = (*end != '\0') ? end + 1 : end;
+    return 1;
+}
+
+int
+CrParseAddress(
+    const char* Text,
+    CR_ADDRESS* Address
+)
+{
+    unsigned long fields[4] = { 0, 0, 0, 0 };
+    int colons = 0;
+
+    memset(Address, 0, sizeof(*Address));
+    for (const char* c = Text; *c != '\0'; c++) {
+        colons += (*c == ':');
+    }
+    if (colons == 2) {
+        if (!CrParseField(&Text, ':', 0xFFFF, &fields[0])) {
+            return 0;
+        }
+    }
+    else if (colons != 1) {
+        return 0;
+    }
+    if (!CrParseField(&Text, ':', 0xFF, &fields[1])) {
+        return 0;
+    }
+    if (strchr(Text, '.') != NULL) {
+        if (!CrParseField(&Text, '.', CR_MAX_DEVICES - 1, &fields[2]) ||
+            !CrParseField(&Text, '\0', CR_MAX_FUNCTIONS - 1, &fields[3])) {
+            return 0;
+        }
+    }
+    else if (!CrParseField(&Text, '\0', CR_MAX_DEVICES - 1, &fields[2])) {
+        return 0;
+    }
+    Address->Segment = (uint16_t)fields[0];
+    Address->Bus = (uint8_t)fields[1];
+    Address->Device = (uint8_t)fields[2];
+    Address->Function = (uint8_t)fields[3];
+    return 1;
+}
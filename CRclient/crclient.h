@@ -0,0 +1,570 @@
+// crclient.h
+//
+// Client side of the CRdriver protocol, for CRconsole and any agent that
+// talks to the driver. A CrTransport carries one request to something that
+// speaks the protocol: the driver through a device handle, or the portable
+// core in-process (CrLoopbackTransport), which is how Linux hosts and
+// offline tools run the same requests against sysfs, an ECAM image or a
+// snapshot file. CrClient builds the requests, runs the size-probe protocol
+// and checks every reply, so callers deal in records rather than buffers.
+//
+// A client keeps its transport open across requests; nothing here starts or
+// stops the driver service per call. CrClient is not thread safe; give each
+// thread its own client over a shared CrDeviceTransport. CrAsyncClient keeps
+// several requests in flight from one thread instead.
+
+#pragma once
+
+#include "../CRcommon/crprotocol.h"
+#include "../CRcore/crcore.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+// Timeout for CrTransport::Poll and CrAsyncClient::Poll: wait for as long as
+// requests are outstanding.
+#define CR_POLL_INFINITE 0xFFFFFFFF
+
+// Completion of an asynchronous request: its status and the bytes written to
+// its output buffer, as Control would have returned them.
+typedef std::function<void(CR_STATUS Status, uint32_t BytesReturned)> CrCompletion;
+
+// One request/reply exchange with METHOD_BUFFERED semantics. On CR_OK or
+// CR_E_MORE_DATA, *BytesReturned is what the server wrote, which for
+// CR_E_MORE_DATA is at least the reply header with its totals.
+class CrTransport {
+public:
+    virtual ~CrTransport() {}
+
+    virtual CR_STATUS Control(
+        _In_ uint32_t IoControlCode,
+        _In_reads_bytes_opt_(InputLength) const void* Input,
+        _In_ uint32_t InputLength,
+        _Out_writes_bytes_to_opt_(OutputLength, *BytesReturned) void* Output,
+        _In_ uint32_t OutputLength,
+        _Out_ uint32_t* BytesReturned) = 0;
+
+    // Short name for messages: "device" or "loopback".
+    virtual const char* Name() const = 0;
+
+    // Starts a request without waiting for it. Input is consumed before
+    // Submit returns; Output must stay valid until Completion has run.
+    // Completion runs only inside Poll, on the polling thread, never inside
+    // Submit. On failure Completion is not run. This default has no
+    // asynchronous I/O underneath: it runs the request at once and holds the
+    // completion for the next Poll.
+    virtual CR_STATUS Submit(
+        _In_ uint32_t IoControlCode,
+        _In_reads_bytes_opt_(InputLength) const void* Input,
+        _In_ uint32_t InputLength,
+        _Out_writes_bytes_opt_(OutputLength) void* Output,
+        _In_ uint32_t OutputLength,
+        _In_ CrCompletion Completion);
+
+    // Runs the completions of finished requests, waiting up to TimeoutMs for
+    // the first one. Returns how many ran; 0 on timeout or when nothing is
+    // outstanding. Only one thread may poll a transport.
+    virtual uint32_t Poll(_In_ uint32_t TimeoutMs);
+
+    // Requests submitted whose completions have not run yet.
+    virtual uint32_t Outstanding() const;
+
+private:
+    struct Finished {
+        CrCompletion Completion;
+        CR_STATUS Status;
+        uint32_t BytesReturned;
+    };
+
+    std::deque<Finished> m_Finished;    // Default Submit/Poll only
+};
+
+#if defined(_WIN32)
+// \\.\MyPciScanner. The handle is shared by every request, and the driver
+// dispatches them in parallel, so several clients may use one transport.
+class CrDeviceTransport : public CrTransport {
+public:
+    CrDeviceTransport();
+    ~CrDeviceTransport();
+
+    // Opens the device. If it is not there and StartService is set, starts
+    // the CRdriver service once and retries; a running service is left alone.
+    CR_STATUS Open(_In_ bool StartService);
+    void Close();
+
+    // Stops the CRdriver service. Only for callers that explicitly want the
+    // driver unloaded; Close does not do this.
+    static bool StopService();
+
+    HANDLE Handle() const { return m_Device; }
+    DWORD LastError() const { return m_LastError; }   // Of the last failed request
+
+    CR_STATUS Control(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, uint32_t* BytesReturned) override;
+    const char* Name() const override { return "device"; }
+
+    // Overlapped DeviceIoControl on the handle, completed through an I/O
+    // completion port; Poll dequeues completions in batches.
+    CR_STATUS Submit(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, CrCompletion Completion) override;
+    uint32_t Poll(uint32_t TimeoutMs) override;
+    uint32_t Outstanding() const override { return m_Outstanding; }
+
+    static CR_STATUS StatusFromWin32(_In_ DWORD Error);
+
+private:
+    struct Operation;
+
+    CrDeviceTransport(const CrDeviceTransport&);
+    CrDeviceTransport& operator=(const CrDeviceTransport&);
+
+    HANDLE m_Device;                // Opened for overlapped I/O
+    HANDLE m_Port;                  // Completion port bound to m_Device
+    volatile PVOID m_SyncEvent;     // Cached event for synchronous Control
+    std::atomic<uint32_t> m_Outstanding;
+    std::deque<Operation*> m_Failed; // Failed at submission; no packet will come
+    DWORD m_LastError;
+};
+#endif
+
+// Serves requests in-process from a config backend, the way the driver
+// would: scans and reads go through a config-space cache, deltas and the
+// change watch keep their own snapshots. There is no default vendor filter;
+// without a filter spec every function is reported. WAIT_CHANGE blocks as it
+// does in the driver, re-checking presence at the same interval, but does not
+// hold up other requests while it waits; it fails with CR_E_IO if the
+// transport is closed first. Sampling and statistics are driver features
+// and fail with CR_E_UNSUPPORTED.
+// Submitted requests run one at a time on a worker thread, the stand-in for
+// the driver, so the submitting thread decodes while the next one runs.
+class CrLoopbackTransport : public CrTransport {
+public:
+    CrLoopbackTransport();
+    ~CrLoopbackTransport();
+
+    // Takes ownership of Backend, even on failure.
+    CR_STATUS Open(_In_ PCR_CONFIG_BACKEND Backend);
+    void Close();
+
+    CR_STATUS Control(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, uint32_t* BytesReturned) override;
+    const char* Name() const override;
+
+    CR_STATUS Submit(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, CrCompletion Completion) override;
+    uint32_t Poll(uint32_t TimeoutMs) override;
+    uint32_t Outstanding() const override;
+
+    // Bounds how long WAIT_CHANGE blocks, CR_POLL_INFINITE (the default) for
+    // as long as the device would. A wait that times out succeeds with an
+    // empty delta at BaseGeneration.
+    void SetWaitTimeout(_In_ uint32_t TimeoutMs) { m_WaitTimeoutMs = TimeoutMs; }
+
+private:
+    struct Operation {
+        uint32_t IoControlCode;
+        std::vector<uint8_t> Input;
+        void* Output;
+        uint32_t OutputLength;
+        CrCompletion Completion;
+        CR_STATUS Status;
+        uint32_t BytesReturned;
+    };
+
+    CrLoopbackTransport(const CrLoopbackTransport&);
+    CrLoopbackTransport& operator=(const CrLoopbackTransport&);
+
+    void Worker();
+    void StopWorker();
+    CR_STATUS Dispatch(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, uint32_t* BytesReturned);
+    CR_STATUS TopologyOptions(const void* Input, uint32_t InputLength,
+        CR_TOPOLOGY_OPTIONS* Options, PCR_FILTER* Filter);
+    CR_STATUS Delta(PCR_DELTA_STATE State, const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, size_t* BytesWritten);
+    CR_STATUS RefreshWatch();
+    CR_STATUS WaitChange(const void* Input, uint32_t InputLength,
+        void* Output, uint32_t OutputLength, uint32_t* BytesReturned);
+
+    PCR_CONFIG_BACKEND m_Backend;
+    PCR_CACHE m_Cache;
+    CR_EXECUTOR m_Executor;
+    CR_DELTA_STATE m_Delta;
+    CR_DELTA_STATE m_Watch;
+    std::vector<uint8_t> m_Input;    // Copy of the request, as the system buffer would hold it
+    std::atomic<uint32_t> m_WaitTimeoutMs;
+
+    std::mutex m_DispatchLock;       // One request at a time, as above
+    mutable std::mutex m_QueueLock;
+    std::condition_variable m_QueueChanged;
+    std::deque<Operation*> m_Pending;
+    std::deque<Operation*> m_Done;
+    uint32_t m_InFlight;             // Submitted, completion not yet run
+    bool m_Stopping;
+    std::thread m_Worker;
+};
+
+// Typed requests over a transport. Every call returns CR_OK or the first
+// error; replies in an unexpected format are CR_E_IO. Scans remember the
+// size of their last reply, so a repeated scan takes one round trip instead
+// of a probe and a retry.
+class CrClient {
+public:
+    explicit CrClient(_In_ CrTransport* Transport);
+
+    CrTransport* Transport() const { return m_Transport; }
+
+    // IOCTL_MYPCISCANNER_SCAN_BUS0, optionally with a filter spec.
+    CR_STATUS ScanBus0(
+        _In_reads_bytes_opt_(FilterLength) const CR_FILTER_SPEC* Filter,
+        _In_ uint32_t FilterLength,
+        _Out_ std::vector<CR_FUNCTION_RECORD>& Records);
+
+    // IOCTL_MYPCISCANNER_SCAN_TOPOLOGY. Request may be followed by a filter
+    // spec of FilterLength bytes when it has CR_TOPOLOGY_FILTER.
+    CR_STATUS ScanTopology(
+        _In_ const CR_TOPOLOGY_REQUEST* Request,
+        _In_ uint32_t RequestLength,
+        _Out_ std::vector<CR_FUNCTION_RECORD>& Records);
+
+    // IOCTL_MYPCISCANNER_SCAN_DELTA or IOCTL_MYPCISCANNER_WAIT_CHANGE. The
+    // latter blocks until the topology moves past BaseGeneration.
+    CR_STATUS Delta(
+        _In_ uint32_t IoControlCode,
+        _In_ uint64_t BaseGeneration,
+        _Out_ CR_DELTA_HEADER* Header,
+        _Out_ std::vector<CR_FUNCTION_RECORD>& Records);
+
+    // IOCTL_MYPCISCANNER_READ_BATCH, split into CR_MAX_BATCH_ENTRIES calls
+    // when needed. Results come back in Entries order.
+    CR_STATUS ReadBatch(
+        _In_reads_(Count) const CR_READ_ENTRY* Entries,
+        _In_ uint32_t Count,
+        _Out_writes_(Count) CR_READ_RESULT* Results,
+        _Out_opt_ uint32_t* FailedCount);
+
+    // Pipelined reads: queued reads go out together, as one batch, on the
+    // next FlushReads. Returns the index of the read's result.
+    uint32_t QueueRead(_In_ CR_ADDRESS Address, _In_ uint16_t Offset, _In_ uint8_t Width);
+    uint32_t QueuedReads() const { return (uint32_t)m_Queued.size(); }
+    CR_STATUS FlushReads(_Out_ std::vector<CR_READ_RESULT>& Results);
+
+    // IOCTL_MYPCISCANNER_QUERY_CAPS.
+    CR_STATUS Capabilities(
+        _In_ CR_ADDRESS Address,
+        _Out_ std::vector<CR_CAP_ENTRY>& Entries,
+        _Out_opt_ uint32_t* TotalCount);
+
+    // IOCTL_MYPCISCANNER_READ_CAP. *Length is the capacity of Data on input
+    // and the bytes read on output.
+    CR_STATUS ReadCapability(
+        _In_ const CR_CAP_READ_REQUEST* Request,
+        _Out_opt_ CR_CAP_ENTRY* Capability,
+        _Out_writes_bytes_to_(*Length, *Length) void* Data,
+        _Inout_ uint32_t* Length);
+
+    // IOCTL_MYPCISCANNER_SCAN_VFS.
+    CR_STATUS VirtualFunctions(
+        _In_opt_ const CR_TOPOLOGY_REQUEST* Request,
+        _Out_ CR_VF_HEADER* Header,
+        _Out_ std::vector<CR_VF_RANGE>& Ranges);
+
+    // IOCTL_MYPCISCANNER_FLUSH_CACHE. NULL drops the whole cache.
+    CR_STATUS FlushCache(_In_opt_ const CR_ADDRESS* Address);
+
+    // IOCTL_MYPCISCANNER_QUERY_STATS.
+    CR_STATUS QueryStats(_Out_ CR_STATS_REPLY* Stats);
+
+    // IOCTL_MYPCISCANNER_SAMPLE_START / SAMPLE_STOP.
+    CR_STATUS StartSampling(
+        _In_ const CR_SAMPLE_REQUEST* Request,
+        _In_reads_(Request->RegisterCount) const CR_READ_ENTRY* Registers,
+        _Out_ CR_SAMPLE_MAPPING* Mapping);
+    CR_STATUS StopSampling();
+
+private:
+    // Size-probe loop shared by the scan-shaped IOCTLs. Count and Total are
+    // read from the reply header at the given offsets.
+    CR_STATUS Exchange(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        uint32_t HeaderSize, uint32_t ItemSize, uint32_t TotalOffset, std::vector<uint8_t>& Reply);
+
+    CrTransport* m_Transport;
+    std::vector<uint8_t> m_Reply;                // Reused across requests
+    std::vector<CR_READ_ENTRY> m_Queued;
+    uint32_t m_SizeHints[CR_STATS_IOCTL_SLOTS];  // Last reply size per IOCTL
+};
+
+// Keeps up to Depth requests in flight on one transport. Each reply is
+// checked and decoded inside Poll, on the calling thread, while the
+// transport works on the others, then handed to the request's callback. A
+// list reply that does not fit is resubmitted from its completion, at the
+// size the reply asked for, without giving up its slot. Callbacks may issue
+// more requests. Like CrClient it is not thread safe: one thread issues and
+// polls. Buffers are recycled between requests, so a steady stream of
+// same-sized requests does not allocate.
+class CrAsyncClient {
+public:
+    typedef std::function<void(CR_STATUS Status, const CR_FUNCTION_RECORD* Records, uint32_t Count)> ScanCallback;
+    typedef std::function<void(CR_STATUS Status, const CR_DELTA_HEADER* Header,
+        const CR_FUNCTION_RECORD* Records)> DeltaCallback;
+    typedef std::function<void(CR_STATUS Status, const CR_READ_RESULT* Results, uint32_t Count,
+        uint32_t FailedCount)> ReadCallback;
+    typedef std::function<void(CR_STATUS Status, const CR_SAMPLE_MAPPING* Mapping)> SampleCallback;
+    typedef std::function<void(CR_STATUS Status)> StatusCallback;
+
+    CrAsyncClient(_In_ CrTransport* Transport, _In_ uint32_t Depth);
+    ~CrAsyncClient();   // Drains
+
+    // The issuing calls wait, polling, for a free slot. If one fails, its
+    // callback is never run. Record and result pointers handed to callbacks
+    // are only valid during the call.
+    CR_STATUS ScanBus0(
+        _In_reads_bytes_opt_(FilterLength) const CR_FILTER_SPEC* Filter,
+        _In_ uint32_t FilterLength,
+        _In_ ScanCallback Callback);
+    CR_STATUS ScanTopology(
+        _In_ const CR_TOPOLOGY_REQUEST* Request,
+        _In_ uint32_t RequestLength,
+        _In_ ScanCallback Callback);
+    CR_STATUS Delta(
+        _In_ uint32_t IoControlCode,
+        _In_ uint64_t BaseGeneration,
+        _In_ DeltaCallback Callback);
+
+    // Batches larger than CR_MAX_BATCH_ENTRIES go out as several requests,
+    // in flight together; the callback runs once, with every result in
+    // Entries order.
+    CR_STATUS ReadBatch(
+        _In_reads_(Count) const CR_READ_ENTRY* Entries,
+        _In_ uint32_t Count,
+        _In_ ReadCallback Callback);
+
+    CR_STATUS StartSampling(
+        _In_ const CR_SAMPLE_REQUEST* Request,
+        _In_reads_(Request->RegisterCount) const CR_READ_ENTRY* Registers,
+        _In_ SampleCallback Callback);
+    CR_STATUS StopSampling(_In_ StatusCallback Callback);
+
+    // Runs callbacks of finished requests, waiting up to TimeoutMs for the
+    // first. Returns how many requests completed.
+    uint32_t Poll(_In_ uint32_t TimeoutMs);
+
+    // Polls until nothing is outstanding.
+    void Drain();
+
+    uint32_t Outstanding() const { return m_InFlight; }
+
+private:
+    struct Request;
+
+    CrAsyncClient(const CrAsyncClient&);
+    CrAsyncClient& operator=(const CrAsyncClient&);
+
+    Request* Allocate(uint32_t IoControlCode, uint32_t ReplySize);
+    void Release(Request* Request);
+    CR_STATUS Issue(Request* Request);
+    CR_STATUS Start(Request* Request);
+    void Complete(Request* Request, CR_STATUS Status, uint32_t BytesReturned);
+    CR_STATUS IssueList(uint32_t IoControlCode, const void* Input, uint32_t InputLength,
+        uint32_t HeaderSize, uint32_t ItemSize, uint32_t TotalOffset,
+        std::function<void(CR_STATUS Status, const uint8_t* Reply)> Decode);
+
+    CrTransport* m_Transport;
+    uint32_t m_Depth;
+    uint32_t m_InFlight;
+    std::vector<std::vector<uint8_t>> m_Buffers;   // Recycled reply buffers
+    uint32_t m_SizeHints[CR_STATS_IOCTL_SLOTS];
+};
+
+// Formats of CrRecordWriter.
+enum CrOutputFormat {
+    CrOutputJson,        // One JSON object per line (NDJSON)
+    CrOutputCsv,         // A header row whenever the columns change, then rows
+    CrOutputBinary       // CR_STREAM_FRAMEs around the raw reply records
+};
+
+#define CR_WRITER_BUFFER_SIZE 0x10000
+
+// Streams scan, delta, sample and statistics records to a FILE in one of the
+// CrOutputFormats. Text formats are built by hand in a buffer allocated once
+// with the writer; binary frames copy the caller's records as they are. The
+// buffer goes out in whole blocks, and records larger than it bypass it, so
+// writing does not allocate and costs one fwrite per BufferSize bytes.
+// Text rows carry the decoded fields, not the raw config header; use the
+// binary format to keep it. Nothing reaches Stream before Flush or a full
+// buffer.
+class CrRecordWriter {
+public:
+    CrRecordWriter(_In_ FILE* Stream, _In_ CrOutputFormat Format, _In_ size_t BufferSize = CR_WRITER_BUFFER_SIZE);
+    ~CrRecordWriter();   // Flushes
+
+    // Each returns CR_OK, or CR_E_IO once any write to Stream has failed;
+    // after that everything is dropped.
+    CR_STATUS WriteScan(_In_reads_(Count) const CR_FUNCTION_RECORD* Records, _In_ uint32_t Count);
+    CR_STATUS WriteDelta(_In_ const CR_DELTA_HEADER* Header, _In_reads_(Header->RecordCount) const CR_FUNCTION_RECORD* Records);
+
+    // Count ring slots as CrRingConsume returned them.
+    CR_STATUS WriteSamples(
+        _In_ const CR_RING_HEADER* Ring,
+        _In_reads_bytes_((size_t)Count * Ring->SampleSize) const void* Samples,
+        _In_ uint32_t Count);
+
+    // One row per counter group: config reads, function probes and every
+    // IOCTL that has served a request.
+    CR_STATUS WriteStats(_In_ const CR_STATS_REPLY* Stats);
+
+    CR_STATUS Flush();
+    CR_STATUS Status() const { return m_Status; }
+    CrOutputFormat Format() const { return m_Format; }
+
+private:
+    CrRecordWriter(const CrRecordWriter&);
+    CrRecordWriter& operator=(const CrRecordWriter&);
+
+    void Put(_In_reads_bytes_(Length) const void* Data, _In_ size_t Length);
+    template <size_t N> void Put(const char (&Text)[N]) { Put(Text, N - 1); }
+    void PutDecimal(_In_ uint64_t Value);
+    void PutHex(_In_ uint32_t Value, _In_ uint32_t Digits);
+    void Frame(_In_ uint16_t Kind, _In_reads_bytes_opt_(HeaderSize) const void* Header, _In_ uint16_t HeaderSize,
+        _In_reads_bytes_opt_((size_t)ItemSize * ItemCount) const void* Items, _In_ uint32_t ItemSize,
+        _In_ uint32_t ItemCount);
+
+    // Text rows. Before a CSV row whose columns (Layout) differ from the
+    // last header written, the row is run once more with m_Names set, which
+    // turns it into the header row.
+    bool HeaderPass(_In_ uint32_t Layout);
+    void BeginRow(_In_z_ const char* Type);
+    void EndRow();
+    void Field(_In_z_ const char* Name, _In_ uint64_t Value);
+    void Field(_In_z_ const char* Name, _In_z_ const char* Value);
+    void HexField(_In_z_ const char* Name, _In_ uint32_t Value, _In_ uint32_t Digits);
+    void FunctionFields(_In_ const CR_FUNCTION_RECORD* Record);
+    void ScanRow(_In_ const CR_FUNCTION_RECORD* Record);
+    void ChangeRow(_In_ const CR_DELTA_HEADER* Header, _In_ const CR_FUNCTION_RECORD* Record);
+    void DeltaRow(_In_ const CR_DELTA_HEADER* Header);
+    void SampleRow(_In_ const CR_RING_HEADER* Ring, _In_ const CR_SAMPLE* Sample);
+    void StatsRow(_In_z_ const char* Name, _In_ uint64_t Requests, _In_ uint64_t Failures, _In_ uint64_t Bytes,
+        _In_ uint64_t TotalNs, _In_reads_opt_(CR_STATS_BUCKETS) const uint64_t* Latency);
+
+    FILE* m_Stream;
+    CrOutputFormat m_Format;
+    std::vector<char> m_Buffer;
+    size_t m_Used;
+    CR_STATUS m_Status;
+    uint32_t m_Layout;       // Columns of the last CSV header, 0 before the first
+    bool m_Names;            // Emitting a CSV header row
+};
+
+// PCIe link and AER health for Prometheus. Init locates the PCI Express and
+// AER capabilities of each function once, and reads each port type once to
+// pair the two ends of every link, so a link counts as degraded only below
+// what both ends support. Every Collect after that is one READ_BATCH of Link
+// Capabilities, Link Status and the two AER status registers of every
+// tracked function, followed by a pass over the results in memory. Nothing is rediscovered and, after the first collection,
+// nothing is allocated, so an interval costs the same fixed handful of
+// registers per function however long the collector runs.
+//
+// AER status bits are sticky until software clears them, so the error
+// counters count bits that went from clear to set between collections; an
+// OS error handler that clears them makes a storm show up as repeated rises.
+class CrHealthCollector {
+public:
+    explicit CrHealthCollector(_In_ CrClient* Client);
+
+    // Functions without a PCI Express capability are left out, and so are
+    // functions whose capability list cannot be read; UnreadableCount says
+    // how many of those there were. Path is where Export writes.
+    CR_STATUS Init(_In_reads_(Count) const CR_FUNCTION_RECORD* Records, _In_ uint32_t Count,
+        _In_z_ const char* Path);
+
+    CR_STATUS Collect();
+
+    // Writes the last collection in the Prometheus text format to Path.tmp,
+    // then renames it over Path, so a scraper never sees a partial file.
+    CR_STATUS Export();
+
+    const char* Path() const { return m_Path.empty() ? "" : m_Path.data(); }
+
+    uint32_t FunctionCount() const { return (uint32_t)m_Functions.size(); }
+    uint32_t RegisterCount() const { return (uint32_t)m_Entries.size(); }
+    uint32_t UnreadableCount() const { return m_Unreadable; }
+    uint64_t Collections() const { return m_Collections; }
+    uint32_t DegradedCount() const;
+
+private:
+    struct Function {
+        CR_ADDRESS Address;
+        uint16_t VendorId;
+        uint16_t DeviceId;
+        uint32_t FirstEntry;         // Link Capabilities, Link Status, then AER if present
+        uint32_t Partner;            // Function at the other end of the link, if tracked
+        bool HasAer;
+        bool Valid;                  // A collection has read every register
+        uint32_t LinkCapabilities;
+        uint16_t LinkStatus;
+        uint32_t Uncorrectable;
+        uint32_t Correctable;
+        uint64_t LinkChanges;
+        uint64_t UncorrectableErrors;
+        uint64_t CorrectableErrors;
+        uint64_t ReadFailures;
+    };
+
+    CrHealthCollector(const CrHealthCollector&);
+    CrHealthCollector& operator=(const CrHealthCollector&);
+
+    void Put(_In_reads_bytes_(Length) const char* Text, _In_ size_t Length);
+    template <size_t N> void Put(const char (&Text)[N]) { Put(Text, N - 1); }
+    void PutDecimal(_In_ uint64_t Value);
+    void Family(_In_z_ const char* Name, _In_z_ const char* Type, _In_z_ const char* Help);
+    void Sample(_In_z_ const char* Name, _In_opt_ const Function* Labels, _In_ uint64_t Value);
+    void Format();
+    void PairLinks(_In_ const std::vector<uint8_t>& SecondaryBuses);
+    uint32_t PartnerCapabilities(_In_ const Function& F) const;
+
+    CrClient* m_Client;
+    std::vector<Function> m_Functions;
+    std::vector<CR_READ_ENTRY> m_Entries;
+    std::vector<CR_READ_RESULT> m_Results;
+    std::vector<char> m_Text;
+    std::vector<char> m_Path;            // NUL-terminated, as is m_TemporaryPath
+    std::vector<char> m_TemporaryPath;
+    uint32_t m_Unreadable;           // Functions Init had to leave out
+    uint64_t m_Collections;
+    uint64_t m_LastCollectNs;
+};
+
+// Probe, grow, retry. More than a few rounds means the topology keeps
+// growing faster than we can ask, which is as good as an I/O error.
+#define CR_CLIENT_EXCHANGE_ATTEMPTS 4
+
+// Checks shared by CrClient and CrAsyncClient for list-shaped replies (scan,
+// delta, capabilities, VF ranges). CrListReplyNeeded reads the reply size to
+// retry with after CR_E_MORE_DATA; CrListReplyCheck validates a full reply.
+CR_STATUS CrListReplyNeeded(
+    _In_reads_bytes_(BytesReturned) const uint8_t* Reply,
+    _In_ uint32_t BytesReturned,
+    _In_ uint32_t HeaderSize,
+    _In_ uint32_t ItemSize,
+    _In_ uint32_t TotalOffset,
+    _Out_ uint32_t* Needed);
+CR_STATUS CrListReplyCheck(
+    _In_reads_bytes_(BytesReturned) const uint8_t* Reply,
+    _In_ uint32_t BytesReturned,
+    _In_ uint32_t HeaderSize,
+    _In_ uint32_t ItemSize);
+
+// "S:B:D.F", "B:D.F" (segment 0) or "B:D" (function 0), in hexadecimal.
+// Returns nonzero on success.
+int CrParseAddress(_In_z_ const char* Text, _Out_ CR_ADDRESS* Address);
@@ -0,0 +1,319 @@
+// crdevice.cpp
+//
+// CrDeviceTransport: requests to CRdriver through \\.\MyPciScanner. The
+// service is only started when the device is missing, and only once per
+// Open; it is never stopped behind the caller's back. The handle is opened
+// for overlapped I/O and bound to a completion port, so any number of
+// requests can be outstanding; synchronous Control waits on its own event.
+
+#include "crclient.h"
+
+#include <string.h>
+
+#if defined(_WIN32)
+
+#include <winioctl.h>
+#include <winsvc.h>
+
+#define CR_SERVICE_NAME        L"CRdriver"
+#define CR_DEVICE_PATH         L"\\\\.\\MyPciScanner"
+#define CR_SERVICE_TIMEOUT_MS  30000
+#define CR_DEVICE_POLL_BATCH   64      // Completions dequeued per wait
+
+struct CrDeviceTransport::Operation {
+    OVERLAPPED Overlapped;      // First, so a dequeued OVERLAPPED* is the Operation*
+    CrCompletion Completion;
+    DWORD Error;                // For requests that failed at submission
+};
+
+// Waits for a pending service state to settle. The wait hint is used as the
+// poll interval, capped, instead of a fixed sleep.
+static bool
+CrWaitForServiceState(
+    SC_HANDLE Service,
+    DWORD DesiredState
+)
+{
+    SERVICE_STATUS_PROCESS status;
+    DWORD bytesNeeded;
+    DWORD start = GetTickCount();
+
+    for (;;) {
+        if (!QueryServiceStatusEx(Service, SC_STATUS_PROCESS_INFO, (LPBYTE)&status, sizeof(status), &bytesNeeded)) {
+            return false;
+        }
+        if (status.dwCurrentState == DesiredState) {
+            return true;
+        }
+        if (status.dwCurrentState != SERVICE_START_PENDING && status.dwCurrentState != SERVICE_STOP_PENDING) {
+            return false;
+        }
+        if (GetTickCount() - start >= CR_SERVICE_TIMEOUT_MS) {
+            return false;
+        }
+        DWORD interval = status.dwWaitHint / 10;
+        Sleep(interval < 10 ? 10 : interval > 1000 ? 1000 : interval);
+    }
+}
+
+// Starts CRdriver and waits for it to run. Succeeds if it already was.
+static bool
+CrStartService()
+{
+    SC_HANDLE manager = OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    SC_HANDLE service = NULL;
+    bool running = false;
+
+    if (manager == NULL) {
+        return false;
+    }
+    service = OpenServiceW(manager, CR_SERVICE_NAME, SERVICE_START | SERVICE_QUERY_STATUS);
+    if (service != NULL) {
+        if (StartService(service, 0, NULL) || GetLastError() == ERROR_SERVICE_ALREADY_RUNNING) {
+            running = CrWaitForServiceState(service, SERVICE_RUNNING);
+        }
+        CloseServiceHandle(service);
+    }
+    CloseServiceHandle(manager);
+    return running;
+}
+
+bool
+CrDeviceTransport::StopService()
+{
+    SC_HANDLE manager = OpenSCManagerW(NULL, NULL, SC_MANAGER_CONNECT);
+    SC_HANDLE service = NULL;
+    SERVICE_STATUS status;
+    bool stopped = false;
+
+    if (manager == NULL) {
+        return false;
+    }
+    service = OpenServiceW(manager, CR_SERVICE_NAME, SERVICE_STOP | SERVICE_QUERY_STATUS);
+    if (service != NULL) {
+        if (ControlService(service, SERVICE_CONTROL_STOP, &status) || GetLastError() == ERROR_SERVICE_NOT_ACTIVE) {
+            stopped = CrWaitForServiceState(service, SERVICE_STOPPED);
+        }
+        CloseServiceHandle(service);
+    }
+    CloseServiceHandle(manager);
+    return stopped;
+}
+
+CrDeviceTransport::CrDeviceTransport()
+    : m_Device(INVALID_HANDLE_VALUE), m_Port(NULL), m_SyncEvent(NULL), m_Outstanding(0), m_LastError(ERROR_SUCCESS)
+{
+}
+
+CrDeviceTransport::~CrDeviceTransport()
+{
+    Close();
+}
+
+CR_STATUS
+CrDeviceTransport::Open(
+    bool StartService
+)
+{
+    Close();
+    for (int attempt = 0; attempt < 2; attempt++) {
+        m_Device = CreateFileW(CR_DEVICE_PATH, GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if (m_Device != INVALID_HANDLE_VALUE) {
+            m_Port = CreateIoCompletionPort(m_Device, NULL, 0, 1);
+            if (m_Port == NULL) {
+                m_LastError = GetLastError();
+                Close();
+                return StatusFromWin32(m_LastError);
+            }
+            m_LastError = ERROR_SUCCESS;
+            return CR_OK;
+        }
+        m_LastError = GetLastError();
+        if (!StartService || attempt != 0 || m_LastError != ERROR_FILE_NOT_FOUND || !CrStartService()) {
+            break;
+        }
+    }
+    return StatusFromWin32(m_LastError);
+}
+
+// Outstanding requests are cancelled and their completions run first, so no
+// caller is left holding a buffer the driver might still write.
+void
+CrDeviceTransport::Close()
+{
+    if (m_Device != INVALID_HANDLE_VALUE) {
+        if (m_Outstanding != 0) {
+            CancelIoEx(m_Device, NULL);
+            while (m_Outstanding != 0 && Poll(CR_POLL_INFINITE) != 0) {
+            }
+        }
+        CloseHandle(m_Device);
+        m_Device = INVALID_HANDLE_VALUE;
+    }
+    if (m_Port != NULL) {
+        CloseHandle(m_Port);
+        m_Port = NULL;
+    }
+    if (m_SyncEvent != NULL) {
+        CloseHandle(m_SyncEvent);
+        m_SyncEvent = NULL;
+    }
+}
+
+CR_STATUS
+CrDeviceTransport::StatusFromWin32(
+    DWORD Error
+)
+{
+    switch (Error) {
+    case ERROR_SUCCESS:               return CR_OK;
+    case ERROR_MORE_DATA:             return CR_E_MORE_DATA;
+    case ERROR_INVALID_PARAMETER:
+    case ERROR_INSUFFICIENT_BUFFER:   return CR_E_INVALID_PARAMETER;
+    case ERROR_NOT_ENOUGH_MEMORY:
+    case ERROR_NO_SYSTEM_RESOURCES:   return CR_E_NO_MEMORY;
+    case ERROR_NOT_FOUND:
+    case ERROR_FILE_NOT_FOUND:        return CR_E_NOT_FOUND;
+    case ERROR_NOT_SUPPORTED:
+    case ERROR_INVALID_FUNCTION:
+    case ERROR_REVISION_MISMATCH:     return CR_E_UNSUPPORTED;
+    default:                          return CR_E_IO;
+    }
+}
+
+// Blocking request on the overlapped handle. The event handle has its low
+// bit set so the completion is not also queued to the port. One event is
+// cached; concurrent callers beyond the first create their own.
+CR_STATUS
+CrDeviceTransport::Control(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    uint32_t* BytesReturned
+)
+{
+    OVERLAPPED overlapped;
+    DWORD bytesReturned = 0;
+    DWORD error = ERROR_SUCCESS;
+    HANDLE event;
+
+    *BytesReturned = 0;
+    if (m_Device == INVALID_HANDLE_VALUE) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    event = InterlockedExchangePointer(&m_SyncEvent, NULL);
+    if (event == NULL) {
+        event = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (event == NULL) {
+            m_LastError = GetLastError();
+            return StatusFromWin32(m_LastError);
+        }
+    }
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+    if (!DeviceIoControl(m_Device, IoControlCode, (LPVOID)Input, InputLength,
+        Output, OutputLength, NULL, &overlapped)) {
+        error = GetLastError();
+    }
+    if (error == ERROR_SUCCESS || error == ERROR_IO_PENDING || error == ERROR_MORE_DATA) {
+        error = GetOverlappedResult(m_Device, &overlapped, &bytesReturned, TRUE) ? ERROR_SUCCESS : GetLastError();
+    }
+    if (InterlockedCompareExchangePointer(&m_SyncEvent, event, NULL) != NULL) {
+        CloseHandle(event);
+    }
+
+    *BytesReturned = bytesReturned;
+    if (error != ERROR_SUCCESS) {
+        m_LastError = error;
+    }
+    return StatusFromWin32(error);
+}
+
+CR_STATUS
+CrDeviceTransport::Submit(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    CrCompletion Completion
+)
+{
+    Operation* operation;
+    DWORD error = ERROR_SUCCESS;
+
+    if (m_Device == INVALID_HANDLE_VALUE) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    operation = new Operation();
+    memset(&operation->Overlapped, 0, sizeof(operation->Overlapped));
+    operation->Completion = Completion;
+    operation->Error = ERROR_SUCCESS;
+    m_Outstanding++;
+
+    // METHOD_BUFFERED: the input is copied into the system buffer before
+    // DeviceIoControl returns. Success, pending and warning statuses such as
+    // ERROR_MORE_DATA all queue a packet; outright failures do not.
+    if (!DeviceIoControl(m_Device, IoControlCode, (LPVOID)Input, InputLength,
+        Output, OutputLength, NULL, &operation->Overlapped)) {
+        error = GetLastError();
+    }
+    if (error != ERROR_SUCCESS && error != ERROR_IO_PENDING && error != ERROR_MORE_DATA) {
+        operation->Error = error;
+        m_Failed.push_back(operation);
+    }
+    return CR_OK;
+}
+
+uint32_t
+CrDeviceTransport::Poll(
+    uint32_t TimeoutMs
+)
+{
+    OVERLAPPED_ENTRY entries[CR_DEVICE_POLL_BATCH];
+    ULONG count = 0;
+    uint32_t completed = 0;
+
+    if (m_Outstanding == 0) {
+        return 0;
+    }
+
+    // Requests that never reached the port complete here, in order.
+    for (size_t n = m_Failed.size(); n != 0 && !m_Failed.empty(); n--) {
+        Operation* operation = m_Failed.front();
+        m_Failed.pop_front();
+        m_LastError = operation->Error;
+        m_Outstanding--;
+        operation->Completion(StatusFromWin32(operation->Error), 0);
+        delete operation;
+        completed++;
+    }
+    if (completed != 0) {
+        return completed;
+    }
+
+    if (!GetQueuedCompletionStatusEx(m_Port, entries, CR_DEVICE_POLL_BATCH, &count,
+        (TimeoutMs == CR_POLL_INFINITE) ? INFINITE : TimeoutMs, FALSE)) {
+        return 0;
+    }
+    for (ULONG i = 0; i < count; i++) {
+        Operation* operation = CONTAINING_RECORD(entries[i].lpOverlapped, Operation, Overlapped);
+        DWORD bytesReturned = 0;
+        DWORD error = ERROR_SUCCESS;
+
+        if (!GetOverlappedResult(m_Device, &operation->Overlapped, &bytesReturned, FALSE)) {
+            error = GetLastError();
+            m_LastError = error;
+        }
+        m_Outstanding--;
+        operation->Completion(StatusFromWin32(error), bytesReturned);
+        delete operation;
+        completed++;
+    }
+    return completed;
+}
+
+#endif
@@ -0,0 +1,488 @@
+// crhealth.cpp
+//
+// CrHealthCollector: periodic PCIe link and AER status in the Prometheus
+// text format. The register list is built once from the capability lists;
+// a collection is one batched read and a pass over its results.
+
+#include "crclient.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+
+#define CR_CAP_ID_PCIE          0x10
+#define CR_EXT_CAP_AER          0x0001
+
+// PCI Express capability registers
+#define CR_PCIE_CAPABILITIES    0x02
+#define CR_PCIE_LINK_CAPABILITIES 0x0C
+#define CR_PCIE_LINK_STATUS     0x12
+
+// AER capability registers
+#define CR_AER_UNCORRECTABLE_STATUS 0x04
+#define CR_AER_CORRECTABLE_STATUS   0x10
+
+#define CR_LINK_SPEED(Register) ((Register) & 0xF)
+#define CR_LINK_WIDTH(Register) (((Register) >> 4) & 0x3F)
+
+// Device/Port Type in the PCI Express Capabilities register. Root and
+// downstream ports face the link on their secondary bus; every other type
+// faces the link on its own bus.
+#define CR_PCIE_PORT_TYPE(Register) (((Register) >> 4) & 0xF)
+#define CR_PCIE_ROOT_PORT       0x4
+#define CR_PCIE_DOWNSTREAM_PORT 0x6
+
+#define CR_HEALTH_NO_PARTNER    UINT32_MAX
+
+// Link speed encodings 1-6 in MT/s; anything else reads as 0.
+static const uint32_t CrLinkSpeeds[] = { 0, 2500, 5000, 8000, 16000, 32000, 64000 };
+
+static uint32_t
+CrLinkSpeedMts(
+    uint32_t Encoding
+)
+{
+    return (Encoding < sizeof(CrLinkSpeeds) / sizeof(CrLinkSpeeds[0])) ? CrLinkSpeeds[Encoding] : 0;
+}
+
+static uint32_t
+CrBitCount(
+    uint32_t Value
+)
+{
+    uint32_t count = 0;
+
+    for (; Value != 0; Value &= Value - 1) {
+        count++;
+    }
+    return count;
+}
+
+static CR_READ_ENTRY
+CrHealthEntry(
+    CR_ADDRESS Address,
+    uint32_t Offset,
+    uint8_t Width
+)
+{
+    CR_READ_ENTRY entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.Segment = Address.Segment;
+    entry.Bus = Address.Bus;
+    entry.Device = Address.Device;
+    entry.Function = Address.Function;
+    entry.Offset = (uint16_t)Offset;
+    entry.Width = Width;
+    return entry;
+}
+
+// A link that trained, but below what both of its ends can do. Partner is
+// the Link Capabilities of the other end, or 0 when that is not known and
+// this end's are all there is to go on. Width 0 is a link that is down, or a
+// function without one.
+static bool
+CrLinkDegraded(
+    uint32_t LinkCapabilities,
+    uint32_t PartnerCapabilities,
+    uint16_t LinkStatus
+)
+{
+    uint32_t width = CR_LINK_WIDTH(LinkStatus);
+    uint32_t maxSpeed = CR_LINK_SPEED(LinkCapabilities);
+    uint32_t maxWidth = CR_LINK_WIDTH(LinkCapabilities);
+
+    if (PartnerCapabilities != 0) {
+        maxSpeed = (CR_LINK_SPEED(PartnerCapabilities) < maxSpeed) ? CR_LINK_SPEED(PartnerCapabilities) : maxSpeed;
+        maxWidth = (CR_LINK_WIDTH(PartnerCapabilities) < maxWidth) ? CR_LINK_WIDTH(PartnerCapabilities) : maxWidth;
+    }
+    return width != 0 && (CR_LINK_SPEED(LinkStatus) < maxSpeed || width < maxWidth);
+}
+
+CrHealthCollector::CrHealthCollector(
+    CrClient* Client
+)
+    : m_Client(Client), m_Unreadable(0), m_Collections(0), m_LastCollectNs(0)
+{
+}
+
+CR_STATUS
+CrHealthCollector::Init(
+    const CR_FUNCTION_RECORD* Records,
+    uint32_t Count,
+    const char* Path
+)
+{
+    static const char suffix[] = ".tmp";
+    std::vector<CR_CAP_ENTRY> caps;
+    std::vector<uint8_t> secondaryBuses;
+
+    if (Path == NULL || Path[0] == '\0') {
+        return CR_E_INVALID_PARAMETER;
+    }
+    m_Path.assign(Path, Path + strlen(Path) + 1);
+    m_TemporaryPath.assign(Path, Path + strlen(Path));
+    m_TemporaryPath.insert(m_TemporaryPath.end(), suffix, suffix + sizeof(suffix));
+
+    m_Functions.clear();
+    m_Entries.clear();
+    m_Unreadable = 0;
+    m_Collections = 0;
+    for (uint32_t i = 0; i < Count; i++) {
+        const CR_FUNCTION_RECORD* r = &Records[i];
+        Function function;
+        const CR_CAP_ENTRY* pcie = NULL;
+        const CR_CAP_ENTRY* aer = NULL;
+
+        memset(&function, 0, sizeof(function));
+        function.Address.Segment = r->Segment;
+        function.Address.Bus = r->Bus;
+        function.Address.Device = r->Device;
+        function.Address.Function = r->Function;
+        // One function that went away or cannot be reached must not take
+        // the whole exporter down with it.
+        if (m_Client->Capabilities(function.Address, caps, NULL) != CR_OK) {
+            m_Unreadable++;
+            continue;
+        }
+        for (size_t j = 0; j < caps.size(); j++) {
+            if (!(caps[j].Flags & CR_CAP_EXTENDED) && caps[j].Id == CR_CAP_ID_PCIE && pcie == NULL) {
+                pcie = &caps[j];
+            }
+            else if ((caps[j].Flags & CR_CAP_EXTENDED) && caps[j].Id == CR_EXT_CAP_AER && aer == NULL) {
+                aer = &caps[j];
+            }
+        }
+        if (pcie == NULL) {
+            continue;
+        }
+
+        function.VendorId = r->VendorId;
+        function.DeviceId = r->DeviceId;
+        function.FirstEntry = (uint32_t)m_Entries.size();
+        function.Partner = CR_HEALTH_NO_PARTNER;
+        function.HasAer = (aer != NULL);
+        m_Entries.push_back(CrHealthEntry(function.Address, pcie->Offset + CR_PCIE_LINK_CAPABILITIES, 4));
+        m_Entries.push_back(CrHealthEntry(function.Address, pcie->Offset + CR_PCIE_LINK_STATUS, 2));
+        if (aer != NULL) {
+            m_Entries.push_back(CrHealthEntry(function.Address, aer->Offset + CR_AER_UNCORRECTABLE_STATUS, 4));
+            m_Entries.push_back(CrHealthEntry(function.Address, aer->Offset + CR_AER_CORRECTABLE_STATUS, 4));
+        }
+        m_Functions.push_back(function);
+        secondaryBuses.push_back(((r->HeaderType & CR_HEADER_TYPE_MASK) == CR_HEADER_TYPE_BRIDGE) ?
+            r->Config[CR_CFG_SECONDARY_BUS] : 0);
+    }
+    m_Results.resize(m_Entries.size());
+    PairLinks(secondaryBuses);
+    return CR_OK;
+}
+
+// Pairs the two ends of each link: a root or downstream port with the
+// functions on its secondary bus. The port's partner is the first of them,
+// normally function 0; a multi-function device shares one link. Without the
+// port types, or for functions whose port is not tracked, nothing is paired.
+void
+CrHealthCollector::PairLinks(
+    const std::vector<uint8_t>& SecondaryBuses
+)
+{
+    std::vector<CR_READ_ENTRY> entries(m_Functions.size());
+    std::vector<CR_READ_RESULT> results(m_Functions.size());
+    std::vector<bool> ports(m_Functions.size());
+    std::unordered_map<uint32_t, uint32_t> portBelow;   // Segment:secondary bus -> port
+
+    if (m_Functions.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < m_Functions.size(); i++) {
+        const Function& f = m_Functions[i];
+        uint32_t pcie = m_Entries[f.FirstEntry].Offset - CR_PCIE_LINK_CAPABILITIES;
+
+        entries[i] = CrHealthEntry(f.Address, pcie + CR_PCIE_CAPABILITIES, 2);
+    }
+    if (m_Client->ReadBatch(entries.data(), (uint32_t)entries.size(), results.data(), NULL) != CR_OK) {
+        return;
+    }
+
+    for (size_t i = 0; i < m_Functions.size(); i++) {
+        uint32_t type = CR_PCIE_PORT_TYPE(results[i].Value);
+
+        ports[i] = results[i].Status == CR_READ_OK && SecondaryBuses[i] != 0 &&
+            (type == CR_PCIE_ROOT_PORT || type == CR_PCIE_DOWNSTREAM_PORT);
+        if (ports[i]) {
+            portBelow[((uint32_t)m_Functions[i].Address.Segment << 8) | SecondaryBuses[i]] = (uint32_t)i;
+        }
+    }
+    for (size_t i = 0; i < m_Functions.size(); i++) {
+        Function& f = m_Functions[i];
+        std::unordered_map<uint32_t, uint32_t>::const_iterator port;
+
+        if (ports[i] || results[i].Status != CR_READ_OK) {
+            continue;
+        }
+        port = portBelow.find(((uint32_t)f.Address.Segment << 8) | f.Address.Bus);
+        if (port == portBelow.end()) {
+            continue;
+        }
+        f.Partner = port->second;
+        if (m_Functions[port->second].Partner == CR_HEALTH_NO_PARTNER) {
+            m_Functions[port->second].Partner = (uint32_t)i;
+        }
+    }
+}
+
+uint32_t
+CrHealthCollector::PartnerCapabilities(
+    const Function& F
+) const
+{
+    if (F.Partner == CR_HEALTH_NO_PARTNER || !m_Functions[F.Partner].Valid) {
+        return 0;
+    }
+    return m_Functions[F.Partner].LinkCapabilities;
+}
+
+CR_STATUS
+CrHealthCollector::Collect()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if (!m_Entries.empty()) {
+        CR_STATUS status = m_Client->ReadBatch(m_Entries.data(), (uint32_t)m_Entries.size(), m_Results.data(), NULL);
+        if (status != CR_OK) {
+            return status;
+        }
+    }
+
+    for (size_t i = 0; i < m_Functions.size(); i++) {
+        Function& f = m_Functions[i];
+        const CR_READ_RESULT* results = &m_Results[f.FirstEntry];
+        uint32_t count = f.HasAer ? 4 : 2;
+        bool failed = false;
+
+        for (uint32_t j = 0; j < count; j++) {
+            failed |= (results[j].Status != CR_READ_OK);
+        }
+        if (failed) {
+            f.ReadFailures++;
+            continue;
+        }
+
+        uint16_t linkStatus = (uint16_t)results[1].Value;
+        uint32_t uncorrectable = f.HasAer ? results[2].Value : 0;
+        uint32_t correctable = f.HasAer ? results[3].Value : 0;
+        // The first reading is the baseline; bits already set were latched
+        // at some unknown time before it.
+        if (f.Valid) {
+            if (CR_LINK_SPEED(linkStatus) != CR_LINK_SPEED(f.LinkStatus) ||
+                CR_LINK_WIDTH(linkStatus) != CR_LINK_WIDTH(f.LinkStatus)) {
+                f.LinkChanges++;
+            }
+            f.UncorrectableErrors += CrBitCount(uncorrectable & ~f.Uncorrectable);
+            f.CorrectableErrors += CrBitCount(correctable & ~f.Correctable);
+        }
+        f.LinkCapabilities = results[0].Value;
+        f.LinkStatus = linkStatus;
+        f.Uncorrectable = uncorrectable;
+        f.Correctable = correctable;
+        f.Valid = true;
+    }
+
+    m_Collections++;
+    m_LastCollectNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return CR_OK;
+}
+
+uint32_t
+CrHealthCollector::DegradedCount() const
+{
+    uint32_t count = 0;
+
+    for (size_t i = 0; i < m_Functions.size(); i++) {
+        const Function& f = m_Functions[i];
+        count += (f.Valid && CrLinkDegraded(f.LinkCapabilities, PartnerCapabilities(f), f.LinkStatus)) ? 1 : 0;
+    }
+    return count;
+}
+
+//
+// Prometheus text format
+//
+
+void
+CrHealthCollector::Put(
+    const char* Text,
+    size_t Length
+)
+{
+    m_Text.insert(m_Text.end(), Text, Text + Length);
+}
+
+void
+CrHealthCollector::PutDecimal(
+    uint64_t Value
+)
+{
+    char digits[20];
+    size_t count = 0;
+
+    do {
+        digits[sizeof(digits) - ++count] = (char)('0' + Value % 10);
+        Value /= 10;
+    } while (Value != 0);
+    Put(digits + sizeof(digits) - count, count);
+}
+
+void
+CrHealthCollector::Family(
+    const char* Name,
+    const char* Type,
+    const char* Help
+)
+{
+    Put("# HELP ");
+    Put(Name, strlen(Name));
+    Put(" ");
+    Put(Help, strlen(Help));
+    Put("\n# TYPE ");
+    Put(Name, strlen(Name));
+    Put(" ");
+    Put(Type, strlen(Type));
+    Put("\n");
+}
+
+void
+CrHealthCollector::Sample(
+    const char* Name,
+    const Function* Labels,
+    uint64_t Value
+)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    Put(Name, strlen(Name));
+    if (Labels != NULL) {
+        const CR_ADDRESS& a = Labels->Address;
+        char label[] = "{pci=\"ssss:bb:dd.";
+        char ids[] = ",vendor=\"vvvv\",device=\"dddd\"} ";
+
+        for (int i = 0; i < 4; i++) {
+            label[6 + i] = hex[(a.Segment >> (12 - 4 * i)) & 0xF];
+            ids[9 + i] = hex[(Labels->VendorId >> (12 - 4 * i)) & 0xF];
+            ids[23 + i] = hex[(Labels->DeviceId >> (12 - 4 * i)) & 0xF];
+        }
+        label[11] = hex[a.Bus >> 4];
+        label[12] = hex[a.Bus & 0xF];
+        label[14] = hex[a.Device >> 4];
+        label[15] = hex[a.Device & 0xF];
+        Put(label);
+        PutDecimal(a.Function);     // ARI function numbers go past 7
+        Put("\"");
+        Put(ids);
+    }
+    else {
+        Put(" ");
+    }
+    PutDecimal(Value);
+    Put("\n");
+}
+
+void
+CrHealthCollector::Format()
+{
+    // Each family's samples must be contiguous, so the functions are walked
+    // once per metric.
+    static const struct {
+        const char* Name;
+        const char* Type;
+        const char* Help;
+        bool Aer;
+    } families[] = {
+        { "cr_pcie_link_speed_mts", "gauge", "Current link speed in MT/s (Link Status).", false },
+        { "cr_pcie_link_max_speed_mts", "gauge", "Maximum link speed in MT/s (Link Capabilities).", false },
+        { "cr_pcie_link_width", "gauge", "Negotiated link width in lanes; 0 when the link is down.", false },
+        { "cr_pcie_link_max_width", "gauge", "Maximum link width in lanes.", false },
+        { "cr_pcie_link_degraded", "gauge", "1 if the link trained below the speed or width both of its ends support.", false },
+        { "cr_pcie_link_changes_total", "counter", "Collections that saw the link speed or width change.", false },
+        { "cr_pcie_read_failures_total", "counter", "Collections that could not read every register of the function.", false },
+        { "cr_pcie_aer_uncorrectable_status", "gauge", "AER Uncorrectable Error Status register.", true },
+        { "cr_pcie_aer_correctable_status", "gauge", "AER Correctable Error Status register.", true },
+        { "cr_pcie_aer_uncorrectable_errors_total", "counter", "AER uncorrectable status bits seen going from clear to set.", true },
+        { "cr_pcie_aer_correctable_errors_total", "counter", "AER correctable status bits seen going from clear to set.", true },
+    };
+
+    m_Text.clear();
+    for (size_t k = 0; k < sizeof(families) / sizeof(families[0]); k++) {
+        Family(families[k].Name, families[k].Type, families[k].Help);
+        for (size_t i = 0; i < m_Functions.size(); i++) {
+            const Function& f = m_Functions[i];
+            uint64_t value;
+
+            if (!f.Valid || (families[k].Aer && !f.HasAer)) {
+                continue;
+            }
+            switch (k) {
+            case 0:  value = CrLinkSpeedMts(CR_LINK_SPEED(f.LinkStatus)); break;
+            case 1:  value = CrLinkSpeedMts(CR_LINK_SPEED(f.LinkCapabilities)); break;
+            case 2:  value = CR_LINK_WIDTH(f.LinkStatus); break;
+            case 3:  value = CR_LINK_WIDTH(f.LinkCapabilities); break;
+            case 4:  value = CrLinkDegraded(f.LinkCapabilities, PartnerCapabilities(f), f.LinkStatus) ? 1 : 0; break;
+            case 5:  value = f.LinkChanges; break;
+            case 6:  value = f.ReadFailures; break;
+            case 7:  value = f.Uncorrectable; break;
+            case 8:  value = f.Correctable; break;
+            case 9:  value = f.UncorrectableErrors; break;
+            default: value = f.CorrectableErrors; break;
+            }
+            Sample(families[k].Name, &f, value);
+        }
+    }
+
+    Family("cr_pcie_health_functions", "gauge", "Functions with a PCI Express capability being collected.");
+    Sample("cr_pcie_health_functions", NULL, m_Functions.size());
+    Family("cr_pcie_health_unreadable_functions", "gauge", "Functions left out because their capability list could not be read.");
+    Sample("cr_pcie_health_unreadable_functions", NULL, m_Unreadable);
+    Family("cr_pcie_health_registers", "gauge", "Registers read per collection.");
+    Sample("cr_pcie_health_registers", NULL, m_Entries.size());
+    Family("cr_pcie_health_collections_total", "counter", "Collections since the collector was initialized.");
+    Sample("cr_pcie_health_collections_total", NULL, m_Collections);
+    Family("cr_pcie_health_collect_nanoseconds", "gauge", "Duration of the last collection.");
+    Sample("cr_pcie_health_collect_nanoseconds", NULL, m_LastCollectNs);
+}
+
+CR_STATUS
+CrHealthCollector::Export()
+{
+    const char* temporary = m_TemporaryPath.data();
+    FILE* file = NULL;
+    bool ok;
+
+    if (m_Path.empty()) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    Format();
+#if defined(_WIN32)
+    if (fopen_s(&file, temporary, "wb") != 0) {
+        file = NULL;
+    }
+#else
+    file = fopen(temporary, "wb");
+#endif
+    if (file == NULL) {
+        return CR_E_IO;
+    }
+    ok = fwrite(m_Text.data(), 1, m_Text.size(), file) == m_Text.size();
+    ok = (fclose(file) == 0) && ok;
+#if defined(_WIN32)
+    ok = ok && MoveFileExA(temporary, m_Path.data(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+    ok = ok && rename(temporary, m_Path.data()) == 0;
+#endif
+    if (!ok) {
+        remove(temporary);
+        return CR_E_IO;
+    }
+    return CR_OK;
+}
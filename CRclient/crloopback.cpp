@@ -0,0 +1,499 @@
+// crloopback.cpp
+//
+// CrLoopbackTransport: the driver's request handling over the portable core,
+// in-process. Kept close to Driver.c so a request behaves the same whichever
+// transport carries it. Asynchronous requests are served by one worker
+// thread, in submission order, and handed back through Poll.
+
+#include "crclient.h"
+
+#include <chrono>
+#include <string.h>
+
+// Same sizing as the driver's cache, and the driver's watch interval.
+#define CR_LOOPBACK_CACHE_SLOTS     16384
+#define CR_LOOPBACK_CACHE_FUNCTIONS 1024
+#define CR_LOOPBACK_WATCH_INTERVAL_MS 50
+
+CrLoopbackTransport::CrLoopbackTransport()
+    : m_Backend(NULL), m_Cache(NULL), m_WaitTimeoutMs(CR_POLL_INFINITE), m_InFlight(0), m_Stopping(false)
+{
+    memset(&m_Executor, 0, sizeof(m_Executor));
+    memset(&m_Delta, 0, sizeof(m_Delta));
+    memset(&m_Watch, 0, sizeof(m_Watch));
+}
+
+CrLoopbackTransport::~CrLoopbackTransport()
+{
+    Close();
+}
+
+CR_STATUS
+CrLoopbackTransport::Open(
+    PCR_CONFIG_BACKEND Backend
+)
+{
+    CR_STATUS status;
+
+    Close();
+    if (Backend == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    m_Backend = Backend;
+    m_Stopping = false;
+    status = CrCacheCreate(m_Backend, CR_LOOPBACK_CACHE_SLOTS, CR_LOOPBACK_CACHE_FUNCTIONS, &m_Cache);
+    if (status != CR_OK) {
+        Close();
+        return status;
+    }
+    CrThreadExecutorInit(&m_Executor, 0);
+    return CR_OK;
+}
+
+// Requests still queued are cancelled with CR_E_IO; every outstanding
+// completion runs before Close returns, as it does for the device. A
+// synchronous WAIT_CHANGE on another thread returns CR_E_IO too.
+void
+CrLoopbackTransport::Close()
+{
+    StopWorker();
+
+    std::lock_guard<std::mutex> lock(m_DispatchLock);
+    CrCacheFree(m_Cache);
+    m_Cache = NULL;
+    CrBackendClose(m_Backend);
+    m_Backend = NULL;
+    CrDeltaFree(&m_Delta);
+    CrDeltaFree(&m_Watch);
+    memset(&m_Delta, 0, sizeof(m_Delta));
+    memset(&m_Watch, 0, sizeof(m_Watch));
+}
+
+const char*
+CrLoopbackTransport::Name() const
+{
+    return "loopback";
+}
+
+// MyPciScannerTopologyOptions without the default vendor set.
+CR_STATUS
+CrLoopbackTransport::TopologyOptions(
+    const void* Input,
+    uint32_t InputLength,
+    CR_TOPOLOGY_OPTIONS* Options,
+    PCR_FILTER* Filter
+)
+{
+    const CR_TOPOLOGY_REQUEST* request = (const CR_TOPOLOGY_REQUEST*)Input;
+
+    *Filter = NULL;
+    memset(Options, 0, sizeof(*Options));
+    Options->Executor = &m_Executor;
+    if (Input == NULL) {
+        return CR_OK;
+    }
+    if (InputLength < sizeof(*request)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (request->Version != CR_PROTOCOL_VERSION) {
+        return CR_E_UNSUPPORTED;
+    }
+    Options->Flags = request->Flags;
+    Options->Segment = request->Segment;
+    Options->MaxWorkers = request->MaxWorkers;
+    if (request->Flags & CR_TOPOLOGY_FILTER) {
+        CR_STATUS status = CrFilterCompileSpec(request + 1, InputLength - sizeof(*request), Filter, NULL);
+        if (status != CR_OK) {
+            return status;
+        }
+        Options->Scan.Match = *Filter;
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrLoopbackTransport::Delta(
+    PCR_DELTA_STATE State,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    size_t* BytesWritten
+)
+{
+    const CR_DELTA_REQUEST* request = (const CR_DELTA_REQUEST*)Input;
+    CR_TOPOLOGY_OPTIONS options;
+    CR_STATUS status;
+
+    if (Input == NULL || InputLength < sizeof(*request)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (request->Version != CR_PROTOCOL_VERSION) {
+        return CR_E_UNSUPPORTED;
+    }
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    options.Executor = &m_Executor;
+    status = CrDeltaRefresh(State, CrCacheRefreshBackend(m_Cache), &options);
+    if (status == CR_OK) {
+        status = CrDeltaToBuffer(State, request->BaseGeneration, Output, OutputLength, BytesWritten);
+    }
+    return status;
+}
+
+CR_STATUS
+CrLoopbackTransport::Control(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    uint32_t* BytesReturned
+)
+{
+    if (IoControlCode == IOCTL_MYPCISCANNER_WAIT_CHANGE) {
+        return WaitChange(Input, InputLength, Output, OutputLength, BytesReturned);
+    }
+
+    std::lock_guard<std::mutex> lock(m_DispatchLock);
+
+    return Dispatch(IoControlCode, Input, InputLength, Output, OutputLength, BytesReturned);
+}
+
+// MyPciScannerRefreshWatch: unfiltered, since the presence check needs every
+// bridge. Caller holds m_DispatchLock.
+CR_STATUS
+CrLoopbackTransport::RefreshWatch()
+{
+    CR_TOPOLOGY_OPTIONS options;
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    options.Executor = &m_Executor;
+    return CrDeltaRefresh(&m_Watch, CrCacheRefreshBackend(m_Cache), &options);
+}
+
+// MyPciScannerWaitChange and the driver's watch timer folded into one loop:
+// completes at once if the watch is not at BaseGeneration, otherwise runs
+// the presence check every CR_LOOPBACK_WATCH_INTERVAL_MS and rescans only
+// when it disagrees. The dispatch lock is held for each check alone, so
+// other requests are served while this one waits.
+CR_STATUS
+CrLoopbackTransport::WaitChange(
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    uint32_t* BytesReturned
+)
+{
+    const CR_DELTA_REQUEST* request = (const CR_DELTA_REQUEST*)Input;
+    uint32_t timeoutMs = m_WaitTimeoutMs;
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    std::chrono::milliseconds interval(CR_LOOPBACK_WATCH_INTERVAL_MS);
+    uint64_t baseGeneration;
+    size_t bytesWritten = 0;
+    bool waited = false;
+    CR_STATUS status;
+
+    *BytesReturned = 0;
+    if (Input == NULL || InputLength < sizeof(*request)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (request->Version != CR_PROTOCOL_VERSION) {
+        return CR_E_UNSUPPORTED;
+    }
+    // Output may share the caller's buffer with Input.
+    baseGeneration = request->BaseGeneration;
+
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(m_DispatchLock);
+
+            if (m_Backend == NULL) {
+                // Not open, or closed while this request waited.
+                return waited ? CR_E_IO : CR_E_INVALID_PARAMETER;
+            }
+            status = CR_OK;
+            // The first request takes the scan the presence check compares
+            // against. The check goes through the live backend: the cache
+            // would answer from what it learned.
+            if (m_Watch.Current.Generation == 0 ||
+                (baseGeneration == m_Watch.Current.Generation && CrSnapshotProbe(m_Backend, &m_Watch.Current))) {
+                status = RefreshWatch();
+            }
+            if (status != CR_OK) {
+                return status;
+            }
+            if (baseGeneration != m_Watch.Current.Generation ||
+                (timeoutMs != CR_POLL_INFINITE && std::chrono::steady_clock::now() >= deadline)) {
+                status = CrDeltaToBuffer(&m_Watch, baseGeneration, Output, OutputLength, &bytesWritten);
+                *BytesReturned = (uint32_t)bytesWritten;
+                return status;
+            }
+        }
+
+        if (timeoutMs != CR_POLL_INFINITE) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (deadline - now < interval) {
+                interval = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) +
+                    std::chrono::milliseconds(1);
+            }
+        }
+        std::unique_lock<std::mutex> lock(m_QueueLock);
+        if (m_QueueChanged.wait_for(lock, interval, [this] { return m_Stopping; })) {
+            return CR_E_IO;
+        }
+        waited = true;
+    }
+}
+
+CR_STATUS
+CrLoopbackTransport::Submit(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    CrCompletion Completion
+)
+{
+    Operation* operation;
+
+    if (m_Backend == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    operation = new Operation();
+    operation->IoControlCode = IoControlCode;
+    if (Input != NULL && InputLength != 0) {
+        operation->Input.assign((const uint8_t*)Input, (const uint8_t*)Input + InputLength);
+    }
+    operation->Output = Output;
+    operation->OutputLength = OutputLength;
+    operation->Completion = Completion;
+    operation->Status = CR_OK;
+    operation->BytesReturned = 0;
+
+    std::lock_guard<std::mutex> lock(m_QueueLock);
+    if (m_Stopping) {
+        // Closing; completions that submit again are refused.
+        delete operation;
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (!m_Worker.joinable()) {
+        m_Worker = std::thread(&CrLoopbackTransport::Worker, this);
+    }
+    m_Pending.push_back(operation);
+    m_InFlight++;
+    m_QueueChanged.notify_all();
+    return CR_OK;
+}
+
+void
+CrLoopbackTransport::Worker()
+{
+    std::unique_lock<std::mutex> lock(m_QueueLock);
+
+    for (;;) {
+        m_QueueChanged.wait(lock, [this] { return m_Stopping || !m_Pending.empty(); });
+        if (m_Stopping) {
+            return;
+        }
+        Operation* operation = m_Pending.front();
+        m_Pending.pop_front();
+        lock.unlock();
+
+        operation->Status = Control(operation->IoControlCode,
+            operation->Input.empty() ? NULL : operation->Input.data(), (uint32_t)operation->Input.size(),
+            operation->Output, operation->OutputLength, &operation->BytesReturned);
+
+        lock.lock();
+        m_Done.push_back(operation);
+        m_QueueChanged.notify_all();
+    }
+}
+
+void
+CrLoopbackTransport::StopWorker()
+{
+    std::unique_lock<std::mutex> lock(m_QueueLock);
+
+    m_Stopping = true;
+    if (m_Worker.joinable()) {
+        m_QueueChanged.notify_all();
+        lock.unlock();
+        m_Worker.join();
+        lock.lock();
+    }
+    while (!m_Pending.empty()) {
+        Operation* operation = m_Pending.front();
+        m_Pending.pop_front();
+        operation->Status = CR_E_IO;
+        operation->BytesReturned = 0;
+        m_Done.push_back(operation);
+    }
+    lock.unlock();
+    while (Poll(0) != 0) {
+    }
+}
+
+uint32_t
+CrLoopbackTransport::Poll(
+    uint32_t TimeoutMs
+)
+{
+    std::unique_lock<std::mutex> lock(m_QueueLock);
+    uint32_t count = 0;
+    size_t ready;
+
+    if (m_InFlight == 0) {
+        return 0;
+    }
+    if (TimeoutMs == CR_POLL_INFINITE) {
+        m_QueueChanged.wait(lock, [this] { return !m_Done.empty(); });
+    }
+    else if (!m_QueueChanged.wait_for(lock, std::chrono::milliseconds(TimeoutMs), [this] { return !m_Done.empty(); })) {
+        return 0;
+    }
+
+    // Completions may submit, or poll, again; only what was done on entry runs.
+    for (ready = m_Done.size(); ready != 0 && !m_Done.empty(); ready--) {
+        Operation* operation = m_Done.front();
+        m_Done.pop_front();
+        m_InFlight--;
+        lock.unlock();
+        operation->Completion(operation->Status, operation->BytesReturned);
+        delete operation;
+        count++;
+        lock.lock();
+    }
+    return count;
+}
+
+uint32_t
+CrLoopbackTransport::Outstanding() const
+{
+    std::lock_guard<std::mutex> lock(m_QueueLock);
+
+    return m_InFlight;
+}
+
+CR_STATUS
+CrLoopbackTransport::Dispatch(
+    uint32_t IoControlCode,
+    const void* Input,
+    uint32_t InputLength,
+    void* Output,
+    uint32_t OutputLength,
+    uint32_t* BytesReturned
+)
+{
+    const void* input = NULL;
+    CR_TOPOLOGY_OPTIONS options;
+    CR_SCAN_OPTIONS scanOptions;
+    PCR_FILTER filter = NULL;
+    size_t bytesWritten = 0;
+    CR_STATUS status;
+
+    *BytesReturned = 0;
+    if (m_Backend == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    // Handlers may write Output before they are done with the input, as they
+    // can in the driver's shared system buffer, so they get a copy.
+    if (Input != NULL && InputLength != 0) {
+        m_Input.assign((const uint8_t*)Input, (const uint8_t*)Input + InputLength);
+        input = m_Input.data();
+    }
+
+    switch (IoControlCode) {
+    case IOCTL_MYPCISCANNER_SCAN_BUS0:
+        memset(&scanOptions, 0, sizeof(scanOptions));
+        status = CR_OK;
+        if (input != NULL) {
+            status = CrFilterCompileSpec(input, InputLength, &filter, NULL);
+            scanOptions.Match = filter;
+        }
+        if (status == CR_OK) {
+            status = CrScanBusToBuffer(CrCacheBackend(m_Cache), 0, 0, &scanOptions,
+                Output, OutputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_SCAN_TOPOLOGY:
+        status = TopologyOptions(input, InputLength, &options, &filter);
+        if (status == CR_OK) {
+            status = CrScanTopologyToBuffer(CrCacheBackend(m_Cache), &options, Output, OutputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_SCAN_VFS:
+        status = TopologyOptions(input, InputLength, &options, &filter);
+        if (status == CR_OK) {
+            status = CrScanVirtualFunctionsToBuffer(CrCacheBackend(m_Cache), &options,
+                Output, OutputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_SCAN_DELTA:
+        status = Delta(&m_Delta, input, InputLength, Output, OutputLength, &bytesWritten);
+        break;
+
+    case IOCTL_MYPCISCANNER_READ_BATCH:
+        if (input == NULL || InputLength < sizeof(CR_BATCH_HEADER)) {
+            status = CR_E_INVALID_PARAMETER;
+        }
+        else if (((const CR_BATCH_HEADER*)input)->Version != CR_PROTOCOL_VERSION) {
+            status = CR_E_UNSUPPORTED;
+        }
+        else {
+            status = CrReadBatchBuffer(CrCacheBackend(m_Cache), input, InputLength, Output, OutputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_QUERY_CAPS:
+        status = CrCapWalkBuffer(CrCacheBackend(m_Cache), input, InputLength, Output, OutputLength, &bytesWritten);
+        break;
+
+    case IOCTL_MYPCISCANNER_READ_CAP:
+        status = CrCapReadBuffer(CrCacheBackend(m_Cache), input, InputLength, Output, OutputLength, &bytesWritten);
+        break;
+
+    case IOCTL_MYPCISCANNER_FLUSH_CACHE:
+    {
+        const CR_CACHE_FLUSH_REQUEST* request = (const CR_CACHE_FLUSH_REQUEST*)input;
+        CR_ADDRESS address;
+
+        status = CR_OK;
+        if (request != NULL && InputLength < sizeof(*request)) {
+            status = CR_E_INVALID_PARAMETER;
+        }
+        else if (request != NULL && request->Version != CR_PROTOCOL_VERSION) {
+            status = CR_E_UNSUPPORTED;
+        }
+        else if (request == NULL || (request->Flags & CR_CACHE_FLUSH_ALL)) {
+            CrCacheFlush(m_Cache);
+        }
+        else if (request->Device >= CR_MAX_DEVICES || request->Function >= CR_MAX_FUNCTIONS) {
+            status = CR_E_INVALID_PARAMETER;
+        }
+        else {
+            address.Segment = request->Segment;
+            address.Bus = request->Bus;
+            address.Device = request->Device;
+            address.Function = request->Function;
+            CrCacheInvalidate(m_Cache, address);
+        }
+        break;
+    }
+
+    default:
+        status = CR_E_UNSUPPORTED;
+        break;
+    }
+
+    CrFilterFree(filter);
+    *BytesReturned = (uint32_t)bytesWritten;
+    return status;
+}
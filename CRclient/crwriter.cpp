@@ -0,0 +1,523 @@
+// crwriter.cpp
+//
+// CrRecordWriter: scan, delta, sample and statistics records as NDJSON, CSV
+// or CR_STREAM_FRAMEs. Numbers and addresses are formatted by hand straight
+// into the writer's buffer; there is no printf and no allocation per record.
+
+#include "crclient.h"
+
+#include <string.h>
+
+#define CR_WRITER_MIN_BUFFER 4096
+
+// CSV column sets. Sample rows also carry their register count above these.
+#define CR_LAYOUT_SCAN    1
+#define CR_LAYOUT_DELTA   2
+#define CR_LAYOUT_CHANGE  3
+#define CR_LAYOUT_SAMPLE  4
+#define CR_LAYOUT_STATS   5
+
+static const char CrHexDigits[] = "0123456789abcdef";
+
+// Row names of the IOCTL counters, by CR_STATS_IOCTL_SLOT.
+static const struct {
+    uint32_t Code;
+    const char* Name;
+} CrIoctlNames[] = {
+    { IOCTL_MYPCISCANNER_SCAN_BUS0,     "scan_bus0" },
+    { IOCTL_MYPCISCANNER_SCAN_TOPOLOGY, "scan_topology" },
+    { IOCTL_MYPCISCANNER_READ_BATCH,    "read_batch" },
+    { IOCTL_MYPCISCANNER_SCAN_DELTA,    "scan_delta" },
+    { IOCTL_MYPCISCANNER_SAMPLE_START,  "sample_start" },
+    { IOCTL_MYPCISCANNER_SAMPLE_STOP,   "sample_stop" },
+    { IOCTL_MYPCISCANNER_QUERY_STATS,   "query_stats" },
+    { IOCTL_MYPCISCANNER_FLUSH_CACHE,   "flush_cache" },
+    { IOCTL_MYPCISCANNER_QUERY_CAPS,    "query_caps" },
+    { IOCTL_MYPCISCANNER_READ_CAP,      "read_cap" },
+    { IOCTL_MYPCISCANNER_SCAN_VFS,      "scan_vfs" },
+    { IOCTL_MYPCISCANNER_WAIT_CHANGE,   "wait_change" },
+};
+
+// Ticks to nanoseconds without overflowing for any realistic uptime.
+static uint64_t
+CrTicksToNs(
+    uint64_t Ticks,
+    uint64_t Frequency
+)
+{
+    if (Frequency == 0) {
+        return 0;
+    }
+    return (Ticks / Frequency) * 1000000000ull + (Ticks % Frequency) * 1000000000ull / Frequency;
+}
+
+CrRecordWriter::CrRecordWriter(
+    FILE* Stream,
+    CrOutputFormat Format,
+    size_t BufferSize
+)
+    : m_Stream(Stream), m_Format(Format), m_Used(0), m_Status(CR_OK), m_Layout(0), m_Names(false)
+{
+    m_Buffer.resize(BufferSize < CR_WRITER_MIN_BUFFER ? CR_WRITER_MIN_BUFFER : BufferSize);
+}
+
+CrRecordWriter::~CrRecordWriter()
+{
+    Flush();
+}
+
+CR_STATUS
+CrRecordWriter::Flush()
+{
+    if (m_Used != 0 && m_Status == CR_OK) {
+        if (fwrite(m_Buffer.data(), 1, m_Used, m_Stream) != m_Used) {
+            m_Status = CR_E_IO;
+        }
+    }
+    m_Used = 0;
+    if (m_Status == CR_OK && fflush(m_Stream) != 0) {
+        m_Status = CR_E_IO;
+    }
+    return m_Status;
+}
+
+// Small pieces are copied into the buffer; a piece that would not fit even
+// in an empty buffer goes straight to the stream after what is queued.
+void
+CrRecordWriter::Put(
+    const void* Data,
+    size_t Length
+)
+{
+    if (m_Status != CR_OK) {
+        return;
+    }
+    if (Length > m_Buffer.size() - m_Used) {
+        if (m_Used != 0 && fwrite(m_Buffer.data(), 1, m_Used, m_Stream) != m_Used) {
+            m_Status = CR_E_IO;
+            return;
+        }
+        m_Used = 0;
+        if (Length > m_Buffer.size()) {
+            if (fwrite(Data, 1, Length, m_Stream) != Length) {
+                m_Status = CR_E_IO;
+            }
+            return;
+        }
+    }
+    memcpy(m_Buffer.data() + m_Used, Data, Length);
+    m_Used += Length;
+}
+
+void
+CrRecordWriter::PutDecimal(
+    uint64_t Value
+)
+{
+    char digits[20];
+    size_t count = 0;
+
+    do {
+        digits[sizeof(digits) - ++count] = (char)('0' + Value % 10);
+        Value /= 10;
+    } while (Value != 0);
+    Put(digits + sizeof(digits) - count, count);
+}
+
+void
+CrRecordWriter::PutHex(
+    uint32_t Value,
+    uint32_t Digits
+)
+{
+    char digits[8];
+
+    for (uint32_t i = Digits; i != 0; i--) {
+        digits[i - 1] = CrHexDigits[Value & 0xF];
+        Value >>= 4;
+    }
+    Put(digits, Digits);
+}
+
+void
+CrRecordWriter::Frame(
+    uint16_t Kind,
+    const void* Header,
+    uint16_t HeaderSize,
+    const void* Items,
+    uint32_t ItemSize,
+    uint32_t ItemCount
+)
+{
+    CR_STREAM_FRAME frame;
+
+    frame.Magic = CR_STREAM_MAGIC;
+    frame.Kind = Kind;
+    frame.HeaderSize = HeaderSize;
+    frame.ItemSize = ItemSize;
+    frame.ItemCount = ItemCount;
+    Put(&frame, sizeof(frame));
+    if (HeaderSize != 0) {
+        Put(Header, HeaderSize);
+    }
+    if (ItemCount != 0) {
+        Put(Items, (size_t)ItemSize * ItemCount);
+    }
+}
+
+//
+// Text rows
+//
+
+bool
+CrRecordWriter::HeaderPass(
+    uint32_t Layout
+)
+{
+    if (m_Format != CrOutputCsv || m_Layout == Layout) {
+        return false;
+    }
+    m_Layout = Layout;
+    return true;
+}
+
+void
+CrRecordWriter::BeginRow(
+    const char* Type
+)
+{
+    if (m_Names) {
+        Put("type");
+    }
+    else if (m_Format == CrOutputJson) {
+        Put("{\"type\":\"");
+        Put(Type, strlen(Type));
+        Put("\"");
+    }
+    else {
+        Put(Type, strlen(Type));
+    }
+}
+
+void
+CrRecordWriter::EndRow()
+{
+    if (m_Format == CrOutputJson) {
+        Put("}\n");
+    }
+    else {
+        Put("\n");
+    }
+}
+
+void
+CrRecordWriter::Field(
+    const char* Name,
+    uint64_t Value
+)
+{
+    if (m_Names) {
+        Put(",");
+        Put(Name, strlen(Name));
+        return;
+    }
+    if (m_Format == CrOutputJson) {
+        Put(",\"");
+        Put(Name, strlen(Name));
+        Put("\":");
+    }
+    else {
+        Put(",");
+    }
+    PutDecimal(Value);
+}
+
+// Values are names from this file, never caller text, so nothing needs
+// escaping or quoting in CSV.
+void
+CrRecordWriter::Field(
+    const char* Name,
+    const char* Value
+)
+{
+    if (m_Names) {
+        Put(",");
+        Put(Name, strlen(Name));
+        return;
+    }
+    if (m_Format == CrOutputJson) {
+        Put(",\"");
+        Put(Name, strlen(Name));
+        Put("\":\"");
+        Put(Value, strlen(Value));
+        Put("\"");
+    }
+    else {
+        Put(",");
+        Put(Value, strlen(Value));
+    }
+}
+
+// IDs and class codes are strings of fixed-width hex, as pci.ids and lspci
+// spell them.
+void
+CrRecordWriter::HexField(
+    const char* Name,
+    uint32_t Value,
+    uint32_t Digits
+)
+{
+    if (m_Names) {
+        Put(",");
+        Put(Name, strlen(Name));
+        return;
+    }
+    if (m_Format == CrOutputJson) {
+        Put(",\"");
+        Put(Name, strlen(Name));
+        Put("\":\"");
+        PutHex(Value, Digits);
+        Put("\"");
+    }
+    else {
+        Put(",");
+        PutHex(Value, Digits);
+    }
+}
+
+void
+CrRecordWriter::FunctionFields(
+    const CR_FUNCTION_RECORD* Record
+)
+{
+    if (m_Names) {
+        Put(",address");
+    }
+    else {
+        if (m_Format == CrOutputJson) {
+            Put(",\"address\":\"");
+        }
+        else {
+            Put(",");
+        }
+        PutHex(Record->Segment, 4);
+        Put(":");
+        PutHex(Record->Bus, 2);
+        Put(":");
+        PutHex(Record->Device, 2);
+        Put(".");
+        PutDecimal(Record->Function);
+        if (m_Format == CrOutputJson) {
+            Put("\"");
+        }
+    }
+    HexField("vendor", Record->VendorId, 4);
+    HexField("device", Record->DeviceId, 4);
+    HexField("class", ((uint32_t)Record->BaseClass << 16) | ((uint32_t)Record->SubClass << 8) | Record->ProgIf, 6);
+    HexField("revision", Record->RevisionId, 2);
+    HexField("header_type", Record->HeaderType, 2);
+}
+
+void
+CrRecordWriter::ScanRow(
+    const CR_FUNCTION_RECORD* Record
+)
+{
+    BeginRow("function");
+    FunctionFields(Record);
+    EndRow();
+}
+
+void
+CrRecordWriter::DeltaRow(
+    const CR_DELTA_HEADER* Header
+)
+{
+    BeginRow("delta");
+    Field("generation", Header->Generation);
+    Field("full", (Header->Flags & CR_DELTA_FULL) ? 1 : 0);
+    Field("changes", Header->RecordCount);
+    EndRow();
+}
+
+void
+CrRecordWriter::ChangeRow(
+    const CR_DELTA_HEADER* Header,
+    const CR_FUNCTION_RECORD* Record
+)
+{
+    BeginRow("change");
+    Field("generation", Header->Generation);
+    Field("change", (Record->Flags & CR_RECORD_REMOVED) ? "removed" :
+        (Record->Flags & CR_RECORD_CHANGED) ? "changed" : "added");
+    FunctionFields(Record);
+    EndRow();
+}
+
+void
+CrRecordWriter::SampleRow(
+    const CR_RING_HEADER* Ring,
+    const CR_SAMPLE* Sample
+)
+{
+    const uint32_t* values = (const uint32_t*)(Sample + 1);
+
+    BeginRow("sample");
+    Field("sequence", Sample->Sequence);
+    Field("time_ns", CrTicksToNs(Sample->Timestamp, Ring->TimestampFrequency));
+    Field("failed_mask", Sample->FailedMask);
+    if (m_Names) {
+        for (uint32_t i = 0; i < Ring->RegisterCount; i++) {
+            Put(",value");
+            PutDecimal(i);
+        }
+    }
+    else {
+        if (m_Format == CrOutputJson) {
+            Put(",\"values\":[");
+        }
+        for (uint32_t i = 0; i < Ring->RegisterCount; i++) {
+            if (i != 0 || m_Format == CrOutputCsv) {
+                Put(",");
+            }
+            PutDecimal(values[i]);
+        }
+        if (m_Format == CrOutputJson) {
+            Put("]");
+        }
+    }
+    EndRow();
+}
+
+void
+CrRecordWriter::StatsRow(
+    const char* Name,
+    uint64_t Requests,
+    uint64_t Failures,
+    uint64_t Bytes,
+    uint64_t TotalNs,
+    const uint64_t* Latency
+)
+{
+    BeginRow("stats");
+    Field("name", Name);
+    Field("requests", Requests);
+    Field("failures", Failures);
+    Field("bytes", Bytes);
+    Field("total_ns", TotalNs);
+    Field("p50_ns", (Latency != NULL) ? CrStatsPercentile(Latency, 50) : 0);
+    Field("p99_ns", (Latency != NULL) ? CrStatsPercentile(Latency, 99) : 0);
+    EndRow();
+}
+
+//
+// Records
+//
+
+CR_STATUS
+CrRecordWriter::WriteScan(
+    const CR_FUNCTION_RECORD* Records,
+    uint32_t Count
+)
+{
+    if (m_Format == CrOutputBinary) {
+        Frame(CR_STREAM_SCAN, NULL, 0, Records, sizeof(CR_FUNCTION_RECORD), Count);
+        return m_Status;
+    }
+    for (uint32_t i = 0; i < Count && m_Status == CR_OK; i++) {
+        if (HeaderPass(CR_LAYOUT_SCAN)) {
+            m_Names = true;
+            ScanRow(&Records[i]);
+            m_Names = false;
+        }
+        ScanRow(&Records[i]);
+    }
+    return m_Status;
+}
+
+// A delta row first, so a collector sees the generation move even when
+// nothing changed, then one row per change.
+CR_STATUS
+CrRecordWriter::WriteDelta(
+    const CR_DELTA_HEADER* Header,
+    const CR_FUNCTION_RECORD* Records
+)
+{
+    if (m_Format == CrOutputBinary) {
+        Frame(CR_STREAM_DELTA, Header, sizeof(*Header), Records, sizeof(CR_FUNCTION_RECORD), Header->RecordCount);
+        return m_Status;
+    }
+    if (HeaderPass(CR_LAYOUT_DELTA)) {
+        m_Names = true;
+        DeltaRow(Header);
+        m_Names = false;
+    }
+    DeltaRow(Header);
+    for (uint32_t i = 0; i < Header->RecordCount && m_Status == CR_OK; i++) {
+        if (HeaderPass(CR_LAYOUT_CHANGE)) {
+            m_Names = true;
+            ChangeRow(Header, &Records[i]);
+            m_Names = false;
+        }
+        ChangeRow(Header, &Records[i]);
+    }
+    return m_Status;
+}
+
+CR_STATUS
+CrRecordWriter::WriteSamples(
+    const CR_RING_HEADER* Ring,
+    const void* Samples,
+    uint32_t Count
+)
+{
+    const uint8_t* samples = (const uint8_t*)Samples;
+
+    if (Ring->SampleSize < sizeof(CR_SAMPLE) + (size_t)Ring->RegisterCount * sizeof(uint32_t)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (m_Format == CrOutputBinary) {
+        CR_STREAM_SAMPLE_HEADER header;
+        header.TimestampFrequency = Ring->TimestampFrequency;
+        header.RegisterCount = Ring->RegisterCount;
+        header.Dropped = Ring->Dropped;
+        Frame(CR_STREAM_SAMPLES, &header, sizeof(header), Samples, Ring->SampleSize, Count);
+        return m_Status;
+    }
+    for (uint32_t i = 0; i < Count && m_Status == CR_OK; i++) {
+        const CR_SAMPLE* sample = (const CR_SAMPLE*)(samples + (size_t)i * Ring->SampleSize);
+        if (HeaderPass(CR_LAYOUT_SAMPLE | (Ring->RegisterCount << 8))) {
+            m_Names = true;
+            SampleRow(Ring, sample);
+            m_Names = false;
+        }
+        SampleRow(Ring, sample);
+    }
+    return m_Status;
+}
+
+CR_STATUS
+CrRecordWriter::WriteStats(
+    const CR_STATS_REPLY* Stats
+)
+{
+    if (m_Format == CrOutputBinary) {
+        Frame(CR_STREAM_STATS, NULL, 0, Stats, sizeof(*Stats), 1);
+        return m_Status;
+    }
+    if (HeaderPass(CR_LAYOUT_STATS)) {
+        m_Names = true;
+        StatsRow("", 0, 0, 0, 0, NULL);
+        m_Names = false;
+    }
+    StatsRow("config_reads", Stats->ConfigReads, Stats->ConfigReadFailures, Stats->ConfigReadBytes,
+        Stats->ConfigReadNs, Stats->ReadLatency);
+    StatsRow("function_probes", Stats->FunctionsProbed, 0, 0, 0, NULL);
+    for (size_t i = 0; i < sizeof(CrIoctlNames) / sizeof(CrIoctlNames[0]); i++) {
+        const CR_STATS_IOCTL* s = &Stats->Ioctls[CR_STATS_IOCTL_SLOT(CrIoctlNames[i].Code)];
+        if (s->Requests != 0) {
+            StatsRow(CrIoctlNames[i].Name, s->Requests, s->Failures, s->BytesReturned, s->TotalNs, s->Latency);
+        }
+    }
+    return m_Status;
+}
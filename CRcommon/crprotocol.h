@@ -0,0 +1,663 @@
+// crprotocol.h
+//
+// Wire protocol shared by CRdriver, CRconsole and the portable scan core.
+// Everything in here crosses the user/kernel boundary, so layouts are fixed
+// size, naturally aligned and versioned. Do not reorder fields; append new
+// ones and bump CR_PROTOCOL_VERSION instead.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef CTL_CODE
+// Non-Windows builds (Linux hosts driving the core in-process) still use the
+// IOCTL codes as request identifiers. Unsigned, so codes with the top bit
+// set compare equal to the uint32_t they travel in.
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((uint32_t)(DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define METHOD_BUFFERED 0
+#define FILE_ANY_ACCESS 0
+#endif
+
+#define CR_STATIC_ASSERT(name, expr) typedef char CrStaticAssert_##name[(expr) ? 1 : -1]
+
+// IOCTL Definition
+#define MYPCISCANNER_DEVICE_TYPE 0x8000
+
+// Input: optional CR_FILTER_SPEC; without one the driver reports its default
+// vendor set. Output: CR_SCAN_HEADER followed by CR_FUNCTION_RECORD[RecordCount].
+// Send a buffer of exactly sizeof(CR_SCAN_HEADER) to probe for the size;
+// the driver completes with STATUS_BUFFER_OVERFLOW (ERROR_MORE_DATA in user
+// mode) whenever TotalCount records did not all fit.
+#define IOCTL_MYPCISCANNER_SCAN_BUS0 CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x800, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: optional CR_TOPOLOGY_REQUEST (defaults: segment 0, probe every root
+// bus, driver-chosen worker count), followed by a CR_FILTER_SPEC when Flags
+// has CR_TOPOLOGY_FILTER. Output: same format as SCAN_BUS0, with
+// records sorted by segment/bus/device/function.
+#define IOCTL_MYPCISCANNER_SCAN_TOPOLOGY CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x801, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: CR_BATCH_HEADER followed by CR_READ_ENTRY[Count]. Output:
+// CR_BATCH_HEADER followed by CR_READ_RESULT[Count] in input order. The call
+// succeeds as long as the request is well formed; check each Status.
+#define IOCTL_MYPCISCANNER_READ_BATCH CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x802, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: CR_DELTA_REQUEST. Rescans the whole topology from hardware,
+// refreshing the driver's config-space cache on the way, and returns
+// CR_DELTA_HEADER followed by CR_FUNCTION_RECORD[RecordCount], each tagged
+// with a CR_RECORD_* flag, describing what changed since BaseGeneration.
+// Uses the same size-probe protocol as the scan IOCTLs.
+#define IOCTL_MYPCISCANNER_SCAN_DELTA CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x803, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: CR_SAMPLE_REQUEST followed by CR_READ_ENTRY[RegisterCount].
+// Output: CR_SAMPLE_MAPPING. Starts sampling the registers on a periodic
+// timer into a CR_RING_HEADER ring mapped into the calling process. One
+// sampling session per driver; it ends with SAMPLE_STOP or when the handle
+// that started it is closed.
+#define IOCTL_MYPCISCANNER_SAMPLE_START CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x804, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// No input or output. Stops sampling and unmaps the ring.
+#define IOCTL_MYPCISCANNER_SAMPLE_STOP CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x805, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// No input. Output: CR_STATS_REPLY with counters accumulated since the
+// driver loaded. Served in the caller's context, so it never waits behind
+// a slow scan.
+#define IOCTL_MYPCISCANNER_QUERY_STATS CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x806, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: optional CR_CACHE_FLUSH_REQUEST; without one the whole cache is
+// dropped. No output. Forgets the cached immutable config-space fields
+// (IDs, class code, header type, subsystem IDs, capability headers), so the
+// next access to each function goes back to hardware.
+#define IOCTL_MYPCISCANNER_FLUSH_CACHE CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x807, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: CR_CAP_REQUEST. Output: CR_CAP_HEADER followed by
+// CR_CAP_ENTRY[EntryCount], standard capabilities first, each list in chain
+// order. Uses the same size-probe protocol as the scan IOCTLs.
+#define IOCTL_MYPCISCANNER_QUERY_CAPS CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x808, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: CR_CAP_READ_REQUEST. Output: CR_CAP_READ_REPLY followed by Length
+// bytes read from the capability. Fails with STATUS_NOT_FOUND if the
+// function has no such capability.
+#define IOCTL_MYPCISCANNER_READ_CAP CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x809, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: optional CR_TOPOLOGY_REQUEST, as for SCAN_TOPOLOGY; its filter
+// selects physical functions. Output: CR_VF_HEADER followed by
+// CR_VF_RANGE[RangeCount], one per physical function with VFs enabled,
+// sorted by PF address. VFs are computed from each PF's SR-IOV capability,
+// not probed. Uses the same size-probe protocol as the scan IOCTLs.
+#define IOCTL_MYPCISCANNER_SCAN_VFS CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x80A, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+// Input: CR_DELTA_REQUEST. Output: as for SCAN_DELTA, but against the
+// driver's own watch of the whole topology (every vendor), whose generations
+// are unrelated to SCAN_DELTA's. Completes at once if the topology is not at
+// BaseGeneration; otherwise stays pending until a periodic presence check
+// sees a device come or go, or the request is cancelled. Pass 0 first to
+// learn the current generation. Keep one pending per client thread that
+// waits; a too-small buffer completes with the size and can be retried with
+// the same BaseGeneration.
+#define IOCTL_MYPCISCANNER_WAIT_CHANGE CTL_CODE( \
+    MYPCISCANNER_DEVICE_TYPE, \
+    0x80B, \
+    METHOD_BUFFERED, \
+    FILE_ANY_ACCESS \
+)
+
+#define CR_PROTOCOL_VERSION   1
+#define CR_CONFIG_HEADER_SIZE 64
+
+// One PCI function as seen by a scan. The decoded fields duplicate the raw
+// header so consumers can sort/filter without knowing PCI layouts.
+typedef struct _CR_FUNCTION_RECORD {
+    uint16_t Segment;
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+    uint8_t  HeaderType;     // Raw, including the multifunction bit
+    uint8_t  RevisionId;
+    uint8_t  ProgIf;
+    uint8_t  SubClass;
+    uint8_t  BaseClass;
+    uint16_t VendorId;
+    uint16_t DeviceId;
+    uint16_t Flags;          // CR_RECORD_* in delta results, zero otherwise
+    uint8_t  Config[CR_CONFIG_HEADER_SIZE];
+} CR_FUNCTION_RECORD, * PCR_FUNCTION_RECORD;
+
+typedef struct _CR_SCAN_HEADER {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t RecordSize;     // sizeof(CR_FUNCTION_RECORD)
+    uint32_t RecordCount;    // Records present in this buffer
+    uint32_t TotalCount;     // Records the scan found; > RecordCount on overflow
+} CR_SCAN_HEADER, * PCR_SCAN_HEADER;
+
+// CR_FUNCTION_RECORD.Flags
+#define CR_RECORD_ADDED    0x0001
+#define CR_RECORD_REMOVED  0x0002   // Record holds the last contents seen
+#define CR_RECORD_CHANGED  0x0004
+
+CR_STATIC_ASSERT(FunctionRecordSize, sizeof(CR_FUNCTION_RECORD) == 80);
+CR_STATIC_ASSERT(ScanHeaderSize, sizeof(CR_SCAN_HEADER) == 16);
+
+// CR_TOPOLOGY_REQUEST.Flags
+#define CR_TOPOLOGY_ALL_SEGMENTS  0x00000001  // Every segment the backend knows, not just Segment
+#define CR_TOPOLOGY_BRIDGES_ONLY  0x00000002  // Only buses reachable from bus 0 through bridges
+#define CR_TOPOLOGY_FILTER        0x00000004  // A CR_FILTER_SPEC follows the request
+#define CR_TOPOLOGY_ARI           0x00000008  // Follow ARI function chains past function 7
+
+typedef struct _CR_TOPOLOGY_REQUEST {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t Flags;          // CR_TOPOLOGY_*
+    uint16_t Segment;        // Ignored with CR_TOPOLOGY_ALL_SEGMENTS
+    uint16_t Reserved;
+    uint32_t MaxWorkers;     // 0 lets the driver choose; 1 forces a sequential walk
+} CR_TOPOLOGY_REQUEST, * PCR_TOPOLOGY_REQUEST;
+
+CR_STATIC_ASSERT(TopologyRequestSize, sizeof(CR_TOPOLOGY_REQUEST) == 16);
+
+// A function is reported if it matches any rule; a spec with no rules
+// reports everything. Within a rule every condition must hold.
+#define CR_MAX_FILTER_RULES  256
+#define CR_FILTER_ANY_ID     0xFFFF     // Wildcard for VendorId/DeviceId
+
+typedef struct _CR_FILTER_RULE {
+    uint16_t VendorId;       // CR_FILTER_ANY_ID matches every vendor
+    uint16_t DeviceId;       // CR_FILTER_ANY_ID matches every device
+    uint32_t ClassCode;      // (BaseClass << 16) | (SubClass << 8) | ProgIf
+    uint32_t ClassMask;      // ClassCode bits that must match; 0 ignores the class
+    uint8_t  FirstBus;
+    uint8_t  LastBus;        // Inclusive; 0 and 255 for every bus
+    uint16_t Reserved;
+} CR_FILTER_RULE, * PCR_FILTER_RULE;
+
+typedef struct _CR_FILTER_SPEC {
+    uint32_t RuleCount;      // CR_FILTER_RULE[RuleCount] follows
+    uint32_t Reserved;
+} CR_FILTER_SPEC, * PCR_FILTER_SPEC;
+
+CR_STATIC_ASSERT(FilterRuleSize, sizeof(CR_FILTER_RULE) == 16);
+CR_STATIC_ASSERT(FilterSpecSize, sizeof(CR_FILTER_SPEC) == 8);
+
+// Upper bound on CR_BATCH_HEADER.Count.
+#define CR_MAX_BATCH_ENTRIES  65536
+
+typedef struct _CR_BATCH_HEADER {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t EntrySize;      // sizeof(CR_READ_ENTRY) in, sizeof(CR_READ_RESULT) out
+    uint32_t Count;
+    uint32_t FailedCount;    // Output only: results with a nonzero Status
+} CR_BATCH_HEADER, * PCR_BATCH_HEADER;
+
+// Width is 1, 2 or 4 and Offset must be a multiple of it.
+typedef struct _CR_READ_ENTRY {
+    uint16_t Segment;
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+    uint8_t  Width;
+    uint16_t Offset;
+} CR_READ_ENTRY, * PCR_READ_ENTRY;
+
+// CR_READ_RESULT.Status
+#define CR_READ_OK           0
+#define CR_READ_INVALID      1   // Bad width, misaligned or past the end of config space
+#define CR_READ_UNREACHABLE  2   // The backend could not reach that register
+
+typedef struct _CR_READ_RESULT {
+    uint32_t Value;          // Zero-extended; absent functions read as all ones
+    uint32_t Status;         // CR_READ_*
+} CR_READ_RESULT, * PCR_READ_RESULT;
+
+CR_STATIC_ASSERT(BatchHeaderSize, sizeof(CR_BATCH_HEADER) == 16);
+CR_STATIC_ASSERT(ReadEntrySize, sizeof(CR_READ_ENTRY) == 8);
+CR_STATIC_ASSERT(ReadResultSize, sizeof(CR_READ_RESULT) == 8);
+
+typedef struct _CR_DELTA_REQUEST {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t Reserved;
+    uint64_t BaseGeneration; // Generation the caller already holds; 0 for none
+} CR_DELTA_REQUEST, * PCR_DELTA_REQUEST;
+
+// CR_DELTA_HEADER.Flags
+#define CR_DELTA_FULL  0x00000001  // BaseGeneration is unknown: every function is reported as added
+
+typedef struct _CR_DELTA_HEADER {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t RecordSize;     // sizeof(CR_FUNCTION_RECORD)
+    uint32_t RecordCount;
+    uint32_t TotalCount;
+    uint32_t Flags;          // CR_DELTA_*
+    uint32_t Reserved;
+    uint64_t Generation;     // Pass back as BaseGeneration next time
+} CR_DELTA_HEADER, * PCR_DELTA_HEADER;
+
+CR_STATIC_ASSERT(DeltaRequestSize, sizeof(CR_DELTA_REQUEST) == 16);
+CR_STATIC_ASSERT(DeltaHeaderSize, sizeof(CR_DELTA_HEADER) == 32);
+
+// CR_CACHE_FLUSH_REQUEST.Flags
+#define CR_CACHE_FLUSH_ALL  0x00000001  // Drop every function, not just the one addressed
+
+typedef struct _CR_CACHE_FLUSH_REQUEST {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t Flags;          // CR_CACHE_FLUSH_*
+    uint16_t Segment;        // Ignored with CR_CACHE_FLUSH_ALL
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+    uint8_t  Reserved[3];
+} CR_CACHE_FLUSH_REQUEST, * PCR_CACHE_FLUSH_REQUEST;
+
+CR_STATIC_ASSERT(CacheFlushRequestSize, sizeof(CR_CACHE_FLUSH_REQUEST) == 16);
+
+// CR_CAP_ENTRY.Flags and CR_CAP_READ_REQUEST.Flags
+#define CR_CAP_EXTENDED  0x0001     // In extended config space (0x100 and up)
+
+typedef struct _CR_CAP_REQUEST {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint16_t Segment;
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+    uint8_t  Reserved0[3];
+    uint32_t Reserved1;
+} CR_CAP_REQUEST, * PCR_CAP_REQUEST;
+
+typedef struct _CR_CAP_ENTRY {
+    uint16_t Id;             // 8-bit standard or 16-bit extended capability ID
+    uint16_t Offset;         // Of the capability header in config space
+    uint8_t  Version;        // Extended capabilities only; 0 for standard ones
+    uint8_t  Flags;          // CR_CAP_*
+    uint16_t Reserved;
+} CR_CAP_ENTRY, * PCR_CAP_ENTRY;
+
+typedef struct _CR_CAP_HEADER {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t EntrySize;      // sizeof(CR_CAP_ENTRY)
+    uint32_t EntryCount;     // Entries present in this buffer
+    uint32_t TotalCount;     // Capabilities found; > EntryCount on overflow
+} CR_CAP_HEADER, * PCR_CAP_HEADER;
+
+typedef struct _CR_CAP_READ_REQUEST {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint16_t Segment;
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+    uint8_t  Instance;       // 0 for the first capability with this ID
+    uint16_t Id;
+    uint16_t Flags;          // CR_CAP_EXTENDED to look Id up in extended space
+    uint16_t Offset;         // From the capability header
+    uint16_t Length;
+    uint16_t Reserved;
+} CR_CAP_READ_REQUEST, * PCR_CAP_READ_REQUEST;
+
+typedef struct _CR_CAP_READ_REPLY {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t Length;         // Bytes that follow; short if the backend ran out
+    CR_CAP_ENTRY Capability; // Where the capability was found
+} CR_CAP_READ_REPLY, * PCR_CAP_READ_REPLY;
+
+CR_STATIC_ASSERT(CapRequestSize, sizeof(CR_CAP_REQUEST) == 16);
+CR_STATIC_ASSERT(CapEntrySize, sizeof(CR_CAP_ENTRY) == 8);
+CR_STATIC_ASSERT(CapHeaderSize, sizeof(CR_CAP_HEADER) == 16);
+CR_STATIC_ASSERT(CapReadRequestSize, sizeof(CR_CAP_READ_REQUEST) == 20);
+CR_STATIC_ASSERT(CapReadReplySize, sizeof(CR_CAP_READ_REPLY) == 16);
+
+// The enabled virtual functions of one SR-IOV physical function. VF N
+// (0-based) has routing ID FirstRoutingId + N * Stride, i.e. bus in the
+// high byte and device << 3 | function in the low byte. VFs share the PF's
+// vendor ID (their own reads as all ones) and the capability's VF device ID.
+typedef struct _CR_VF_RANGE {
+    uint16_t Segment;        // Physical function
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+    uint8_t  RevisionId;     // Of the first VF
+    uint16_t FirstRoutingId;
+    uint16_t Stride;
+    uint16_t Count;          // Enabled VFs with a valid routing ID
+    uint16_t TotalVFs;       // VFs the PF supports
+    uint16_t VendorId;
+    uint16_t DeviceId;       // VF Device ID
+    uint16_t CapOffset;      // SR-IOV capability in the PF
+    uint32_t ClassCode;      // Of the first VF: (BaseClass << 16) | (SubClass << 8) | ProgIf
+    uint32_t Reserved[2];
+} CR_VF_RANGE, * PCR_VF_RANGE;
+
+typedef struct _CR_VF_HEADER {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t RangeSize;      // sizeof(CR_VF_RANGE)
+    uint32_t RangeCount;     // Ranges present in this buffer
+    uint32_t TotalCount;     // Ranges found; > RangeCount on overflow
+    uint32_t FunctionCount;  // Sum of Count over every range found
+    uint32_t Reserved;
+} CR_VF_HEADER, * PCR_VF_HEADER;
+
+CR_STATIC_ASSERT(VfRangeSize, sizeof(CR_VF_RANGE) == 32);
+CR_STATIC_ASSERT(VfHeaderSize, sizeof(CR_VF_HEADER) == 24);
+
+//
+// Sampling ring. A single-producer/single-consumer ring of fixed-size
+// samples in memory shared between the sampler and one reader. Head and Tail
+// are free-running counters on separate cache lines; Tail - Head is the
+// number of unread samples and slot N lives at index N & (Capacity - 1).
+// The producer publishes Tail after writing a slot, the consumer publishes
+// Head after reading one, and neither ever writes the other's counter.
+//
+
+#define CR_MAX_SAMPLE_REGISTERS  32       // One bit each in CR_SAMPLE.FailedMask
+#define CR_MAX_RING_BYTES        0x100000
+
+typedef struct _CR_SAMPLE_REQUEST {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t RegisterCount;  // CR_READ_ENTRY[RegisterCount] follows
+    uint32_t IntervalUs;     // Sampling period in microseconds
+    uint32_t Capacity;       // Ring slots, a power of two
+} CR_SAMPLE_REQUEST, * PCR_SAMPLE_REQUEST;
+
+typedef struct _CR_SAMPLE_MAPPING {
+    uint64_t RingAddress;    // CR_RING_HEADER in the caller's address space
+    uint64_t RingSize;
+} CR_SAMPLE_MAPPING, * PCR_SAMPLE_MAPPING;
+
+typedef struct _CR_RING_HEADER {
+    // Written once before sampling starts
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t SampleSize;     // Bytes per slot, a multiple of 8
+    uint32_t Capacity;
+    uint32_t RegisterCount;
+    uint64_t TimestampFrequency;  // CR_SAMPLE.Timestamp ticks per second
+    uint32_t DataOffset;     // Slot 0, from the start of this header
+    uint32_t Reserved0[9];
+
+    // Producer cache line
+    volatile uint32_t Tail;  // Samples published
+    volatile uint32_t Dropped;    // Samples lost because the ring was full
+    uint32_t Reserved1[14];
+
+    // Consumer cache line
+    volatile uint32_t Head;  // Samples consumed
+    uint32_t Reserved2[15];
+} CR_RING_HEADER, * PCR_RING_HEADER;
+
+// Followed by uint32_t Values[RegisterCount] in CR_SAMPLE_REQUEST order.
+typedef struct _CR_SAMPLE {
+    uint64_t Timestamp;
+    uint32_t Sequence;       // Tick number; a gap means samples were dropped
+    uint32_t FailedMask;     // Bit N set: register N could not be read
+} CR_SAMPLE, * PCR_SAMPLE;
+
+CR_STATIC_ASSERT(SampleRequestSize, sizeof(CR_SAMPLE_REQUEST) == 16);
+CR_STATIC_ASSERT(SampleMappingSize, sizeof(CR_SAMPLE_MAPPING) == 16);
+CR_STATIC_ASSERT(RingHeaderSize, sizeof(CR_RING_HEADER) == 192);
+CR_STATIC_ASSERT(SampleSize, sizeof(CR_SAMPLE) == 16);
+
+//
+// Snapshot files. A full config-space dump laid out to be memory mapped and
+// queried in place: CR_SNAPFILE_HEADER, then CR_SNAPFILE_ENTRY[EntryCount]
+// sorted by Key, then BlobCount page-aligned 4 KB config-space blobs.
+// Functions with identical config space share one blob. All fields are
+// little endian.
+//
+
+#define CR_SNAPFILE_MAGIC     0x46535243   // "CRSF"
+#define CR_SNAPFILE_VERSION   1
+#define CR_SNAPFILE_BLOB_SIZE 4096
+
+typedef struct _CR_SNAPFILE_HEADER {
+    uint32_t Magic;          // CR_SNAPFILE_MAGIC
+    uint32_t Version;        // CR_SNAPFILE_VERSION
+    uint32_t HeaderSize;     // sizeof(CR_SNAPFILE_HEADER); the index follows it
+    uint32_t EntrySize;      // sizeof(CR_SNAPFILE_ENTRY)
+    uint32_t BlobSize;       // CR_SNAPFILE_BLOB_SIZE
+    uint32_t EntryCount;
+    uint32_t BlobCount;
+    uint32_t Reserved0;
+    uint64_t BlobOffset;     // Blob 0, a multiple of BlobSize
+    uint64_t FileSize;
+    uint64_t Reserved1[2];
+} CR_SNAPFILE_HEADER, * PCR_SNAPFILE_HEADER;
+
+typedef struct _CR_SNAPFILE_ENTRY {
+    uint32_t Key;            // Segment << 16 | Bus << 8 | Device << 3 | Function
+    uint32_t BlobIndex;
+    uint16_t ValidLength;    // Bytes captured; the rest of the blob is zero
+    uint16_t Reserved0;
+    uint32_t Reserved1;
+    uint64_t Hash;           // 64-bit FNV-1a of the whole blob
+} CR_SNAPFILE_ENTRY, * PCR_SNAPFILE_ENTRY;
+
+CR_STATIC_ASSERT(SnapFileHeaderSize, sizeof(CR_SNAPFILE_HEADER) == 64);
+CR_STATIC_ASSERT(SnapFileEntrySize, sizeof(CR_SNAPFILE_ENTRY) == 24);
+
+//
+// Config-access traces. Every read a recording backend passed to the
+// hardware, in completion order: CR_TRACE_HEADER, then RecordCount records,
+// each a CR_TRACE_RECORD followed by its Returned bytes of data padded to a
+// multiple of 4. All fields are little endian.
+//
+
+#define CR_TRACE_MAGIC   0x52545243   // "CRTR"
+#define CR_TRACE_VERSION 1
+
+// Bytes a record with Returned bytes of data occupies.
+#define CR_TRACE_RECORD_SPAN(Returned) (sizeof(CR_TRACE_RECORD) + (((uint32_t)(Returned) + 3) & ~3u))
+
+typedef struct _CR_TRACE_HEADER {
+    uint32_t Magic;          // CR_TRACE_MAGIC
+    uint32_t Version;        // CR_TRACE_VERSION
+    uint32_t HeaderSize;     // sizeof(CR_TRACE_HEADER); the records follow it
+    uint32_t RecordSize;     // sizeof(CR_TRACE_RECORD)
+    uint32_t RecordCount;
+    uint32_t Reserved0;
+    uint64_t DataSize;       // Bytes of records
+    uint64_t DurationNs;     // From the first read's start to the last one's end
+    uint64_t LatencyNs;      // Sum of every record's LatencyNs
+    uint64_t Reserved1[2];
+} CR_TRACE_HEADER, * PCR_TRACE_HEADER;
+
+typedef struct _CR_TRACE_RECORD {
+    uint32_t Key;            // Segment << 16 | Bus << 8 | Device << 3 | Function
+    uint16_t Offset;
+    uint16_t Length;         // Bytes asked for
+    uint16_t Returned;       // Bytes the backend read; this much data follows
+    uint16_t Reserved;
+    uint32_t LatencyNs;      // Time in the backend, saturating
+} CR_TRACE_RECORD, * PCR_TRACE_RECORD;
+
+CR_STATIC_ASSERT(TraceHeaderSize, sizeof(CR_TRACE_HEADER) == 64);
+CR_STATIC_ASSERT(TraceRecordSize, sizeof(CR_TRACE_RECORD) == 16);
+
+//
+// Name databases. pci.ids compiled into sorted tables that are mapped (or
+// embedded) and searched in place: CR_NAMEDB_HEADER, then the vendor,
+// device, subsystem and class tables at the offsets it gives, then a pool of
+// NUL-terminated strings. Devices are sorted by (vendor, device) and each
+// vendor points at its run of them; subsystems hang off devices the same
+// way. Names are byte offsets into the pool, which starts with an empty
+// string and ends with a NUL. All fields are little endian.
+//
+
+#define CR_NAMEDB_MAGIC   0x444E5243   // "CRND"
+#define CR_NAMEDB_VERSION 1
+
+// Class table keys: the 24-bit class code in the low bits, the depth of the
+// entry (base class, subclass or programming interface) above it.
+#define CR_NAMEDB_CLASS_BASE   1
+#define CR_NAMEDB_CLASS_SUB    2
+#define CR_NAMEDB_CLASS_PROGIF 3
+#define CR_NAMEDB_CLASS_KEY(Depth, ClassCode) (((uint32_t)(Depth) << 24) | ((ClassCode) & 0x00FFFFFF))
+
+typedef struct _CR_NAMEDB_HEADER {
+    uint32_t Magic;          // CR_NAMEDB_MAGIC
+    uint32_t Version;        // CR_NAMEDB_VERSION
+    uint32_t HeaderSize;     // sizeof(CR_NAMEDB_HEADER)
+    uint32_t FileSize;
+    uint32_t VendorOffset;   // Every table offset is a multiple of 4
+    uint32_t VendorCount;
+    uint32_t DeviceOffset;
+    uint32_t DeviceCount;
+    uint32_t SubsystemOffset;
+    uint32_t SubsystemCount;
+    uint32_t ClassOffset;
+    uint32_t ClassCount;
+    uint32_t StringOffset;
+    uint32_t StringSize;
+    uint32_t Reserved[2];
+} CR_NAMEDB_HEADER, * PCR_NAMEDB_HEADER;
+
+typedef struct _CR_NAMEDB_VENDOR {
+    uint16_t VendorId;
+    uint16_t Reserved;
+    uint32_t Name;
+    uint32_t FirstDevice;    // Index into the device table
+    uint32_t DeviceCount;
+} CR_NAMEDB_VENDOR, * PCR_NAMEDB_VENDOR;
+
+typedef struct _CR_NAMEDB_DEVICE {
+    uint16_t DeviceId;
+    uint16_t Reserved;
+    uint32_t Name;
+    uint32_t FirstSubsystem; // Index into the subsystem table
+    uint32_t SubsystemCount;
+} CR_NAMEDB_DEVICE, * PCR_NAMEDB_DEVICE;
+
+typedef struct _CR_NAMEDB_SUBSYSTEM {
+    uint32_t Key;            // SubVendorId << 16 | SubDeviceId
+    uint32_t Name;
+} CR_NAMEDB_SUBSYSTEM, * PCR_NAMEDB_SUBSYSTEM;
+
+typedef struct _CR_NAMEDB_CLASS {
+    uint32_t Key;            // CR_NAMEDB_CLASS_KEY
+    uint32_t Name;
+} CR_NAMEDB_CLASS, * PCR_NAMEDB_CLASS;
+
+CR_STATIC_ASSERT(NameDbHeaderSize, sizeof(CR_NAMEDB_HEADER) == 64);
+CR_STATIC_ASSERT(NameDbVendorSize, sizeof(CR_NAMEDB_VENDOR) == 16);
+CR_STATIC_ASSERT(NameDbDeviceSize, sizeof(CR_NAMEDB_DEVICE) == 16);
+CR_STATIC_ASSERT(NameDbSubsystemSize, sizeof(CR_NAMEDB_SUBSYSTEM) == 8);
+CR_STATIC_ASSERT(NameDbClassSize, sizeof(CR_NAMEDB_CLASS) == 8);
+
+//
+// Record streams: the binary output of CrRecordWriter. A sequence of frames,
+// each a CR_STREAM_FRAME, HeaderSize bytes of header for its Kind, then
+// ItemCount items of ItemSize bytes copied unchanged from the driver's
+// replies. All fields are little endian.
+//
+
+#define CR_STREAM_MAGIC   0x54535243   // "CRST"
+
+// CR_STREAM_FRAME.Kind
+#define CR_STREAM_SCAN    1   // No header; CR_FUNCTION_RECORD items
+#define CR_STREAM_DELTA   2   // CR_DELTA_HEADER; CR_FUNCTION_RECORD items
+#define CR_STREAM_SAMPLES 3   // CR_STREAM_SAMPLE_HEADER; ring slots (CR_SAMPLE + values)
+#define CR_STREAM_STATS   4   // No header; one CR_STATS_REPLY
+
+typedef struct _CR_STREAM_FRAME {
+    uint32_t Magic;          // CR_STREAM_MAGIC, to resynchronize on a damaged stream
+    uint16_t Kind;           // CR_STREAM_*
+    uint16_t HeaderSize;
+    uint32_t ItemSize;
+    uint32_t ItemCount;
+} CR_STREAM_FRAME, * PCR_STREAM_FRAME;
+
+typedef struct _CR_STREAM_SAMPLE_HEADER {
+    uint64_t TimestampFrequency; // CR_SAMPLE.Timestamp ticks per second
+    uint32_t RegisterCount;      // Values per sample
+    uint32_t Dropped;            // CR_RING_HEADER.Dropped when the frame was written
+} CR_STREAM_SAMPLE_HEADER, * PCR_STREAM_SAMPLE_HEADER;
+
+CR_STATIC_ASSERT(StreamFrameSize, sizeof(CR_STREAM_FRAME) == 16);
+CR_STATIC_ASSERT(StreamSampleHeaderSize, sizeof(CR_STREAM_SAMPLE_HEADER) == 16);
+
+//
+// Statistics. Counters only ever grow; diff two replies to get rates.
+// Histogram bucket N counts latencies in [2^N, 2^(N+1)) nanoseconds (bucket
+// 0 also takes 0 ns, the last bucket everything longer).
+//
+
+#define CR_STATS_IOCTL_BASE   0x800    // Function code of IOCTL slot 0
+#define CR_STATS_IOCTL_SLOTS  16
+#define CR_STATS_BUCKETS      32
+
+// Index of an IOCTL in CR_STATS_REPLY.Ioctls.
+#define CR_STATS_IOCTL_SLOT(IoControlCode) ((((IoControlCode) >> 2) & 0xFFF) - CR_STATS_IOCTL_BASE)
+
+typedef struct _CR_STATS_IOCTL {
+    uint64_t Requests;
+    uint64_t Failures;       // Completed with an error status
+    uint64_t BytesReturned;
+    uint64_t TotalNs;
+    uint64_t Latency[CR_STATS_BUCKETS];
+} CR_STATS_IOCTL, * PCR_STATS_IOCTL;
+
+typedef struct _CR_STATS_REPLY {
+    uint32_t Version;        // CR_PROTOCOL_VERSION
+    uint32_t IoctlSlots;     // CR_STATS_IOCTL_SLOTS
+    uint32_t BucketCount;    // CR_STATS_BUCKETS
+    uint32_t CpuCount;       // Per-CPU slots summed into this reply
+    uint64_t FunctionsProbed;    // Vendor/device dword reads, one per probed slot
+    uint64_t ConfigReads;        // Backend reads, including probes
+    uint64_t ConfigReadFailures; // Reads that returned fewer bytes than asked
+    uint64_t ConfigReadBytes;
+    uint64_t ConfigReadNs;
+    uint64_t ReadLatency[CR_STATS_BUCKETS];
+    CR_STATS_IOCTL Ioctls[CR_STATS_IOCTL_SLOTS];
+} CR_STATS_REPLY, * PCR_STATS_REPLY;
+
+CR_STATIC_ASSERT(StatsIoctlSize, sizeof(CR_STATS_IOCTL) == 288);
+CR_STATIC_ASSERT(StatsReplySize, sizeof(CR_STATS_REPLY) == 56 + 8 * CR_STATS_BUCKETS + 288 * CR_STATS_IOCTL_SLOTS);
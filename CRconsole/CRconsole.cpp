@@ -1,19 +1,55 @@
 // CRconsole.cpp
+//
+// Command-line front end to CRdriver, built on the CRclient library. One
+// transport is opened at start and every command of the run goes through
+// it, so sessions and batches pay for the service and the handle once.
+//
+//   CRconsole                      Run the demo sequence
+//   CRconsole -i                   Interactive session
+//   CRconsole -c "scan; stats"     Run commands, separated by ';', and exit
+//   CRconsole -b FILE              Run commands from FILE ('-' for stdin)
+//
+//   --snapshot PATH   Serve requests in-process from a snapshot file
+//                     instead of the driver (no service, no admin rights)
+//   --no-start        Fail instead of starting the CRdriver service
+//   --stop            Stop the CRdriver service on exit
+//   --names PATH      Name database built by CRnames (default: crnames.bin
+//                     in the current directory, if there is one)
+//   --format FORMAT   Emit scan, delta, wait, sample and stats results as
+//                     json (NDJSON), csv or binary (CR_STREAM_FRAMEs)
+//                     records instead of tables
+//   --output PATH     Write those records to PATH instead of stdout
+//
+// Consecutive 'read' commands are pipelined: they go to the driver as one
+// IOCTL_MYPCISCANNER_READ_BATCH when the run of reads ends. 'snapshot' keeps
+// several batches in flight at once through CrAsyncClient.
 
 #include <windows.h>
-#include <stdio.h>    // For printf, wprintf, getchar
-#include <winioctl.h> // For IOCTL definitions and DeviceIoControl
-#include <winsvc.h>   // For Service Control Manager APIs
-#include <tchar.h>    // For _TCHAR, _tprintf (though we'll use wprintf for consistency here)
-
-// Define the IOCTL code exactly as it is in your driver.h
-#define MYPCISCANNER_DEVICE_TYPE 0x8000
-#define IOCTL_MYPCISCANNER_SCAN_BUS0 CTL_CODE( \
-    MYPCISCANNER_DEVICE_TYPE, \
-    0x800, \
-    METHOD_BUFFERED, \
-    FILE_ANY_ACCESS \
-)
+#include <fcntl.h>    // For _O_BINARY
+#include <io.h>       // For _setmode
+#include <stdio.h>    // For printf, wprintf
+#include <stdlib.h>   // For malloc, free
+#include <string.h>
+
+#include "../CRclient/crclient.h" // CrClient and its transports; pulls in crprotocol.h and crcore.h
+
+#define CONSOLE_MAX_LINE   1024
+#define CONSOLE_MAX_ARGS   8
+#define CONSOLE_PIPELINE_DEPTH 8    // Requests kept in flight by bulk commands
+#define CONSOLE_NAMES_PATH "crnames.bin"
+
+static const wchar_t* StatusName(CR_STATUS status) {
+    switch (status) {
+    case CR_OK:                  return L"success";
+    case CR_E_MORE_DATA:         return L"more data";
+    case CR_E_INVALID_PARAMETER: return L"invalid parameter";
+    case CR_E_NO_MEMORY:         return L"out of memory";
+    case CR_E_NOT_FOUND:         return L"not found";
+    case CR_E_IO:                return L"I/O error or unexpected reply";
+    case CR_E_UNSUPPORTED:       return L"not supported";
+    default:                     return L"unknown error";
+    }
+}
 
 // Helper function to print error messages
 void PrintError(const wchar_t* prefix, DWORD dwError) {
@@ -29,242 +65,895 @@ void PrintError(const wchar_t* prefix, DWORD dwError) {
     LocalFree(lpMsgBuf);
 }
 
-// Function to wait for a service to reach a specific state
-BOOL WaitForServiceState(SC_HANDLE hService, const wchar_t* serviceName, DWORD dwDesiredState, DWORD dwTimeoutMs = 30000) {
-    SERVICE_STATUS_PROCESS ssStatus;
-    DWORD dwBytesNeeded;
-    DWORD dwStartTime = GetTickCount();
-    DWORD dwWaitTime;
-
-    wprintf(L"Waiting for service '%s' to reach state %lu...\n", serviceName, dwDesiredState);
-
-    while (TRUE) {
-        if (!QueryServiceStatusEx(
-            hService,
-            SC_STATUS_PROCESS_INFO,
-            (LPBYTE)&ssStatus,
-            sizeof(SERVICE_STATUS_PROCESS),
-            &dwBytesNeeded))
-        {
-            PrintError(L"Error: QueryServiceStatusEx failed while waiting", GetLastError());
-            return FALSE;
-        }
-
-        if (ssStatus.dwCurrentState == dwDesiredState) {
-            wprintf(L"Service '%s' reached state %lu.\n", serviceName, dwDesiredState);
-            return TRUE;
-        }
-
-        dwWaitTime = GetTickCount() - dwStartTime;
-        if (dwWaitTime >= dwTimeoutMs) {
-            wprintf(L"Error: Timeout waiting for service '%s' to reach state %lu (current state %lu)\n", serviceName, dwDesiredState, ssStatus.dwCurrentState);
-            return FALSE;
-        }
-
-        // If it's in a pending state, wait a bit using the hint or a default
-        // Ensure dwWaitHint is treated as a suggestion and capped to avoid overly long sleeps if the hint is huge.
-        DWORD sleepInterval = 250; // Default sleep interval
-        if (ssStatus.dwCurrentState == SERVICE_START_PENDING ||
-            ssStatus.dwCurrentState == SERVICE_STOP_PENDING ||
-            ssStatus.dwCurrentState == SERVICE_CONTINUE_PENDING ||
-            ssStatus.dwCurrentState == SERVICE_PAUSE_PENDING) {
-            if (ssStatus.dwWaitHint > 0) {
-                sleepInterval = min(ssStatus.dwWaitHint, 3000); // Use wait hint, but cap it
-            }
+// Everything a run keeps between commands.
+struct Session {
+    CrClient* Client;
+    CrDeviceTransport* Device;               // NULL when serving from a snapshot
+    std::vector<CR_FUNCTION_RECORD> Records; // Last scan
+    UINT64 DeltaGeneration;
+    UINT64 WatchGeneration;
+    std::vector<CR_ADDRESS> ReadAddresses;   // Queued reads, for printing their results
+    PCR_NAMEDB Names;                        // NULL without a name database
+    CrRecordWriter* Writer;                  // NULL for the text tables
+    std::unique_ptr<CrHealthCollector> Health; // Set up by the first 'health' after a scan
+};
+
+// Reports a failed request, with the Win32 error behind it when there is one.
+static void PrintFailure(const Session& session, const wchar_t* what, CR_STATUS status) {
+    if (session.Device != NULL && session.Device->LastError() != ERROR_SUCCESS && status != CR_E_IO) {
+        wchar_t prefix[128];
+        swprintf_s(prefix, L"%s failed", what);
+        PrintError(prefix, session.Device->LastError());
+    }
+    else {
+        wprintf(L"%s failed: %s\n", what, StatusName(status));
+    }
+}
+
+// Prints "Vendor Device [Class]" from the name database, falling back to the
+// IDs for whatever it does not know.
+static void PrintRecordName(const CR_NAMEDB* names, const CR_FUNCTION_RECORD* r) {
+    DWORD classCode = ((DWORD)r->BaseClass << 16) | ((DWORD)r->SubClass << 8) | r->ProgIf;
+    const char* vendor = CrNameDbVendor(names, r->VendorId);
+    const char* device = CrNameDbDevice(names, r->VendorId, r->DeviceId);
+    const char* className = CrNameDbClass(names, classCode, CR_NAMEDB_CLASS_SUB);
+
+    if (className == NULL) {
+        className = CrNameDbClass(names, classCode, CR_NAMEDB_CLASS_BASE);
+    }
+    if (vendor != NULL) {
+        wprintf(L"  %S", vendor);
+    }
+    else {
+        wprintf(L"  Vendor %04X", r->VendorId);
+    }
+    if (device != NULL) {
+        wprintf(L" %S", device);
+    }
+    else {
+        wprintf(L" Device %04X", r->DeviceId);
+    }
+    if (className != NULL) {
+        wprintf(L" [%S]", className);
+    }
+}
+
+static void PrintRecords(const Session& session) {
+    const std::vector<CR_FUNCTION_RECORD>& records = session.Records;
+
+    wprintf(L"Found %lu function(s):\n", (DWORD)records.size());
+    wprintf(L"  Seg  Bus Dev Fn  Vendor Device Class    Rev Hdr%s\n", (session.Names != NULL) ? L"  Name" : L"");
+    for (size_t i = 0; i < records.size(); i++) {
+        const CR_FUNCTION_RECORD* r = &records[i];
+        wprintf(L"  %04X %02X  %02X  %u   %04X   %04X   %02X%02X%02X   %02X  %02X",
+            r->Segment, r->Bus, r->Device, r->Function,
+            r->VendorId, r->DeviceId,
+            r->BaseClass, r->SubClass, r->ProgIf,
+            r->RevisionId, r->HeaderType);
+        if (session.Names != NULL) {
+            PrintRecordName(session.Names, r);
+        }
+        wprintf(L"\n");
+    }
+}
+
+static CR_ADDRESS RecordAddress(const CR_FUNCTION_RECORD* r) {
+    CR_ADDRESS address;
+    address.Segment = r->Segment;
+    address.Bus = r->Bus;
+    address.Device = r->Device;
+    address.Function = r->Function;
+    return address;
+}
+
+// Scans every segment, following ARI chains, or just bus 0.
+static bool Scan(Session& session, bool bus0) {
+    CR_STATUS status;
+
+    if (bus0) {
+        status = session.Client->ScanBus0(NULL, 0, session.Records);
+    }
+    else {
+        CR_TOPOLOGY_REQUEST request = { 0 };
+        request.Version = CR_PROTOCOL_VERSION;
+        request.Flags = CR_TOPOLOGY_ALL_SEGMENTS | CR_TOPOLOGY_ARI;
+        status = session.Client->ScanTopology(&request, sizeof(request), session.Records);
+    }
+    if (status != CR_OK) {
+        PrintFailure(session, L"Scan", status);
+        return false;
+    }
+    // The health collector's register list belongs to the previous topology.
+    session.Health.reset();
+    if (session.Writer != NULL) {
+        return session.Writer->WriteScan(session.Records.data(), (uint32_t)session.Records.size()) == CR_OK;
+    }
+    PrintRecords(session);
+    return true;
+}
+
+// Scans first if this run has not yet.
+static bool EnsureScanned(Session& session) {
+    return !session.Records.empty() || Scan(session, false);
+}
+
+// Reads the Command and Status registers of every scanned function with a
+// single IOCTL_MYPCISCANNER_READ_BATCH instead of one round trip per register.
+static bool PrintCommandStatus(Session& session) {
+    const std::vector<CR_FUNCTION_RECORD>& records = session.Records;
+    std::vector<CR_READ_RESULT> results;
+
+    for (size_t i = 0; i < records.size(); i++) {
+        session.Client->QueueRead(RecordAddress(&records[i]), 0x04, 2);   // Command
+        session.Client->QueueRead(RecordAddress(&records[i]), 0x06, 2);   // Status
+    }
+    CR_STATUS status = session.Client->FlushReads(results);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Batch read", status);
+        return false;
+    }
+
+    wprintf(L"Command/Status (%lu register(s)):\n", (DWORD)results.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        const CR_READ_RESULT* command = &results[i * 2];
+        const CR_READ_RESULT* stat = &results[i * 2 + 1];
+        if (command->Status != CR_READ_OK || stat->Status != CR_READ_OK) {
+            wprintf(L"  %04X:%02X:%02X.%u  unreadable\n",
+                records[i].Segment, records[i].Bus, records[i].Device, records[i].Function);
+            continue;
+        }
+        wprintf(L"  %04X:%02X:%02X.%u  Cmd %04X  Sts %04X\n",
+            records[i].Segment, records[i].Bus, records[i].Device, records[i].Function,
+            command->Value, stat->Value);
+    }
+    return true;
+}
+
+// Sends every queued 'read' as one batch and prints the results in order.
+static bool FlushReads(Session& session) {
+    std::vector<CR_READ_RESULT> results;
+
+    if (session.Client->QueuedReads() == 0) {
+        return true;
+    }
+    CR_STATUS status = session.Client->FlushReads(results);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Batch read", status);
+        session.ReadAddresses.clear();
+        return false;
+    }
+    for (size_t i = 0; i < results.size() && i < session.ReadAddresses.size(); i++) {
+        const CR_ADDRESS* a = &session.ReadAddresses[i];
+        if (results[i].Status == CR_READ_OK) {
+            wprintf(L"  %04X:%02X:%02X.%u  %08X\n", a->Segment, a->Bus, a->Device, a->Function, results[i].Value);
         }
         else {
-            // Service is in a stable non-desired state, probably won't change without intervention
-            wprintf(L"Service '%s' is in stable state %lu, not the desired state %lu. Will not reach desired state without intervention.\n", serviceName, ssStatus.dwCurrentState, dwDesiredState);
-            return FALSE;
+            wprintf(L"  %04X:%02X:%02X.%u  unreadable (%lu)\n", a->Segment, a->Bus, a->Device, a->Function,
+                results[i].Status);
         }
-        Sleep(sleepInterval);
     }
+    session.ReadAddresses.clear();
+    return true;
 }
 
-// Function to start the CRdriver service
-BOOL StartDriverService() {
-    SC_HANDLE hSCManager = NULL;
-    SC_HANDLE hService = NULL;
-    BOOL bSuccess = FALSE;
-    const wchar_t* serviceName = L"CRdriver";
+// Lists the capabilities of one function from the driver's index, then
+// reads the PCI Express Link Status register straight from its capability
+// with IOCTL_MYPCISCANNER_READ_CAP instead of walking the list here.
+static bool PrintCapabilities(Session& session, CR_ADDRESS address) {
+    std::vector<CR_CAP_ENTRY> caps;
+    DWORD total = 0;
 
-    hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
-    if (hSCManager == NULL) {
-        PrintError(L"Error: OpenSCManager failed", GetLastError());
-        return FALSE;
+    CR_STATUS status = session.Client->Capabilities(address, caps, (uint32_t*)&total);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Capability query", status);
+        return false;
+    }
+    wprintf(L"Capabilities of %04X:%02X:%02X.%u (%lu of %lu):\n",
+        address.Segment, address.Bus, address.Device, address.Function, (DWORD)caps.size(), total);
+    for (size_t i = 0; i < caps.size(); i++) {
+        const CR_CAP_ENTRY* e = &caps[i];
+        if (e->Flags & CR_CAP_EXTENDED) {
+            wprintf(L"  %03X  extended %04X v%u\n", e->Offset, e->Id, e->Version);
+        }
+        else {
+            wprintf(L"  %03X  %02X\n", e->Offset, e->Id);
+        }
     }
 
-    hService = OpenService(hSCManager, serviceName, SERVICE_START | SERVICE_QUERY_STATUS);
-    if (hService == NULL) {
-        PrintError(L"Error: OpenService failed for CRdriver", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return FALSE;
+    CR_CAP_READ_REQUEST read = { 0 };
+    UINT16 linkStatus = 0;
+    uint32_t length = sizeof(linkStatus);
+    read.Version = CR_PROTOCOL_VERSION;
+    read.Segment = address.Segment;
+    read.Bus = address.Bus;
+    read.Device = address.Device;
+    read.Function = address.Function;
+    read.Id = 0x10;         // PCI Express
+    read.Offset = 0x12;     // Link Status
+    read.Length = sizeof(linkStatus);
+    status = session.Client->ReadCapability(&read, NULL, &linkStatus, &length);
+    if (status == CR_OK && length == sizeof(linkStatus)) {
+        wprintf(L"  PCIe link: gen %u x%u\n", linkStatus & 0xF, (linkStatus >> 4) & 0x3F);
+    }
+    else if (status != CR_OK && status != CR_E_NOT_FOUND) {
+        PrintFailure(session, L"Capability read", status);
+        return false;
     }
+    return true;
+}
 
-    SERVICE_STATUS_PROCESS ssStatus;
-    DWORD dwBytesNeeded;
-    if (!QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssStatus, sizeof(SERVICE_STATUS_PROCESS), &dwBytesNeeded)) {
-        PrintError(L"Error: QueryServiceStatusEx failed for CRdriver", GetLastError());
+// Lists the SR-IOV virtual functions enabled under each physical function.
+// The driver reports one range per PF; individual VF addresses are expanded
+// here with CrVfAddress, so thousands of VFs cost no more than a few ranges.
+static bool PrintVirtualFunctions(Session& session) {
+    CR_TOPOLOGY_REQUEST request = { 0 };
+    CR_VF_HEADER header;
+    std::vector<CR_VF_RANGE> ranges;
+
+    request.Version = CR_PROTOCOL_VERSION;
+    request.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    CR_STATUS status = session.Client->VirtualFunctions(&request, &header, ranges);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Virtual function scan", status);
+        return false;
     }
-    else {
-        if (ssStatus.dwCurrentState == SERVICE_RUNNING) {
-            wprintf(L"%s service is already running.\n", serviceName);
-            bSuccess = TRUE;
-        }
-        else if (ssStatus.dwCurrentState == SERVICE_STOPPED || ssStatus.dwCurrentState == SERVICE_STOP_PENDING) {
-            wprintf(L"Attempting to start %s service...\n", serviceName);
-            if (!StartService(hService, 0, NULL)) {
-                PrintError(L"Error: StartService failed for CRdriver", GetLastError());
-            }
-            else {
-                wprintf(L"Service start initiated for %s. Waiting for service to run...\n", serviceName);
-                if (WaitForServiceState(hService, serviceName, SERVICE_RUNNING)) {
-                    wprintf(L"%s service started successfully.\n", serviceName);
-                    bSuccess = TRUE;
+
+    wprintf(L"SR-IOV: %lu physical function(s) with %lu virtual function(s) enabled\n",
+        header.TotalCount, header.FunctionCount);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        const CR_VF_RANGE* r = &ranges[i];
+        CR_ADDRESS first = CrVfAddress(r, 0);
+        CR_ADDRESS last = CrVfAddress(r, r->Count - 1u);
+        wprintf(L"  PF %04X:%02X:%02X.%u: %u of %u VF(s) %04X:%04X class %06X, %02X:%02X.%u - %02X:%02X.%u\n",
+            r->Segment, r->Bus, r->Device, r->Function, r->Count, r->TotalVFs,
+            r->VendorId, r->DeviceId, r->ClassCode,
+            first.Bus, first.Device, first.Function, last.Bus, last.Device, last.Function);
+    }
+    return true;
+}
+
+// Dumps the full 4 KB config space of every scanned function to a snapshot
+// file that any tool can map with CrSnapFileOpen, or serve with --snapshot.
+// Each function is one READ_BATCH of 1024 dwords; CONSOLE_PIPELINE_DEPTH of
+// them are kept in flight, and each reply is unpacked while the driver reads
+// the next functions. A function keeps the dwords up to its first failed
+// read, so a HAL backend limited to 256 bytes still produces a usable dump.
+static bool WriteSnapshot(Session& session, const char* path) {
+    const std::vector<CR_FUNCTION_RECORD>& records = session.Records;
+    const DWORD dwordsPerFunction = CR_SNAPFILE_BLOB_SIZE / 4;
+    DWORD count = (DWORD)records.size();
+    std::vector<CR_SNAPFILE_INPUT> inputs(count + 1);
+    std::vector<BYTE> configs(((size_t)count + 1) * CR_SNAPFILE_BLOB_SIZE);
+    std::vector<CR_READ_ENTRY> entries(dwordsPerFunction);
+    CrAsyncClient pipeline(session.Client->Transport(), CONSOLE_PIPELINE_DEPTH);
+    CR_STATUS failure = CR_OK;
+
+    for (DWORD i = 0; i < count && failure == CR_OK; i++) {
+        const CR_FUNCTION_RECORD* r = &records[i];
+        PCR_SNAPFILE_INPUT input = &inputs[i];
+        BYTE* config = &configs[(size_t)i * CR_SNAPFILE_BLOB_SIZE];
+
+        for (DWORD j = 0; j < dwordsPerFunction; j++) {
+            memset(&entries[j], 0, sizeof(entries[j]));
+            entries[j].Segment = r->Segment;
+            entries[j].Bus = r->Bus;
+            entries[j].Device = r->Device;
+            entries[j].Function = r->Function;
+            entries[j].Offset = (uint16_t)(j * 4);
+            entries[j].Width = 4;
+        }
+        input->Address = RecordAddress(r);
+        input->Config = config;
+
+        CR_STATUS status = pipeline.ReadBatch(entries.data(), dwordsPerFunction,
+            [r, input, config, &failure](CR_STATUS status, const CR_READ_RESULT* values, uint32_t valueCount, uint32_t) {
+                DWORD valid = 0;
+
+                if (status != CR_OK) {
+                    failure = status;
+                    return;
                 }
-                else {
-                    wprintf(L"%s service did not reach running state.\n", serviceName);
+                // Config space and Windows are both little endian.
+                while (valid < valueCount && values[valid].Status == CR_READ_OK) {
+                    memcpy(config + valid * 4, &values[valid].Value, 4);
+                    valid++;
                 }
-            }
-        }
-        else {
-            wprintf(L"%s service is in state %lu, not attempting to start.\n", serviceName, ssStatus.dwCurrentState);
+                input->Length = valid * 4;
+                if (input->Length < CR_CONFIG_HEADER_SIZE) {
+                    // Fall back to the header the scan already returned.
+                    memcpy(config, r->Config, CR_CONFIG_HEADER_SIZE);
+                    input->Length = CR_CONFIG_HEADER_SIZE;
+                }
+            });
+        if (status != CR_OK) {
+            failure = status;
         }
     }
+    pipeline.Drain();
+    if (failure != CR_OK) {
+        PrintFailure(session, L"Snapshot batch read", failure);
+        return false;
+    }
 
-    if (hService) CloseServiceHandle(hService);
-    if (hSCManager) CloseServiceHandle(hSCManager);
-    return bSuccess;
+    if (CrSnapFileWrite(path, inputs.data(), count) != CR_OK) {
+        wprintf(L"Error: Could not write snapshot %S\n", path);
+        return false;
+    }
+    wprintf(L"Wrote %lu function(s) to snapshot %S\n", count, path);
+    return true;
 }
 
-// Function to stop the CRdriver service
-BOOL StopDriverService() {
-    SC_HANDLE hSCManager = NULL;
-    SC_HANDLE hService = NULL;
-    BOOL bSuccess = FALSE;
-    SERVICE_STATUS_PROCESS ssStatus; // Used for sending control and for waiting
-    const wchar_t* serviceName = L"CRdriver";
+// Collects PCIe link and AER health count times, intervalMs apart (count 0:
+// until the console is killed), rewriting path in the Prometheus text format
+// after each collection. Capabilities are located on the first run after a
+// scan; each collection after that is a single READ_BATCH.
+static bool ExportHealth(Session& session, const char* path, DWORD count, DWORD intervalMs) {
+    CR_STATUS status;
 
-    hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
-    if (hSCManager == NULL) {
-        PrintError(L"Error: OpenSCManager failed (for stop)", GetLastError());
-        return FALSE;
+    // A new path starts a new collector, so Export never has to build one.
+    if (session.Health && strcmp(session.Health->Path(), path) != 0) {
+        session.Health.reset();
     }
+    if (!session.Health) {
+        session.Health.reset(new CrHealthCollector(session.Client));
+        status = session.Health->Init(session.Records.data(), (uint32_t)session.Records.size(), path);
+        if (status != CR_OK) {
+            session.Health.reset();
+            PrintFailure(session, L"Capability query", status);
+            return false;
+        }
+        if (session.Health->UnreadableCount() != 0) {
+            wprintf(L"Warning: Left out %lu function(s) whose capabilities could not be read\n",
+                session.Health->UnreadableCount());
+        }
+    }
+    for (DWORD i = 0; count == 0 || i < count; i++) {
+        if (i != 0) {
+            Sleep(intervalMs);
+        }
+        status = session.Health->Collect();
+        if (status != CR_OK) {
+            PrintFailure(session, L"Health batch read", status);
+            return false;
+        }
+        if (session.Health->Export() != CR_OK) {
+            wprintf(L"Error: Could not write %S\n", path);
+            return false;
+        }
+    }
+    wprintf(L"Wrote PCIe health of %lu function(s) to %S: %lu degraded link(s), %lu register(s) per collection\n",
+        session.Health->FunctionCount(), path, session.Health->DegradedCount(), session.Health->RegisterCount());
+    return true;
+}
+
+// Asks for the changes since *generation with IOCTL_MYPCISCANNER_SCAN_DELTA
+// or IOCTL_MYPCISCANNER_WAIT_CHANGE and advances *generation. WAIT_CHANGE
+// blocks until the topology moves past it; the first call of a run, from
+// generation 0, returns at once with the whole watched topology.
+static bool PrintDelta(Session& session, DWORD ioControlCode, UINT64* generation) {
+    CR_DELTA_HEADER header;
+    std::vector<CR_FUNCTION_RECORD> records;
 
-    hService = OpenService(hSCManager, serviceName, SERVICE_STOP | SERVICE_QUERY_STATUS);
-    if (hService == NULL) {
-        PrintError(L"Error: OpenService failed for CRdriver (for stop)", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return FALSE;
+    CR_STATUS status = session.Client->Delta(ioControlCode, *generation, &header, records);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Delta", status);
+        return false;
+    }
+    if (session.Writer != NULL) {
+        *generation = header.Generation;
+        return session.Writer->WriteDelta(&header, records.data()) == CR_OK;
     }
+    wprintf(L"Generation %llu -> %llu: %lu change(s)%s\n", *generation, header.Generation,
+        header.RecordCount, (header.Flags & CR_DELTA_FULL) ? L" (full resync)" : L"");
+    for (size_t i = 0; i < records.size(); i++) {
+        const CR_FUNCTION_RECORD* r = &records[i];
+        const wchar_t* kind = (r->Flags & CR_RECORD_REMOVED) ? L"-" : (r->Flags & CR_RECORD_CHANGED) ? L"~" : L"+";
+        wprintf(L"  %s %04X:%02X:%02X.%u  %04X:%04X\n", kind,
+            r->Segment, r->Bus, r->Device, r->Function, r->VendorId, r->DeviceId);
+    }
+    *generation = header.Generation;
+    return true;
+}
+
+// Samples Command/Status of one function at 1 kHz for about a second. The
+// driver fills a ring mapped into this process; draining it is plain memory
+// access, with no IOCTL per sample.
+static bool SampleCommandStatus(Session& session, CR_ADDRESS address) {
+    CR_SAMPLE_REQUEST request = { 0 };
+    CR_READ_ENTRY registers[2] = { 0 };
+    CR_SAMPLE_MAPPING mapping = { 0 };
 
-    DWORD dwBytesNeeded;
-    if (!QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssStatus, sizeof(SERVICE_STATUS_PROCESS), &dwBytesNeeded)) {
-        PrintError(L"Error: QueryServiceStatusEx failed before stop for CRdriver", GetLastError());
+    request.Version = CR_PROTOCOL_VERSION;
+    request.RegisterCount = 2;
+    request.IntervalUs = 1000;
+    request.Capacity = 256;
+    for (DWORD i = 0; i < 2; i++) {
+        registers[i].Segment = address.Segment;
+        registers[i].Bus = address.Bus;
+        registers[i].Device = address.Device;
+        registers[i].Function = address.Function;
+        registers[i].Width = 2;
+        registers[i].Offset = (uint16_t)(0x04 + i * 2); // Command, then Status
     }
-    else {
-        if (ssStatus.dwCurrentState == SERVICE_STOPPED) {
-            wprintf(L"%s service is already stopped.\n", serviceName);
-            bSuccess = TRUE;
-        }
-        else if (ssStatus.dwCurrentState == SERVICE_RUNNING || ssStatus.dwCurrentState == SERVICE_PAUSE_PENDING || ssStatus.dwCurrentState == SERVICE_PAUSED) { // More states from which we can stop
-            wprintf(L"Attempting to stop %s service (current state: %lu)...\n", serviceName, ssStatus.dwCurrentState);
-            if (!ControlService(hService, SERVICE_CONTROL_STOP, (LPSERVICE_STATUS)&ssStatus)) { // Use LPSERVICE_STATUS for 2nd param
-                PrintError(L"Error: ControlService (stop) failed for CRdriver", GetLastError());
-            }
-            else {
-                wprintf(L"Service stop request sent for %s. Waiting for service to stop...\n", serviceName);
-                if (WaitForServiceState(hService, serviceName, SERVICE_STOPPED)) {
-                    wprintf(L"%s service stopped successfully.\n", serviceName);
-                    bSuccess = TRUE;
-                }
-                else {
-                    wprintf(L"%s service did not reach stopped state.\n", serviceName);
-                }
+    CR_STATUS status = session.Client->StartSampling(&request, registers, &mapping);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Sample start", status);
+        return false;
+    }
+
+    PCR_RING_HEADER ring = (PCR_RING_HEADER)(ULONG_PTR)mapping.RingAddress;
+    BYTE* samples = (BYTE*)malloc((size_t)64 * ring->SampleSize);
+    DWORD drained = 0;
+    DWORD failed = 0;
+    ULONGLONG first = 0;
+    ULONGLONG last = 0;
+    DWORD startTick = GetTickCount();
+
+    while (samples != NULL && GetTickCount() - startTick < 1000) {
+        uint32_t count = CrRingConsume(ring, samples, 64);
+        if (session.Writer != NULL && count != 0) {
+            session.Writer->WriteSamples(ring, samples, count);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            const CR_SAMPLE* sample = (const CR_SAMPLE*)(samples + (size_t)i * ring->SampleSize);
+            if (drained == 0) {
+                first = sample->Timestamp;
             }
+            last = sample->Timestamp;
+            failed += (sample->FailedMask != 0);
+            drained++;
         }
-        else {
-            wprintf(L"%s service is in state %lu (e.g. STOP_PENDING), not attempting to send another stop signal.\n", serviceName, ssStatus.dwCurrentState);
-            // If it's STOP_PENDING, we might just want to wait for it to become STOPPED
-            if (ssStatus.dwCurrentState == SERVICE_STOP_PENDING) {
-                if (WaitForServiceState(hService, serviceName, SERVICE_STOPPED, 5000)) { // Shorter timeout for stop_pending
-                    wprintf(L"%s service reached stopped state from pending.\n", serviceName);
-                    bSuccess = TRUE;
-                }
-                else {
-                    wprintf(L"%s service did not reach stopped state from pending.\n", serviceName);
-                }
+        if (count == 0) {
+            Sleep(10);
+        }
+    }
+
+    if (session.Writer == NULL) {
+        wprintf(L"Sampled %04X:%02X:%02X.%u: %lu sample(s) over %.1f ms, %lu with read failures, %lu dropped\n",
+            address.Segment, address.Bus, address.Device, address.Function, drained,
+            drained > 1 ? (double)(last - first) * 1000.0 / (double)ring->TimestampFrequency : 0.0,
+            failed, ring->Dropped);
+    }
+    free(samples);
+
+    status = session.Client->StopSampling();
+    if (status != CR_OK) {
+        PrintFailure(session, L"Sample stop", status);
+        return false;
+    }
+    return true;
+}
+
+// Prints the driver's request and config-read counters. Latency percentiles
+// are bucket upper bounds, so they are accurate to within a factor of two.
+static bool PrintStats(Session& session) {
+    static const struct {
+        DWORD Code;
+        const wchar_t* Name;
+    } ioctls[] = {
+        { IOCTL_MYPCISCANNER_SCAN_BUS0,     L"SCAN_BUS0" },
+        { IOCTL_MYPCISCANNER_SCAN_TOPOLOGY, L"SCAN_TOPOLOGY" },
+        { IOCTL_MYPCISCANNER_READ_BATCH,    L"READ_BATCH" },
+        { IOCTL_MYPCISCANNER_SCAN_DELTA,    L"SCAN_DELTA" },
+        { IOCTL_MYPCISCANNER_SAMPLE_START,  L"SAMPLE_START" },
+        { IOCTL_MYPCISCANNER_SAMPLE_STOP,   L"SAMPLE_STOP" },
+        { IOCTL_MYPCISCANNER_QUERY_STATS,   L"QUERY_STATS" },
+        { IOCTL_MYPCISCANNER_FLUSH_CACHE,   L"FLUSH_CACHE" },
+        { IOCTL_MYPCISCANNER_QUERY_CAPS,    L"QUERY_CAPS" },
+        { IOCTL_MYPCISCANNER_READ_CAP,      L"READ_CAP" },
+        { IOCTL_MYPCISCANNER_SCAN_VFS,      L"SCAN_VFS" },
+        { IOCTL_MYPCISCANNER_WAIT_CHANGE,   L"WAIT_CHANGE" },
+    };
+    CR_STATS_REPLY stats;
+
+    CR_STATUS status = session.Client->QueryStats(&stats);
+    if (status != CR_OK) {
+        PrintFailure(session, L"Statistics query", status);
+        return false;
+    }
+    if (session.Writer != NULL) {
+        return session.Writer->WriteStats(&stats) == CR_OK;
+    }
+
+    wprintf(L"Driver statistics (%lu CPU slot(s)):\n", stats.CpuCount);
+    wprintf(L"  IOCTL           Requests  Failed      Bytes   Mean us    p50 us    p99 us\n");
+    for (DWORD i = 0; i < ARRAYSIZE(ioctls); i++) {
+        const CR_STATS_IOCTL* s = &stats.Ioctls[CR_STATS_IOCTL_SLOT(ioctls[i].Code)];
+        if (s->Requests == 0) {
+            continue;
+        }
+        wprintf(L"  %-14s %9llu %7llu %10llu %9.1f %9.1f %9.1f\n", ioctls[i].Name,
+            s->Requests, s->Failures, s->BytesReturned,
+            (double)s->TotalNs / (double)s->Requests / 1000.0,
+            (double)CrStatsPercentile(s->Latency, 50) / 1000.0,
+            (double)CrStatsPercentile(s->Latency, 99) / 1000.0);
+    }
+    wprintf(L"  Config reads: %llu (%llu failed, %llu bytes), %llu function probe(s)\n",
+        stats.ConfigReads, stats.ConfigReadFailures, stats.ConfigReadBytes, stats.FunctionsProbed);
+    if (stats.ConfigReads != 0) {
+        wprintf(L"  Read latency: mean %.0f ns, p50 %llu ns, p99 %llu ns\n",
+            (double)stats.ConfigReadNs / (double)stats.ConfigReads,
+            CrStatsPercentile(stats.ReadLatency, 50), CrStatsPercentile(stats.ReadLatency, 99));
+    }
+    return true;
+}
+
+// What a plain 'CRconsole' run has always shown.
+static bool RunDemo(Session& session) {
+    bool ok = Scan(session, false);
+    if (ok) {
+        ok &= PrintCommandStatus(session);
+        ok &= WriteSnapshot(session, "crsnapshot.bin");
+        if (!session.Records.empty()) {
+            ok &= PrintCapabilities(session, RecordAddress(&session.Records[0]));
+            if (session.Device != NULL) {
+                ok &= SampleCommandStatus(session, RecordAddress(&session.Records[0]));
             }
         }
     }
+    ok &= PrintVirtualFunctions(session);
+
+    // The first delta is a full resync; the second one is normally empty.
+    ok &= PrintDelta(session, IOCTL_MYPCISCANNER_SCAN_DELTA, &session.DeltaGeneration);
+    ok &= PrintDelta(session, IOCTL_MYPCISCANNER_SCAN_DELTA, &session.DeltaGeneration);
+    // Generation 0 returns at once with the watched topology; an agent would
+    // then loop on 'wait', blocking until the next hotplug event.
+    ok &= PrintDelta(session, IOCTL_MYPCISCANNER_WAIT_CHANGE, &session.WatchGeneration);
+    if (session.Device != NULL) {
+        ok &= PrintStats(session);
+    }
+    return ok;
+}
 
-    if (hService) CloseServiceHandle(hService);
-    if (hSCManager) CloseServiceHandle(hSCManager);
-    return bSuccess;
+static void PrintHelp() {
+    wprintf(L"Commands:\n"
+        L"  scan [bus0]                 Scan all segments (or bus 0) and list the functions\n"
+        L"  status                      Command/Status registers of the last scan\n"
+        L"  read S:B:D.F OFFSET [WIDTH] Read a register; consecutive reads go as one batch\n"
+        L"  caps S:B:D.F                List capabilities and the PCIe link status\n"
+        L"  vfs                         List enabled SR-IOV virtual functions\n"
+        L"  delta                       Changes since the previous 'delta'\n"
+        L"  wait                        Block until the topology changes after the previous 'wait'\n"
+        L"  flush [S:B:D.F]             Drop the driver's config-space cache\n"
+        L"  snapshot PATH               Dump the last scan's config space to a snapshot file\n"
+        L"  sample S:B:D.F              Sample Command/Status for a second\n"
+        L"  stats                       Driver request and config-read statistics\n"
+        L"  health PATH [COUNT [SECS]]  Write PCIe link/AER health for Prometheus COUNT times (0: forever)\n"
+        L"  demo                        Run the default sequence\n"
+        L"  help, quit\n");
 }
 
+static bool ParseAddressArgument(const char* text, CR_ADDRESS* address) {
+    if (text == NULL || !CrParseAddress(text, address)) {
+        wprintf(L"Error: Expected an address like 0000:00:1f.0, got '%S'\n", text != NULL ? text : "");
+        return false;
+    }
+    return true;
+}
 
-int main() {
-    HANDLE hDevice = INVALID_HANDLE_VALUE;
-    BOOL bResult;
-    DWORD bytesReturned;
+// Runs one command. Sets *quit on 'quit'.
+static bool RunCommand(Session& session, int argc, char** argv, bool* quit) {
+    const char* command = argv[0];
 
-    wprintf(L"--- Managing CRdriver Service ---\n");
-    if (!StartDriverService()) {
-        wprintf(L"Warning: Could not ensure CRdriver service is running. Attempting to open device anyway...\n");
-        // For robust operation, you might exit here:
-        // wprintf(L"CRITICAL: Could not start CRdriver service. Exiting.\n");
-        // getchar(); // Keep console open
-        // return 1; 
+    // Any other command ends a run of pipelined reads.
+    if (_stricmp(command, "read") != 0 && !FlushReads(session)) {
+        return false;
     }
-    else {
-        wprintf(L"CRdriver service management indicates service should be running.\n");
+
+    if (_stricmp(command, "quit") == 0 || _stricmp(command, "exit") == 0) {
+        *quit = true;
+        return true;
+    }
+    if (_stricmp(command, "help") == 0 || strcmp(command, "?") == 0) {
+        PrintHelp();
+        return true;
+    }
+    if (_stricmp(command, "scan") == 0) {
+        return Scan(session, argc > 1 && _stricmp(argv[1], "bus0") == 0);
     }
-    wprintf(L"---------------------------------\n\n");
+    if (_stricmp(command, "status") == 0) {
+        return EnsureScanned(session) && PrintCommandStatus(session);
+    }
+    if (_stricmp(command, "read") == 0) {
+        CR_ADDRESS address;
+        char* end = NULL;
+        unsigned long offset = (argc > 2) ? strtoul(argv[2], &end, 16) : 0;
+        unsigned long width = (argc > 3) ? strtoul(argv[3], NULL, 10) : 4;
+        if (argc < 3 || !ParseAddressArgument(argv[1], &address) || *end != '\0' ||
+            offset >= CR_CONFIG_SPACE_SIZE || (width != 1 && width != 2 && width != 4)) {
+            wprintf(L"Usage: read S:B:D.F OFFSET [1|2|4]\n");
+            return false;
+        }
+        session.Client->QueueRead(address, (uint16_t)offset, (uint8_t)width);
+        session.ReadAddresses.push_back(address);
+        return true;
+    }
+    if (_stricmp(command, "caps") == 0) {
+        CR_ADDRESS address;
+        return ParseAddressArgument(argc > 1 ? argv[1] : NULL, &address) && PrintCapabilities(session, address);
+    }
+    if (_stricmp(command, "vfs") == 0) {
+        return PrintVirtualFunctions(session);
+    }
+    if (_stricmp(command, "delta") == 0) {
+        return PrintDelta(session, IOCTL_MYPCISCANNER_SCAN_DELTA, &session.DeltaGeneration);
+    }
+    if (_stricmp(command, "wait") == 0) {
+        return PrintDelta(session, IOCTL_MYPCISCANNER_WAIT_CHANGE, &session.WatchGeneration);
+    }
+    if (_stricmp(command, "flush") == 0) {
+        CR_ADDRESS address;
+        if (argc > 1 && !ParseAddressArgument(argv[1], &address)) {
+            return false;
+        }
+        CR_STATUS status = session.Client->FlushCache(argc > 1 ? &address : NULL);
+        if (status != CR_OK) {
+            PrintFailure(session, L"Cache flush", status);
+            return false;
+        }
+        return true;
+    }
+    if (_stricmp(command, "snapshot") == 0) {
+        if (argc < 2) {
+            wprintf(L"Usage: snapshot PATH\n");
+            return false;
+        }
+        return EnsureScanned(session) && WriteSnapshot(session, argv[1]);
+    }
+    if (_stricmp(command, "sample") == 0) {
+        CR_ADDRESS address;
+        return ParseAddressArgument(argc > 1 ? argv[1] : NULL, &address) && SampleCommandStatus(session, address);
+    }
+    if (_stricmp(command, "stats") == 0) {
+        return PrintStats(session);
+    }
+    if (_stricmp(command, "health") == 0) {
+        char* end = NULL;
+        unsigned long count = (argc > 2) ? strtoul(argv[2], &end, 10) : 1;
+        unsigned long seconds = (argc > 3) ? strtoul(argv[3], NULL, 10) : 15;
+        if (argc < 2 || (end != NULL && *end != '\0') || seconds > MAXDWORD / 1000) {
+            wprintf(L"Usage: health PATH [COUNT [SECONDS]]\n");
+            return false;
+        }
+        return EnsureScanned(session) && ExportHealth(session, argv[1], count, seconds * 1000);
+    }
+    if (_stricmp(command, "demo") == 0) {
+        return RunDemo(session);
+    }
+    wprintf(L"Unknown command '%S'; try 'help'\n", command);
+    return false;
+}
 
+// Splits a line into ';'-separated commands of whitespace-separated words
+// and runs them. Returns false if any command failed.
+static bool RunLine(Session& session, char* line, bool* quit) {
+    bool ok = true;
+    char* next = line;
 
-    wprintf(L"Attempting to open device \\\\.\\MyPciScanner...\n");
-    hDevice = CreateFile(
-        L"\\\\.\\MyPciScanner",
-        GENERIC_READ | GENERIC_WRITE,
-        FILE_SHARE_READ | FILE_SHARE_WRITE, // Changed share mode slightly
-        NULL, OPEN_EXISTING, 0, NULL
-    );
+    while (next != NULL && !*quit) {
+        char* command = next;
+        char* argv[CONSOLE_MAX_ARGS];
+        int argc = 0;
 
-    if (hDevice == INVALID_HANDLE_VALUE) {
-        PrintError(L"Failed to open device", GetLastError());
+        next = strchr(command, ';');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        for (char* c = command; *c != '\0' && argc < CONSOLE_MAX_ARGS;) {
+            while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n') {
+                *c++ = '\0';
+            }
+            if (*c == '\0' || *c == '#') {
+                break;
+            }
+            argv[argc++] = c;
+            while (*c != '\0' && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') {
+                c++;
+            }
+        }
+        if (argc != 0) {
+            ok &= RunCommand(session, argc, argv, quit);
+        }
     }
-    else {
-        wprintf(L"Device opened successfully. Handle: %p\n", hDevice);
-        wprintf(L"Sending IOCTL_MYPCISCANNER_SCAN_BUS0...\n");
+    return ok;
+}
 
-        bResult = DeviceIoControl(
-            hDevice, IOCTL_MYPCISCANNER_SCAN_BUS0,
-            NULL, 0, NULL, 0,
-            &bytesReturned, NULL
-        );
+// Reads commands until end of input or 'quit'. Interactive sessions flush
+// pipelined reads after every line; batches only when the run of reads ends.
+static bool RunCommands(Session& session, FILE* input, bool interactive) {
+    char line[CONSOLE_MAX_LINE];
+    bool quit = false;
+    bool ok = true;
 
-        if (!bResult) {
-            PrintError(L"DeviceIoControl failed", GetLastError());
+    while (!quit) {
+        if (interactive) {
+            wprintf(L"cr> ");
+            fflush(stdout);
+        }
+        if (fgets(line, sizeof(line), input) == NULL) {
+            break;
+        }
+        ok &= RunLine(session, line, &quit);
+        if (interactive) {
+            ok &= FlushReads(session);
+            if (session.Writer != NULL) {
+                ok &= session.Writer->Flush() == CR_OK;
+            }
+        }
+    }
+    return FlushReads(session) && ok;
+}
+
+static void PrintUsage() {
+    wprintf(L"Usage: CRconsole [-i | -c COMMANDS | -b FILE] [--snapshot PATH] [--names PATH]\n"
+        L"                 [--format json|csv|binary] [--output PATH] [--no-start] [--stop]\n");
+    PrintHelp();
+}
+
+int main(int argc, char** argv) {
+    const char* commands = NULL;
+    const char* batchPath = NULL;
+    const char* snapshotPath = NULL;
+    const char* namesPath = NULL;
+    const char* format = NULL;
+    const char* outputPath = NULL;
+    bool interactive = false;
+    bool startService = true;
+    bool stopService = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0) {
+            interactive = true;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            commands = argv[++i];
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            batchPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--names") == 0 && i + 1 < argc) {
+            namesPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            format = argv[++i];
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-start") == 0) {
+            startService = false;
+        }
+        else if (strcmp(argv[i], "--stop") == 0) {
+            stopService = true;
         }
         else {
-            wprintf(L"IOCTL sent successfully.\n");
+            PrintUsage();
+            return 2;
         }
+    }
 
-        wprintf(L"Closing device handle...\n");
-        if (!CloseHandle(hDevice)) {
-            PrintError(L"Failed to close device handle", GetLastError());
+    CrOutputFormat outputFormat = CrOutputJson;
+    if (format != NULL) {
+        if (_stricmp(format, "json") == 0) {
+            outputFormat = CrOutputJson;
+        }
+        else if (_stricmp(format, "csv") == 0) {
+            outputFormat = CrOutputCsv;
+        }
+        else if (_stricmp(format, "binary") == 0) {
+            outputFormat = CrOutputBinary;
         }
         else {
-            wprintf(L"Device handle closed successfully.\n");
+            PrintUsage();
+            return 2;
+        }
+    }
+    else if (outputPath != NULL) {
+        PrintUsage();
+        return 2;
+    }
+
+    // Names are optional: only a database asked for by name has to open.
+    PCR_NAMEDB names = NULL;
+    CR_STATUS status = CrNameDbOpen((namesPath != NULL) ? namesPath : CONSOLE_NAMES_PATH, &names);
+    if (status != CR_OK && namesPath != NULL) {
+        wprintf(L"Error: Could not open name database %S: %s\n", namesPath, StatusName(status));
+        return 1;
+    }
+
+    CrDeviceTransport device;
+    CrLoopbackTransport loopback;
+    CrTransport* transport = &device;
+
+    if (snapshotPath != NULL) {
+        PCR_SNAPFILE file = NULL;
+        status = CrSnapFileOpen(snapshotPath, &file);
+        if (status == CR_OK) {
+            status = loopback.Open(CrSnapFileBackend(file));
         }
+        if (status != CR_OK) {
+            wprintf(L"Error: Could not open snapshot %S: %s\n", snapshotPath, StatusName(status));
+            return 1;
+        }
+        transport = &loopback;
+    }
+    else {
+        status = device.Open(startService);
+        if (status != CR_OK) {
+            PrintError(L"Failed to open device \\\\.\\MyPciScanner", device.LastError());
+            return 1;
+        }
+    }
+
+    // Records go out in binary mode, so the stream is byte for byte the same
+    // on every platform and frames survive.
+    FILE* output = stdout;
+    if (outputPath != NULL && fopen_s(&output, outputPath, "wb") != 0) {
+        wprintf(L"Error: Could not create %S\n", outputPath);
+        return 1;
+    }
+    if (format != NULL && output == stdout) {
+        fflush(stdout);
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+    std::unique_ptr<CrRecordWriter> writer;
+    if (format != NULL) {
+        writer.reset(new CrRecordWriter(output, outputFormat));
     }
 
-    wprintf(L"\n--- Managing CRdriver Service for Shutdown ---\n");
-    StopDriverService();
-    wprintf(L"------------------------------------------\n");
+    CrClient client(transport);
+    Session session;
+    session.Client = &client;
+    session.Device = (transport == &device) ? &device : NULL;
+    session.DeltaGeneration = 0;
+    session.WatchGeneration = 0;
+    session.Names = names;
+    session.Writer = writer.get();
 
-    wprintf(L"Console app finished. Press Enter to exit.\n");
-    getchar();
-    return 0;
-}
\ No newline at end of file
+    bool ok;
+    if (commands != NULL) {
+        char line[CONSOLE_MAX_LINE];
+        bool quit = false;
+        strncpy_s(line, commands, _TRUNCATE);
+        ok = RunLine(session, line, &quit);
+        ok = FlushReads(session) && ok;
+    }
+    else if (batchPath != NULL) {
+        FILE* input = stdin;
+        if (strcmp(batchPath, "-") != 0 && fopen_s(&input, batchPath, "r") != 0) {
+            wprintf(L"Error: Could not open %S\n", batchPath);
+            return 1;
+        }
+        ok = RunCommands(session, input, false);
+        if (input != stdin) {
+            fclose(input);
+        }
+    }
+    else if (interactive) {
+        ok = RunCommands(session, stdin, true);
+    }
+    else {
+        ok = RunDemo(session);
+    }
+
+    if (writer) {
+        if (writer->Flush() != CR_OK) {
+            wprintf(L"Error: Could not write records\n");
+            ok = false;
+        }
+        writer.reset();
+    }
+    if (output != stdout) {
+        fclose(output);
+    }
+    device.Close();
+    loopback.Close();
+    CrNameDbClose(names);
+    if (stopService && !CrDeviceTransport::StopService()) {
+        wprintf(L"Warning: Could not stop the CRdriver service\n");
+    }
+    return ok ? 0 : 1;
+}
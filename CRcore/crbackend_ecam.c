@@ -0,0 +1,356 @@
+// crbackend_ecam.c
+//
+// ECAM/MMCONFIG backend. Each MCFG region is mapped once at creation; a read
+// is then an address computation and a few loads, with no per-access call
+// into the HAL or the OS.
+
+#include "crinternal.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define CR_HAVE_SSE2 1
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CR_HAVE_NEON 1
+#endif
+
+#define CR_ECAM_BUS_SHIFT      20
+#define CR_ECAM_MAX_REGIONS    64
+#define CR_MCFG_HEADER_LENGTH  44    // ACPI header (36) + reserved (8)
+#define CR_MCFG_ENTRY_LENGTH   16
+
+typedef struct _CR_ECAM_WINDOW {
+    CR_ECAM_REGION Region;
+    uint8_t* Mapping;        // Config space of Region.StartBus, device 0, function 0
+    size_t Length;
+} CR_ECAM_WINDOW;
+
+typedef struct _CR_ECAM_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    CR_ECAM_MAPPER Mapper;
+    uint32_t WindowCount;
+    CR_ECAM_WINDOW Windows[CR_ECAM_MAX_REGIONS];
+} CR_ECAM_BACKEND;
+
+uint32_t
+CrParseMcfg(
+    _In_reads_bytes_(Length) const void* Table,
+    _In_ size_t Length,
+    _Out_writes_(Capacity) CR_ECAM_REGION* Regions,
+    _In_ uint32_t Capacity
+)
+{
+    const uint8_t* bytes = (const uint8_t*)Table;
+    uint32_t tableLength;
+    uint32_t count = 0;
+    size_t offset;
+
+    if (Table == NULL || Length < CR_MCFG_HEADER_LENGTH || memcmp(bytes, "MCFG", 4) != 0) {
+        return 0;
+    }
+    memcpy(&tableLength, bytes + 4, sizeof(tableLength));
+    if (tableLength < Length) {
+        Length = tableLength;
+    }
+
+    for (offset = CR_MCFG_HEADER_LENGTH; offset + CR_MCFG_ENTRY_LENGTH <= Length; offset += CR_MCFG_ENTRY_LENGTH) {
+        if (count < Capacity) {
+            CR_ECAM_REGION* region = &Regions[count];
+            memcpy(&region->BaseAddress, bytes + offset, sizeof(region->BaseAddress));
+            memcpy(&region->Segment, bytes + offset + 8, sizeof(region->Segment));
+            region->StartBus = bytes[offset + 10];
+            region->EndBus = bytes[offset + 11];
+        }
+        count++;
+    }
+    return count;
+}
+
+static const CR_ECAM_WINDOW*
+CrEcamFindWindow(
+    _In_ const CR_ECAM_BACKEND* Ecam,
+    _In_ CR_ADDRESS Address
+)
+{
+    uint32_t i;
+
+    for (i = 0; i < Ecam->WindowCount; i++) {
+        const CR_ECAM_WINDOW* window = &Ecam->Windows[i];
+        if (window->Region.Segment == Address.Segment &&
+            Address.Bus >= window->Region.StartBus && Address.Bus <= window->Region.EndBus) {
+            return window;
+        }
+    }
+    return NULL;
+}
+
+// MMIO path: naturally aligned dword loads only.
+static void
+CrEcamCopyDwords(
+    _In_ const uint8_t* Source,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) uint8_t* Destination,
+    _In_ uint32_t Length
+)
+{
+    const volatile uint32_t* dwords = (const volatile uint32_t*)Source;
+    uint32_t position = Offset & ~3u;
+    uint32_t end = Offset + Length;
+    uint32_t value;
+    uint32_t skip;
+    uint32_t take;
+
+    while (position < end) {
+        value = dwords[position / 4];
+        skip = (position < Offset) ? Offset - position : 0;
+        take = 4 - skip;
+        if (position + 4 > end) {
+            take -= position + 4 - end;
+        }
+        memcpy(Destination, (const uint8_t*)&value + skip, take);
+        Destination += take;
+        position += 4;
+    }
+}
+
+// Memory path: a 64-byte header is four 16-byte loads.
+static void
+CrEcamCopyMemory(
+    _In_ const uint8_t* Source,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) uint8_t* Destination,
+    _In_ uint32_t Length
+)
+{
+    Source += Offset;
+    if (Length == CR_CONFIG_HEADER_SIZE) {
+#if defined(CR_HAVE_SSE2)
+        __m128i a = _mm_loadu_si128((const __m128i*)Source);
+        __m128i b = _mm_loadu_si128((const __m128i*)(Source + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(Source + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(Source + 48));
+        _mm_storeu_si128((__m128i*)Destination, a);
+        _mm_storeu_si128((__m128i*)(Destination + 16), b);
+        _mm_storeu_si128((__m128i*)(Destination + 32), c);
+        _mm_storeu_si128((__m128i*)(Destination + 48), d);
+        return;
+#elif defined(CR_HAVE_NEON)
+        uint8x16x4_t block = vld1q_u8_x4(Source);
+        vst1q_u8_x4(Destination, block);
+        return;
+#endif
+    }
+    memcpy(Destination, Source, Length);
+}
+
+static uint32_t
+CrEcamRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    CR_ECAM_BACKEND* ecam = (CR_ECAM_BACKEND*)Backend;
+    const CR_ECAM_WINDOW* window;
+    size_t position;
+
+    if (Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        return 0;
+    }
+    window = CrEcamFindWindow(ecam, Address);
+    if (window == NULL) {
+        return 0;
+    }
+    position = ((size_t)(Address.Bus - window->Region.StartBus) << CR_ECAM_BUS_SHIFT) |
+        ((size_t)(Address.Device & 0x1F) << 15) | ((size_t)(Address.Function & 0x7) << 12);
+    if (position + CR_CONFIG_SPACE_SIZE > window->Length) {
+        return 0;
+    }
+
+    if (ecam->Mapper.Flags & CR_ECAM_MAPPING_IS_MEMORY) {
+        CrEcamCopyMemory(window->Mapping + position, Offset, (uint8_t*)Buffer, Length);
+    }
+    else {
+        CrEcamCopyDwords(window->Mapping + position, Offset, (uint8_t*)Buffer, Length);
+    }
+    return Length;
+}
+
+static uint32_t
+CrEcamEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    CR_ECAM_BACKEND* ecam = (CR_ECAM_BACKEND*)Backend;
+    uint32_t count = 0;
+    uint32_t next = 0;
+    uint32_t candidate;
+    uint32_t i;
+
+    // Ascending, distinct; region lists are tiny so a selection pass is fine.
+    for (;;) {
+        candidate = CR_MAX_SEGMENTS;
+        for (i = 0; i < ecam->WindowCount; i++) {
+            uint32_t segment = ecam->Windows[i].Region.Segment;
+            if (segment >= next && segment < candidate) {
+                candidate = segment;
+            }
+        }
+        if (candidate == CR_MAX_SEGMENTS) {
+            return count;
+        }
+        if (count < Capacity) {
+            Segments[count] = (uint16_t)candidate;
+        }
+        count++;
+        next = candidate + 1;
+    }
+}
+
+static void
+CrEcamClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CR_ECAM_BACKEND* ecam = (CR_ECAM_BACKEND*)Backend;
+    uint32_t i;
+
+    for (i = 0; i < ecam->WindowCount; i++) {
+        ecam->Mapper.Unmap(ecam->Mapper.Context, ecam->Windows[i].Mapping, ecam->Windows[i].Length);
+    }
+    CrFree(ecam);
+}
+
+CR_STATUS
+CrEcamCreate(
+    _In_reads_(RegionCount) const CR_ECAM_REGION* Regions,
+    _In_ uint32_t RegionCount,
+    _In_ const CR_ECAM_MAPPER* Mapper,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_ECAM_BACKEND* ecam;
+    uint32_t i;
+
+    *Backend = NULL;
+    if (Regions == NULL || RegionCount == 0 || RegionCount > CR_ECAM_MAX_REGIONS ||
+        Mapper == NULL || Mapper->Map == NULL || Mapper->Unmap == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    ecam = (CR_ECAM_BACKEND*)CrAlloc(sizeof(*ecam));
+    if (ecam == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    ecam->Mapper = *Mapper;
+    ecam->Base.Name = "ecam";
+    ecam->Base.Read = CrEcamRead;
+    ecam->Base.Close = CrEcamClose;
+    ecam->Base.EnumerateSegments = CrEcamEnumerateSegments;
+
+    for (i = 0; i < RegionCount; i++) {
+        CR_ECAM_WINDOW* window = &ecam->Windows[ecam->WindowCount];
+
+        if (Regions[i].EndBus < Regions[i].StartBus) {
+            continue;
+        }
+        window->Region = Regions[i];
+        window->Length = (size_t)(Regions[i].EndBus - Regions[i].StartBus + 1) << CR_ECAM_BUS_SHIFT;
+        window->Mapping = (uint8_t*)Mapper->Map(Mapper->Context,
+            Regions[i].BaseAddress + ((uint64_t)Regions[i].StartBus << CR_ECAM_BUS_SHIFT), window->Length);
+        if (window->Mapping == NULL) {
+            CrEcamClose(&ecam->Base);
+            return CR_E_IO;
+        }
+        ecam->WindowCount++;
+    }
+    if (ecam->WindowCount == 0) {
+        CrEcamClose(&ecam->Base);
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    *Backend = &ecam->Base;
+    return CR_OK;
+}
+
+#if !defined(_KERNEL_MODE)
+
+// The image is mapped before CrEcamCreate runs; the mapper only hands it out.
+static void*
+CrEcamImageMap(
+    _In_opt_ void* Context,
+    _In_ uint64_t PhysicalAddress,
+    _In_ size_t Length
+)
+{
+    PCR_MAPPED_FILE image = (PCR_MAPPED_FILE)Context;
+
+    (void)PhysicalAddress;
+    return (Length <= image->Length) ? (void*)image->View : NULL;
+}
+
+static void
+CrEcamImageUnmap(
+    _In_opt_ void* Context,
+    _In_ void* Mapping,
+    _In_ size_t Length
+)
+{
+    PCR_MAPPED_FILE image = (PCR_MAPPED_FILE)Context;
+
+    (void)Mapping;
+    (void)Length;
+    CrUnmapFile(image);
+    CrFree(image);
+}
+
+CR_STATUS
+CrEcamOpenImage(
+    _In_ const char* Path,
+    _In_ uint16_t Segment,
+    _In_ uint8_t StartBus,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    PCR_MAPPED_FILE image;
+    CR_ECAM_REGION region;
+    CR_ECAM_MAPPER mapper;
+    uint64_t buses;
+    CR_STATUS status;
+
+    *Backend = NULL;
+    image = (PCR_MAPPED_FILE)CrAlloc(sizeof(*image));
+    if (image == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    status = CrMapFile(Path, (size_t)1 << CR_ECAM_BUS_SHIFT, image);
+    if (status != CR_OK) {
+        CrFree(image);
+        return status;
+    }
+
+    // Only whole 1 MB buses are served; a trailing partial bus is ignored.
+    buses = (uint64_t)image->Length >> CR_ECAM_BUS_SHIFT;
+    if (buses > 256u - StartBus) {
+        buses = 256u - StartBus;
+    }
+    region.BaseAddress = 0;
+    region.Segment = Segment;
+    region.StartBus = StartBus;
+    region.EndBus = (uint8_t)(StartBus + buses - 1);
+
+    mapper.Map = CrEcamImageMap;
+    mapper.Unmap = CrEcamImageUnmap;
+    mapper.Context = image;
+    mapper.Flags = CR_ECAM_MAPPING_IS_MEMORY;
+    status = CrEcamCreate(&region, 1, &mapper, Backend);
+    if (status != CR_OK) {
+        CrEcamImageUnmap(image, (void*)image->View, image->Length);
+    }
+    return status;
+}
+
+#endif // !_KERNEL_MODE
@@ -0,0 +1,173 @@
+// crbackend_file.c
+//
+// Config-space image file backend (user mode only). The image uses the ECAM
+// layout, so a dump taken through the memory-mapped window can be replayed
+// byte for byte. Reads are positional, so concurrent scans may share one
+// backend.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pread under strict -std=c11
+#endif
+
+#include "crcore.h"
+
+#if !defined(_KERNEL_MODE)
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+typedef struct _CR_FILE_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    uint16_t Segment;
+    uint8_t StartBus;
+    uint64_t Size;
+#if defined(_WIN32)
+    HANDLE File;
+#else
+    int File;
+#endif
+} CR_FILE_BACKEND;
+
+static uint32_t
+CrFileRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    CR_FILE_BACKEND* file = (CR_FILE_BACKEND*)Backend;
+    uint64_t position;
+
+    if (Address.Segment != file->Segment || Address.Bus < file->StartBus ||
+        Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        return 0;
+    }
+    position = ((uint64_t)(Address.Bus - file->StartBus) << 20) |
+        ((uint64_t)(Address.Device & 0x1F) << 15) |
+        ((uint64_t)(Address.Function & 0x7) << 12) | Offset;
+    if (position + Length > file->Size) {
+        return 0;
+    }
+
+#if defined(_WIN32)
+    {
+        OVERLAPPED overlapped = { 0 };
+        DWORD bytesRead = 0;
+
+        overlapped.Offset = (DWORD)position;
+        overlapped.OffsetHigh = (DWORD)(position >> 32);
+        if (!ReadFile(file->File, Buffer, Length, &bytesRead, &overlapped)) {
+            return 0;
+        }
+        return bytesRead;
+    }
+#else
+    {
+        ssize_t bytesRead = pread(file->File, Buffer, Length, (off_t)position);
+        return (bytesRead < 0) ? 0 : (uint32_t)bytesRead;
+    }
+#endif
+}
+
+static uint32_t
+CrFileEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    if (Capacity != 0) {
+        Segments[0] = ((CR_FILE_BACKEND*)Backend)->Segment;
+    }
+    return 1;
+}
+
+static void
+CrFileClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CR_FILE_BACKEND* file = (CR_FILE_BACKEND*)Backend;
+
+#if defined(_WIN32)
+    CloseHandle(file->File);
+#else
+    close(file->File);
+#endif
+    CrFree(file);
+}
+
+CR_STATUS
+CrFileImageOpen(
+    _In_ const char* Path,
+    _In_ uint16_t Segment,
+    _In_ uint8_t StartBus,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_FILE_BACKEND* file;
+
+    *Backend = NULL;
+    if (Path == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    file = (CR_FILE_BACKEND*)CrAlloc(sizeof(*file));
+    if (file == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+
+#if defined(_WIN32)
+    {
+        LARGE_INTEGER size;
+
+        file->File = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (file->File == INVALID_HANDLE_VALUE) {
+            CrFree(file);
+            return CR_E_NOT_FOUND;
+        }
+        if (!GetFileSizeEx(file->File, &size)) {
+            CloseHandle(file->File);
+            CrFree(file);
+            return CR_E_IO;
+        }
+        file->Size = (uint64_t)size.QuadPart;
+    }
+#else
+    {
+        struct stat st;
+
+        file->File = open(Path, O_RDONLY);
+        if (file->File < 0) {
+            CrFree(file);
+            return CR_E_NOT_FOUND;
+        }
+        if (fstat(file->File, &st) != 0) {
+            close(file->File);
+            CrFree(file);
+            return CR_E_IO;
+        }
+        file->Size = (uint64_t)st.st_size;
+    }
+#endif
+
+    file->Segment = Segment;
+    file->StartBus = StartBus;
+    file->Base.Name = "file";
+    file->Base.Read = CrFileRead;
+    file->Base.Close = CrFileClose;
+    file->Base.EnumerateSegments = CrFileEnumerateSegments;
+    *Backend = &file->Base;
+    return CR_OK;
+}
+
+#endif // !_KERNEL_MODE
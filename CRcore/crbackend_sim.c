@@ -0,0 +1,245 @@
+// crbackend_sim.c
+//
+// Synthetic topology backend. Used by CRdriver's simulation build, by the
+// loopback transport and by anything that wants a scan without hardware.
+
+#include "crcore.h"
+
+typedef struct _CR_SIM_FUNCTION {
+    uint32_t Key;
+    uint8_t* Config;   // CR_CONFIG_SPACE_SIZE bytes
+} CR_SIM_FUNCTION;
+
+typedef struct _CR_SIM_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    uint32_t Count;
+    uint32_t Capacity;
+    CR_SIM_FUNCTION* Functions;   // Sorted by Key
+} CR_SIM_BACKEND;
+
+static CR_SIM_FUNCTION*
+CrSimFind(
+    _In_ CR_SIM_BACKEND* Sim,
+    _In_ uint32_t Key
+)
+{
+    uint32_t low = 0;
+    uint32_t high = Sim->Count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (Sim->Functions[mid].Key < Key) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return (low < Sim->Count && Sim->Functions[low].Key == Key) ? &Sim->Functions[low] : NULL;
+}
+
+static uint32_t
+CrSimRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    CR_SIM_BACKEND* sim = (CR_SIM_BACKEND*)Backend;
+    CR_SIM_FUNCTION* function;
+
+    if (Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        return 0;
+    }
+    function = CrSimFind(sim, CrAddressKey(Address));
+    if (function == NULL) {
+        // Behave like a master abort.
+        memset(Buffer, 0xFF, Length);
+        return Length;
+    }
+    memcpy(Buffer, function->Config + Offset, Length);
+    return Length;
+}
+
+static uint32_t
+CrSimEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    CR_SIM_BACKEND* sim = (CR_SIM_BACKEND*)Backend;
+    uint32_t count = 0;
+    uint32_t i;
+    uint16_t segment;
+
+    for (i = 0; i < sim->Count; i++) {
+        segment = (uint16_t)(sim->Functions[i].Key >> 16);
+        if (i != 0 && (uint16_t)(sim->Functions[i - 1].Key >> 16) == segment) {
+            continue;
+        }
+        if (count < Capacity) {
+            Segments[count] = segment;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void
+CrSimEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    CR_SIM_BACKEND* sim = (CR_SIM_BACKEND*)Backend;
+    uint32_t bus;
+    uint32_t i;
+
+    for (i = 0; i < sim->Count; i++) {
+        if ((uint16_t)(sim->Functions[i].Key >> 16) != Segment) {
+            continue;
+        }
+        bus = (sim->Functions[i].Key >> 8) & 0xFF;
+        Buses[bus >> 5] |= 1u << (bus & 31);
+    }
+}
+
+static void
+CrSimClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CR_SIM_BACKEND* sim = (CR_SIM_BACKEND*)Backend;
+    uint32_t i;
+
+    for (i = 0; i < sim->Count; i++) {
+        CrFree(sim->Functions[i].Config);
+    }
+    if (sim->Functions != NULL) {
+        CrFree(sim->Functions);
+    }
+    CrFree(sim);
+}
+
+CR_STATUS
+CrSimCreate(
+    _In_ uint32_t MaxFunctions,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_SIM_BACKEND* sim;
+
+    *Backend = NULL;
+    if (MaxFunctions == 0) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    sim = (CR_SIM_BACKEND*)CrAlloc(sizeof(*sim));
+    if (sim == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    sim->Functions = (CR_SIM_FUNCTION*)CrAlloc((size_t)MaxFunctions * sizeof(CR_SIM_FUNCTION));
+    if (sim->Functions == NULL) {
+        CrFree(sim);
+        return CR_E_NO_MEMORY;
+    }
+    sim->Capacity = MaxFunctions;
+    sim->Base.Name = "sim";
+    sim->Base.Read = CrSimRead;
+    sim->Base.Close = CrSimClose;
+    sim->Base.EnumerateSegments = CrSimEnumerateSegments;
+    sim->Base.EnumerateBuses = CrSimEnumerateBuses;
+    *Backend = &sim->Base;
+    return CR_OK;
+}
+
+CR_STATUS
+CrSimAddFunction(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_reads_bytes_(Length) const void* Config,
+    _In_ uint32_t Length
+)
+{
+    CR_SIM_BACKEND* sim = (CR_SIM_BACKEND*)Backend;
+    uint32_t key = CrAddressKey(Address);
+    CR_SIM_FUNCTION* function = CrSimFind(sim, key);
+    uint32_t index;
+
+    if (Length > CR_CONFIG_SPACE_SIZE) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (function == NULL) {
+        if (sim->Count == sim->Capacity) {
+            return CR_E_NO_MEMORY;
+        }
+        // Topologies are usually built in address order, so this rarely moves anything.
+        index = sim->Count;
+        while (index > 0 && sim->Functions[index - 1].Key > key) {
+            index--;
+        }
+        function = &sim->Functions[index];
+        memmove(function + 1, function, (size_t)(sim->Count - index) * sizeof(*function));
+        function->Key = key;
+        function->Config = (uint8_t*)CrAlloc(CR_CONFIG_SPACE_SIZE);
+        if (function->Config == NULL) {
+            memmove(function, function + 1, (size_t)(sim->Count - index) * sizeof(*function));
+            return CR_E_NO_MEMORY;
+        }
+        sim->Count++;
+    }
+    memset(function->Config, 0, CR_CONFIG_SPACE_SIZE);
+    memcpy(function->Config, Config, Length);
+    return CR_OK;
+}
+
+CR_STATUS
+CrSimAddDevice(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ uint8_t HeaderType
+)
+{
+    uint8_t header[CR_CONFIG_HEADER_SIZE] = { 0 };
+
+    header[CR_CFG_VENDOR_ID] = (uint8_t)VendorId;
+    header[CR_CFG_VENDOR_ID + 1] = (uint8_t)(VendorId >> 8);
+    header[CR_CFG_DEVICE_ID] = (uint8_t)DeviceId;
+    header[CR_CFG_DEVICE_ID + 1] = (uint8_t)(DeviceId >> 8);
+    header[CR_CFG_PROG_IF] = (uint8_t)ClassCode;
+    header[CR_CFG_SUB_CLASS] = (uint8_t)(ClassCode >> 8);
+    header[CR_CFG_BASE_CLASS] = (uint8_t)(ClassCode >> 16);
+    header[CR_CFG_HEADER_TYPE] = HeaderType;
+    return CrSimAddFunction(Backend, Address, header, sizeof(header));
+}
+
+CR_STATUS
+CrSimAddBridge(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint8_t SecondaryBus,
+    _In_ uint8_t SubordinateBus
+)
+{
+    uint8_t header[CR_CONFIG_HEADER_SIZE] = { 0 };
+
+    header[CR_CFG_VENDOR_ID] = (uint8_t)VendorId;
+    header[CR_CFG_VENDOR_ID + 1] = (uint8_t)(VendorId >> 8);
+    header[CR_CFG_DEVICE_ID] = (uint8_t)DeviceId;
+    header[CR_CFG_DEVICE_ID + 1] = (uint8_t)(DeviceId >> 8);
+    header[CR_CFG_SUB_CLASS] = 0x04;
+    header[CR_CFG_BASE_CLASS] = 0x06;
+    header[CR_CFG_HEADER_TYPE] = CR_HEADER_TYPE_BRIDGE;
+    header[CR_CFG_SECONDARY_BUS - 1] = Address.Bus;   // Primary bus
+    header[CR_CFG_SECONDARY_BUS] = SecondaryBus;
+    header[CR_CFG_SUBORDINATE_BUS] = SubordinateBus;
+    return CrSimAddFunction(Backend, Address, header, sizeof(header));
+}
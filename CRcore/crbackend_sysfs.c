@@ -0,0 +1,234 @@
+// crbackend_sysfs.c
+//
+// Linux sysfs backend: reads /sys/bus/pci/devices/SSSS:BB:DD.F/config. The
+// directory is listed once at open; config files are opened on first use and
+// kept open, so a scan costs one pread per access.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pread, O_CLOEXEC under strict -std=c11
+#endif
+
+#include "crcore.h"
+
+#if defined(__linux__)
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define CR_SYSFS_DEFAULT_ROOT "/sys/bus/pci/devices"
+#define CR_SYSFS_PATH_MAX     512
+
+typedef struct _CR_SYSFS_FUNCTION {
+    uint32_t Key;
+    int File;          // -1 until first read
+} CR_SYSFS_FUNCTION;
+
+typedef struct _CR_SYSFS_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    char Root[CR_SYSFS_PATH_MAX];
+    uint32_t Count;
+    CR_SYSFS_FUNCTION* Functions;   // Sorted by Key
+} CR_SYSFS_BACKEND;
+
+static int
+CrSysfsCompare(
+    const void* Left,
+    const void* Right
+)
+{
+    uint32_t l = ((const CR_SYSFS_FUNCTION*)Left)->Key;
+    uint32_t r = ((const CR_SYSFS_FUNCTION*)Right)->Key;
+    return (l > r) - (l < r);
+}
+
+static int
+CrSysfsOpenFunction(
+    _In_ CR_SYSFS_BACKEND* Sysfs,
+    _In_ CR_SYSFS_FUNCTION* Function
+)
+{
+    char path[CR_SYSFS_PATH_MAX + 32];
+    CR_ADDRESS address = CrAddressFromKey(Function->Key);
+    int file = __atomic_load_n(&Function->File, __ATOMIC_ACQUIRE);
+    int expected = -1;
+
+    if (file >= 0) {
+        return file;
+    }
+    snprintf(path, sizeof(path), "%s/%04x:%02x:%02x.%x/config",
+        Sysfs->Root, address.Segment, address.Bus, address.Device, address.Function);
+    file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        return -1;
+    }
+    // Another scan thread may have raced us to it; keep whichever landed first.
+    if (!__atomic_compare_exchange_n(&Function->File, &expected, file, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(file);
+        file = expected;
+    }
+    return file;
+}
+
+static uint32_t
+CrSysfsRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    CR_SYSFS_BACKEND* sysfs = (CR_SYSFS_BACKEND*)Backend;
+    CR_SYSFS_FUNCTION key;
+    CR_SYSFS_FUNCTION* function;
+    ssize_t bytesRead;
+    int file;
+
+    key.Key = CrAddressKey(Address);
+    function = (CR_SYSFS_FUNCTION*)bsearch(&key, sysfs->Functions, sysfs->Count,
+        sizeof(*sysfs->Functions), CrSysfsCompare);
+    if (function == NULL) {
+        // Not listed means not present: answer like a master abort without a syscall.
+        memset(Buffer, 0xFF, Length);
+        return Length;
+    }
+    file = CrSysfsOpenFunction(sysfs, function);
+    if (file < 0) {
+        return 0;
+    }
+    bytesRead = pread(file, Buffer, Length, (off_t)Offset);
+    return (bytesRead < 0) ? 0 : (uint32_t)bytesRead;
+}
+
+static uint32_t
+CrSysfsEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    CR_SYSFS_BACKEND* sysfs = (CR_SYSFS_BACKEND*)Backend;
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < sysfs->Count; i++) {
+        if (i != 0 && (sysfs->Functions[i - 1].Key >> 16) == (sysfs->Functions[i].Key >> 16)) {
+            continue;
+        }
+        if (count < Capacity) {
+            Segments[count] = (uint16_t)(sysfs->Functions[i].Key >> 16);
+        }
+        count++;
+    }
+    return count;
+}
+
+static void
+CrSysfsEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    CR_SYSFS_BACKEND* sysfs = (CR_SYSFS_BACKEND*)Backend;
+    uint32_t bus;
+    uint32_t i;
+
+    for (i = 0; i < sysfs->Count; i++) {
+        if ((uint16_t)(sysfs->Functions[i].Key >> 16) != Segment) {
+            continue;
+        }
+        bus = (sysfs->Functions[i].Key >> 8) & 0xFF;
+        Buses[bus >> 5] |= 1u << (bus & 31);
+    }
+}
+
+static void
+CrSysfsClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CR_SYSFS_BACKEND* sysfs = (CR_SYSFS_BACKEND*)Backend;
+    uint32_t i;
+
+    for (i = 0; i < sysfs->Count; i++) {
+        if (sysfs->Functions[i].File >= 0) {
+            close(sysfs->Functions[i].File);
+        }
+    }
+    free(sysfs->Functions);
+    CrFree(sysfs);
+}
+
+CR_STATUS
+CrSysfsOpen(
+    _In_opt_ const char* Root,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_SYSFS_BACKEND* sysfs;
+    struct dirent* entry;
+    uint32_t capacity = 0;
+    DIR* directory;
+
+    *Backend = NULL;
+    if (Root == NULL) {
+        Root = CR_SYSFS_DEFAULT_ROOT;
+    }
+    if (strlen(Root) >= CR_SYSFS_PATH_MAX) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    directory = opendir(Root);
+    if (directory == NULL) {
+        return CR_E_NOT_FOUND;
+    }
+    sysfs = (CR_SYSFS_BACKEND*)CrAlloc(sizeof(*sysfs));
+    if (sysfs == NULL) {
+        closedir(directory);
+        return CR_E_NO_MEMORY;
+    }
+    strcpy(sysfs->Root, Root);
+
+    while ((entry = readdir(directory)) != NULL) {
+        unsigned int segment, bus, device, function;
+        CR_ADDRESS address;
+
+        if (sscanf(entry->d_name, "%4x:%2x:%2x.%1x", &segment, &bus, &device, &function) != 4 ||
+            bus > 0xFF || device >= CR_MAX_DEVICES || function >= CR_MAX_FUNCTIONS) {
+            continue;
+        }
+        if (sysfs->Count == capacity) {
+            uint32_t newCapacity = capacity ? capacity * 2 : 64;
+            CR_SYSFS_FUNCTION* grown = (CR_SYSFS_FUNCTION*)realloc(sysfs->Functions,
+                (size_t)newCapacity * sizeof(*grown));
+            if (grown == NULL) {
+                closedir(directory);
+                CrSysfsClose(&sysfs->Base);
+                return CR_E_NO_MEMORY;
+            }
+            sysfs->Functions = grown;
+            capacity = newCapacity;
+        }
+        address.Segment = (uint16_t)segment;
+        address.Bus = (uint8_t)bus;
+        address.Device = (uint8_t)device;
+        address.Function = (uint8_t)function;
+        sysfs->Functions[sysfs->Count].Key = CrAddressKey(address);
+        sysfs->Functions[sysfs->Count].File = -1;
+        sysfs->Count++;
+    }
+    closedir(directory);
+
+    qsort(sysfs->Functions, sysfs->Count, sizeof(*sysfs->Functions), CrSysfsCompare);
+    sysfs->Base.Name = "sysfs";
+    sysfs->Base.Read = CrSysfsRead;
+    sysfs->Base.Close = CrSysfsClose;
+    sysfs->Base.EnumerateSegments = CrSysfsEnumerateSegments;
+    sysfs->Base.EnumerateBuses = CrSysfsEnumerateBuses;
+    *Backend = &sysfs->Base;
+    return CR_OK;
+}
+
+#endif // __linux__
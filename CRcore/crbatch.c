@@ -0,0 +1,293 @@
+// crbatch.c
+//
+// Scatter-list register reads. A monitoring poll asks for a few dozen
+// registers spread over many functions; sorting them by function and offset
+// lets runs of neighbouring dwords share one backend read.
+
+#include "crinternal.h"
+
+// Longest run fetched with one backend read. Fits the HAL backend's 256-byte
+// limit and keeps the bounce buffer on the stack.
+#define CR_BATCH_MAX_SPAN 256
+
+CR_INLINE int CrSlotLess(_In_ const CR_BATCH_SLOT* Left, _In_ const CR_BATCH_SLOT* Right)
+{
+    if (Left->Key != Right->Key) {
+        return Left->Key < Right->Key;
+    }
+    return Left->Offset < Right->Offset;
+}
+
+static void
+CrSiftDownSlots(
+    _Inout_updates_(Count) CR_BATCH_SLOT* Slots,
+    _In_ uint32_t Root,
+    _In_ uint32_t Count
+)
+{
+    CR_BATCH_SLOT swap;
+    uint32_t child;
+
+    while ((child = 2 * Root + 1) < Count) {
+        if (child + 1 < Count && CrSlotLess(&Slots[child], &Slots[child + 1])) {
+            child++;
+        }
+        if (!CrSlotLess(&Slots[Root], &Slots[child])) {
+            return;
+        }
+        swap = Slots[Root];
+        Slots[Root] = Slots[child];
+        Slots[child] = swap;
+        Root = child;
+    }
+}
+
+static void
+CrSortSlots(
+    _Inout_updates_(Count) CR_BATCH_SLOT* Slots,
+    _In_ uint32_t Count
+)
+{
+    CR_BATCH_SLOT swap;
+    uint32_t i;
+
+    if (Count < 2) {
+        return;
+    }
+    for (i = Count / 2; i-- > 0;) {
+        CrSiftDownSlots(Slots, i, Count);
+    }
+    for (i = Count - 1; i > 0; i--) {
+        swap = Slots[0];
+        Slots[0] = Slots[i];
+        Slots[i] = swap;
+        CrSiftDownSlots(Slots, 0, i);
+    }
+}
+
+CR_INLINE int CrReadEntryValid(_In_ const CR_READ_ENTRY* Entry)
+{
+    if (Entry->Width != 1 && Entry->Width != 2 && Entry->Width != 4) {
+        return 0;
+    }
+    return (Entry->Offset & (Entry->Width - 1)) == 0 &&
+        (uint32_t)Entry->Offset + Entry->Width <= CR_CONFIG_SPACE_SIZE;
+}
+
+// Reads Slots[0..Count), which all belong to one function and are sorted by
+// offset, as a sequence of contiguous dword runs.
+static uint32_t
+CrReadFunctionSlots(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(Count) const CR_BATCH_SLOT* Slots,
+    _In_ uint32_t Count,
+    _Inout_ CR_READ_RESULT* Results
+)
+{
+    uint8_t span[CR_BATCH_MAX_SPAN];
+    CR_ADDRESS address = CrAddressFromKey(Slots[0].Key);
+    uint32_t failed = 0;
+    uint32_t first = 0;
+    uint32_t last;
+    uint32_t start;
+    uint32_t end;
+    uint32_t got;
+    uint32_t i;
+
+    while (first < Count) {
+        // Grow the run while the next register starts inside or right after
+        // the dwords already covered. Gaps are never read.
+        start = Slots[first].Offset & ~3u;
+        end = ((uint32_t)Slots[first].Offset + Slots[first].Width + 3) & ~3u;
+        for (last = first + 1; last < Count; last++) {
+            uint32_t nextStart = Slots[last].Offset & ~3u;
+            uint32_t nextEnd = ((uint32_t)Slots[last].Offset + Slots[last].Width + 3) & ~3u;
+            if (nextStart > end || nextEnd - start > CR_BATCH_MAX_SPAN) {
+                break;
+            }
+            if (nextEnd > end) {
+                end = nextEnd;
+            }
+        }
+
+        got = CrConfigRead(Backend, address, start, span, end - start);
+        for (i = first; i < last; i++) {
+            CR_READ_RESULT* result = &Results[Slots[i].Index];
+            uint32_t at = Slots[i].Offset - start;
+            uint32_t value = 0;
+
+            if (at + Slots[i].Width > got) {
+                result->Value = 0;
+                result->Status = CR_READ_UNREACHABLE;
+                failed++;
+                continue;
+            }
+            // Config space is little endian.
+            switch (Slots[i].Width) {
+            case 4:
+                value = (uint32_t)span[at + 3] << 24 | (uint32_t)span[at + 2] << 16;
+                // Fall through
+            case 2:
+                value |= (uint32_t)span[at + 1] << 8;
+                // Fall through
+            default:
+                value |= span[at];
+                break;
+            }
+            result->Value = value;
+            result->Status = CR_READ_OK;
+        }
+        first = last;
+    }
+    return failed;
+}
+
+uint32_t
+CrBatchPrepare(
+    _In_reads_(Count) const CR_READ_ENTRY* Entries,
+    _In_ uint32_t Count,
+    _Out_writes_(Count) CR_BATCH_SLOT* Slots,
+    _Out_writes_(Count) CR_READ_RESULT* Results,
+    _Out_ uint32_t* FailedCount
+)
+{
+    uint32_t slotCount = 0;
+    uint32_t i;
+
+    *FailedCount = 0;
+    // Entries and results are the same size, so when they alias, writing
+    // Results[i] only ever clobbers an entry that has already been captured.
+    for (i = 0; i < Count; i++) {
+        CR_READ_ENTRY entry = Entries[i];
+        CR_ADDRESS address;
+
+        if (!CrReadEntryValid(&entry)) {
+            Results[i].Value = 0;
+            Results[i].Status = CR_READ_INVALID;
+            (*FailedCount)++;
+            continue;
+        }
+        address.Segment = entry.Segment;
+        address.Bus = entry.Bus;
+        address.Device = entry.Device;
+        address.Function = entry.Function;
+        Slots[slotCount].Key = CrAddressKey(address);
+        Slots[slotCount].Offset = entry.Offset;
+        Slots[slotCount].Width = entry.Width;
+        Slots[slotCount].Reserved = 0;
+        Slots[slotCount].Index = i;
+        slotCount++;
+    }
+
+    CrSortSlots(Slots, slotCount);
+    return slotCount;
+}
+
+uint32_t
+CrBatchExecute(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(SlotCount) const CR_BATCH_SLOT* Slots,
+    _In_ uint32_t SlotCount,
+    _Inout_ CR_READ_RESULT* Results
+)
+{
+    uint32_t failed = 0;
+    uint32_t first;
+    uint32_t last;
+
+    for (first = 0; first < SlotCount; first = last) {
+        for (last = first + 1; last < SlotCount && Slots[last].Key == Slots[first].Key; last++) {
+        }
+        failed += CrReadFunctionSlots(Backend, &Slots[first], last - first, Results);
+    }
+    return failed;
+}
+
+CR_STATUS
+CrReadBatch(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(Count) const CR_READ_ENTRY* Entries,
+    _In_ uint32_t Count,
+    _Out_writes_(Count) CR_READ_RESULT* Results,
+    _Out_opt_ uint32_t* FailedCount
+)
+{
+    CR_BATCH_SLOT* slots;
+    uint32_t slotCount;
+    uint32_t failed;
+
+    if (FailedCount != NULL) {
+        *FailedCount = 0;
+    }
+    if (Backend == NULL || Count > CR_MAX_BATCH_ENTRIES || (Count != 0 && (Entries == NULL || Results == NULL))) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (Count == 0) {
+        return CR_OK;
+    }
+    slots = (CR_BATCH_SLOT*)CrAlloc((size_t)Count * sizeof(CR_BATCH_SLOT));
+    if (slots == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+
+    slotCount = CrBatchPrepare(Entries, Count, slots, Results, &failed);
+    failed += CrBatchExecute(Backend, slots, slotCount, Results);
+
+    CrFree(slots);
+    if (FailedCount != NULL) {
+        *FailedCount = failed;
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrReadBatchBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_bytes_(InputLength) const void* Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    const CR_BATCH_HEADER* request = (const CR_BATCH_HEADER*)Input;
+    CR_BATCH_HEADER* reply = (CR_BATCH_HEADER*)Buffer;
+    uint32_t count;
+    uint32_t failed = 0;
+    size_t needed;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    if (Input == NULL || InputLength < sizeof(CR_BATCH_HEADER) ||
+        Buffer == NULL || BufferLength < sizeof(CR_BATCH_HEADER)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (request->Version != CR_PROTOCOL_VERSION || request->EntrySize != sizeof(CR_READ_ENTRY)) {
+        return CR_E_UNSUPPORTED;
+    }
+    count = request->Count;
+    if (count > CR_MAX_BATCH_ENTRIES ||
+        InputLength - sizeof(CR_BATCH_HEADER) < (size_t)count * sizeof(CR_READ_ENTRY)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    needed = sizeof(CR_BATCH_HEADER) + (size_t)count * sizeof(CR_READ_RESULT);
+    if (BufferLength < needed) {
+        status = CR_E_MORE_DATA;
+    }
+    else {
+        status = CrReadBatch(Backend, (const CR_READ_ENTRY*)(request + 1), count,
+            (CR_READ_RESULT*)(reply + 1), &failed);
+        if (status != CR_OK) {
+            return status;
+        }
+    }
+
+    // The request header has been consumed by now, so it is safe to overwrite.
+    reply->Version = CR_PROTOCOL_VERSION;
+    reply->EntrySize = sizeof(CR_READ_RESULT);
+    reply->Count = count;
+    reply->FailedCount = failed;
+    *BytesWritten = (status == CR_OK) ? needed : sizeof(CR_BATCH_HEADER);
+    return status;
+}
@@ -0,0 +1,562 @@
+// crcache.c
+//
+// Read-through cache of immutable config-space fields. Slots live in an
+// open-addressing table keyed by CrAddressKey; only present functions get a
+// CR_CACHE_FUNCTION, so remembering thousands of empty slots stays cheap.
+// One spin lock guards everything and is never held across a backend read.
+
+#include "crinternal.h"
+
+#define CR_CACHE_MAX_CAPS      16
+#define CR_CACHE_MAX_EXT_CAPS  16
+#define CR_CACHE_NONE          0xFFFF
+#define CR_CACHE_PROBE_SIZE    4         // Vendor and device ID
+
+// Header bytes cached for every header type: IDs, revision and class code,
+// header type.
+#define CR_CACHE_BASE_MASK  0x4F0Full
+#define CR_CACHE_SUBSYSTEM_MASK (0xFull << CR_CFG_SUBSYSTEM_VENDOR_ID)
+#define CR_CACHE_CAPS_MASK  (1ull << CR_CFG_CAPABILITIES)
+
+typedef enum _CR_CACHE_STATE {
+    CrCacheSlotFree = 0,     // Never used since the last flush
+    CrCacheSlotUnknown,      // Keyed, but nothing is known
+    CrCacheSlotPresent,
+    CrCacheSlotAbsent        // Vendor ID last read as all ones
+} CR_CACHE_STATE;
+
+typedef struct _CR_CACHE_SLOT {
+    uint32_t Key;
+    uint16_t State;          // CR_CACHE_STATE
+    uint16_t Function;       // Index into Functions when present
+} CR_CACHE_SLOT;
+
+typedef struct _CR_CACHE_FUNCTION {
+    uint64_t Known;          // Bit N: Header[N] holds the device's value
+    uint8_t Header[CR_CONFIG_HEADER_SIZE];
+    uint8_t CapCount;
+    uint8_t ExtCapCount;
+    uint16_t NextFree;
+    uint8_t CapOffsets[CR_CACHE_MAX_CAPS];
+    uint8_t CapHeaders[CR_CACHE_MAX_CAPS][2];    // ID, next pointer
+    uint16_t ExtCapOffsets[CR_CACHE_MAX_EXT_CAPS];
+    uint32_t ExtCapHeaders[CR_CACHE_MAX_EXT_CAPS];
+} CR_CACHE_FUNCTION;
+
+struct _CR_CACHE {
+    CR_CONFIG_BACKEND Cached;    // Must stay first
+    CR_CONFIG_BACKEND Refresh;
+    PCR_CONFIG_BACKEND Inner;
+    CR_SPIN_LOCK Lock;
+    uint32_t SlotBits;
+    uint32_t SlotsUsed;
+    uint32_t MaxSlots;
+    CR_CACHE_SLOT* Slots;
+    CR_CACHE_FUNCTION* Functions;
+    uint32_t FunctionCount;
+    uint16_t FreeFunction;       // Head of the free list, CR_CACHE_NONE if empty
+};
+
+CR_INLINE PCR_CACHE CrCacheFromRefresh(_In_ PCR_CONFIG_BACKEND Backend)
+{
+    return (PCR_CACHE)((uint8_t*)Backend - offsetof(CR_CACHE, Refresh));
+}
+
+// Immutable header bytes, given what is known of the header type so far.
+CR_INLINE uint64_t CrCacheHeaderMask(_In_ const CR_CACHE_FUNCTION* Function)
+{
+    uint8_t headerType;
+
+    if (!(Function->Known & (1ull << CR_CFG_HEADER_TYPE))) {
+        return CR_CACHE_BASE_MASK;
+    }
+    headerType = Function->Header[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK;
+    if (headerType == 0) {
+        return CR_CACHE_BASE_MASK | CR_CACHE_SUBSYSTEM_MASK | CR_CACHE_CAPS_MASK;
+    }
+    if (headerType == CR_HEADER_TYPE_BRIDGE) {
+        return CR_CACHE_BASE_MASK | CR_CACHE_CAPS_MASK;
+    }
+    return CR_CACHE_BASE_MASK;
+}
+
+CR_INLINE uint64_t CrCacheRangeMask(_In_ uint32_t Offset, _In_ uint32_t Length)
+{
+    uint64_t mask = (Length >= 64) ? ~0ull : ((1ull << Length) - 1);
+
+    return mask << Offset;
+}
+
+static void
+CrCacheResetFunction(
+    _Out_ CR_CACHE_FUNCTION* Function
+)
+{
+    uint16_t nextFree = Function->NextFree;
+
+    memset(Function, 0, sizeof(*Function));
+    Function->NextFree = nextFree;
+}
+
+// Called with the lock held.
+static void
+CrCacheReleaseFunction(
+    _Inout_ PCR_CACHE Cache,
+    _Inout_ CR_CACHE_SLOT* Slot
+)
+{
+    if (Slot->State == CrCacheSlotPresent) {
+        Cache->Functions[Slot->Function].NextFree = Cache->FreeFunction;
+        Cache->FreeFunction = Slot->Function;
+    }
+    Slot->State = CrCacheSlotUnknown;
+    Slot->Function = CR_CACHE_NONE;
+}
+
+// Called with the lock held. Returns NULL if Key has no slot and either
+// Insert is zero or the table is full.
+static CR_CACHE_SLOT*
+CrCacheFindSlot(
+    _Inout_ PCR_CACHE Cache,
+    _In_ uint32_t Key,
+    _In_ int Insert
+)
+{
+    uint32_t mask = (1u << Cache->SlotBits) - 1;
+    uint32_t index = (Key * 2654435761u) >> (32 - Cache->SlotBits);
+    CR_CACHE_SLOT* slot;
+
+    for (;;) {
+        slot = &Cache->Slots[index];
+        if (slot->State == CrCacheSlotFree) {
+            break;
+        }
+        if (slot->Key == Key) {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+    if (!Insert || Cache->SlotsUsed >= Cache->MaxSlots) {
+        return NULL;
+    }
+    Cache->SlotsUsed++;
+    slot->Key = Key;
+    slot->State = CrCacheSlotUnknown;
+    slot->Function = CR_CACHE_NONE;
+    return slot;
+}
+
+// Copies the answer to a read out of Function if every byte is known.
+static int
+CrCacheServe(
+    _In_ const CR_CACHE_FUNCTION* Function,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) uint8_t* Buffer,
+    _In_ uint32_t Length
+)
+{
+    uint64_t range;
+    uint32_t i;
+
+    if (Offset + Length <= CR_CONFIG_HEADER_SIZE) {
+        range = CrCacheRangeMask(Offset, Length);
+        if ((Function->Known & CrCacheHeaderMask(Function) & range) != range) {
+            return 0;
+        }
+        memcpy(Buffer, Function->Header + Offset, Length);
+        return 1;
+    }
+    for (i = 0; i < Function->CapCount; i++) {
+        uint32_t at = Function->CapOffsets[i];
+        if (Offset >= at && Offset + Length <= at + 2) {
+            memcpy(Buffer, &Function->CapHeaders[i][Offset - at], Length);
+            return 1;
+        }
+    }
+    for (i = 0; i < Function->ExtCapCount; i++) {
+        uint32_t at = Function->ExtCapOffsets[i];
+        uint32_t j;
+        if (Offset >= at && Offset + Length <= at + 4) {
+            for (j = 0; j < Length; j++) {
+                Buffer[j] = (uint8_t)(Function->ExtCapHeaders[i] >> (8 * (Offset - at + j)));
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Follows the capability lists as far as Data (Length bytes read at Offset)
+// reaches. Each list only ever grows from its known end, and an offset seen
+// before ends it, so a looping list cannot grow without bound.
+static void
+CrCacheLearnCaps(
+    _Inout_ CR_CACHE_FUNCTION* Function,
+    _In_ uint32_t Offset,
+    _In_reads_bytes_(Length) const uint8_t* Data,
+    _In_ uint32_t Length
+)
+{
+    uint32_t at;
+    uint32_t i;
+
+    while (Function->CapCount < CR_CACHE_MAX_CAPS) {
+        if (Function->CapCount == 0) {
+            if (!(Function->Known & CrCacheHeaderMask(Function) & CR_CACHE_CAPS_MASK)) {
+                break;
+            }
+            at = Function->Header[CR_CFG_CAPABILITIES] & 0xFC;
+        }
+        else {
+            at = Function->CapHeaders[Function->CapCount - 1][1] & 0xFC;
+        }
+        if (at < CR_CONFIG_HEADER_SIZE || at < Offset || at + 2 > Offset + Length) {
+            break;
+        }
+        for (i = 0; i < Function->CapCount && Function->CapOffsets[i] != at; i++) {
+        }
+        if (i < Function->CapCount) {
+            break;
+        }
+        Function->CapOffsets[Function->CapCount] = (uint8_t)at;
+        Function->CapHeaders[Function->CapCount][0] = Data[at - Offset];
+        Function->CapHeaders[Function->CapCount][1] = Data[at - Offset + 1];
+        Function->CapCount++;
+    }
+
+    while (Function->ExtCapCount < CR_CACHE_MAX_EXT_CAPS) {
+        uint32_t header;
+
+        at = (Function->ExtCapCount == 0) ? CR_EXTENDED_CAPS_START :
+            (Function->ExtCapHeaders[Function->ExtCapCount - 1] >> 20) & 0xFFC;
+        if (at < CR_EXTENDED_CAPS_START || at < Offset || at + 4 > Offset + Length) {
+            break;
+        }
+        for (i = 0; i < Function->ExtCapCount && Function->ExtCapOffsets[i] != at; i++) {
+        }
+        if (i < Function->ExtCapCount) {
+            break;
+        }
+        header = (uint32_t)Data[at - Offset] | (uint32_t)Data[at - Offset + 1] << 8 |
+            (uint32_t)Data[at - Offset + 2] << 16 | (uint32_t)Data[at - Offset + 3] << 24;
+        // Zero or all ones at 0x100 means no extended capabilities at all.
+        if (header == 0 || header == 0xFFFFFFFF) {
+            break;
+        }
+        Function->ExtCapOffsets[Function->ExtCapCount] = (uint16_t)at;
+        Function->ExtCapHeaders[Function->ExtCapCount] = header;
+        Function->ExtCapCount++;
+    }
+}
+
+// Records what a hardware read returned.
+static void
+CrCacheLearn(
+    _Inout_ PCR_CACHE Cache,
+    _In_ uint32_t Key,
+    _In_ uint32_t Offset,
+    _In_reads_bytes_(Got) const uint8_t* Data,
+    _In_ uint32_t Got
+)
+{
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    CR_CACHE_FUNCTION* function;
+    CR_CACHE_SLOT* slot;
+    uint32_t end = Offset + Got;
+    uint64_t mask;
+    uint32_t i;
+
+    if (Got == 0) {
+        return;
+    }
+    CrSpinLockAcquire(&Cache->Lock, &lockHandle);
+    slot = CrCacheFindSlot(Cache, Key, Offset == 0 && Got >= 2);
+    if (slot == NULL) {
+        goto Exit;
+    }
+
+    if (Offset == 0 && Got >= 2) {
+        uint16_t vendorId = (uint16_t)(Data[0] | (Data[1] << 8));
+
+        if (vendorId == CR_INVALID_VENDOR_ID) {
+            CrCacheReleaseFunction(Cache, slot);
+            slot->State = CrCacheSlotAbsent;
+            goto Exit;
+        }
+        if (slot->State == CrCacheSlotPresent) {
+            function = &Cache->Functions[slot->Function];
+            for (i = 0; i < Got && i < CR_CACHE_PROBE_SIZE; i++) {
+                if ((function->Known & (1ull << i)) && function->Header[i] != Data[i]) {
+                    // A different device answers at this address now.
+                    CrCacheResetFunction(function);
+                    break;
+                }
+            }
+        }
+        else {
+            CrCacheReleaseFunction(Cache, slot);
+            if (Cache->FreeFunction == CR_CACHE_NONE) {
+                goto Exit;
+            }
+            slot->Function = Cache->FreeFunction;
+            slot->State = CrCacheSlotPresent;
+            function = &Cache->Functions[slot->Function];
+            Cache->FreeFunction = function->NextFree;
+            CrCacheResetFunction(function);
+        }
+    }
+    if (slot->State != CrCacheSlotPresent) {
+        goto Exit;
+    }
+
+    function = &Cache->Functions[slot->Function];
+    if (Offset < CR_CONFIG_HEADER_SIZE) {
+        // The header type decides which other bytes are immutable, so take it first.
+        if (Offset <= CR_CFG_HEADER_TYPE && end > CR_CFG_HEADER_TYPE) {
+            function->Header[CR_CFG_HEADER_TYPE] = Data[CR_CFG_HEADER_TYPE - Offset];
+            function->Known |= 1ull << CR_CFG_HEADER_TYPE;
+        }
+        mask = CrCacheHeaderMask(function);
+        for (i = Offset; i < end && i < CR_CONFIG_HEADER_SIZE; i++) {
+            if (mask & (1ull << i)) {
+                function->Header[i] = Data[i - Offset];
+                function->Known |= 1ull << i;
+            }
+        }
+    }
+    CrCacheLearnCaps(function, Offset, Data, Got);
+
+Exit:
+    CrSpinLockRelease(&lockHandle);
+}
+
+static uint32_t
+CrCacheRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    PCR_CACHE cache = (PCR_CACHE)Backend;
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    uint32_t key = CrAddressKey(Address);
+    uint8_t probe[CR_CACHE_PROBE_SIZE];
+    CR_CACHE_SLOT* slot;
+    uint32_t got;
+    int served = 0;
+
+    if (Length == 0 || Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        goto ReadThrough;
+    }
+
+    // Presence is never answered from memory. The ID dword always goes to
+    // the device, and an answer that differs from the cached one drops the
+    // slot before anything else is served, so hot-add and hot-remove show up
+    // on the next probe.
+    if (Offset < CR_CACHE_PROBE_SIZE) {
+        got = CrConfigRead(cache->Inner, Address, 0, probe, sizeof(probe));
+        CrCacheLearn(cache, key, 0, probe, got);
+        if (got < sizeof(probe)) {
+            goto ReadThrough;
+        }
+        if (Offset + Length <= sizeof(probe)) {
+            memcpy(Buffer, probe + Offset, Length);
+            return Length;
+        }
+    }
+
+    CrSpinLockAcquire(&cache->Lock, &lockHandle);
+    slot = CrCacheFindSlot(cache, key, 0);
+    if (slot != NULL && slot->State == CrCacheSlotPresent) {
+        served = CrCacheServe(&cache->Functions[slot->Function], Offset, (uint8_t*)Buffer, Length);
+    }
+    CrSpinLockRelease(&lockHandle);
+    if (served) {
+        return Length;
+    }
+
+ReadThrough:
+    got = CrConfigRead(cache->Inner, Address, Offset, Buffer, Length);
+    CrCacheLearn(cache, key, Offset, (const uint8_t*)Buffer, got);
+    return got;
+}
+
+static uint32_t
+CrCacheRefreshRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    PCR_CACHE cache = CrCacheFromRefresh(Backend);
+    uint32_t got;
+
+    // Every walk starts at the vendor ID, so this is where a rescan of the
+    // slot begins.
+    if (Offset == 0) {
+        CrCacheInvalidate(cache, Address);
+    }
+    got = CrConfigRead(cache->Inner, Address, Offset, Buffer, Length);
+    CrCacheLearn(cache, CrAddressKey(Address), Offset, (const uint8_t*)Buffer, got);
+    return got;
+}
+
+static uint32_t
+CrCacheEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    PCR_CACHE cache = (Backend->Read == CrCacheRead) ? (PCR_CACHE)Backend : CrCacheFromRefresh(Backend);
+
+    return cache->Inner->EnumerateSegments(cache->Inner, Segments, Capacity);
+}
+
+static void
+CrCacheEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    PCR_CACHE cache = (Backend->Read == CrCacheRead) ? (PCR_CACHE)Backend : CrCacheFromRefresh(Backend);
+
+    cache->Inner->EnumerateBuses(cache->Inner, Segment, Buses);
+}
+
+static void
+CrCacheCloseView(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    (void)Backend;
+}
+
+static void
+CrCacheResetTable(
+    _Inout_ PCR_CACHE Cache
+)
+{
+    uint32_t i;
+
+    memset(Cache->Slots, 0, ((size_t)1 << Cache->SlotBits) * sizeof(CR_CACHE_SLOT));
+    Cache->SlotsUsed = 0;
+    Cache->FreeFunction = (Cache->FunctionCount != 0) ? 0 : CR_CACHE_NONE;
+    for (i = 0; i < Cache->FunctionCount; i++) {
+        Cache->Functions[i].NextFree = (i + 1 < Cache->FunctionCount) ? (uint16_t)(i + 1) : CR_CACHE_NONE;
+    }
+}
+
+CR_STATUS
+CrCacheCreate(
+    _In_ PCR_CONFIG_BACKEND Inner,
+    _In_ uint32_t MaxFunctions,
+    _In_ uint32_t MaxPresent,
+    _Out_ PCR_CACHE* Cache
+)
+{
+    PCR_CACHE cache;
+    uint32_t bits = 4;
+
+    *Cache = NULL;
+    if (Inner == NULL || MaxFunctions == 0 || MaxFunctions > (1u << 24) || MaxPresent > CR_CACHE_MAX_PRESENT) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    // At most half full, so probe sequences stay short.
+    while ((1u << bits) < 2 * MaxFunctions) {
+        bits++;
+    }
+    cache = (PCR_CACHE)CrAlloc(sizeof(*cache));
+    if (cache == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    cache->Slots = (CR_CACHE_SLOT*)CrAlloc(((size_t)1 << bits) * sizeof(CR_CACHE_SLOT));
+    // One spare entry so MaxPresent 0 is not a zero-byte allocation.
+    cache->Functions = (CR_CACHE_FUNCTION*)CrAlloc(((size_t)MaxPresent + 1) * sizeof(CR_CACHE_FUNCTION));
+    if (cache->Slots == NULL || cache->Functions == NULL) {
+        CrCacheFree(cache);
+        return CR_E_NO_MEMORY;
+    }
+
+    cache->Cached.Name = Inner->Name;
+    cache->Cached.Read = CrCacheRead;
+    cache->Cached.Close = CrCacheCloseView;
+    cache->Cached.EnumerateSegments = (Inner->EnumerateSegments != NULL) ? CrCacheEnumerateSegments : NULL;
+    cache->Cached.EnumerateBuses = (Inner->EnumerateBuses != NULL) ? CrCacheEnumerateBuses : NULL;
+    cache->Refresh = cache->Cached;
+    cache->Refresh.Read = CrCacheRefreshRead;
+    cache->Inner = Inner;
+    cache->SlotBits = bits;
+    cache->MaxSlots = MaxFunctions;
+    cache->FunctionCount = MaxPresent;
+    CrCacheResetTable(cache);
+    *Cache = cache;
+    return CR_OK;
+}
+
+void
+CrCacheFree(
+    _In_opt_ PCR_CACHE Cache
+)
+{
+    if (Cache == NULL) {
+        return;
+    }
+    if (Cache->Slots != NULL) {
+        CrFree(Cache->Slots);
+    }
+    if (Cache->Functions != NULL) {
+        CrFree(Cache->Functions);
+    }
+    CrFree(Cache);
+}
+
+PCR_CONFIG_BACKEND
+CrCacheBackend(
+    _In_ PCR_CACHE Cache
+)
+{
+    return &Cache->Cached;
+}
+
+PCR_CONFIG_BACKEND
+CrCacheRefreshBackend(
+    _In_ PCR_CACHE Cache
+)
+{
+    return &Cache->Refresh;
+}
+
+void
+CrCacheInvalidate(
+    _In_ PCR_CACHE Cache,
+    _In_ CR_ADDRESS Address
+)
+{
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    CR_CACHE_SLOT* slot;
+
+    CrSpinLockAcquire(&Cache->Lock, &lockHandle);
+    slot = CrCacheFindSlot(Cache, CrAddressKey(Address), 0);
+    if (slot != NULL) {
+        CrCacheReleaseFunction(Cache, slot);
+    }
+    CrSpinLockRelease(&lockHandle);
+}
+
+void
+CrCacheFlush(
+    _In_ PCR_CACHE Cache
+)
+{
+    CR_SPIN_LOCK_HANDLE lockHandle;
+
+    CrSpinLockAcquire(&Cache->Lock, &lockHandle);
+    CrCacheResetTable(Cache);
+    CrSpinLockRelease(&lockHandle);
+}
@@ -0,0 +1,311 @@
+// crcaps.c
+//
+// Capability list walker. Both lists are singly linked through config space
+// and firmware gets them wrong often enough that a walk must not trust them:
+// every header offset is marked in a visited bitmap and a repeat ends the
+// list. Each header costs one small read at its own offset, which is what
+// the config-space cache learns from and answers.
+
+#include "crinternal.h"
+
+#define CR_CAP_STANDARD_START  0x40
+#define CR_CAP_STANDARD_END    0x100
+
+typedef struct _CR_CAP_WALK {
+    PCR_CONFIG_BACKEND Backend;
+    CR_ADDRESS Address;
+    uint32_t Next;           // Offset of the next header; 0 when the list ended
+    int Extended;            // Walking the extended list
+    int StandardOnly;        // Stop when the standard list ends
+    uint32_t Visited[CR_CONFIG_SPACE_SIZE / 4 / 32];   // One bit per dword
+} CR_CAP_WALK;
+
+// Returns nonzero if Offset had not been visited yet, and marks it.
+CR_INLINE int CrCapVisit(_Inout_ CR_CAP_WALK* Walk, _In_ uint32_t Offset)
+{
+    uint32_t dword = Offset >> 2;
+    uint32_t bit = 1u << (dword & 31);
+
+    if (Walk->Visited[dword >> 5] & bit) {
+        return 0;
+    }
+    Walk->Visited[dword >> 5] |= bit;
+    return 1;
+}
+
+// Reads the capability pointer. Without the Capabilities List status bit the
+// pointer is reserved and reads as zero on conforming devices; the status
+// register is not consulted because it is the one header dword that changes.
+static CR_STATUS
+CrCapBegin(
+    _Out_ CR_CAP_WALK* Walk,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address
+)
+{
+    uint8_t header[4];
+    uint8_t headerType;
+    uint8_t pointer = 0;
+    uint32_t pointerOffset;
+
+    memset(Walk, 0, sizeof(*Walk));
+    Walk->Backend = Backend;
+    Walk->Address = Address;
+    if (Backend == NULL || Address.Device >= CR_MAX_DEVICES || Address.Function >= CR_MAX_FUNCTIONS) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (CrConfigRead(Backend, Address, CR_CFG_VENDOR_ID, header, 4) != 4) {
+        return CR_E_IO;
+    }
+    if ((header[0] | (header[1] << 8)) == CR_INVALID_VENDOR_ID) {
+        return CR_E_NOT_FOUND;
+    }
+    if (CrConfigRead(Backend, Address, CR_CFG_HEADER_TYPE, &headerType, 1) != 1) {
+        return CR_E_IO;
+    }
+    pointerOffset = ((headerType & CR_HEADER_TYPE_MASK) == CR_HEADER_TYPE_CARDBUS) ?
+        CR_CFG_CARDBUS_CAPABILITIES : CR_CFG_CAPABILITIES;
+    if (CrConfigRead(Backend, Address, pointerOffset, &pointer, 1) != 1) {
+        return CR_E_IO;
+    }
+    Walk->Next = pointer & 0xFC;
+    return CR_OK;
+}
+
+// Produces the next capability, moving on to the extended list once the
+// standard one ends. Returns 0 when both are exhausted.
+static int
+CrCapNext(
+    _Inout_ CR_CAP_WALK* Walk,
+    _Out_ PCR_CAP_ENTRY Entry
+)
+{
+    for (;;) {
+        uint32_t at = Walk->Next;
+
+        if (!Walk->Extended) {
+            uint8_t header[2];
+
+            if (at < CR_CAP_STANDARD_START || at >= CR_CAP_STANDARD_END || !CrCapVisit(Walk, at) ||
+                CrConfigRead(Walk->Backend, Walk->Address, at, header, 2) != 2 || header[0] == 0xFF) {
+                if (Walk->StandardOnly) {
+                    Walk->Next = 0;
+                    return 0;
+                }
+                // The extended list always starts at 0x100.
+                Walk->Extended = 1;
+                Walk->Next = CR_EXTENDED_CAPS_START;
+                continue;
+            }
+            Walk->Next = header[1] & 0xFC;
+            Entry->Id = header[0];
+            Entry->Offset = (uint16_t)at;
+            Entry->Version = 0;
+            Entry->Flags = 0;
+            Entry->Reserved = 0;
+            return 1;
+        }
+        else {
+            uint8_t bytes[4];
+            uint32_t header;
+
+            // Backends limited to 256 bytes (the HAL, unprivileged sysfs)
+            // fail the read and simply report no extended capabilities.
+            if (at < CR_EXTENDED_CAPS_START || at > CR_CONFIG_SPACE_SIZE - 4 || !CrCapVisit(Walk, at) ||
+                CrConfigRead(Walk->Backend, Walk->Address, at, bytes, 4) != 4) {
+                Walk->Next = 0;
+                return 0;
+            }
+            header = (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+            if (header == 0 || header == 0xFFFFFFFF) {
+                Walk->Next = 0;
+                return 0;
+            }
+            Walk->Next = (header >> 20) & 0xFFC;
+            // ID 0 is a placeholder that only links to the rest of the list.
+            if ((header & 0xFFFF) == 0) {
+                continue;
+            }
+            Entry->Id = (uint16_t)header;
+            Entry->Offset = (uint16_t)at;
+            Entry->Version = (uint8_t)((header >> 16) & 0xF);
+            Entry->Flags = CR_CAP_EXTENDED;
+            Entry->Reserved = 0;
+            return 1;
+        }
+    }
+}
+
+CR_STATUS
+CrCapWalk(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _Out_writes_(Capacity) CR_CAP_ENTRY* Entries,
+    _In_ uint32_t Capacity,
+    _Out_ uint32_t* Total
+)
+{
+    CR_CAP_WALK walk;
+    CR_CAP_ENTRY entry;
+    CR_STATUS status;
+    uint32_t total = 0;
+
+    *Total = 0;
+    if (Capacity != 0 && Entries == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrCapBegin(&walk, Backend, Address);
+    if (status != CR_OK) {
+        return status;
+    }
+    while (CrCapNext(&walk, &entry)) {
+        if (total < Capacity) {
+            Entries[total] = entry;
+        }
+        total++;
+    }
+    *Total = total;
+    return (total > Capacity) ? CR_E_MORE_DATA : CR_OK;
+}
+
+CR_STATUS
+CrCapFind(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t Id,
+    _In_ uint32_t Flags,
+    _In_ uint32_t Instance,
+    _Out_ PCR_CAP_ENTRY Entry
+)
+{
+    CR_CAP_WALK walk;
+    int extended = (Flags & CR_CAP_EXTENDED) != 0;
+    CR_STATUS status;
+
+    memset(Entry, 0, sizeof(*Entry));
+    status = CrCapBegin(&walk, Backend, Address);
+    if (status != CR_OK) {
+        return status;
+    }
+    // Only the list that can hold Id is walked.
+    if (extended) {
+        walk.Extended = 1;
+        walk.Next = CR_EXTENDED_CAPS_START;
+    }
+    else {
+        walk.StandardOnly = 1;
+    }
+    while (CrCapNext(&walk, Entry)) {
+        if (Entry->Id == Id && Instance-- == 0) {
+            return CR_OK;
+        }
+    }
+    memset(Entry, 0, sizeof(*Entry));
+    return CR_E_NOT_FOUND;
+}
+
+CR_INLINE int CrCapRequestAddress(_In_ uint16_t Segment, _In_ uint8_t Bus, _In_ uint8_t Device,
+    _In_ uint8_t Function, _Out_ PCR_ADDRESS Address)
+{
+    Address->Segment = Segment;
+    Address->Bus = Bus;
+    Address->Device = Device;
+    Address->Function = Function;
+    return Device < CR_MAX_DEVICES && Function < CR_MAX_FUNCTIONS;
+}
+
+CR_STATUS
+CrCapWalkBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_bytes_(InputLength) const void* Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    const CR_CAP_REQUEST* request = (const CR_CAP_REQUEST*)Input;
+    CR_CAP_HEADER* reply = (CR_CAP_HEADER*)Buffer;
+    CR_ADDRESS address;
+    uint32_t capacity;
+    uint32_t total;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    if (Input == NULL || InputLength < sizeof(CR_CAP_REQUEST) ||
+        Buffer == NULL || BufferLength < sizeof(CR_CAP_HEADER)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (request->Version != CR_PROTOCOL_VERSION) {
+        return CR_E_UNSUPPORTED;
+    }
+    if (!CrCapRequestAddress(request->Segment, request->Bus, request->Device, request->Function, &address)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    // The request is fully captured in address; entries may overwrite it.
+    capacity = (uint32_t)((BufferLength - sizeof(CR_CAP_HEADER)) / sizeof(CR_CAP_ENTRY));
+    status = CrCapWalk(Backend, address, (CR_CAP_ENTRY*)(reply + 1), capacity, &total);
+    if (status != CR_OK && status != CR_E_MORE_DATA) {
+        return status;
+    }
+    reply->Version = CR_PROTOCOL_VERSION;
+    reply->EntrySize = sizeof(CR_CAP_ENTRY);
+    reply->EntryCount = (total < capacity) ? total : capacity;
+    reply->TotalCount = total;
+    *BytesWritten = sizeof(CR_CAP_HEADER) + (size_t)reply->EntryCount * sizeof(CR_CAP_ENTRY);
+    return status;
+}
+
+CR_STATUS
+CrCapReadBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_bytes_(InputLength) const void* Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_CAP_READ_REQUEST request;
+    CR_CAP_READ_REPLY* reply = (CR_CAP_READ_REPLY*)Buffer;
+    CR_CAP_ENTRY entry;
+    CR_ADDRESS address;
+    uint32_t offset;
+    uint32_t got = 0;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    if (Input == NULL || InputLength < sizeof(CR_CAP_READ_REQUEST) ||
+        Buffer == NULL || BufferLength < sizeof(CR_CAP_READ_REPLY)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    memcpy(&request, Input, sizeof(request));
+    if (request.Version != CR_PROTOCOL_VERSION) {
+        return CR_E_UNSUPPORTED;
+    }
+    if (!CrCapRequestAddress(request.Segment, request.Bus, request.Device, request.Function, &address)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    status = CrCapFind(Backend, address, request.Id, request.Flags, request.Instance, &entry);
+    if (status != CR_OK) {
+        return status;
+    }
+    offset = (uint32_t)entry.Offset + request.Offset;
+    if (offset >= CR_CONFIG_SPACE_SIZE || request.Length > CR_CONFIG_SPACE_SIZE - offset) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (BufferLength - sizeof(CR_CAP_READ_REPLY) < request.Length) {
+        status = CR_E_MORE_DATA;
+    }
+    else if (request.Length != 0) {
+        got = CrConfigRead(Backend, address, offset, reply + 1, request.Length);
+    }
+
+    reply->Version = CR_PROTOCOL_VERSION;
+    reply->Length = got;
+    reply->Capability = entry;
+    *BytesWritten = sizeof(CR_CAP_READ_REPLY) + got;
+    return status;
+}
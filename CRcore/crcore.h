@@ -0,0 +1,966 @@
+// crcore.h
+//
+// Portable PCI enumeration core. The walker only ever touches config space
+// through a CR_CONFIG_BACKEND, so the same code runs against the HAL in
+// CRdriver, a synthetic topology, a config-space image file or Linux sysfs.
+
+#pragma once
+
+#include "crplatform.h"
+#include "../CRcommon/crprotocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum _CR_STATUS {
+    CR_OK = 0,
+    CR_E_MORE_DATA,          // Output was truncated; totals are still valid
+    CR_E_INVALID_PARAMETER,
+    CR_E_NO_MEMORY,
+    CR_E_NOT_FOUND,
+    CR_E_IO,
+    CR_E_UNSUPPORTED,
+} CR_STATUS;
+
+#define CR_SUCCESS(Status) ((Status) == CR_OK)
+
+#define CR_MAX_DEVICES          32
+#define CR_MAX_FUNCTIONS        8
+#define CR_CONFIG_SPACE_SIZE    4096
+#define CR_INVALID_VENDOR_ID    0xFFFF
+
+// Standard header offsets the core decodes itself.
+#define CR_CFG_VENDOR_ID        0x00
+#define CR_CFG_DEVICE_ID        0x02
+#define CR_CFG_REVISION_ID      0x08
+#define CR_CFG_PROG_IF          0x09
+#define CR_CFG_SUB_CLASS        0x0A
+#define CR_CFG_BASE_CLASS       0x0B
+#define CR_CFG_HEADER_TYPE      0x0E
+#define CR_CFG_CARDBUS_CAPABILITIES 0x14 // Type 2 headers
+#define CR_CFG_PRIMARY_BUS      0x18    // Type 1 and type 2 headers
+#define CR_CFG_SECONDARY_BUS    0x19
+#define CR_CFG_SUBORDINATE_BUS  0x1A
+#define CR_CFG_SUBSYSTEM_VENDOR_ID 0x2C // Type 0 headers
+#define CR_CFG_CAPABILITIES     0x34    // Type 0 and type 1 headers
+#define CR_EXTENDED_CAPS_START  0x100
+#define CR_EXT_CAP_ARI          0x000E
+#define CR_EXT_CAP_SRIOV        0x0010
+#define CR_HEADER_TYPE_MULTIFUNCTION 0x80
+#define CR_HEADER_TYPE_MASK     0x7F
+#define CR_HEADER_TYPE_BRIDGE   0x01
+#define CR_HEADER_TYPE_CARDBUS  0x02
+#define CR_MAX_SEGMENTS         65536
+
+typedef struct _CR_ADDRESS {
+    uint16_t Segment;
+    uint8_t  Bus;
+    uint8_t  Device;
+    uint8_t  Function;
+} CR_ADDRESS, * PCR_ADDRESS;
+
+// Sortable key: segment, bus, device, function from most to least significant.
+CR_INLINE uint32_t CrAddressKey(CR_ADDRESS Address)
+{
+    return ((uint32_t)Address.Segment << 16) | ((uint32_t)Address.Bus << 8) |
+        ((uint32_t)(Address.Device & 0x1F) << 3) | (Address.Function & 0x7);
+}
+
+CR_INLINE CR_ADDRESS CrAddressFromKey(uint32_t Key)
+{
+    CR_ADDRESS address;
+    address.Segment = (uint16_t)(Key >> 16);
+    address.Bus = (uint8_t)(Key >> 8);
+    address.Device = (uint8_t)((Key >> 3) & 0x1F);
+    address.Function = (uint8_t)(Key & 0x7);
+    return address;
+}
+
+//
+// Config-space access backends
+//
+
+typedef struct _CR_CONFIG_BACKEND CR_CONFIG_BACKEND, * PCR_CONFIG_BACKEND;
+
+// Reads Length bytes starting at Offset. Returns the number of bytes read;
+// 0 means the function (or its bus) is not reachable through this backend.
+// Absent functions may also read back as all-ones, as real hardware does.
+typedef uint32_t(*CR_BACKEND_READ)(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length);
+
+typedef void (*CR_BACKEND_CLOSE)(_In_ PCR_CONFIG_BACKEND Backend);
+
+// Writes up to Capacity segment numbers in ascending order and returns how
+// many the backend serves (which may exceed Capacity).
+typedef uint32_t(*CR_BACKEND_ENUMERATE_SEGMENTS)(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity);
+
+#define CR_BUS_MAP_WORDS (256 / 32)
+
+// Sets the bit for every bus of Segment that holds a function in Buses, a
+// 256-bit map the caller has zeroed. Only backends that know their functions
+// up front provide this; the topology walk uses it to skip probing buses no
+// bridge leads to.
+typedef void (*CR_BACKEND_ENUMERATE_BUSES)(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses);
+
+// Backends embed this as their first member and hand out a pointer to it.
+// Read must be safe to call from several scan workers at once.
+struct _CR_CONFIG_BACKEND {
+    const char* Name;
+    CR_BACKEND_READ Read;
+    CR_BACKEND_CLOSE Close;
+    CR_BACKEND_ENUMERATE_SEGMENTS EnumerateSegments;  // NULL: segment 0 only
+    CR_BACKEND_ENUMERATE_BUSES EnumerateBuses;        // NULL: any bus may be populated
+};
+
+CR_INLINE uint32_t CrConfigRead(PCR_CONFIG_BACKEND Backend, CR_ADDRESS Address,
+    uint32_t Offset, void* Buffer, uint32_t Length)
+{
+    return Backend->Read(Backend, Address, Offset, Buffer, Length);
+}
+
+CR_INLINE void CrBackendClose(PCR_CONFIG_BACKEND Backend)
+{
+    if (Backend != NULL) {
+        Backend->Close(Backend);
+    }
+}
+
+// In-memory synthetic topology. Functions are stored sorted by address with a
+// full 4 KB config space each; reads past what was supplied return zeroes.
+CR_STATUS CrSimCreate(_In_ uint32_t MaxFunctions, _Out_ PCR_CONFIG_BACKEND* Backend);
+CR_STATUS CrSimAddFunction(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_reads_bytes_(Length) const void* Config,
+    _In_ uint32_t Length);
+// Convenience for type 0 endpoints. ClassCode is BaseClass:SubClass:ProgIf.
+CR_STATUS CrSimAddDevice(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ uint8_t HeaderType);
+// PCI-to-PCI bridge (class 06:04:00) forwarding SecondaryBus..SubordinateBus.
+CR_STATUS CrSimAddBridge(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint8_t SecondaryBus,
+    _In_ uint8_t SubordinateBus);
+
+#if !defined(_KERNEL_MODE)
+// Raw config-space image: an ECAM-layout file where function (b, d, f) lives
+// at ((b - StartBus) << 20 | d << 15 | f << 12). Regions past EOF are absent.
+CR_STATUS CrFileImageOpen(
+    _In_ const char* Path,
+    _In_ uint16_t Segment,
+    _In_ uint8_t StartBus,
+    _Out_ PCR_CONFIG_BACKEND* Backend);
+#endif
+
+// ECAM (MMCONFIG) window as described by one ACPI MCFG allocation entry.
+// BaseAddress is the address of bus 0 even when StartBus is not 0.
+typedef struct _CR_ECAM_REGION {
+    uint64_t BaseAddress;
+    uint16_t Segment;
+    uint8_t StartBus;
+    uint8_t EndBus;
+} CR_ECAM_REGION, * PCR_ECAM_REGION;
+
+// CR_ECAM_MAPPER.Flags
+#define CR_ECAM_MAPPING_IS_MEMORY 0x1   // Ordinary memory (an image), wide loads are safe
+
+// Maps [PhysicalAddress, PhysicalAddress + Length) once for the backend's lifetime.
+typedef void* (*CR_ECAM_MAP)(_In_opt_ void* Context, _In_ uint64_t PhysicalAddress, _In_ size_t Length);
+typedef void (*CR_ECAM_UNMAP)(_In_opt_ void* Context, _In_ void* Mapping, _In_ size_t Length);
+
+typedef struct _CR_ECAM_MAPPER {
+    CR_ECAM_MAP Map;
+    CR_ECAM_UNMAP Unmap;
+    void* Context;
+    uint32_t Flags;
+} CR_ECAM_MAPPER, * PCR_ECAM_MAPPER;
+
+// Extracts allocation entries from a raw MCFG table. Returns how many the
+// table holds, writing at most Capacity of them.
+uint32_t CrParseMcfg(
+    _In_reads_bytes_(Length) const void* Table,
+    _In_ size_t Length,
+    _Out_writes_(Capacity) CR_ECAM_REGION* Regions,
+    _In_ uint32_t Capacity);
+
+// Maps each region's bus range once; reads are then plain loads, reaching the
+// full 4 KB extended config space. Real MMIO is read one aligned dword at a
+// time (ECAM does not guarantee wider accesses); memory-backed mappings copy
+// 64-byte headers with vector loads.
+CR_STATUS CrEcamCreate(
+    _In_reads_(RegionCount) const CR_ECAM_REGION* Regions,
+    _In_ uint32_t RegionCount,
+    _In_ const CR_ECAM_MAPPER* Mapper,
+    _Out_ PCR_CONFIG_BACKEND* Backend);
+
+#if !defined(_KERNEL_MODE)
+// ECAM backend over a memory-mapped image file laid out like the file
+// backend (bus StartBus at offset 0). EndBus follows from the file size.
+CR_STATUS CrEcamOpenImage(
+    _In_ const char* Path,
+    _In_ uint16_t Segment,
+    _In_ uint8_t StartBus,
+    _Out_ PCR_CONFIG_BACKEND* Backend);
+#endif
+
+#if defined(__linux__)
+// /sys/bus/pci/devices/SSSS:BB:DD.F/config. Without root only the first 64
+// bytes of each function are readable, which is all a scan needs.
+CR_STATUS CrSysfsOpen(_In_opt_ const char* Root, _Out_ PCR_CONFIG_BACKEND* Backend);
+#endif
+
+//
+// Enumeration
+//
+
+// Return nonzero to report the function. Evaluated before the record is copied.
+typedef int (*CR_FUNCTION_FILTER)(_In_opt_ void* Context, _In_ const CR_FUNCTION_RECORD* Record);
+
+// A CR_FILTER_RULE list compiled into lookup bitmaps. The walker checks it
+// against the vendor/device and class dwords before reading the rest of the
+// header, so rejected functions are never copied or decoded.
+typedef struct _CR_FILTER CR_FILTER, * PCR_FILTER;
+
+CR_STATUS CrFilterCompile(
+    _In_reads_(RuleCount) const CR_FILTER_RULE* Rules,
+    _In_ uint32_t RuleCount,
+    _Out_ PCR_FILTER* Filter);
+
+// Compiles a wire-format CR_FILTER_SPEC and its rules. *Consumed is the
+// number of bytes the spec occupied.
+CR_STATUS CrFilterCompileSpec(
+    _In_reads_bytes_(Length) const void* Spec,
+    _In_ size_t Length,
+    _Out_ PCR_FILTER* Filter,
+    _Out_opt_ size_t* Consumed);
+
+int CrFilterMatch(
+    _In_ const CR_FILTER* Filter,
+    _In_ uint8_t Bus,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode);
+
+void CrFilterFree(_In_ PCR_FILTER Filter);
+
+// CR_SCAN_OPTIONS.Flags
+#define CR_SCAN_ARI  0x00000001  // Enumerate ARI devices by their function chain
+
+typedef struct _CR_SCAN_OPTIONS {
+    const CR_FILTER* Match;      // NULL reports every function
+    CR_FUNCTION_FILTER Filter;   // Optional extra check on the decoded record
+    void* FilterContext;
+    uint32_t Flags;              // CR_SCAN_*
+} CR_SCAN_OPTIONS, * PCR_SCAN_OPTIONS;
+
+// Caller-owned record array. Count never exceeds Capacity; Total keeps
+// counting past it so a caller can size a retry.
+typedef struct _CR_SCAN_OUTPUT {
+    CR_FUNCTION_RECORD* Records;
+    uint32_t Capacity;
+    uint32_t Count;
+    uint32_t Total;
+} CR_SCAN_OUTPUT, * PCR_SCAN_OUTPUT;
+
+// Fills Record from a raw 64-byte header.
+void CrDecodeRecord(_In_ CR_ADDRESS Address, _In_reads_bytes_(CR_CONFIG_HEADER_SIZE) const uint8_t* Header,
+    _Out_ CR_FUNCTION_RECORD* Record);
+
+// Walks every device/function slot of one bus, appending to Output.
+// Returns CR_E_MORE_DATA if Output ran out of room.
+CR_STATUS CrScanBus(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output);
+
+// Scans one bus into a CR_SCAN_HEADER-prefixed buffer in the IOCTL wire
+// format. Buffer must hold at least the header.
+CR_STATUS CrScanBusToBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+//
+// Batched register reads
+//
+
+// Reads every entry and writes Results in the same order. Entries are sorted
+// by function and offset internally and runs of nearby registers on the same
+// function are fetched with a single backend read. Results may alias Entries.
+// Returns CR_OK unless the request itself is unusable; per-register failures
+// are reported in each result's Status.
+CR_STATUS CrReadBatch(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(Count) const CR_READ_ENTRY* Entries,
+    _In_ uint32_t Count,
+    _Out_writes_(Count) CR_READ_RESULT* Results,
+    _Out_opt_ uint32_t* FailedCount);
+
+// CrReadBatch over the IOCTL wire format. Input and Buffer may be the same
+// METHOD_BUFFERED system buffer. If Buffer cannot hold every result only the
+// header is written and CR_E_MORE_DATA is returned.
+CR_STATUS CrReadBatchBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_bytes_(InputLength) const void* Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+//
+// Capabilities
+//
+
+// Walks the standard list from the header's capability pointer, then the
+// extended list from 0x100 if the backend reaches that far. Each list stops
+// at an offset it has already visited, so a looping chain ends after one
+// lap. Writes at most Capacity entries; *Total counts every capability found.
+// Returns CR_E_NOT_FOUND for an absent function, CR_E_IO if it is unreachable
+// and CR_E_MORE_DATA if Entries ran out of room. Through a CrCacheBackend
+// view, repeat walks are answered from memory apart from the ID probe.
+CR_STATUS CrCapWalk(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _Out_writes_(Capacity) CR_CAP_ENTRY* Entries,
+    _In_ uint32_t Capacity,
+    _Out_ uint32_t* Total);
+
+// Finds the Instance'th capability with Id (extended if Flags has
+// CR_CAP_EXTENDED), stopping the walk there.
+CR_STATUS CrCapFind(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t Id,
+    _In_ uint32_t Flags,
+    _In_ uint32_t Instance,
+    _Out_ PCR_CAP_ENTRY Entry);
+
+// CrCapWalk over the IOCTL_MYPCISCANNER_QUERY_CAPS wire format. Input and
+// Buffer may be the same system buffer; Buffer must hold at least the header.
+CR_STATUS CrCapWalkBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_bytes_(InputLength) const void* Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+// Serves IOCTL_MYPCISCANNER_READ_CAP: finds the capability, then reads
+// straight from its offset. Input and Buffer may be the same system buffer.
+CR_STATUS CrCapReadBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_bytes_(InputLength) const void* Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+//
+// Whole-topology enumeration
+//
+
+typedef void (*CR_WORK_ROUTINE)(_In_ void* Context);
+
+// Runs Routine(Context) on Count threads at once, one of which may be the
+// caller, and returns once every invocation has returned. Starting fewer
+// threads than asked is allowed; the work loops tolerate any number.
+typedef struct _CR_EXECUTOR CR_EXECUTOR, * PCR_EXECUTOR;
+struct _CR_EXECUTOR {
+    void (*Run)(_In_ PCR_EXECUTOR Executor, _In_ uint32_t Count, _In_ CR_WORK_ROUTINE Routine, _In_ void* Context);
+    uint32_t MaxWorkers;     // Upper bound the host is willing to run
+};
+
+typedef struct _CR_TOPOLOGY_OPTIONS {
+    CR_SCAN_OPTIONS Scan;
+    uint32_t Flags;          // CR_TOPOLOGY_*
+    uint16_t Segment;        // Ignored with CR_TOPOLOGY_ALL_SEGMENTS
+    uint32_t MaxWorkers;     // 0: Executor->MaxWorkers
+    PCR_EXECUTOR Executor;   // NULL: walk sequentially on the calling thread
+} CR_TOPOLOGY_OPTIONS, * PCR_TOPOLOGY_OPTIONS;
+
+// Sorts records by segment, bus, device, function. In place, no allocation.
+void CrSortRecords(_Inout_updates_(Count) CR_FUNCTION_RECORD* Records, _In_ uint32_t Count);
+
+// Follows bridge secondary/subordinate ranges from bus 0 of each segment, then
+// (unless CR_TOPOLOGY_BRIDGES_ONLY) probes the remaining buses as additional
+// root buses; with a backend that has EnumerateBuses, only those it reports
+// populated. Each bus is scanned at most once. Buses found behind a bridge
+// are queued as independent work items for up to MaxWorkers workers. With
+// CR_TOPOLOGY_ARI, ARI devices are enumerated through their function chains
+// instead of stopping at function 7. Output is sorted; if it overflows,
+// which records are kept is unspecified.
+CR_STATUS CrScanTopology(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output);
+
+CR_STATUS CrScanTopologyToBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+#if !defined(_KERNEL_MODE)
+// Thread-per-worker executor over Win32 threads or pthreads. MaxWorkers 0
+// means one per online CPU.
+void CrThreadExecutorInit(_Out_ PCR_EXECUTOR Executor, _In_ uint32_t MaxWorkers);
+uint32_t CrOnlineCpuCount(void);
+#endif
+
+//
+// SR-IOV virtual functions
+//
+
+// Scans the topology with Options (ARI chains always followed), reads the
+// SR-IOV capability of every matching type 0 function and writes one range
+// per PF with VFs enabled. Nothing is probed per VF: routing IDs come from
+// First VF Offset, VF Stride and NumVFs, and only the first VF is read, for
+// its class code. Ranges are sorted by PF address. Writes at most Capacity
+// ranges; *Total counts them all and *FunctionCount their VFs.
+CR_STATUS CrScanVirtualFunctions(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Out_writes_(Capacity) CR_VF_RANGE* Ranges,
+    _In_ uint32_t Capacity,
+    _Out_ uint32_t* Total,
+    _Out_opt_ uint32_t* FunctionCount);
+
+// CrScanVirtualFunctions in the IOCTL_MYPCISCANNER_SCAN_VFS wire format.
+// Buffer must hold at least the header.
+CR_STATUS CrScanVirtualFunctionsToBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+// Address of VF Index (0-based) of Range. Index must be below Range->Count.
+CR_INLINE CR_ADDRESS CrVfAddress(_In_ const CR_VF_RANGE* Range, _In_ uint32_t Index)
+{
+    uint32_t routingId = Range->FirstRoutingId + Index * Range->Stride;
+    CR_ADDRESS address;
+
+    address.Segment = Range->Segment;
+    address.Bus = (uint8_t)(routingId >> 8);
+    address.Device = (uint8_t)((routingId >> 3) & 0x1F);
+    address.Function = (uint8_t)(routingId & 0x7);
+    return address;
+}
+
+//
+// Incremental scans
+//
+
+// One topology scan, sorted by address, with a hash of each header.
+typedef struct _CR_SNAPSHOT {
+    uint64_t Generation;
+    uint32_t Count;
+    CR_FUNCTION_RECORD* Records;
+    uint64_t* Hashes;
+} CR_SNAPSHOT, * PCR_SNAPSHOT;
+
+// The latest snapshot and the one before it. Keeping both lets a caller that
+// probed for the size, and so triggered the rescan, still get its delta on
+// the retry. Not thread safe; callers serialize. Zero-initialize before use.
+typedef struct _CR_DELTA_STATE {
+    CR_SNAPSHOT Previous;
+    CR_SNAPSHOT Current;
+} CR_DELTA_STATE, * PCR_DELTA_STATE;
+
+// 64-bit FNV-1a over a raw 64-byte header with the Status register masked,
+// so error bits being set and cleared do not show up as changes.
+uint64_t CrHashHeader(_In_reads_bytes_(CR_CONFIG_HEADER_SIZE) const uint8_t* Header);
+
+// Rescans with Options and, if anything differs from the current snapshot,
+// makes the result current under the next generation number.
+CR_STATUS CrDeltaRefresh(
+    _Inout_ PCR_DELTA_STATE State,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options);
+
+// Writes the changes from BaseGeneration to the current snapshot in the
+// IOCTL_MYPCISCANNER_SCAN_DELTA wire format. Buffer must hold at least the header.
+CR_STATUS CrDeltaToBuffer(
+    _In_ const CR_DELTA_STATE* State,
+    _In_ uint64_t BaseGeneration,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+// Cheap hotplug check against Snapshot, which should be unfiltered: re-reads
+// the vendor and device ID of every function in it, the bus numbers of every
+// bridge, and the vendor ID at device 0 of each bridge's secondary bus that
+// was empty. A few reads per function instead of a probe per slot. Returns
+// nonzero when anything disagrees; a full rescan then says what changed.
+// Devices added to a root bus outside any bridge's range are not seen.
+int CrSnapshotProbe(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ const CR_SNAPSHOT* Snapshot);
+
+void CrDeltaFree(_Inout_ PCR_DELTA_STATE State);
+
+//
+// Coalesced scans
+//
+
+#define CR_FLIGHT_SLOTS    4     // Distinct requests that can be in flight at once
+#define CR_FLIGHT_MAX_KEY  256   // Longer keys are never coalesced
+
+// A request waiting on a topology scan. Complete is called exactly once, on
+// the thread that ran the scan; Records are only valid during the call.
+typedef struct _CR_FLIGHT_WAITER CR_FLIGHT_WAITER, * PCR_FLIGHT_WAITER;
+
+typedef void (*CR_FLIGHT_COMPLETE)(
+    _In_ PCR_FLIGHT_WAITER Waiter,
+    _In_ CR_STATUS Status,
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count);
+
+struct _CR_FLIGHT_WAITER {
+    PCR_FLIGHT_WAITER Next;
+    CR_FLIGHT_COMPLETE Complete;
+    void* Context;
+};
+
+typedef struct _CR_FLIGHT {
+    uint32_t InUse;
+    uint32_t KeyLength;
+    uint8_t Key[CR_FLIGHT_MAX_KEY];
+    PCR_FLIGHT_WAITER Waiters;
+} CR_FLIGHT;
+
+// Scans in flight, keyed by the caller's request bytes. Zero-initialize
+// before use; there is nothing to free.
+typedef struct _CR_SCAN_FLIGHTS {
+    CR_SPIN_LOCK Lock;
+    uint32_t LastCount;      // Sizing hint for the next scan
+    uint64_t Scans;          // Scans actually run
+    uint64_t Joined;         // Requests served by another request's scan
+    CR_FLIGHT Flights[CR_FLIGHT_SLOTS];
+} CR_SCAN_FLIGHTS, * PCR_SCAN_FLIGHTS;
+
+// Single-flight topology scan. If a scan with the same Key is already
+// running, Waiter joins it and this returns at once; otherwise the calling
+// thread scans with Options and completes every waiter that joined in the
+// meantime, itself included. A joined waiter may be completed before this
+// returns, so callers must not touch it afterwards. Returns nonzero if this
+// call ran the scan. Key identifies everything that shapes the result, Options included.
+int CrScanCoalesced(
+    _Inout_ PCR_SCAN_FLIGHTS Flights,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_reads_bytes_(KeyLength) const void* Key,
+    _In_ uint32_t KeyLength,
+    _In_ PCR_FLIGHT_WAITER Waiter);
+
+// Writes Records in the scan wire format (CR_SCAN_HEADER + records), with
+// the same overflow behaviour as CrScanTopologyToBuffer.
+CR_STATUS CrRecordsToBuffer(
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten);
+
+//
+// Register sampling
+//
+
+// Bytes of ring memory needed for Capacity samples of RegisterCount
+// registers, or 0 if the combination is not allowed.
+size_t CrRingSize(_In_ uint32_t RegisterCount, _In_ uint32_t Capacity);
+
+// Producer side. Reads Registers into Ring on every CrSamplerTick. Ring
+// must stay valid until CrSamplerFree; it is initialized here.
+typedef struct _CR_SAMPLER CR_SAMPLER, * PCR_SAMPLER;
+
+CR_STATUS CrSamplerCreate(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(RegisterCount) const CR_READ_ENTRY* Registers,
+    _In_ uint32_t RegisterCount,
+    _In_ uint32_t Capacity,
+    _In_ uint64_t TimestampFrequency,
+    _Out_writes_bytes_(RingSize) void* Ring,
+    _In_ size_t RingSize,
+    _Out_ PCR_SAMPLER* Sampler);
+
+// Takes one sample. Never allocates or blocks, so it can run from a timer
+// callback at whatever IRQL the backend tolerates. Only one tick may run at
+// a time. The consumer's Head is treated as untrusted.
+void CrSamplerTick(_Inout_ PCR_SAMPLER Sampler, _In_ uint64_t Timestamp);
+
+void CrSamplerFree(_In_ PCR_SAMPLER Sampler);
+
+// Consumer side. Copies up to MaxSamples unread samples (each
+// Ring->SampleSize bytes) into Buffer and releases their slots. Returns the
+// number copied.
+uint32_t CrRingConsume(
+    _Inout_ PCR_RING_HEADER Ring,
+    _Out_writes_bytes_(MaxSamples * Ring->SampleSize) void* Buffer,
+    _In_ uint32_t MaxSamples);
+
+//
+// Statistics
+//
+
+// Clock and CPU numbering supplied by the host. Now and CurrentCpu must be
+// callable at any IRQL the backend is used at.
+typedef struct _CR_STATS_HOST {
+    uint64_t (*Now)(void);
+    uint64_t Frequency;      // Now() ticks per second
+    uint32_t (*CurrentCpu)(void);
+    uint32_t CpuCount;       // CurrentCpu() is below this
+} CR_STATS_HOST, * PCR_STATS_HOST;
+
+// Per-CPU counters and histograms. Updates are atomic adds on the calling
+// CPU's own cache lines, so they never contend; a thread that migrates
+// mid-update only lands a count on a neighbouring slot.
+typedef struct _CR_STATS CR_STATS, * PCR_STATS;
+
+CR_STATUS CrStatsCreate(_In_ const CR_STATS_HOST* Host, _Out_ PCR_STATS* Stats);
+void CrStatsFree(_In_opt_ PCR_STATS Stats);
+
+// Timestamp to pass to CrStatsRecordRequest.
+uint64_t CrStatsNow(_In_ const CR_STATS* Stats);
+
+// Counts one completed request. IOCTLs outside the CR_STATS_IOCTL_SLOTS
+// window are ignored.
+void CrStatsRecordRequest(
+    _In_ PCR_STATS Stats,
+    _In_ uint32_t IoControlCode,
+    _In_ uint64_t Start,
+    _In_ uint64_t BytesReturned,
+    _In_ int Failed);
+
+// Wraps Inner so every read is counted and timed. Closing the wrapper closes
+// Inner too; Stats must outlive it.
+CR_STATUS CrStatsWrapBackend(
+    _In_ PCR_STATS Stats,
+    _In_ PCR_CONFIG_BACKEND Inner,
+    _Out_ PCR_CONFIG_BACKEND* Backend);
+
+// Sums every CPU's counters into Reply.
+void CrStatsQuery(_In_ const CR_STATS* Stats, _Out_ PCR_STATS_REPLY Reply);
+
+// Upper bound, in nanoseconds, of the bucket holding the Percent-th
+// percentile of a CR_STATS_BUCKETS histogram. 0 if the histogram is empty.
+uint64_t CrStatsPercentile(_In_reads_(CR_STATS_BUCKETS) const uint64_t* Buckets, _In_ uint32_t Percent);
+
+//
+// Config-space cache
+//
+
+// Remembers the fields of each function that cannot change while it stays
+// present: vendor/device ID, revision and class code, header type, subsystem
+// IDs, the capability pointer and every capability header, standard and
+// extended.
+//
+// The cache is a backend with two views over one table. The cached view
+// answers reads that fall entirely within known immutable bytes from memory
+// and passes everything else through, learning from what comes back. Any
+// read touching the vendor/device ID dword still reads that dword from the
+// hardware first, so presence is never answered from memory. The refresh
+// view always reads the hardware; a read of offset 0 through it drops what
+// was known about the function first, so a scan through it is a rescan that
+// repopulates the cache. Either view drops a function whose vendor or device
+// ID is seen to change, which is how a device added, removed or replaced
+// behind the cache's back is noticed. Neither view owns Inner, and closing
+// them does nothing.
+//
+// Entries are only ever dropped, never evicted: when the table is full, new
+// functions are simply not cached.
+typedef struct _CR_CACHE CR_CACHE, * PCR_CACHE;
+
+#define CR_CACHE_MAX_PRESENT 0xFFFE
+
+// MaxFunctions bounds the slots remembered, empty ones included;
+// MaxPresent bounds the functions whose fields are kept.
+CR_STATUS CrCacheCreate(
+    _In_ PCR_CONFIG_BACKEND Inner,
+    _In_ uint32_t MaxFunctions,
+    _In_ uint32_t MaxPresent,
+    _Out_ PCR_CACHE* Cache);
+void CrCacheFree(_In_opt_ PCR_CACHE Cache);
+
+PCR_CONFIG_BACKEND CrCacheBackend(_In_ PCR_CACHE Cache);
+PCR_CONFIG_BACKEND CrCacheRefreshBackend(_In_ PCR_CACHE Cache);
+
+void CrCacheInvalidate(_In_ PCR_CACHE Cache, _In_ CR_ADDRESS Address);
+void CrCacheFlush(_In_ PCR_CACHE Cache);
+
+#if !defined(_KERNEL_MODE)
+//
+// Snapshot files (CR_SNAPFILE_HEADER in crprotocol.h)
+//
+
+// One function's config space for CrSnapFileWrite. Length is at most
+// CR_SNAPFILE_BLOB_SIZE; the rest of the blob is written as zeroes.
+typedef struct _CR_SNAPFILE_INPUT {
+    CR_ADDRESS Address;
+    const void* Config;
+    uint32_t Length;
+} CR_SNAPFILE_INPUT, * PCR_SNAPFILE_INPUT;
+
+// Writes Functions, in any order, to a new snapshot file at Path. Fails with
+// CR_E_INVALID_PARAMETER if an address appears twice.
+CR_STATUS CrSnapFileWrite(
+    _In_ const char* Path,
+    _In_reads_(Count) const CR_SNAPFILE_INPUT* Functions,
+    _In_ uint32_t Count);
+
+// Scans with Options and writes every function found, reading as much of
+// its config space as the backend allows (4 KB, else 256 bytes, else the header).
+CR_STATUS CrSnapFileCapture(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_ const char* Path);
+
+// A mapped snapshot file. Opening validates the header and the bounds of the
+// index and blobs; nothing is copied, and lookups are a binary search over
+// the mapped index.
+typedef struct _CR_SNAPFILE CR_SNAPFILE, * PCR_SNAPFILE;
+
+CR_STATUS CrSnapFileOpen(_In_ const char* Path, _Out_ PCR_SNAPFILE* File);
+
+const CR_SNAPFILE_HEADER* CrSnapFileHeader(_In_ const CR_SNAPFILE* File);
+
+// The index, sorted by Key; CrSnapFileHeader(File)->EntryCount entries.
+const CR_SNAPFILE_ENTRY* CrSnapFileEntries(_In_ const CR_SNAPFILE* File);
+
+// Config space of Address inside the mapping, or NULL if the file does not
+// have the function. *ValidLength is how much of it was captured.
+const uint8_t* CrSnapFileFind(
+    _In_ const CR_SNAPFILE* File,
+    _In_ CR_ADDRESS Address,
+    _Out_opt_ uint32_t* ValidLength);
+
+// The file as a config backend, for scans and batch reads. Missing functions
+// read as all-ones and reads past ValidLength fail. The backend belongs to
+// File: closing either one closes both.
+PCR_CONFIG_BACKEND CrSnapFileBackend(_In_ PCR_SNAPFILE File);
+
+void CrSnapFileClose(_In_ PCR_SNAPFILE File);
+
+//
+// Snapshot diffs
+//
+
+#define CR_DIFF_MATCH_IDENTITY   0x00000001  // Pair functions by identity, not address
+#define CR_DIFF_NO_DEFAULT_MASKS 0x00000002  // Apply only CR_DIFF_OPTIONS.Masks
+
+// CR_DIFF_MASK.Flags
+#define CR_DIFF_MASK_ABSOLUTE    0x8000      // Offset is from the start of config space
+
+// Bits of a register that change on their own (error status, counters) and
+// are cleared on both sides before comparing. Offset is relative to every
+// instance of capability CapabilityId, found as in CrCapFind (CR_CAP_EXTENDED
+// in Flags for the extended list), or absolute with CR_DIFF_MASK_ABSOLUTE.
+// The register may not straddle a dword.
+typedef struct _CR_DIFF_MASK {
+    uint16_t CapabilityId;
+    uint16_t Flags;          // CR_CAP_EXTENDED, CR_DIFF_MASK_ABSOLUTE
+    uint16_t Offset;
+    uint16_t Width;          // 1, 2 or 4
+    uint32_t Mask;           // Bits to ignore, in register order
+} CR_DIFF_MASK, * PCR_DIFF_MASK;
+
+typedef struct _CR_DIFF_OPTIONS {
+    uint32_t Flags;          // CR_DIFF_*
+    uint32_t MaskCount;
+    const CR_DIFF_MASK* Masks;   // On top of the defaults unless CR_DIFF_NO_DEFAULT_MASKS
+    uint32_t MaxWorkers;     // CrSnapDiffFiles only; 0: Executor->MaxWorkers
+    PCR_EXECUTOR Executor;   // NULL: diff the files one after another
+} CR_DIFF_OPTIONS, * PCR_DIFF_OPTIONS;
+
+typedef enum _CR_DIFF_KIND {
+    CR_DIFF_REMOVED = 1,     // Only in Left
+    CR_DIFF_ADDED,           // Only in Right
+    CR_DIFF_CHANGED,         // A field differs
+    CR_DIFF_TRUNCATED,       // Captured to different lengths; see below
+} CR_DIFF_KIND;
+
+// One difference. Header fields are reported at their own width; past the
+// header the unit is the dword, attributed to the nearest capability header
+// at or below it in the same list. A CR_DIFF_TRUNCATED entry comes before
+// the field entries of its pair: Left and Right are the two captured
+// lengths, Offset the shorter one, and nothing past Offset was compared.
+typedef struct _CR_DIFF_ENTRY {
+    uint32_t Kind;           // CR_DIFF_KIND
+    uint32_t LeftKey;        // CrAddressKey in Left; unused for CR_DIFF_ADDED
+    uint32_t RightKey;       // CrAddressKey in Right; unused for CR_DIFF_REMOVED
+    uint16_t Offset;
+    uint8_t  Width;
+    uint8_t  HeaderType;     // Left's header type without the multifunction bit
+    uint16_t CapabilityId;
+    uint16_t CapabilityOffset;   // 0 when the field is in no capability
+    uint32_t CapabilityFlags;    // CR_CAP_EXTENDED
+    uint32_t Left;           // Field values with the volatile bits cleared
+    uint32_t Right;
+} CR_DIFF_ENTRY, * PCR_DIFF_ENTRY;
+
+typedef struct _CR_DIFF_SUMMARY {
+    CR_STATUS Status;
+    uint32_t Matched;        // Functions on both sides
+    uint32_t Changed;        // Matched functions with at least one field entry
+    uint32_t Removed;
+    uint32_t Added;
+    uint32_t Fields;         // CR_DIFF_CHANGED entries
+    uint32_t Truncated;      // CR_DIFF_TRUNCATED entries
+} CR_DIFF_SUMMARY, * PCR_DIFF_SUMMARY;
+
+// Compares every function of Left with its counterpart in Right: the same
+// address, or with CR_DIFF_MATCH_IDENTITY the same vendor, device, subsystem
+// and Device Serial Number, in address order among equals. Pairs are
+// compared 64 bytes at a time with vector loads and only the differing
+// blocks are decoded. Only the bytes both sides captured are compared, and a
+// pair captured to different lengths gets a CR_DIFF_TRUNCATED entry. Writes
+// at most Capacity entries in match order; the summary counts all of them,
+// and the status is CR_E_MORE_DATA if Entries ran out of room.
+CR_STATUS CrSnapDiff(
+    _In_ PCR_SNAPFILE Left,
+    _In_ PCR_SNAPFILE Right,
+    _In_opt_ const CR_DIFF_OPTIONS* Options,
+    _Out_writes_(Capacity) CR_DIFF_ENTRY* Entries,
+    _In_ uint32_t Capacity,
+    _Out_ PCR_DIFF_SUMMARY Summary);
+
+// Diffs Golden against each file in Paths, Options->MaxWorkers files at a
+// time, and fills Summaries[i] for Paths[i]. Golden is indexed once and
+// shared; each file is mapped only while it is compared. A file that cannot
+// be opened has its status in the summary and does not fail the call.
+CR_STATUS CrSnapDiffFiles(
+    _In_ PCR_SNAPFILE Golden,
+    _In_reads_(Count) const char* const* Paths,
+    _In_ uint32_t Count,
+    _In_opt_ const CR_DIFF_OPTIONS* Options,
+    _Out_writes_(Count) CR_DIFF_SUMMARY* Summaries);
+
+// Name of the header field at Offset for HeaderType (0, 1 or 2), or NULL.
+const char* CrConfigFieldName(_In_ uint8_t HeaderType, _In_ uint32_t Offset);
+
+//
+// Config-access traces (CR_TRACE_HEADER in crprotocol.h)
+//
+
+// Logs every read made through its backend view: address, offset, length,
+// the data that came back and how long Inner took. Workers may read through
+// it at once; records are kept in memory until saved. The view does not own
+// Inner, and closing it does nothing.
+typedef struct _CR_TRACE_RECORDER CR_TRACE_RECORDER, * PCR_TRACE_RECORDER;
+
+CR_STATUS CrTraceRecorderCreate(_In_ PCR_CONFIG_BACKEND Inner, _Out_ PCR_TRACE_RECORDER* Recorder);
+
+PCR_CONFIG_BACKEND CrTraceRecorderBackend(_In_ PCR_TRACE_RECORDER Recorder);
+
+// Writes everything recorded so far to a new trace file at Path. Fails with
+// CR_E_NO_MEMORY if a record could not be kept.
+CR_STATUS CrTraceRecorderSave(_In_ PCR_TRACE_RECORDER Recorder, _In_ const char* Path);
+
+void CrTraceRecorderFree(_In_opt_ PCR_TRACE_RECORDER Recorder);
+
+// CrTraceOpen Flags
+#define CR_TRACE_REALTIME 0x00000001  // Replayed reads take as long as recorded ones
+
+// A mapped, validated trace and a backend that replays it. Each function's
+// config space is rebuilt from the data read from it, later reads winning.
+// A replayed read that matches a recorded one (address, offset and length)
+// returns what that one returned. Any other read succeeds if every byte it
+// covers was recorded, and counts as a miss otherwise; functions that only
+// ever read back as all-ones, or never appear, read as all-ones. Segments
+// are the ones the trace touched.
+typedef struct _CR_TRACE CR_TRACE, * PCR_TRACE;
+
+// Counters of the replay backend since the trace was opened.
+typedef struct _CR_TRACE_REPLAY_STATS {
+    uint64_t Reads;
+    uint64_t Matched;        // Reads that repeat a recorded one
+    uint64_t Misses;         // Reads of bytes the trace does not have; they fail
+    uint64_t Bytes;
+} CR_TRACE_REPLAY_STATS, * PCR_TRACE_REPLAY_STATS;
+
+CR_STATUS CrTraceOpen(_In_ const char* Path, _In_ uint32_t Flags, _Out_ PCR_TRACE* Trace);
+
+const CR_TRACE_HEADER* CrTraceHeader(_In_ const CR_TRACE* Trace);
+
+// Record after Record, or the first one if Record is NULL; NULL at the end.
+// The data follows each record.
+const CR_TRACE_RECORD* CrTraceNext(_In_ const CR_TRACE* Trace, _In_opt_ const CR_TRACE_RECORD* Record);
+
+// With CR_TRACE_REALTIME, a read that matches a recorded one busy-waits for
+// its latency and any other read for the trace's mean. The backend belongs
+// to Trace: closing either one closes both.
+PCR_CONFIG_BACKEND CrTraceBackend(_In_ PCR_TRACE Trace);
+
+void CrTraceReplayStats(_In_ const CR_TRACE* Trace, _Out_ PCR_TRACE_REPLAY_STATS Stats);
+
+void CrTraceClose(_In_ PCR_TRACE Trace);
+
+//
+// Name databases (CR_NAMEDB_HEADER in crprotocol.h)
+//
+
+// Compiles a pci.ids file into a name database at Path. Duplicate entries
+// keep the first name; malformed lines are skipped.
+CR_STATUS CrNameDbBuild(_In_ const char* PciIdsPath, _In_ const char* Path);
+
+// A validated name database. Lookups are binary searches over the tables in
+// place and never allocate; the names they return live as long as Db.
+typedef struct _CR_NAMEDB CR_NAMEDB, * PCR_NAMEDB;
+
+CR_STATUS CrNameDbOpen(_In_ const char* Path, _Out_ PCR_NAMEDB* Db);
+
+// Opens a database the caller keeps in memory, such as one compiled into the
+// binary. Data must be 4-byte aligned and outlive Db; it is not copied.
+CR_STATUS CrNameDbOpenMemory(
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length,
+    _Out_ PCR_NAMEDB* Db);
+
+const CR_NAMEDB_HEADER* CrNameDbHeader(_In_ const CR_NAMEDB* Db);
+
+// Each returns NULL when the database does not know the ID.
+const char* CrNameDbVendor(_In_ const CR_NAMEDB* Db, _In_ uint16_t VendorId);
+const char* CrNameDbDevice(_In_ const CR_NAMEDB* Db, _In_ uint16_t VendorId, _In_ uint16_t DeviceId);
+const char* CrNameDbSubsystem(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint16_t SubVendorId,
+    _In_ uint16_t SubDeviceId);
+
+// Name of ClassCode (base << 16 | sub << 8 | prog-if) at Depth, one of
+// CR_NAMEDB_CLASS_*.
+const char* CrNameDbClass(_In_ const CR_NAMEDB* Db, _In_ uint32_t ClassCode, _In_ uint32_t Depth);
+
+void CrNameDbClose(_In_ PCR_NAMEDB Db);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,329 @@
+// crdelta.c
+//
+// Generation-numbered snapshots and the added/removed/changed delta between
+// them. Topology rarely changes between polls, so most deltas are empty.
+
+#include "crinternal.h"
+
+#define CR_CFG_STATUS       0x06
+
+// Rescans retried this many times if functions keep appearing between the
+// sizing pass and the real one.
+#define CR_DELTA_SCAN_ATTEMPTS 4
+
+uint64_t
+CrHashHeader(
+    _In_reads_bytes_(CR_CONFIG_HEADER_SIZE) const uint8_t* Header
+)
+{
+    uint64_t hash = CR_FNV_OFFSET_BASIS;
+    uint32_t i;
+
+    for (i = 0; i < CR_CONFIG_HEADER_SIZE; i++) {
+        uint8_t value = (i == CR_CFG_STATUS || i == CR_CFG_STATUS + 1) ? 0 : Header[i];
+        hash = (hash ^ value) * CR_FNV_PRIME;
+    }
+    return hash;
+}
+
+void
+CrSnapshotFree(
+    _Inout_ PCR_SNAPSHOT Snapshot
+)
+{
+    if (Snapshot->Records != NULL) {
+        CrFree(Snapshot->Records);
+    }
+    if (Snapshot->Hashes != NULL) {
+        CrFree(Snapshot->Hashes);
+    }
+    Snapshot->Records = NULL;
+    Snapshot->Hashes = NULL;
+    Snapshot->Count = 0;
+}
+
+CR_STATUS
+CrSnapshotScan(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_ uint32_t Hint,
+    _Out_ PCR_SNAPSHOT Snapshot
+)
+{
+    CR_SCAN_OUTPUT output;
+    uint32_t capacity = Hint + 16;
+    uint32_t attempt;
+    uint32_t i;
+    CR_STATUS status = CR_E_MORE_DATA;
+
+    memset(Snapshot, 0, sizeof(*Snapshot));
+    for (attempt = 0; attempt < CR_DELTA_SCAN_ATTEMPTS && status == CR_E_MORE_DATA; attempt++) {
+        if (Snapshot->Records != NULL) {
+            CrFree(Snapshot->Records);
+        }
+        Snapshot->Records = (CR_FUNCTION_RECORD*)CrAlloc((size_t)capacity * sizeof(CR_FUNCTION_RECORD));
+        if (Snapshot->Records == NULL) {
+            return CR_E_NO_MEMORY;
+        }
+        output.Records = Snapshot->Records;
+        output.Capacity = capacity;
+        output.Count = 0;
+        output.Total = 0;
+        status = CrScanTopology(Backend, Options, &output);
+        capacity = output.Total + 16;
+    }
+    if (status != CR_OK) {
+        CrSnapshotFree(Snapshot);
+        return (status == CR_E_MORE_DATA) ? CR_E_IO : status;
+    }
+
+    Snapshot->Count = output.Count;
+    // One spare slot so an empty topology is not a zero-byte allocation.
+    Snapshot->Hashes = (uint64_t*)CrAlloc(((size_t)output.Count + 1) * sizeof(uint64_t));
+    if (Snapshot->Hashes == NULL) {
+        CrSnapshotFree(Snapshot);
+        return CR_E_NO_MEMORY;
+    }
+    for (i = 0; i < output.Count; i++) {
+        Snapshot->Hashes[i] = CrHashHeader(Snapshot->Records[i].Config);
+    }
+    return CR_OK;
+}
+
+CR_INLINE uint32_t CrRecordKey(_In_ const CR_FUNCTION_RECORD* Record)
+{
+    CR_ADDRESS address;
+
+    address.Segment = Record->Segment;
+    address.Bus = Record->Bus;
+    address.Device = Record->Device;
+    address.Function = Record->Function;
+    return CrAddressKey(address);
+}
+
+// Merge-walks two sorted snapshots. Calls Emit for every difference, or just
+// reports whether there is one when Emit is NULL.
+typedef void (*CR_DELTA_EMIT)(_Inout_ PCR_SCAN_OUTPUT Output, _In_ const CR_FUNCTION_RECORD* Record, _In_ uint16_t Flags);
+
+static uint32_t
+CrSnapshotCompare(
+    _In_ const CR_SNAPSHOT* Old,
+    _In_ const CR_SNAPSHOT* New,
+    _In_opt_ CR_DELTA_EMIT Emit,
+    _Inout_opt_ PCR_SCAN_OUTPUT Output
+)
+{
+    uint32_t i = 0;
+    uint32_t j = 0;
+    uint32_t differences = 0;
+
+    while (i < Old->Count || j < New->Count) {
+        uint32_t oldKey = (i < Old->Count) ? CrRecordKey(&Old->Records[i]) : 0;
+        uint32_t newKey = (j < New->Count) ? CrRecordKey(&New->Records[j]) : 0;
+
+        if (j == New->Count || (i < Old->Count && oldKey < newKey)) {
+            differences++;
+            if (Emit != NULL) {
+                Emit(Output, &Old->Records[i], CR_RECORD_REMOVED);
+            }
+            i++;
+        }
+        else if (i == Old->Count || newKey < oldKey) {
+            differences++;
+            if (Emit != NULL) {
+                Emit(Output, &New->Records[j], CR_RECORD_ADDED);
+            }
+            j++;
+        }
+        else {
+            if (Old->Hashes[i] != New->Hashes[j]) {
+                differences++;
+                if (Emit != NULL) {
+                    Emit(Output, &New->Records[j], CR_RECORD_CHANGED);
+                }
+            }
+            i++;
+            j++;
+        }
+        if (Emit == NULL && differences != 0) {
+            break;
+        }
+    }
+    return differences;
+}
+
+static void
+CrEmitDeltaRecord(
+    _Inout_ PCR_SCAN_OUTPUT Output,
+    _In_ const CR_FUNCTION_RECORD* Record,
+    _In_ uint16_t Flags
+)
+{
+    if (Output->Total < Output->Capacity) {
+        Output->Records[Output->Total] = *Record;
+        Output->Records[Output->Total].Flags = Flags;
+    }
+    Output->Total++;
+}
+
+CR_STATUS
+CrDeltaRefresh(
+    _Inout_ PCR_DELTA_STATE State,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options
+)
+{
+    CR_SNAPSHOT scan;
+    CR_STATUS status;
+
+    if (State == NULL || Backend == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrSnapshotScan(Backend, Options, State->Current.Count, &scan);
+    if (status != CR_OK) {
+        return status;
+    }
+    if (CrSnapshotCompare(&State->Current, &scan, NULL, NULL) == 0) {
+        CrSnapshotFree(&scan);
+        return CR_OK;
+    }
+
+    CrSnapshotFree(&State->Previous);
+    State->Previous = State->Current;
+    scan.Generation = State->Current.Generation + 1;
+    State->Current = scan;
+    return CR_OK;
+}
+
+CR_STATUS
+CrDeltaToBuffer(
+    _In_ const CR_DELTA_STATE* State,
+    _In_ uint64_t BaseGeneration,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_DELTA_HEADER* header = (CR_DELTA_HEADER*)Buffer;
+    CR_SNAPSHOT empty;
+    CR_SCAN_OUTPUT output;
+    size_t capacity;
+    uint32_t flags = 0;
+
+    *BytesWritten = 0;
+    if (State == NULL || Buffer == NULL || BufferLength < sizeof(CR_DELTA_HEADER)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    capacity = (BufferLength - sizeof(CR_DELTA_HEADER)) / sizeof(CR_FUNCTION_RECORD);
+    output.Records = (CR_FUNCTION_RECORD*)(header + 1);
+    output.Capacity = (capacity > UINT32_MAX) ? UINT32_MAX : (uint32_t)capacity;
+    output.Count = 0;
+    output.Total = 0;
+
+    if (BaseGeneration == State->Current.Generation) {
+        // Nothing changed since the caller last looked.
+    }
+    else if (BaseGeneration != 0 && BaseGeneration == State->Previous.Generation) {
+        CrSnapshotCompare(&State->Previous, &State->Current, CrEmitDeltaRecord, &output);
+    }
+    else {
+        memset(&empty, 0, sizeof(empty));
+        CrSnapshotCompare(&empty, &State->Current, CrEmitDeltaRecord, &output);
+        flags = CR_DELTA_FULL;
+    }
+
+    CrFinishOutput(&output);
+    header->Version = CR_PROTOCOL_VERSION;
+    header->RecordSize = sizeof(CR_FUNCTION_RECORD);
+    header->RecordCount = output.Count;
+    header->TotalCount = output.Total;
+    header->Flags = flags;
+    header->Reserved = 0;
+    header->Generation = State->Current.Generation;
+    *BytesWritten = sizeof(CR_DELTA_HEADER) + (size_t)output.Count * sizeof(CR_FUNCTION_RECORD);
+    return (output.Count < output.Total) ? CR_E_MORE_DATA : CR_OK;
+}
+
+// Binary search of a sorted snapshot. Returns nonzero if Key is in it.
+static int
+CrSnapshotContains(
+    _In_ const CR_SNAPSHOT* Snapshot,
+    _In_ uint32_t Key
+)
+{
+    uint32_t low = 0;
+    uint32_t high = Snapshot->Count;
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint32_t key = CrRecordKey(&Snapshot->Records[middle]);
+
+        if (key == Key) {
+            return 1;
+        }
+        if (key < Key) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return 0;
+}
+
+int
+CrSnapshotProbe(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ const CR_SNAPSHOT* Snapshot
+)
+{
+    uint32_t i;
+
+    for (i = 0; i < Snapshot->Count; i++) {
+        const CR_FUNCTION_RECORD* record = &Snapshot->Records[i];
+        uint8_t headerType = record->HeaderType & CR_HEADER_TYPE_MASK;
+        CR_ADDRESS address;
+        uint8_t bytes[4];
+
+        address.Segment = record->Segment;
+        address.Bus = record->Bus;
+        address.Device = record->Device;
+        address.Function = record->Function;
+        // Vendor and device ID together, so a swapped card is noticed too.
+        if (CrConfigRead(Backend, address, CR_CFG_VENDOR_ID, bytes, 4) != 4 ||
+            memcmp(bytes, record->Config + CR_CFG_VENDOR_ID, 4) != 0) {
+            return 1;
+        }
+        if (headerType != CR_HEADER_TYPE_BRIDGE && headerType != CR_HEADER_TYPE_CARDBUS) {
+            continue;
+        }
+
+        // Primary, secondary and subordinate bus numbers, reassigned when
+        // firmware or the OS rebalances bus ranges after a hot add.
+        if (CrConfigRead(Backend, address, CR_CFG_PRIMARY_BUS, bytes, 3) != 3 ||
+            memcmp(bytes, record->Config + CR_CFG_PRIMARY_BUS, 3) != 0) {
+            return 1;
+        }
+        // A hot-plug slot sits at device 0 of a downstream port's secondary
+        // bus; if nothing was there, look whether something is now.
+        address.Bus = record->Config[CR_CFG_SECONDARY_BUS];
+        address.Device = 0;
+        address.Function = 0;
+        if (address.Bus != 0 && !CrSnapshotContains(Snapshot, CrAddressKey(address)) &&
+            CrConfigRead(Backend, address, CR_CFG_VENDOR_ID, bytes, 2) == 2 &&
+            (bytes[0] | (bytes[1] << 8)) != CR_INVALID_VENDOR_ID &&
+            (bytes[0] | (bytes[1] << 8)) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+CrDeltaFree(
+    _Inout_ PCR_DELTA_STATE State
+)
+{
+    CrSnapshotFree(&State->Previous);
+    CrSnapshotFree(&State->Current);
+}
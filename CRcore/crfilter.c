@@ -0,0 +1,177 @@
+// crfilter.c
+//
+// Compiles CR_FILTER_RULE lists into bus and vendor bitmaps plus a rule table
+// sorted by vendor. Most functions on a machine fail the vendor bitmap, so
+// the walker rejects them after a single config read.
+
+#include "crinternal.h"
+
+#define CR_FILTER_SET_BIT(Bitmap, Bit) ((Bitmap)[(Bit) >> 5] |= 1u << ((Bit) & 31))
+
+CR_INLINE int CrRuleLess(_In_ const CR_FILTER_RULE* Left, _In_ const CR_FILTER_RULE* Right)
+{
+    // CR_FILTER_ANY_ID is the largest vendor value, so wildcards sort last.
+    return Left->VendorId < Right->VendorId;
+}
+
+CR_INLINE int CrRuleMatches(
+    _In_ const CR_FILTER_RULE* Rule,
+    _In_ uint8_t Bus,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode)
+{
+    return Bus >= Rule->FirstBus && Bus <= Rule->LastBus &&
+        (Rule->DeviceId == CR_FILTER_ANY_ID || Rule->DeviceId == DeviceId) &&
+        ((ClassCode ^ Rule->ClassCode) & Rule->ClassMask) == 0;
+}
+
+CR_STATUS
+CrFilterCompile(
+    _In_reads_(RuleCount) const CR_FILTER_RULE* Rules,
+    _In_ uint32_t RuleCount,
+    _Out_ PCR_FILTER* Filter
+)
+{
+    PCR_FILTER filter;
+    CR_FILTER_RULE rule;
+    uint32_t i;
+    uint32_t j;
+    uint32_t bus;
+
+    *Filter = NULL;
+    if (RuleCount > CR_MAX_FILTER_RULES || (RuleCount != 0 && Rules == NULL)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    for (i = 0; i < RuleCount; i++) {
+        if (Rules[i].FirstBus > Rules[i].LastBus || (Rules[i].ClassMask & 0xFF000000) != 0) {
+            return CR_E_INVALID_PARAMETER;
+        }
+    }
+
+    // One allocation: the compiled filter followed by its rule table.
+    filter = (PCR_FILTER)CrAlloc(sizeof(*filter) + (size_t)RuleCount * sizeof(CR_FILTER_RULE));
+    if (filter == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    filter->Rules = (CR_FILTER_RULE*)(filter + 1);
+    filter->RuleCount = RuleCount;
+
+    if (RuleCount == 0) {
+        memset(filter->Buses, 0xFF, sizeof(filter->Buses));
+        memset(filter->Vendors, 0xFF, sizeof(filter->Vendors));
+        *Filter = filter;
+        return CR_OK;
+    }
+
+    // Insertion sort: rule lists are short and this runs once per request.
+    for (i = 0; i < RuleCount; i++) {
+        rule = Rules[i];
+        for (j = i; j > 0 && CrRuleLess(&rule, &filter->Rules[j - 1]); j--) {
+            filter->Rules[j] = filter->Rules[j - 1];
+        }
+        filter->Rules[j] = rule;
+    }
+
+    filter->WildcardStart = RuleCount;
+    for (i = 0; i < RuleCount; i++) {
+        rule = filter->Rules[i];
+        if (rule.VendorId == CR_FILTER_ANY_ID) {
+            if (filter->WildcardStart == RuleCount) {
+                filter->WildcardStart = i;
+            }
+            memset(filter->Vendors, 0xFF, sizeof(filter->Vendors));
+        }
+        else {
+            CR_FILTER_SET_BIT(filter->Vendors, rule.VendorId);
+        }
+        if (rule.ClassMask != 0) {
+            filter->Flags |= CR_FILTER_NEEDS_CLASS;
+        }
+        for (bus = rule.FirstBus; bus <= rule.LastBus; bus++) {
+            CR_FILTER_SET_BIT(filter->Buses, bus);
+        }
+    }
+
+    *Filter = filter;
+    return CR_OK;
+}
+
+CR_STATUS
+CrFilterCompileSpec(
+    _In_reads_bytes_(Length) const void* Spec,
+    _In_ size_t Length,
+    _Out_ PCR_FILTER* Filter,
+    _Out_opt_ size_t* Consumed
+)
+{
+    const CR_FILTER_SPEC* spec = (const CR_FILTER_SPEC*)Spec;
+    size_t needed;
+    CR_STATUS status;
+
+    *Filter = NULL;
+    if (Spec == NULL || Length < sizeof(CR_FILTER_SPEC) || spec->RuleCount > CR_MAX_FILTER_RULES) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    needed = sizeof(CR_FILTER_SPEC) + (size_t)spec->RuleCount * sizeof(CR_FILTER_RULE);
+    if (Length < needed) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrFilterCompile((const CR_FILTER_RULE*)(spec + 1), spec->RuleCount, Filter);
+    if (status == CR_OK && Consumed != NULL) {
+        *Consumed = needed;
+    }
+    return status;
+}
+
+int
+CrFilterMatch(
+    _In_ const CR_FILTER* Filter,
+    _In_ uint8_t Bus,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode
+)
+{
+    uint32_t low = 0;
+    uint32_t high = Filter->WildcardStart;
+    uint32_t i;
+
+    if (Filter->RuleCount == 0) {
+        return 1;
+    }
+    if (!CrFilterMayMatch(Filter, Bus, VendorId)) {
+        return 0;
+    }
+
+    // First rule for this vendor, then every rule that shares it.
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (Filter->Rules[mid].VendorId < VendorId) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    for (i = low; i < Filter->WildcardStart && Filter->Rules[i].VendorId == VendorId; i++) {
+        if (CrRuleMatches(&Filter->Rules[i], Bus, DeviceId, ClassCode)) {
+            return 1;
+        }
+    }
+    for (i = Filter->WildcardStart; i < Filter->RuleCount; i++) {
+        if (CrRuleMatches(&Filter->Rules[i], Bus, DeviceId, ClassCode)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+CrFilterFree(
+    _In_ PCR_FILTER Filter
+)
+{
+    if (Filter != NULL) {
+        CrFree(Filter);
+    }
+}
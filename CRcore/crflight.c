@@ -0,0 +1,145 @@
+// crflight.c
+//
+// Single-flight topology scans. When several clients ask for the same scan
+// at once, the first one runs it and the rest are completed from its result,
+// so a burst of N identical requests costs one enumeration instead of N.
+
+#include "crinternal.h"
+
+// Finds the flight for Key, or claims a free slot for it. Called with the
+// lock held. Returns NULL when every slot is busy with other keys.
+static CR_FLIGHT*
+CrFindFlight(
+    _Inout_ PCR_SCAN_FLIGHTS Flights,
+    _In_reads_bytes_(KeyLength) const void* Key,
+    _In_ uint32_t KeyLength,
+    _Out_ int* Leader
+)
+{
+    CR_FLIGHT* unused = NULL;
+    uint32_t i;
+
+    *Leader = 0;
+    for (i = 0; i < CR_FLIGHT_SLOTS; i++) {
+        CR_FLIGHT* flight = &Flights->Flights[i];
+
+        if (!flight->InUse) {
+            if (unused == NULL) {
+                unused = flight;
+            }
+            continue;
+        }
+        if (flight->KeyLength == KeyLength && (KeyLength == 0 || memcmp(flight->Key, Key, KeyLength) == 0)) {
+            return flight;
+        }
+    }
+    if (unused != NULL) {
+        unused->InUse = 1;
+        unused->KeyLength = KeyLength;
+        if (KeyLength != 0) {
+            memcpy(unused->Key, Key, KeyLength);
+        }
+        unused->Waiters = NULL;
+        *Leader = 1;
+    }
+    return unused;
+}
+
+int
+CrScanCoalesced(
+    _Inout_ PCR_SCAN_FLIGHTS Flights,
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_reads_bytes_(KeyLength) const void* Key,
+    _In_ uint32_t KeyLength,
+    _In_ PCR_FLIGHT_WAITER Waiter
+)
+{
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    CR_FLIGHT* flight = NULL;
+    PCR_FLIGHT_WAITER waiters;
+    CR_SNAPSHOT snapshot;
+    CR_STATUS status;
+    uint32_t hint;
+    int leader = 1;
+
+    Waiter->Next = NULL;
+    CrSpinLockAcquire(&Flights->Lock, &lockHandle);
+    if (KeyLength <= CR_FLIGHT_MAX_KEY) {
+        flight = CrFindFlight(Flights, Key, KeyLength, &leader);
+    }
+    if (flight != NULL) {
+        Waiter->Next = flight->Waiters;
+        flight->Waiters = Waiter;
+    }
+    if (leader) {
+        Flights->Scans++;
+    }
+    else {
+        Flights->Joined++;
+    }
+    hint = Flights->LastCount;
+    CrSpinLockRelease(&lockHandle);
+
+    if (!leader) {
+        return 0;
+    }
+
+    // Without a slot the scan still runs, just for this waiter alone.
+    status = CrSnapshotScan(Backend, Options, hint, &snapshot);
+
+    // Nobody can join once the slot is released, so the list taken here is
+    // final. Later arrivals start a fresh scan rather than receive a result
+    // that predates their request.
+    CrSpinLockAcquire(&Flights->Lock, &lockHandle);
+    if (flight != NULL) {
+        waiters = flight->Waiters;
+        flight->Waiters = NULL;
+        flight->InUse = 0;
+    }
+    else {
+        waiters = Waiter;
+    }
+    if (status == CR_OK) {
+        Flights->LastCount = snapshot.Count;
+    }
+    CrSpinLockRelease(&lockHandle);
+
+    while (waiters != NULL) {
+        PCR_FLIGHT_WAITER next = waiters->Next;
+
+        // Complete may free the waiter, so Next is read first.
+        waiters->Complete(waiters, status, snapshot.Records, (status == CR_OK) ? snapshot.Count : 0);
+        waiters = next;
+    }
+    if (status == CR_OK) {
+        CrSnapshotFree(&snapshot);
+    }
+    return 1;
+}
+
+CR_STATUS
+CrRecordsToBuffer(
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_SCAN_OUTPUT output;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    status = CrOutputFromBuffer(&output, Buffer, BufferLength);
+    if (status != CR_OK) {
+        return status;
+    }
+    output.Total = Count;
+    status = CrFinishOutput(&output);
+    if (output.Count != 0) {
+        memcpy(output.Records, Records, (size_t)output.Count * sizeof(CR_FUNCTION_RECORD));
+    }
+    CrCompleteBuffer(&output, Buffer, BytesWritten);
+    return status;
+}
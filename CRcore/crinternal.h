@@ -0,0 +1,131 @@
+// crinternal.h
+//
+// Declarations shared between CRcore translation units only.
+
+#pragma once
+
+#include "crcore.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 64-bit FNV-1a
+#define CR_FNV_OFFSET_BASIS 0xCBF29CE484222325ull
+#define CR_FNV_PRIME        0x00000100000001B3ull
+
+#define CR_FILTER_NEEDS_CLASS 0x00000001   // Some rule tests the class code
+
+struct _CR_FILTER {
+    uint32_t Flags;                      // CR_FILTER_NEEDS_*
+    uint32_t RuleCount;
+    uint32_t WildcardStart;              // Rules[WildcardStart..] match any vendor
+    CR_FILTER_RULE* Rules;               // Sorted by VendorId, wildcards last
+    uint32_t Buses[256 / 32];            // Set if some rule covers the bus
+    uint32_t Vendors[65536 / 32];        // Set if some rule can match the vendor
+};
+
+// Cheap first-stage test on data the walker already has after one dword.
+CR_INLINE int CrFilterMayMatch(_In_ const CR_FILTER* Filter, _In_ uint8_t Bus, _In_ uint16_t VendorId)
+{
+    return ((Filter->Buses[Bus >> 5] >> (Bus & 31)) & 1) &&
+        ((Filter->Vendors[VendorId >> 5] >> (VendorId & 31)) & 1);
+}
+
+// One register of a batch, in the order CrBatchExecute reads them.
+typedef struct _CR_BATCH_SLOT {
+    uint32_t Key;            // CrAddressKey
+    uint16_t Offset;
+    uint8_t  Width;
+    uint8_t  Reserved;
+    uint32_t Index;          // Position in the caller's entry array
+} CR_BATCH_SLOT;
+
+// Validates Entries, fails the malformed ones in Results and returns the
+// number of Slots filled, sorted for coalescing.
+uint32_t CrBatchPrepare(
+    _In_reads_(Count) const CR_READ_ENTRY* Entries,
+    _In_ uint32_t Count,
+    _Out_writes_(Count) CR_BATCH_SLOT* Slots,
+    _Out_writes_(Count) CR_READ_RESULT* Results,
+    _Out_ uint32_t* FailedCount);
+
+// Reads prepared slots into Results[Slot.Index]. Does not allocate, so it is
+// usable from a timer callback. Returns the number of failed reads.
+uint32_t CrBatchExecute(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(SlotCount) const CR_BATCH_SLOT* Slots,
+    _In_ uint32_t SlotCount,
+    _Inout_ CR_READ_RESULT* Results);
+
+// Called for every present type 1/type 2 function with its forwarded range.
+typedef void (*CR_BRIDGE_CALLBACK)(_In_ void* Context, _In_ CR_ADDRESS Address,
+    _In_ uint8_t SecondaryBus, _In_ uint8_t SubordinateBus);
+
+// CrScanBus with an optional bridge callback. Safe to run concurrently on the
+// same Output: slots are reserved with an atomic increment of Output->Total,
+// and Output->Count is only fixed up by CrFinishOutput afterwards.
+void CrWalkBus(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output,
+    _In_opt_ CR_BRIDGE_CALLBACK BridgeCallback,
+    _In_opt_ void* BridgeContext);
+
+CR_INLINE CR_STATUS CrFinishOutput(_Inout_ PCR_SCAN_OUTPUT Output)
+{
+    Output->Count = (Output->Total < Output->Capacity) ? Output->Total : Output->Capacity;
+    return (Output->Count < Output->Total) ? CR_E_MORE_DATA : CR_OK;
+}
+
+// Wraps Output around a wire-format buffer (CR_SCAN_HEADER + records).
+CR_STATUS CrOutputFromBuffer(
+    _Out_ PCR_SCAN_OUTPUT Output,
+    _In_ void* Buffer,
+    _In_ size_t BufferLength);
+
+// Fills the CR_SCAN_HEADER in front of Output->Records.
+void CrCompleteBuffer(
+    _In_ const CR_SCAN_OUTPUT* Output,
+    _Out_ void* Buffer,
+    _Out_ size_t* BytesWritten);
+
+// Scans the topology into a fresh, sorted snapshot (generation 0), retrying
+// while functions keep appearing. Hint is the expected function count.
+CR_STATUS CrSnapshotScan(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_ uint32_t Hint,
+    _Out_ PCR_SNAPSHOT Snapshot);
+
+void CrSnapshotFree(_Inout_ PCR_SNAPSHOT Snapshot);
+
+#if !defined(_KERNEL_MODE)
+// Read-only mapping of a whole file. The handles are kept as void* so this
+// header does not pull in windows.h.
+typedef struct _CR_MAPPED_FILE {
+    const uint8_t* View;
+    size_t Length;
+#if defined(_WIN32)
+    void* File;
+    void* Section;
+#endif
+} CR_MAPPED_FILE, * PCR_MAPPED_FILE;
+
+// Fails with CR_E_INVALID_PARAMETER if the file is empty or shorter than MinLength.
+CR_STATUS CrMapFile(_In_ const char* Path, _In_ size_t MinLength, _Out_ PCR_MAPPED_FILE File);
+void CrUnmapFile(_Inout_ PCR_MAPPED_FILE File);
+
+// Creates or truncates Path and writes Data to it. A partly written file is
+// deleted.
+CR_STATUS CrWriteFile(
+    _In_ const char* Path,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
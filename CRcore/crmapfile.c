@@ -0,0 +1,170 @@
+// crmapfile.c
+//
+// Read-only whole-file mappings for the user-mode backends that serve
+// config space straight out of an image (ECAM dumps, snapshot files), and
+// whole-file writes for the images built in memory (name databases).
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "crinternal.h"
+
+#if !defined(_KERNEL_MODE)
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CR_STATUS
+CrMapFile(
+    _In_ const char* Path,
+    _In_ size_t MinLength,
+    _Out_ PCR_MAPPED_FILE File
+)
+{
+    memset(File, 0, sizeof(*File));
+    if (Path == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+#if defined(_WIN32)
+    {
+        LARGE_INTEGER fileSize;
+        HANDLE file;
+        HANDLE section;
+        void* view;
+
+        file = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return CR_E_NOT_FOUND;
+        }
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0 ||
+            (uint64_t)fileSize.QuadPart < MinLength || (uint64_t)fileSize.QuadPart > SIZE_MAX) {
+            CloseHandle(file);
+            return CR_E_INVALID_PARAMETER;
+        }
+        section = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        view = section ? MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (view == NULL) {
+            if (section) CloseHandle(section);
+            CloseHandle(file);
+            return CR_E_IO;
+        }
+        File->View = (const uint8_t*)view;
+        File->Length = (size_t)fileSize.QuadPart;
+        File->File = file;
+        File->Section = section;
+    }
+#else
+    {
+        struct stat st;
+        void* view;
+        int file = open(Path, O_RDONLY | O_CLOEXEC);
+
+        if (file < 0) {
+            return CR_E_NOT_FOUND;
+        }
+        if (fstat(file, &st) != 0 || st.st_size == 0 || (uint64_t)st.st_size < MinLength) {
+            close(file);
+            return CR_E_INVALID_PARAMETER;
+        }
+        view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, file, 0);
+        close(file);
+        if (view == MAP_FAILED) {
+            return CR_E_IO;
+        }
+        File->View = (const uint8_t*)view;
+        File->Length = (size_t)st.st_size;
+    }
+#endif
+    return CR_OK;
+}
+
+void
+CrUnmapFile(
+    _Inout_ PCR_MAPPED_FILE File
+)
+{
+    if (File->View == NULL) {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile((void*)File->View);
+    CloseHandle(File->Section);
+    CloseHandle(File->File);
+#else
+    munmap((void*)File->View, File->Length);
+#endif
+    memset(File, 0, sizeof(*File));
+}
+
+CR_STATUS
+CrWriteFile(
+    _In_ const char* Path,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length
+)
+{
+    const uint8_t* data = (const uint8_t*)Data;
+    CR_STATUS status = CR_OK;
+
+    if (Path == NULL || (Length != 0 && Data == NULL)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+#if defined(_WIN32)
+    {
+        HANDLE file = CreateFileA(Path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+        if (file == INVALID_HANDLE_VALUE) {
+            return CR_E_IO;
+        }
+        while (Length != 0 && status == CR_OK) {
+            DWORD chunk = (Length > 0x40000000) ? 0x40000000 : (DWORD)Length;
+            DWORD written = 0;
+            if (!WriteFile(file, data, chunk, &written, NULL) || written == 0) {
+                status = CR_E_IO;
+                break;
+            }
+            data += written;
+            Length -= written;
+        }
+        CloseHandle(file);
+        if (status != CR_OK) {
+            DeleteFileA(Path);
+        }
+    }
+#else
+    {
+        int file = open(Path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (file < 0) {
+            return CR_E_IO;
+        }
+        while (Length != 0) {
+            ssize_t written = write(file, data, Length);
+            if (written <= 0) {
+                status = CR_E_IO;
+                break;
+            }
+            data += written;
+            Length -= (size_t)written;
+        }
+        if (close(file) != 0 && status == CR_OK) {
+            status = CR_E_IO;
+        }
+        if (status != CR_OK) {
+            unlink(Path);
+        }
+    }
+#endif
+    return status;
+}
+
+#endif // !_KERNEL_MODE
@@ -0,0 +1,756 @@
+// crnames.c
+//
+// Name databases: pci.ids compiled into sorted fixed-size tables and a
+// deduplicated string pool, so a reader maps the file (or points at a copy
+// compiled into the binary) and resolves vendor, device, subsystem and
+// class names by binary search, without parsing text or allocating per
+// lookup. User mode only.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "crinternal.h"
+
+#if !defined(_KERNEL_MODE)
+
+#include <stdlib.h>
+
+struct _CR_NAMEDB {
+    CR_MAPPED_FILE Map;                  // Unused for CrNameDbOpenMemory
+    const CR_NAMEDB_HEADER* Header;
+    const CR_NAMEDB_VENDOR* Vendors;
+    const CR_NAMEDB_DEVICE* Devices;
+    const CR_NAMEDB_SUBSYSTEM* Subsystems;
+    const CR_NAMEDB_CLASS* Classes;
+    const char* Strings;
+};
+
+//
+// Builder
+//
+
+// One parsed line. Keys sort entries the way the tables want them:
+// vendor, vendor:device, vendor:device:subvendor:subdevice, class key.
+typedef struct _CR_NAME_ITEM {
+    uint64_t Key;
+    uint32_t Name;           // Pool offset
+    uint32_t Line;           // Tie break, so the first duplicate wins
+} CR_NAME_ITEM;
+
+enum {
+    CrNameVendor,
+    CrNameDevice,
+    CrNameSubsystem,
+    CrNameClass,
+    CrNameKinds
+};
+
+typedef struct _CR_NAME_BUILD {
+    CR_NAME_ITEM* Items[CrNameKinds];
+    uint32_t Counts[CrNameKinds];
+    uint32_t Capacity[CrNameKinds];
+    char* Pool;
+    uint32_t PoolSize;
+    uint32_t PoolCapacity;
+    uint32_t* Table;         // Open addressing over pool offsets + 1, 0 = empty
+    uint32_t TableMask;
+} CR_NAME_BUILD;
+
+// One line of pci.ids, already split into its indentation, ID text and name.
+typedef struct _CR_NAME_LINE {
+    uint32_t Depth;          // Leading tabs
+    const char* Text;        // After the tabs
+    const char* End;         // Trailing whitespace removed
+} CR_NAME_LINE;
+
+static int
+CrHexDigit(
+    _In_ char Character
+)
+{
+    if (Character >= '0' && Character <= '9') return Character - '0';
+    if (Character >= 'a' && Character <= 'f') return Character - 'a' + 10;
+    if (Character >= 'A' && Character <= 'F') return Character - 'A' + 10;
+    return -1;
+}
+
+// Parses exactly Digits hex digits followed by a space or tab, and advances
+// *Text past them.
+static int
+CrParseHexField(
+    _Inout_ const char** Text,
+    _In_ const char* End,
+    _In_ uint32_t Digits,
+    _Out_ uint32_t* Value
+)
+{
+    const char* text = *Text;
+    uint32_t i;
+
+    *Value = 0;
+    if ((size_t)(End - text) <= Digits) {
+        return 0;
+    }
+    for (i = 0; i < Digits; i++) {
+        int digit = CrHexDigit(text[i]);
+        if (digit < 0) {
+            return 0;
+        }
+        *Value = (*Value << 4) | (uint32_t)digit;
+    }
+    if (text[Digits] != ' ' && text[Digits] != '\t') {
+        return 0;
+    }
+    *Text = text + Digits;
+    return 1;
+}
+
+// Splits the next line off [*Cursor, End). Returns 0 at the end of the data.
+static int
+CrNextLine(
+    _Inout_ const char** Cursor,
+    _In_ const char* End,
+    _Out_ CR_NAME_LINE* Line
+)
+{
+    const char* start = *Cursor;
+    const char* stop;
+
+    if (start >= End) {
+        return 0;
+    }
+    stop = (const char*)memchr(start, '\n', (size_t)(End - start));
+    *Cursor = (stop != NULL) ? stop + 1 : End;
+    if (stop == NULL) {
+        stop = End;
+    }
+    while (stop > start && (stop[-1] == '\r' || stop[-1] == ' ' || stop[-1] == '\t')) {
+        stop--;
+    }
+    Line->Depth = 0;
+    while (start < stop && *start == '\t') {
+        Line->Depth++;
+        start++;
+    }
+    Line->Text = start;
+    Line->End = stop;
+    return 1;
+}
+
+// Adds Name to the pool, or finds the copy already there.
+static uint32_t
+CrPoolIntern(
+    _Inout_ CR_NAME_BUILD* Build,
+    _In_reads_(Length) const char* Name,
+    _In_ uint32_t Length
+)
+{
+    uint64_t hash = CR_FNV_OFFSET_BASIS;
+    uint32_t slot;
+    uint32_t i;
+
+    for (i = 0; i < Length; i++) {
+        hash = (hash ^ (uint8_t)Name[i]) * CR_FNV_PRIME;
+    }
+    for (slot = (uint32_t)hash & Build->TableMask; Build->Table[slot] != 0; slot = (slot + 1) & Build->TableMask) {
+        const char* existing = Build->Pool + Build->Table[slot] - 1;
+        if (memcmp(existing, Name, Length) == 0 && existing[Length] == '\0') {
+            return Build->Table[slot] - 1;
+        }
+    }
+    Build->Table[slot] = Build->PoolSize + 1;
+    memcpy(Build->Pool + Build->PoolSize, Name, Length);
+    Build->Pool[Build->PoolSize + Length] = '\0';
+    Build->PoolSize += Length + 1;
+    return Build->Table[slot] - 1;
+}
+
+// Walks the file once. Without a Build it only counts entries and name bytes,
+// to size the arrays for the second walk.
+static void
+CrParsePciIds(
+    _In_reads_(Length) const char* Data,
+    _In_ size_t Length,
+    _Inout_opt_ CR_NAME_BUILD* Build,
+    _Out_writes_(CrNameKinds) uint32_t* Counts,
+    _Out_ size_t* NameBytes
+)
+{
+    const char* cursor = Data;
+    const char* end = Data + Length;
+    CR_NAME_LINE line;
+    uint32_t lineNumber = 0;
+    uint64_t parent[3] = { 0, 0, 0 };   // Key of the innermost entry at each depth
+    int parentValid[3] = { 0, 0, 0 };
+    int classes = 0;                    // Inside a "C xx" section
+
+    memset(Counts, 0, CrNameKinds * sizeof(*Counts));
+    *NameBytes = 0;
+
+    while (CrNextLine(&cursor, end, &line)) {
+        const char* text = line.Text;
+        uint32_t value = 0;
+        uint32_t second = 0;
+        uint64_t key = 0;
+        uint32_t kind;
+        int ok = 0;
+
+        lineNumber++;
+        if (text == line.End || *text == '#' || line.Depth > 2) {
+            continue;
+        }
+
+        if (line.Depth == 0) {
+            classes = (line.End - text > 2 && text[0] == 'C' && text[1] == ' ');
+            if (classes) {
+                text += 2;
+                ok = CrParseHexField(&text, line.End, 2, &value);
+                key = CR_NAMEDB_CLASS_KEY(CR_NAMEDB_CLASS_BASE, value << 16);
+                kind = CrNameClass;
+            }
+            else {
+                ok = CrParseHexField(&text, line.End, 4, &value);
+                key = value;
+                kind = CrNameVendor;
+            }
+            parentValid[1] = 0;
+        }
+        else if (!parentValid[line.Depth - 1]) {
+            continue;
+        }
+        else if (classes) {
+            ok = CrParseHexField(&text, line.End, 2, &value);
+            if (line.Depth == 1) {
+                key = CR_NAMEDB_CLASS_KEY(CR_NAMEDB_CLASS_SUB, (parent[0] & 0xFF0000) | (value << 8));
+            }
+            else {
+                key = CR_NAMEDB_CLASS_KEY(CR_NAMEDB_CLASS_PROGIF, (parent[1] & 0xFFFF00) | value);
+            }
+            kind = CrNameClass;
+        }
+        else if (line.Depth == 1) {
+            ok = CrParseHexField(&text, line.End, 4, &value);
+            key = (parent[0] << 16) | value;
+            kind = CrNameDevice;
+        }
+        else {
+            ok = CrParseHexField(&text, line.End, 4, &value);
+            if (ok) {
+                text++;
+                ok = CrParseHexField(&text, line.End, 4, &second);
+            }
+            key = (parent[1] << 32) | ((uint64_t)value << 16) | second;
+            kind = CrNameSubsystem;
+        }
+
+        while (ok && text < line.End && (*text == ' ' || *text == '\t')) {
+            text++;
+        }
+        if (!ok || text == line.End || line.End - text > 0xFFFF) {
+            parentValid[line.Depth] = 0;
+            continue;
+        }
+        parent[line.Depth] = key;
+        parentValid[line.Depth] = 1;
+        if (line.Depth < 2) {
+            parentValid[line.Depth + 1] = 0;
+        }
+
+        if (Build != NULL) {
+            CR_NAME_ITEM* item;
+            // The counting pass sized everything; a file that grew since
+            // only loses its new entries.
+            if (Build->Counts[kind] == Build->Capacity[kind] ||
+                Build->PoolCapacity - Build->PoolSize <= (uint32_t)(line.End - text)) {
+                continue;
+            }
+            item = &Build->Items[kind][Build->Counts[kind]++];
+            item->Key = key;
+            item->Name = CrPoolIntern(Build, text, (uint32_t)(line.End - text));
+            item->Line = lineNumber;
+        }
+        Counts[kind]++;
+        *NameBytes += (size_t)(line.End - text) + 1;
+    }
+}
+
+static int
+CrNameItemCompare(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    const CR_NAME_ITEM* left = (const CR_NAME_ITEM*)Left;
+    const CR_NAME_ITEM* right = (const CR_NAME_ITEM*)Right;
+
+    if (left->Key != right->Key) {
+        return (left->Key > right->Key) ? 1 : -1;
+    }
+    return (left->Line > right->Line) - (left->Line < right->Line);
+}
+
+// Sorts one kind of item and drops every duplicate key after the first.
+static uint32_t
+CrSortUnique(
+    _Inout_updates_(Count) CR_NAME_ITEM* Items,
+    _In_ uint32_t Count
+)
+{
+    uint32_t kept = 0;
+    uint32_t i;
+
+    qsort(Items, Count, sizeof(*Items), CrNameItemCompare);
+    for (i = 0; i < Count; i++) {
+        if (kept == 0 || Items[kept - 1].Key != Items[i].Key) {
+            Items[kept++] = Items[i];
+        }
+    }
+    return kept;
+}
+
+// Lays the sorted items and the pool out as a database image.
+static void
+CrNameDbLayout(
+    _In_ const CR_NAME_BUILD* Build,
+    _Out_writes_bytes_(Header->FileSize) uint8_t* Image,
+    _In_ const CR_NAMEDB_HEADER* Header
+)
+{
+    CR_NAMEDB_VENDOR* vendors = (CR_NAMEDB_VENDOR*)(Image + Header->VendorOffset);
+    CR_NAMEDB_DEVICE* devices = (CR_NAMEDB_DEVICE*)(Image + Header->DeviceOffset);
+    CR_NAMEDB_SUBSYSTEM* subsystems = (CR_NAMEDB_SUBSYSTEM*)(Image + Header->SubsystemOffset);
+    CR_NAMEDB_CLASS* classes = (CR_NAMEDB_CLASS*)(Image + Header->ClassOffset);
+    const CR_NAME_ITEM* items;
+    uint32_t child = 0;
+    uint32_t i;
+
+    memset(Image, 0, Header->FileSize);
+    memcpy(Image, Header, sizeof(*Header));
+
+    // Children are sorted by their parent's key first, so each parent's run
+    // is found with one forward walk.
+    items = Build->Items[CrNameVendor];
+    for (i = 0; i < Header->VendorCount; i++) {
+        const CR_NAME_ITEM* devicesIn = Build->Items[CrNameDevice];
+        vendors[i].VendorId = (uint16_t)items[i].Key;
+        vendors[i].Name = items[i].Name;
+        while (child < Header->DeviceCount && (devicesIn[child].Key >> 16) < items[i].Key) {
+            child++;
+        }
+        vendors[i].FirstDevice = child;
+        while (child < Header->DeviceCount && (devicesIn[child].Key >> 16) == items[i].Key) {
+            child++;
+        }
+        vendors[i].DeviceCount = child - vendors[i].FirstDevice;
+    }
+
+    child = 0;
+    items = Build->Items[CrNameDevice];
+    for (i = 0; i < Header->DeviceCount; i++) {
+        const CR_NAME_ITEM* subsystemsIn = Build->Items[CrNameSubsystem];
+        devices[i].DeviceId = (uint16_t)items[i].Key;
+        devices[i].Name = items[i].Name;
+        while (child < Header->SubsystemCount && (subsystemsIn[child].Key >> 32) < items[i].Key) {
+            child++;
+        }
+        devices[i].FirstSubsystem = child;
+        while (child < Header->SubsystemCount && (subsystemsIn[child].Key >> 32) == items[i].Key) {
+            child++;
+        }
+        devices[i].SubsystemCount = child - devices[i].FirstSubsystem;
+    }
+
+    items = Build->Items[CrNameSubsystem];
+    for (i = 0; i < Header->SubsystemCount; i++) {
+        subsystems[i].Key = (uint32_t)items[i].Key;
+        subsystems[i].Name = items[i].Name;
+    }
+    items = Build->Items[CrNameClass];
+    for (i = 0; i < Header->ClassCount; i++) {
+        classes[i].Key = (uint32_t)items[i].Key;
+        classes[i].Name = items[i].Name;
+    }
+    memcpy(Image + Header->StringOffset, Build->Pool, Build->PoolSize);
+}
+
+CR_STATUS
+CrNameDbBuild(
+    _In_ const char* PciIdsPath,
+    _In_ const char* Path
+)
+{
+    CR_MAPPED_FILE source;
+    CR_NAME_BUILD build;
+    CR_NAMEDB_HEADER header;
+    uint32_t counts[CrNameKinds];
+    uint32_t total = 0;
+    uint64_t fileSize;
+    size_t nameBytes;
+    uint8_t* image = NULL;
+    uint32_t kind;
+    CR_STATUS status;
+
+    if (PciIdsPath == NULL || Path == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrMapFile(PciIdsPath, 0, &source);
+    if (status != CR_OK) {
+        return status;
+    }
+
+    memset(&build, 0, sizeof(build));
+    CrParsePciIds((const char*)source.View, source.Length, NULL, counts, &nameBytes);
+    for (kind = 0; kind < CrNameKinds; kind++) {
+        total += counts[kind];
+    }
+    if (nameBytes >= UINT32_MAX / 2 || total >= UINT32_MAX / 4) {
+        status = CR_E_UNSUPPORTED;
+        goto Exit;
+    }
+
+    // At most half full, so probe sequences stay short.
+    for (build.TableMask = 1; build.TableMask < total * 2; build.TableMask <<= 1) {
+    }
+    status = CR_E_NO_MEMORY;
+    for (kind = 0; kind < CrNameKinds; kind++) {
+        build.Items[kind] = (CR_NAME_ITEM*)CrAlloc(((size_t)counts[kind] + 1) * sizeof(CR_NAME_ITEM));
+        build.Capacity[kind] = counts[kind];
+        if (build.Items[kind] == NULL) {
+            goto Exit;
+        }
+    }
+    build.Pool = (char*)CrAlloc(nameBytes + 1);
+    build.Table = (uint32_t*)CrAlloc((size_t)build.TableMask * sizeof(uint32_t));
+    if (build.Pool == NULL || build.Table == NULL) {
+        goto Exit;
+    }
+    memset(build.Table, 0, (size_t)build.TableMask * sizeof(uint32_t));
+    build.TableMask--;
+    build.Pool[0] = '\0';
+    build.PoolSize = 1;
+    build.PoolCapacity = (uint32_t)nameBytes + 1;
+
+    CrParsePciIds((const char*)source.View, source.Length, &build, counts, &nameBytes);
+    for (kind = 0; kind < CrNameKinds; kind++) {
+        build.Counts[kind] = CrSortUnique(build.Items[kind], build.Counts[kind]);
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.Magic = CR_NAMEDB_MAGIC;
+    header.Version = CR_NAMEDB_VERSION;
+    header.HeaderSize = sizeof(header);
+    header.VendorOffset = sizeof(header);
+    header.VendorCount = build.Counts[CrNameVendor];
+    header.DeviceOffset = header.VendorOffset + header.VendorCount * (uint32_t)sizeof(CR_NAMEDB_VENDOR);
+    header.DeviceCount = build.Counts[CrNameDevice];
+    header.SubsystemOffset = header.DeviceOffset + header.DeviceCount * (uint32_t)sizeof(CR_NAMEDB_DEVICE);
+    header.SubsystemCount = build.Counts[CrNameSubsystem];
+    header.ClassOffset = header.SubsystemOffset + header.SubsystemCount * (uint32_t)sizeof(CR_NAMEDB_SUBSYSTEM);
+    header.ClassCount = build.Counts[CrNameClass];
+    header.StringOffset = header.ClassOffset + header.ClassCount * (uint32_t)sizeof(CR_NAMEDB_CLASS);
+    header.StringSize = build.PoolSize;
+    fileSize = ((uint64_t)header.StringOffset + header.StringSize + 3) & ~(uint64_t)3;
+    if (fileSize > UINT32_MAX) {
+        status = CR_E_UNSUPPORTED;
+        goto Exit;
+    }
+    header.FileSize = (uint32_t)fileSize;
+
+    image = (uint8_t*)CrAlloc(header.FileSize);
+    if (image == NULL) {
+        goto Exit;
+    }
+    CrNameDbLayout(&build, image, &header);
+    status = CrWriteFile(Path, image, header.FileSize);
+
+Exit:
+    for (kind = 0; kind < CrNameKinds; kind++) {
+        if (build.Items[kind] != NULL) CrFree(build.Items[kind]);
+    }
+    if (build.Pool != NULL) CrFree(build.Pool);
+    if (build.Table != NULL) CrFree(build.Table);
+    if (image != NULL) CrFree(image);
+    CrUnmapFile(&source);
+    return status;
+}
+
+//
+// Reader
+//
+
+// Checks one table of Count entries of Size bytes at Offset.
+CR_INLINE int CrTableFits(_In_ const CR_NAMEDB_HEADER* Header, _In_ uint32_t Offset, _In_ uint32_t Count, _In_ uint32_t Size)
+{
+    return (Offset & 3) == 0 && Offset >= sizeof(*Header) && Offset <= Header->FileSize &&
+        (Header->FileSize - Offset) / Size >= Count;
+}
+
+// Everything a lookup relies on is checked here, except the child ranges
+// and name offsets, which the lookups check as they follow them.
+static CR_STATUS
+CrNameDbAttach(
+    _In_reads_bytes_(Length) const uint8_t* Data,
+    _In_ size_t Length,
+    _Inout_ PCR_NAMEDB Db
+)
+{
+    const CR_NAMEDB_HEADER* header = (const CR_NAMEDB_HEADER*)Data;
+
+    if (Length < sizeof(*header) || ((uintptr_t)Data & 3) != 0 || header->Magic != CR_NAMEDB_MAGIC) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (header->Version != CR_NAMEDB_VERSION || header->HeaderSize != sizeof(*header)) {
+        return CR_E_UNSUPPORTED;
+    }
+    if (header->FileSize > Length ||
+        !CrTableFits(header, header->VendorOffset, header->VendorCount, sizeof(CR_NAMEDB_VENDOR)) ||
+        !CrTableFits(header, header->DeviceOffset, header->DeviceCount, sizeof(CR_NAMEDB_DEVICE)) ||
+        !CrTableFits(header, header->SubsystemOffset, header->SubsystemCount, sizeof(CR_NAMEDB_SUBSYSTEM)) ||
+        !CrTableFits(header, header->ClassOffset, header->ClassCount, sizeof(CR_NAMEDB_CLASS)) ||
+        !CrTableFits(header, header->StringOffset, header->StringSize, 1) ||
+        header->StringSize == 0 || Data[header->StringOffset + header->StringSize - 1] != '\0') {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    Db->Header = header;
+    Db->Vendors = (const CR_NAMEDB_VENDOR*)(Data + header->VendorOffset);
+    Db->Devices = (const CR_NAMEDB_DEVICE*)(Data + header->DeviceOffset);
+    Db->Subsystems = (const CR_NAMEDB_SUBSYSTEM*)(Data + header->SubsystemOffset);
+    Db->Classes = (const CR_NAMEDB_CLASS*)(Data + header->ClassOffset);
+    Db->Strings = (const char*)(Data + header->StringOffset);
+    return CR_OK;
+}
+
+CR_STATUS
+CrNameDbOpen(
+    _In_ const char* Path,
+    _Out_ PCR_NAMEDB* Db
+)
+{
+    PCR_NAMEDB db;
+    CR_STATUS status;
+
+    *Db = NULL;
+    db = (PCR_NAMEDB)CrAlloc(sizeof(*db));
+    if (db == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    memset(db, 0, sizeof(*db));
+    status = CrMapFile(Path, sizeof(CR_NAMEDB_HEADER), &db->Map);
+    if (status == CR_OK) {
+        status = CrNameDbAttach(db->Map.View, db->Map.Length, db);
+        if (status != CR_OK) {
+            CrUnmapFile(&db->Map);
+        }
+    }
+    if (status != CR_OK) {
+        CrFree(db);
+        return status;
+    }
+    *Db = db;
+    return CR_OK;
+}
+
+CR_STATUS
+CrNameDbOpenMemory(
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length,
+    _Out_ PCR_NAMEDB* Db
+)
+{
+    PCR_NAMEDB db;
+    CR_STATUS status;
+
+    *Db = NULL;
+    if (Data == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    db = (PCR_NAMEDB)CrAlloc(sizeof(*db));
+    if (db == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    memset(db, 0, sizeof(*db));
+    status = CrNameDbAttach((const uint8_t*)Data, Length, db);
+    if (status != CR_OK) {
+        CrFree(db);
+        return status;
+    }
+    *Db = db;
+    return CR_OK;
+}
+
+const CR_NAMEDB_HEADER*
+CrNameDbHeader(
+    _In_ const CR_NAMEDB* Db
+)
+{
+    return Db->Header;
+}
+
+CR_INLINE const char* CrNameDbString(_In_ const CR_NAMEDB* Db, _In_ uint32_t Name)
+{
+    return (Name != 0 && Name < Db->Header->StringSize) ? Db->Strings + Name : NULL;
+}
+
+// Index of Id in a table of Count records, Stride bytes apart, that start
+// with a sorted 16-bit ID (vendors, devices). Count if it is missing.
+static uint32_t
+CrNameDbFindId(
+    _In_ const void* Table,
+    _In_ uint32_t Stride,
+    _In_ uint32_t Count,
+    _In_ uint16_t Id
+)
+{
+    const uint8_t* table = (const uint8_t*)Table;
+    uint32_t low = 0;
+    uint32_t high = Count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (*(const uint16_t*)(table + (size_t)mid * Stride) < Id) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return (low < Count && *(const uint16_t*)(table + (size_t)low * Stride) == Id) ? low : Count;
+}
+
+// The same over records that start with a 32-bit key (subsystems, classes).
+static uint32_t
+CrNameDbFindKey(
+    _In_ const void* Table,
+    _In_ uint32_t Stride,
+    _In_ uint32_t Count,
+    _In_ uint32_t Key
+)
+{
+    const uint8_t* table = (const uint8_t*)Table;
+    uint32_t low = 0;
+    uint32_t high = Count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (*(const uint32_t*)(table + (size_t)mid * Stride) < Key) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return (low < Count && *(const uint32_t*)(table + (size_t)low * Stride) == Key) ? low : Count;
+}
+
+static const CR_NAMEDB_VENDOR*
+CrNameDbFindVendor(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint16_t VendorId
+)
+{
+    uint32_t index = CrNameDbFindId(Db->Vendors, sizeof(CR_NAMEDB_VENDOR), Db->Header->VendorCount, VendorId);
+
+    return (index < Db->Header->VendorCount) ? &Db->Vendors[index] : NULL;
+}
+
+static const CR_NAMEDB_DEVICE*
+CrNameDbFindDevice(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId
+)
+{
+    const CR_NAMEDB_VENDOR* vendor = CrNameDbFindVendor(Db, VendorId);
+    const CR_NAMEDB_DEVICE* devices;
+    uint32_t index;
+
+    if (vendor == NULL || vendor->FirstDevice > Db->Header->DeviceCount ||
+        vendor->DeviceCount > Db->Header->DeviceCount - vendor->FirstDevice) {
+        return NULL;
+    }
+    devices = Db->Devices + vendor->FirstDevice;
+    index = CrNameDbFindId(devices, sizeof(CR_NAMEDB_DEVICE), vendor->DeviceCount, DeviceId);
+    return (index < vendor->DeviceCount) ? &devices[index] : NULL;
+}
+
+const char*
+CrNameDbVendor(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint16_t VendorId
+)
+{
+    const CR_NAMEDB_VENDOR* vendor = CrNameDbFindVendor(Db, VendorId);
+
+    return (vendor != NULL) ? CrNameDbString(Db, vendor->Name) : NULL;
+}
+
+const char*
+CrNameDbDevice(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId
+)
+{
+    const CR_NAMEDB_DEVICE* device = CrNameDbFindDevice(Db, VendorId, DeviceId);
+
+    return (device != NULL) ? CrNameDbString(Db, device->Name) : NULL;
+}
+
+const char*
+CrNameDbSubsystem(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint16_t SubVendorId,
+    _In_ uint16_t SubDeviceId
+)
+{
+    const CR_NAMEDB_DEVICE* device = CrNameDbFindDevice(Db, VendorId, DeviceId);
+    const CR_NAMEDB_SUBSYSTEM* subsystems;
+    uint32_t index;
+
+    if (device == NULL || device->FirstSubsystem > Db->Header->SubsystemCount ||
+        device->SubsystemCount > Db->Header->SubsystemCount - device->FirstSubsystem) {
+        return NULL;
+    }
+    subsystems = Db->Subsystems + device->FirstSubsystem;
+    index = CrNameDbFindKey(subsystems, sizeof(CR_NAMEDB_SUBSYSTEM), device->SubsystemCount,
+        ((uint32_t)SubVendorId << 16) | SubDeviceId);
+    return (index < device->SubsystemCount) ? CrNameDbString(Db, subsystems[index].Name) : NULL;
+}
+
+const char*
+CrNameDbClass(
+    _In_ const CR_NAMEDB* Db,
+    _In_ uint32_t ClassCode,
+    _In_ uint32_t Depth
+)
+{
+    uint32_t index;
+
+    switch (Depth) {
+    case CR_NAMEDB_CLASS_BASE:   ClassCode &= 0xFF0000; break;
+    case CR_NAMEDB_CLASS_SUB:    ClassCode &= 0xFFFF00; break;
+    case CR_NAMEDB_CLASS_PROGIF: ClassCode &= 0xFFFFFF; break;
+    default:                     return NULL;
+    }
+    index = CrNameDbFindKey(Db->Classes, sizeof(CR_NAMEDB_CLASS), Db->Header->ClassCount,
+        CR_NAMEDB_CLASS_KEY(Depth, ClassCode));
+    return (index < Db->Header->ClassCount) ? CrNameDbString(Db, Db->Classes[index].Name) : NULL;
+}
+
+void
+CrNameDbClose(
+    _In_ PCR_NAMEDB Db
+)
+{
+    if (Db == NULL) {
+        return;
+    }
+    CrUnmapFile(&Db->Map);
+    CrFree(Db);
+}
+
+#endif // !_KERNEL_MODE
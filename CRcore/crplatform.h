@@ -0,0 +1,184 @@
+// crplatform.h
+//
+// The small amount of glue the portable core needs from its host. The same
+// sources build into CRdriver (kernel mode, C), CRconsole (Windows user mode)
+// and plain gcc/clang on Linux build hosts, so nothing in CRcore includes
+// platform headers directly.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_KERNEL_MODE)
+#include <ntddk.h>
+#define CR_POOL_TAG 'eroC'
+#define CrAlloc(Size) ExAllocatePool2(POOL_FLAG_NON_PAGED, (Size), CR_POOL_TAG)
+#define CrFree(Pointer) ExFreePoolWithTag((Pointer), CR_POOL_TAG)
+#else
+#include <stdlib.h>
+// Zeroed, to match ExAllocatePool2.
+#define CrAlloc(Size) calloc(1, (Size))
+#define CrFree(Pointer) free(Pointer)
+#endif
+
+// SAL annotations are only understood by MSVC; keep them as documentation elsewhere.
+#if !defined(_MSC_VER) && !defined(_In_)
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_z_
+#define _In_reads_(Count)
+#define _In_reads_opt_(Count)
+#define _In_reads_bytes_(Size)
+#define _In_reads_bytes_opt_(Size)
+#define _Out_writes_(Count)
+#define _Out_writes_bytes_(Size)
+#define _Out_writes_bytes_opt_(Size)
+#define _Out_writes_bytes_to_(Size, Count)
+#define _Out_writes_bytes_to_opt_(Size, Count)
+#define _Inout_updates_(Count)
+#endif
+
+#if defined(_MSC_VER)
+#define CR_INLINE static __inline
+#else
+#define CR_INLINE static inline
+#endif
+
+//
+// Atomics and a minimal spin lock. Counters are 32-bit and naturally aligned;
+// the MSVC intrinsics operate on long, which is 32 bits on every Windows ABI.
+// The 64-bit pair is for statistics counters, which must not tear on x86.
+//
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CrAtomicIncrement32(Target) ((uint32_t)_InterlockedIncrement((volatile long*)(Target)))
+#define CrAtomicDecrement32(Target) ((uint32_t)_InterlockedDecrement((volatile long*)(Target)))
+#define CrAtomicFetchAdd32(Target, Value) ((uint32_t)_InterlockedExchangeAdd((volatile long*)(Target), (long)(Value)))
+#define CrAtomicExchange32(Target, Value) ((uint32_t)_InterlockedExchange((volatile long*)(Target), (long)(Value)))
+#define CrAtomicCompareExchange32(Target, Exchange, Comparand) \
+    ((uint32_t)_InterlockedCompareExchange((volatile long*)(Target), (long)(Exchange), (long)(Comparand)))
+#define CrAtomicLoad32(Target) ((uint32_t)_InterlockedOr((volatile long*)(Target), 0))
+#define CrAtomicStore32(Target, Value) ((void)_InterlockedExchange((volatile long*)(Target), (long)(Value)))
+#define CrAtomicAdd64(Target, Value) ((void)_InterlockedExchangeAdd64((volatile __int64*)(Target), (__int64)(Value)))
+#define CrAtomicLoad64(Target) ((uint64_t)_InterlockedCompareExchange64((volatile __int64*)(Target), 0, 0))
+#if defined(_M_IX86) || defined(_M_X64)
+#define CrCpuRelax() _mm_pause()
+#else
+#define CrCpuRelax() __yield()
+#endif
+#else
+#define CrAtomicIncrement32(Target) __atomic_add_fetch((Target), 1u, __ATOMIC_SEQ_CST)
+#define CrAtomicDecrement32(Target) __atomic_sub_fetch((Target), 1u, __ATOMIC_SEQ_CST)
+#define CrAtomicFetchAdd32(Target, Value) __atomic_fetch_add((Target), (uint32_t)(Value), __ATOMIC_SEQ_CST)
+#define CrAtomicExchange32(Target, Value) __atomic_exchange_n((Target), (uint32_t)(Value), __ATOMIC_SEQ_CST)
+#define CrAtomicLoad32(Target) __atomic_load_n((Target), __ATOMIC_ACQUIRE)
+#define CrAtomicStore32(Target, Value) __atomic_store_n((Target), (uint32_t)(Value), __ATOMIC_RELEASE)
+#define CrAtomicAdd64(Target, Value) ((void)__atomic_fetch_add((Target), (uint64_t)(Value), __ATOMIC_RELAXED))
+#define CrAtomicLoad64(Target) __atomic_load_n((Target), __ATOMIC_RELAXED)
+CR_INLINE uint32_t CrAtomicCompareExchange32(volatile uint32_t* Target, uint32_t Exchange, uint32_t Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+#if defined(__x86_64__) || defined(__i386__)
+#define CrCpuRelax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CrCpuRelax() __asm__ __volatile__("yield")
+#else
+#define CrCpuRelax() ((void)0)
+#endif
+#endif
+
+// Counting semaphore for workers that have nothing to do until another
+// worker produces more. CrSemaphoreInit returns nonzero on success; a
+// semaphore is only deleted once nobody can be waiting on it.
+#if defined(_KERNEL_MODE)
+typedef KSEMAPHORE CR_SEMAPHORE;
+
+CR_INLINE int CrSemaphoreInit(CR_SEMAPHORE* Semaphore)
+{
+    KeInitializeSemaphore(Semaphore, 0, MAXLONG);
+    return 1;
+}
+
+CR_INLINE void CrSemaphoreDelete(CR_SEMAPHORE* Semaphore)
+{
+    UNREFERENCED_PARAMETER(Semaphore);
+}
+
+// Callers run at PASSIVE_LEVEL on system threads, so the wait is a real
+// block; the semaphore may live on the waiter's stack because the wait is
+// KernelMode and the stack stays resident.
+CR_INLINE void CrSemaphoreRelease(CR_SEMAPHORE* Semaphore, uint32_t Count)
+{
+    KeReleaseSemaphore(Semaphore, IO_NO_INCREMENT, (LONG)Count, FALSE);
+}
+
+CR_INLINE void CrSemaphoreWait(CR_SEMAPHORE* Semaphore)
+{
+    KeWaitForSingleObject(Semaphore, Executive, KernelMode, FALSE, NULL);
+}
+#else
+typedef struct _CR_SEMAPHORE_OBJECT* CR_SEMAPHORE;
+
+int CrSemaphoreInit(CR_SEMAPHORE* Semaphore);
+void CrSemaphoreDelete(CR_SEMAPHORE* Semaphore);
+void CrSemaphoreRelease(CR_SEMAPHORE* Semaphore, uint32_t Count);
+void CrSemaphoreWait(CR_SEMAPHORE* Semaphore);
+
+// Gives up the CPU while polling for another thread.
+void CrYield(void);
+#endif
+
+// Guards a few instructions at a time. An all-zero lock is unlocked, so locks
+// inside zero-initialized structures need no setup. Each acquisition keeps
+// its state in a handle on the acquirer's stack, which the release takes.
+// Never wait on anything, semaphores included, with one held.
+#if defined(_KERNEL_MODE)
+// A queued spin lock: contenders spin on their own handle instead of the lock,
+// and the holder runs at DISPATCH_LEVEL so it is never preempted while others
+// spin. Everything done under the lock must be safe at DISPATCH_LEVEL and
+// touch nonpaged memory only.
+typedef KSPIN_LOCK CR_SPIN_LOCK;
+typedef KLOCK_QUEUE_HANDLE CR_SPIN_LOCK_HANDLE;
+
+CR_INLINE void CrSpinLockAcquire(CR_SPIN_LOCK* Lock, CR_SPIN_LOCK_HANDLE* Handle)
+{
+    KeAcquireInStackQueuedSpinLock(Lock, Handle);
+}
+
+CR_INLINE void CrSpinLockRelease(CR_SPIN_LOCK_HANDLE* Handle)
+{
+    KeReleaseInStackQueuedSpinLock(Handle);
+}
+#else
+// User mode and host builds spin on a word. A holder can be preempted, in
+// which case contenders spin until it runs again.
+typedef volatile uint32_t CR_SPIN_LOCK;
+
+typedef struct _CR_SPIN_LOCK_HANDLE {
+    CR_SPIN_LOCK* Lock;
+} CR_SPIN_LOCK_HANDLE;
+
+CR_INLINE void CrSpinLockAcquire(CR_SPIN_LOCK* Lock, CR_SPIN_LOCK_HANDLE* Handle)
+{
+    while (CrAtomicCompareExchange32(Lock, 1, 0) != 0) {
+        while (*Lock != 0) {
+            CrCpuRelax();
+        }
+    }
+    Handle->Lock = Lock;
+}
+
+CR_INLINE void CrSpinLockRelease(CR_SPIN_LOCK_HANDLE* Handle)
+{
+    CrAtomicExchange32(Handle->Lock, 0);
+}
+#endif
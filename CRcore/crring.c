@@ -0,0 +1,56 @@
+// crring.c
+//
+// Layout and consumer side of the sampling ring. Kept apart from the sampler
+// so readers (CRconsole, tests) can link it without the scan core.
+
+#include "crcore.h"
+
+size_t
+CrRingSize(
+    _In_ uint32_t RegisterCount,
+    _In_ uint32_t Capacity
+)
+{
+    size_t sampleSize;
+    size_t size;
+
+    if (RegisterCount == 0 || RegisterCount > CR_MAX_SAMPLE_REGISTERS ||
+        Capacity < 2 || (Capacity & (Capacity - 1)) != 0) {
+        return 0;
+    }
+    sampleSize = (sizeof(CR_SAMPLE) + (size_t)RegisterCount * sizeof(uint32_t) + 7) & ~(size_t)7;
+    size = sizeof(CR_RING_HEADER) + (size_t)Capacity * sampleSize;
+    return (size <= CR_MAX_RING_BYTES) ? size : 0;
+}
+
+uint32_t
+CrRingConsume(
+    _Inout_ PCR_RING_HEADER Ring,
+    _Out_writes_bytes_(MaxSamples * Ring->SampleSize) void* Buffer,
+    _In_ uint32_t MaxSamples
+)
+{
+    const uint8_t* data = (const uint8_t*)Ring + Ring->DataOffset;
+    uint8_t* out = (uint8_t*)Buffer;
+    uint32_t mask = Ring->Capacity - 1;
+    uint32_t head = Ring->Head;
+    uint32_t tail = CrAtomicLoad32(&Ring->Tail);
+    uint32_t available = tail - head;
+    uint32_t i;
+
+    if (available > Ring->Capacity) {
+        available = Ring->Capacity;
+    }
+    if (available > MaxSamples) {
+        available = MaxSamples;
+    }
+    for (i = 0; i < available; i++) {
+        memcpy(out, data + (size_t)((head + i) & mask) * Ring->SampleSize, Ring->SampleSize);
+        out += Ring->SampleSize;
+    }
+    // Only now may the producer reuse the slots.
+    if (available != 0) {
+        CrAtomicStore32(&Ring->Head, head + available);
+    }
+    return available;
+}
@@ -0,0 +1,134 @@
+// crsample.c
+//
+// Periodic register sampler feeding the shared ring. The register list is
+// validated and sorted once at creation, so a tick is just the coalesced
+// reads plus a slot write.
+
+#include "crinternal.h"
+
+struct _CR_SAMPLER {
+    PCR_CONFIG_BACKEND Backend;
+    PCR_RING_HEADER Ring;
+    uint8_t* Data;
+    // The ring header is mapped writable into the consumer, so the geometry
+    // used to address Data is kept here and never read back from it.
+    uint32_t Capacity;
+    uint32_t Mask;           // Capacity - 1
+    uint32_t SampleSize;
+    size_t DataLength;       // Capacity * SampleSize
+    uint32_t Tail;           // Private copy; the shared Tail is only ever written
+    uint32_t Sequence;
+    uint32_t Dropped;
+    uint32_t RegisterCount;
+    uint32_t SlotCount;
+    uint32_t InvalidMask;    // Registers rejected at creation
+    CR_BATCH_SLOT Slots[CR_MAX_SAMPLE_REGISTERS];
+    CR_READ_RESULT Results[CR_MAX_SAMPLE_REGISTERS];
+};
+
+CR_STATUS
+CrSamplerCreate(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_reads_(RegisterCount) const CR_READ_ENTRY* Registers,
+    _In_ uint32_t RegisterCount,
+    _In_ uint32_t Capacity,
+    _In_ uint64_t TimestampFrequency,
+    _Out_writes_bytes_(RingSize) void* Ring,
+    _In_ size_t RingSize,
+    _Out_ PCR_SAMPLER* Sampler
+)
+{
+    PCR_SAMPLER sampler;
+    PCR_RING_HEADER ring = (PCR_RING_HEADER)Ring;
+    size_t needed = CrRingSize(RegisterCount, Capacity);
+    uint32_t failed;
+    uint32_t i;
+
+    *Sampler = NULL;
+    if (Backend == NULL || Registers == NULL || Ring == NULL || needed == 0 || RingSize < needed) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    sampler = (PCR_SAMPLER)CrAlloc(sizeof(*sampler));
+    if (sampler == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    sampler->Backend = Backend;
+    sampler->Ring = ring;
+    sampler->RegisterCount = RegisterCount;
+    sampler->SlotCount = CrBatchPrepare(Registers, RegisterCount, sampler->Slots, sampler->Results, &failed);
+    for (i = 0; i < RegisterCount; i++) {
+        if (sampler->Results[i].Status == CR_READ_INVALID) {
+            sampler->InvalidMask |= 1u << i;
+        }
+    }
+
+    sampler->Data = (uint8_t*)ring + sizeof(CR_RING_HEADER);
+    sampler->Capacity = Capacity;
+    sampler->Mask = Capacity - 1;
+    sampler->SampleSize = (uint32_t)((needed - sizeof(CR_RING_HEADER)) / Capacity);
+    sampler->DataLength = (size_t)Capacity * sampler->SampleSize;
+
+    memset(ring, 0, needed);
+    ring->Version = CR_PROTOCOL_VERSION;
+    ring->SampleSize = sampler->SampleSize;
+    ring->Capacity = Capacity;
+    ring->RegisterCount = RegisterCount;
+    ring->TimestampFrequency = TimestampFrequency;
+    ring->DataOffset = sizeof(CR_RING_HEADER);
+
+    *Sampler = sampler;
+    return CR_OK;
+}
+
+void
+CrSamplerTick(
+    _Inout_ PCR_SAMPLER Sampler,
+    _In_ uint64_t Timestamp
+)
+{
+    PCR_RING_HEADER ring = Sampler->Ring;
+    uint32_t tail = Sampler->Tail;
+    uint32_t head = CrAtomicLoad32(&ring->Head);
+    size_t offset = (size_t)(tail & Sampler->Mask) * Sampler->SampleSize;
+    uint32_t* values;
+    CR_SAMPLE* sample;
+    uint32_t failedMask = Sampler->InvalidMask;
+    uint32_t i;
+
+    // Head is the only field read back from the shared header; everything
+    // else the consumer can scribble on is ignored. A Head that does not make
+    // sense looks like a full ring, which only hurts that consumer.
+    if (tail - head >= Sampler->Capacity || offset + Sampler->SampleSize > Sampler->DataLength) {
+        Sampler->Sequence++;
+        CrAtomicStore32(&ring->Dropped, ++Sampler->Dropped);
+        return;
+    }
+
+    CrBatchExecute(Sampler->Backend, Sampler->Slots, Sampler->SlotCount, Sampler->Results);
+
+    sample = (CR_SAMPLE*)(Sampler->Data + offset);
+    values = (uint32_t*)(sample + 1);
+    for (i = 0; i < Sampler->RegisterCount; i++) {
+        values[i] = Sampler->Results[i].Value;
+        if (Sampler->Results[i].Status != CR_READ_OK) {
+            failedMask |= 1u << i;
+        }
+    }
+    sample->Timestamp = Timestamp;
+    sample->Sequence = Sampler->Sequence++;
+    sample->FailedMask = failedMask;
+
+    // Publishing Tail makes the slot contents visible to the consumer.
+    Sampler->Tail = tail + 1;
+    CrAtomicStore32(&ring->Tail, Sampler->Tail);
+}
+
+void
+CrSamplerFree(
+    _In_ PCR_SAMPLER Sampler
+)
+{
+    if (Sampler != NULL) {
+        CrFree(Sampler);
+    }
+}
@@ -0,0 +1,346 @@
+// crscan.c
+//
+// Backend-independent bus walker.
+
+#include "crinternal.h"
+
+void
+CrDecodeRecord(
+    _In_ CR_ADDRESS Address,
+    _In_reads_bytes_(CR_CONFIG_HEADER_SIZE) const uint8_t* Header,
+    _Out_ CR_FUNCTION_RECORD* Record
+)
+{
+    Record->Segment = Address.Segment;
+    Record->Bus = Address.Bus;
+    Record->Device = Address.Device;
+    Record->Function = Address.Function;
+    Record->HeaderType = Header[CR_CFG_HEADER_TYPE];
+    Record->RevisionId = Header[CR_CFG_REVISION_ID];
+    Record->ProgIf = Header[CR_CFG_PROG_IF];
+    Record->SubClass = Header[CR_CFG_SUB_CLASS];
+    Record->BaseClass = Header[CR_CFG_BASE_CLASS];
+    Record->VendorId = (uint16_t)(Header[CR_CFG_VENDOR_ID] | (Header[CR_CFG_VENDOR_ID + 1] << 8));
+    Record->DeviceId = (uint16_t)(Header[CR_CFG_DEVICE_ID] | (Header[CR_CFG_DEVICE_ID + 1] << 8));
+    Record->Flags = 0;
+    memcpy(Record->Config, Header, CR_CONFIG_HEADER_SIZE);
+}
+
+typedef enum _CR_PROBE_RESULT {
+    CrProbeUnreachable,      // Backend cannot reach the slot (0 bytes read)
+    CrProbeAbsent,           // Reachable, vendor ID reads as all-ones or zero
+    CrProbePresent,
+} CR_PROBE_RESULT;
+
+// Reads the vendor/device dword only, so empty slots cost one access.
+static CR_PROBE_RESULT
+CrProbeFunction(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _Out_writes_bytes_(CR_CONFIG_HEADER_SIZE) uint8_t* Header
+)
+{
+    uint16_t vendorId;
+
+    if (CrConfigRead(Backend, Address, CR_CFG_VENDOR_ID, Header, 4) != 4) {
+        return CrProbeUnreachable;
+    }
+    vendorId = (uint16_t)(Header[0] | (Header[1] << 8));
+    if (vendorId == CR_INVALID_VENDOR_ID || vendorId == 0) {
+        return CrProbeAbsent;
+    }
+    return CrProbePresent;
+}
+
+// Completes the header of a present function. With a compiled filter only
+// the dwords it needs are read first; a rejected function then gets just the
+// header type (and a bridge's bus numbers) so the walk can go on. Returns 0
+// if the header could not be read, otherwise sets *Wanted.
+static int
+CrReadHeader(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_opt_ const CR_FILTER* Match,
+    _Inout_updates_(CR_CONFIG_HEADER_SIZE) uint8_t* Header,
+    _Out_ int* Wanted
+)
+{
+    uint16_t vendorId = (uint16_t)(Header[0] | (Header[1] << 8));
+    uint16_t deviceId = (uint16_t)(Header[2] | (Header[3] << 8));
+    uint32_t classCode = 0;
+    uint8_t headerType;
+
+    *Wanted = 1;
+    if (Match != NULL && Match->RuleCount != 0) {
+        if (!CrFilterMayMatch(Match, Address.Bus, vendorId)) {
+            *Wanted = 0;
+        }
+        else {
+            if (Match->Flags & CR_FILTER_NEEDS_CLASS) {
+                if (CrConfigRead(Backend, Address, CR_CFG_REVISION_ID, Header + CR_CFG_REVISION_ID, 4) != 4) {
+                    return 0;
+                }
+                classCode = ((uint32_t)Header[CR_CFG_BASE_CLASS] << 16) |
+                    ((uint32_t)Header[CR_CFG_SUB_CLASS] << 8) | Header[CR_CFG_PROG_IF];
+            }
+            *Wanted = CrFilterMatch(Match, Address.Bus, vendorId, deviceId, classCode);
+        }
+    }
+
+    if (*Wanted) {
+        return CrConfigRead(Backend, Address, 4, Header + 4, CR_CONFIG_HEADER_SIZE - 4) == CR_CONFIG_HEADER_SIZE - 4;
+    }
+    // Just the one byte: its neighbours are mutable, so a cache could not
+    // answer a dword read here.
+    if (CrConfigRead(Backend, Address, CR_CFG_HEADER_TYPE, Header + CR_CFG_HEADER_TYPE, 1) != 1) {
+        return 0;
+    }
+    headerType = Header[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK;
+    if (headerType == CR_HEADER_TYPE_BRIDGE || headerType == CR_HEADER_TYPE_CARDBUS) {
+        return CrConfigRead(Backend, Address, CR_CFG_SECONDARY_BUS & ~3u, Header + (CR_CFG_SECONDARY_BUS & ~3u), 4) == 4;
+    }
+    return 1;
+}
+
+static void
+CrEmitRecord(
+    _Inout_ PCR_SCAN_OUTPUT Output,
+    _In_ const CR_FUNCTION_RECORD* Record
+)
+{
+    uint32_t slot = CrAtomicFetchAdd32(&Output->Total, 1);
+
+    if (slot < Output->Capacity) {
+        Output->Records[slot] = *Record;
+    }
+}
+
+// Probes one function and, if it is present, reports it and any bridge
+// behind it. A header that cannot be read counts as absent.
+static CR_PROBE_RESULT
+CrVisitFunction(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output,
+    _In_opt_ CR_BRIDGE_CALLBACK BridgeCallback,
+    _In_opt_ void* BridgeContext,
+    _Out_writes_bytes_(CR_CONFIG_HEADER_SIZE) uint8_t* Header
+)
+{
+    CR_FUNCTION_RECORD record;
+    CR_PROBE_RESULT probe;
+    uint8_t headerType;
+    int wanted;
+
+    probe = CrProbeFunction(Backend, Address, Header);
+    if (probe != CrProbePresent) {
+        return probe;
+    }
+    if (!CrReadHeader(Backend, Address, (Options != NULL) ? Options->Match : NULL, Header, &wanted)) {
+        return CrProbeAbsent;
+    }
+    if (wanted) {
+        CrDecodeRecord(Address, Header, &record);
+        if (Options == NULL || Options->Filter == NULL || Options->Filter(Options->FilterContext, &record)) {
+            CrEmitRecord(Output, &record);
+        }
+    }
+
+    // Bridges are followed whether or not the filter kept them.
+    headerType = Header[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK;
+    if (BridgeCallback != NULL &&
+        (headerType == CR_HEADER_TYPE_BRIDGE || headerType == CR_HEADER_TYPE_CARDBUS)) {
+        BridgeCallback(BridgeContext, Address,
+            Header[CR_CFG_SECONDARY_BUS], Header[CR_CFG_SUBORDINATE_BUS]);
+    }
+    return CrProbePresent;
+}
+
+// Reads the Next Function Number from a function's ARI capability. Returns
+// 0 if it has none, which also ends a chain.
+static uint8_t
+CrAriNextFunction(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _Out_ int* HasAri
+)
+{
+    CR_CAP_ENTRY ari;
+    uint8_t capability[2];
+
+    *HasAri = 0;
+    if (CrCapFind(Backend, Address, CR_EXT_CAP_ARI, CR_CAP_EXTENDED, 0, &ari) != CR_OK ||
+        CrConfigRead(Backend, Address, ari.Offset + 4u, capability, 2) != 2) {
+        return 0;
+    }
+    *HasAri = 1;
+    return capability[1];
+}
+
+// An ARI device owns all 256 routing IDs of its bus as one device with 8-bit
+// function numbers, listed by each function's Next Function Number. Function
+// N is addressed as device N >> 3, function N & 7. Returns 0 if function 0
+// has no ARI capability, in which case the bus is walked the ordinary way.
+// The chain stops at the first function that does not answer, as happens
+// when the upstream port does not forward ARI routing IDs.
+static int
+CrWalkAriDevice(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output,
+    _In_opt_ CR_BRIDGE_CALLBACK BridgeCallback,
+    _In_opt_ void* BridgeContext,
+    _Inout_updates_(CR_CONFIG_HEADER_SIZE) uint8_t* Header
+)
+{
+    uint32_t visited[256 / 32];
+    uint8_t next;
+    int hasAri;
+
+    next = CrAriNextFunction(Backend, Address, &hasAri);
+    if (!hasAri) {
+        return 0;
+    }
+    memset(visited, 0, sizeof(visited));
+    visited[0] = 1;
+    while (next != 0 && !((visited[next >> 5] >> (next & 31)) & 1)) {
+        visited[next >> 5] |= 1u << (next & 31);
+        Address.Device = (uint8_t)(next >> 3);
+        Address.Function = (uint8_t)(next & 7);
+        if (CrVisitFunction(Backend, Address, Options, Output, BridgeCallback, BridgeContext, Header) != CrProbePresent) {
+            break;
+        }
+        next = CrAriNextFunction(Backend, Address, &hasAri);
+    }
+    return 1;
+}
+
+void
+CrWalkBus(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output,
+    _In_opt_ CR_BRIDGE_CALLBACK BridgeCallback,
+    _In_opt_ void* BridgeContext
+)
+{
+    uint8_t header[CR_CONFIG_HEADER_SIZE];
+    CR_ADDRESS address;
+    uint8_t deviceNumber;
+    uint8_t functionNumber;
+    CR_PROBE_RESULT probe;
+
+    address.Segment = Segment;
+    address.Bus = Bus;
+    for (deviceNumber = 0; deviceNumber < CR_MAX_DEVICES; deviceNumber++) {
+        address.Device = deviceNumber;
+        for (functionNumber = 0; functionNumber < CR_MAX_FUNCTIONS; functionNumber++) {
+            address.Function = functionNumber;
+
+            probe = CrVisitFunction(Backend, address, Options, Output, BridgeCallback, BridgeContext, header);
+            if (probe != CrProbePresent) {
+                // A bus the backend cannot reach at all (nonexistent bus, outside
+                // an image) fails on device 0 already; skip its other 31 slots.
+                if (probe == CrProbeUnreachable && deviceNumber == 0 && functionNumber == 0) {
+                    return;
+                }
+                if (functionNumber == 0) {
+                    break;
+                }
+                continue;
+            }
+
+            if (deviceNumber == 0 && functionNumber == 0 && Options != NULL && (Options->Flags & CR_SCAN_ARI) &&
+                CrWalkAriDevice(Backend, address, Options, Output, BridgeCallback, BridgeContext, header)) {
+                return;
+            }
+            if (functionNumber == 0 && !(header[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MULTIFUNCTION)) {
+                break;
+            }
+        }
+    }
+}
+
+CR_STATUS
+CrScanBus(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output
+)
+{
+    if (Backend == NULL || Output == NULL || (Output->Records == NULL && Output->Capacity != 0)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    CrWalkBus(Backend, Segment, Bus, Options, Output, NULL, NULL);
+    return CrFinishOutput(Output);
+}
+
+CR_STATUS
+CrOutputFromBuffer(
+    _Out_ PCR_SCAN_OUTPUT Output,
+    _In_ void* Buffer,
+    _In_ size_t BufferLength
+)
+{
+    size_t capacity;
+
+    if (Buffer == NULL || BufferLength < sizeof(CR_SCAN_HEADER)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    capacity = (BufferLength - sizeof(CR_SCAN_HEADER)) / sizeof(CR_FUNCTION_RECORD);
+    Output->Records = (CR_FUNCTION_RECORD*)((CR_SCAN_HEADER*)Buffer + 1);
+    Output->Capacity = (capacity > UINT32_MAX) ? UINT32_MAX : (uint32_t)capacity;
+    Output->Count = 0;
+    Output->Total = 0;
+    return CR_OK;
+}
+
+void
+CrCompleteBuffer(
+    _In_ const CR_SCAN_OUTPUT* Output,
+    _Out_ void* Buffer,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_SCAN_HEADER* header = (CR_SCAN_HEADER*)Buffer;
+
+    header->Version = CR_PROTOCOL_VERSION;
+    header->RecordSize = sizeof(CR_FUNCTION_RECORD);
+    header->RecordCount = Output->Count;
+    header->TotalCount = Output->Total;
+    *BytesWritten = sizeof(CR_SCAN_HEADER) + (size_t)Output->Count * sizeof(CR_FUNCTION_RECORD);
+}
+
+CR_STATUS
+CrScanBusToBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_opt_ const CR_SCAN_OPTIONS* Options,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_SCAN_OUTPUT output;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    status = CrOutputFromBuffer(&output, Buffer, BufferLength);
+    if (status != CR_OK) {
+        return status;
+    }
+    status = CrScanBus(Backend, Segment, Bus, Options, &output);
+    if (status != CR_OK && status != CR_E_MORE_DATA) {
+        return status;
+    }
+    CrCompleteBuffer(&output, Buffer, BytesWritten);
+    return status;
+}
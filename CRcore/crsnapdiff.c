@@ -0,0 +1,887 @@
+// crsnapdiff.c
+//
+// Field-level diffs between snapshot files. Every pair is compared one
+// 64-byte block at a time with vector loads, and only the blocks that differ
+// are walked dword by dword, with volatile register bits masked off, and split
+// into header fields or attributed to a capability. User mode only.
+
+#include "crinternal.h"
+
+#if !defined(_KERNEL_MODE)
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define CR_HAVE_SSE2 1
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CR_HAVE_NEON 1
+#endif
+
+#define CR_DIFF_BLOCK_SIZE     64
+#define CR_DIFF_MAX_CAPS       64     // Per side; a longer chain is attributed by its prefix
+#define CR_DIFF_MAX_IGNORED    256    // Masked dwords per pair; the rest compare unmasked
+#define CR_EXT_CAP_DSN         0x0003
+
+typedef struct _CR_CONFIG_FIELD {
+    uint8_t Offset;
+    uint8_t Width;
+    const char* Name;
+} CR_CONFIG_FIELD;
+
+// Header fields from 0x00 to 0x3F, by header type. The first sixteen bytes
+// are shared; reserved bytes are split into fields no wider than a dword.
+#define CR_COMMON_FIELDS \
+    { 0x00, 2, "Vendor ID" }, { 0x02, 2, "Device ID" }, { 0x04, 2, "Command" }, { 0x06, 2, "Status" }, \
+    { 0x08, 1, "Revision ID" }, { 0x09, 1, "Prog IF" }, { 0x0A, 1, "Sub Class" }, { 0x0B, 1, "Base Class" }, \
+    { 0x0C, 1, "Cache Line Size" }, { 0x0D, 1, "Latency Timer" }, { 0x0E, 1, "Header Type" }, { 0x0F, 1, "BIST" }
+
+static const CR_CONFIG_FIELD CrType0Fields[] = {
+    CR_COMMON_FIELDS,
+    { 0x10, 4, "BAR0" }, { 0x14, 4, "BAR1" }, { 0x18, 4, "BAR2" }, { 0x1C, 4, "BAR3" },
+    { 0x20, 4, "BAR4" }, { 0x24, 4, "BAR5" }, { 0x28, 4, "CardBus CIS Pointer" },
+    { 0x2C, 2, "Subsystem Vendor ID" }, { 0x2E, 2, "Subsystem ID" }, { 0x30, 4, "Expansion ROM Base" },
+    { 0x34, 1, "Capabilities Pointer" }, { 0x35, 1, "Reserved" }, { 0x36, 2, "Reserved" }, { 0x38, 4, "Reserved" },
+    { 0x3C, 1, "Interrupt Line" }, { 0x3D, 1, "Interrupt Pin" }, { 0x3E, 1, "Min Grant" }, { 0x3F, 1, "Max Latency" },
+};
+
+static const CR_CONFIG_FIELD CrType1Fields[] = {
+    CR_COMMON_FIELDS,
+    { 0x10, 4, "BAR0" }, { 0x14, 4, "BAR1" },
+    { 0x18, 1, "Primary Bus" }, { 0x19, 1, "Secondary Bus" }, { 0x1A, 1, "Subordinate Bus" },
+    { 0x1B, 1, "Secondary Latency Timer" }, { 0x1C, 1, "I/O Base" }, { 0x1D, 1, "I/O Limit" },
+    { 0x1E, 2, "Secondary Status" }, { 0x20, 2, "Memory Base" }, { 0x22, 2, "Memory Limit" },
+    { 0x24, 2, "Prefetchable Base" }, { 0x26, 2, "Prefetchable Limit" },
+    { 0x28, 4, "Prefetchable Base Upper" }, { 0x2C, 4, "Prefetchable Limit Upper" },
+    { 0x30, 2, "I/O Base Upper" }, { 0x32, 2, "I/O Limit Upper" },
+    { 0x34, 1, "Capabilities Pointer" }, { 0x35, 1, "Reserved" }, { 0x36, 2, "Reserved" },
+    { 0x38, 4, "Expansion ROM Base" }, { 0x3C, 1, "Interrupt Line" }, { 0x3D, 1, "Interrupt Pin" },
+    { 0x3E, 2, "Bridge Control" },
+};
+
+static const CR_CONFIG_FIELD CrType2Fields[] = {
+    CR_COMMON_FIELDS,
+    { 0x10, 4, "CardBus Socket Base" }, { 0x14, 1, "Capabilities Pointer" }, { 0x15, 1, "Reserved" },
+    { 0x16, 2, "Secondary Status" }, { 0x18, 1, "PCI Bus" }, { 0x19, 1, "CardBus Bus" },
+    { 0x1A, 1, "Subordinate Bus" }, { 0x1B, 1, "CardBus Latency Timer" },
+    { 0x1C, 4, "Memory Base 0" }, { 0x20, 4, "Memory Limit 0" }, { 0x24, 4, "Memory Base 1" },
+    { 0x28, 4, "Memory Limit 1" }, { 0x2C, 4, "I/O Base 0" }, { 0x30, 4, "I/O Limit 0" },
+    { 0x34, 4, "I/O Base 1" }, { 0x38, 4, "I/O Limit 1" }, { 0x3C, 1, "Interrupt Line" },
+    { 0x3D, 1, "Interrupt Pin" }, { 0x3E, 2, "Bridge Control" },
+};
+
+#define CR_FIELD_COUNT(Table) ((uint32_t)(sizeof(Table) / sizeof((Table)[0])))
+#define CR_COMMON_FIELD_COUNT 12
+
+// Bits that move without anyone reconfiguring the function: RW1C error and
+// event status, PME status, and the error logs AER latches.
+static const CR_DIFF_MASK CrDefaultMasks[] = {
+    { 0, CR_DIFF_MASK_ABSOLUTE, 0x06, 2, 0xF908 },        // Status: error bits, Interrupt Status
+    { 0x01, 0, 0x04, 2, 0x8000 },                           // PM Control/Status: PME_Status
+    { 0x10, 0, 0x0A, 2, 0x002F },                           // Device Status: errors detected, Transactions Pending
+    { 0x10, 0, 0x12, 2, 0xC800 },                           // Link Status: Link Training, bandwidth notifications
+    { 0x10, 0, 0x1A, 2, 0x011F },                           // Slot Status: event bits
+    { 0x10, 0, 0x20, 4, 0x00030000 },                       // Root Status: PME Status and Pending
+    { 0x0001, CR_CAP_EXTENDED, 0x04, 4, 0xFFFFFFFF },       // AER Uncorrectable Error Status
+    { 0x0001, CR_CAP_EXTENDED, 0x10, 4, 0xFFFFFFFF },       // AER Correctable Error Status
+    { 0x0001, CR_CAP_EXTENDED, 0x18, 4, 0x0000001F },       // AER First Error Pointer
+    { 0x0001, CR_CAP_EXTENDED, 0x1C, 4, 0xFFFFFFFF },       // AER Header Log
+    { 0x0001, CR_CAP_EXTENDED, 0x20, 4, 0xFFFFFFFF },
+    { 0x0001, CR_CAP_EXTENDED, 0x24, 4, 0xFFFFFFFF },
+    { 0x0001, CR_CAP_EXTENDED, 0x28, 4, 0xFFFFFFFF },
+};
+
+// One function of one side, ordered by (Identity, Serial, Ordinal). Matching
+// by address leaves the first two zero and uses the key as the ordinal.
+typedef struct _CR_DIFF_ITEM {
+    uint64_t Identity;       // Vendor/device dword << 32 | subsystem dword
+    uint64_t Serial;         // Device Serial Number, 0 without one
+    uint32_t Ordinal;
+    uint32_t Key;
+    uint32_t ValidLength;
+    uint32_t Reserved;
+    const uint8_t* Config;
+} CR_DIFF_ITEM;
+
+typedef struct _CR_DIFF_SIDE {
+    PCR_SNAPFILE File;
+    CR_DIFF_ITEM* Items;
+    uint32_t Count;
+} CR_DIFF_SIDE;
+
+// Masks and capability layout of one matched pair.
+typedef struct _CR_DIFF_LAYOUT {
+    CR_CAP_ENTRY Caps[CR_DIFF_MAX_CAPS];      // Left's, by offset
+    uint32_t CapCount;
+    uint32_t IgnoredCount;
+    uint16_t IgnoredOffset[CR_DIFF_MAX_IGNORED];
+    uint32_t IgnoredBits[CR_DIFF_MAX_IGNORED];
+} CR_DIFF_LAYOUT;
+
+typedef struct _CR_DIFF_OUTPUT {
+    CR_DIFF_ENTRY* Entries;
+    uint32_t Capacity;
+    uint32_t Count;          // Entries produced, written or not
+    PCR_DIFF_SUMMARY Summary;
+} CR_DIFF_OUTPUT;
+
+// Options resolved once per call.
+typedef struct _CR_DIFF_PLAN {
+    uint32_t Flags;
+    CR_DIFF_MASK* Masks;
+    uint32_t MaskCount;
+} CR_DIFF_PLAN;
+
+CR_INLINE uint32_t CrDiffLoad32(_In_ const uint8_t* Config, _In_ uint32_t Offset)
+{
+    return (uint32_t)Config[Offset] | ((uint32_t)Config[Offset + 1] << 8) |
+        ((uint32_t)Config[Offset + 2] << 16) | ((uint32_t)Config[Offset + 3] << 24);
+}
+
+CR_INLINE uint32_t CrDiffWidthMask(_In_ uint32_t Width)
+{
+    return (Width >= 4) ? 0xFFFFFFFFu : ((1u << (Width * 8)) - 1);
+}
+
+//
+// Block compare
+//
+
+// Returns a bit per 64-byte block of the first BlockCount, set where Left and
+// Right differ. Blobs are 4 KB, so the map is one 64-bit word.
+static uint64_t
+CrDiffBlocks(
+    _In_ const uint8_t* Left,
+    _In_ const uint8_t* Right,
+    _In_ uint32_t BlockCount
+)
+{
+    uint64_t map = 0;
+    uint32_t i;
+
+    for (i = 0; i < BlockCount; i++) {
+        const uint8_t* l = Left + (size_t)i * CR_DIFF_BLOCK_SIZE;
+        const uint8_t* r = Right + (size_t)i * CR_DIFF_BLOCK_SIZE;
+#if defined(CR_HAVE_SSE2)
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)l), _mm_loadu_si128((const __m128i*)r));
+        x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(l + 16)),
+            _mm_loadu_si128((const __m128i*)(r + 16))));
+        x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(l + 32)),
+            _mm_loadu_si128((const __m128i*)(r + 32))));
+        x = _mm_or_si128(x, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(l + 48)),
+            _mm_loadu_si128((const __m128i*)(r + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF) {
+            map |= 1ull << i;
+        }
+#elif defined(CR_HAVE_NEON)
+        uint8x16x4_t a = vld1q_u8_x4(l);
+        uint8x16x4_t b = vld1q_u8_x4(r);
+        uint8x16_t x = vorrq_u8(vorrq_u8(veorq_u8(a.val[0], b.val[0]), veorq_u8(a.val[1], b.val[1])),
+            vorrq_u8(veorq_u8(a.val[2], b.val[2]), veorq_u8(a.val[3], b.val[3])));
+        if (vmaxvq_u8(x) != 0) {
+            map |= 1ull << i;
+        }
+#else
+        uint64_t x = 0;
+        uint64_t a;
+        uint64_t b;
+        uint32_t j;
+        for (j = 0; j < CR_DIFF_BLOCK_SIZE; j += 8) {
+            memcpy(&a, l + j, 8);
+            memcpy(&b, r + j, 8);
+            x |= a ^ b;
+        }
+        if (x != 0) {
+            map |= 1ull << i;
+        }
+#endif
+    }
+    return map;
+}
+
+//
+// Sides
+//
+
+static int
+CrDiffItemCompare(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    const CR_DIFF_ITEM* left = (const CR_DIFF_ITEM*)Left;
+    const CR_DIFF_ITEM* right = (const CR_DIFF_ITEM*)Right;
+
+    if (left->Identity != right->Identity) {
+        return (left->Identity < right->Identity) ? -1 : 1;
+    }
+    if (left->Serial != right->Serial) {
+        return (left->Serial < right->Serial) ? -1 : 1;
+    }
+    return (left->Ordinal > right->Ordinal) - (left->Ordinal < right->Ordinal);
+}
+
+// Fills Item's identity from its config space: the vendor/device dword, the
+// subsystem dword of type 0 headers and the Device Serial Number.
+static void
+CrDiffIdentify(
+    _In_ PCR_SNAPFILE File,
+    _Inout_ CR_DIFF_ITEM* Item
+)
+{
+    CR_CAP_ENTRY dsn;
+    uint64_t subsystem = 0;
+
+    if ((Item->Config[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK) == 0 &&
+        Item->ValidLength >= CR_CFG_SUBSYSTEM_VENDOR_ID + 4) {
+        subsystem = CrDiffLoad32(Item->Config, CR_CFG_SUBSYSTEM_VENDOR_ID);
+    }
+    Item->Identity = ((uint64_t)CrDiffLoad32(Item->Config, CR_CFG_VENDOR_ID) << 32) | subsystem;
+    if (Item->ValidLength > CR_EXTENDED_CAPS_START &&
+        CrCapFind(CrSnapFileBackend(File), CrAddressFromKey(Item->Key), CR_EXT_CAP_DSN, CR_CAP_EXTENDED, 0, &dsn) == CR_OK &&
+        (uint32_t)dsn.Offset + 12 <= Item->ValidLength) {
+        Item->Serial = CrDiffLoad32(Item->Config, dsn.Offset + 4) |
+            ((uint64_t)CrDiffLoad32(Item->Config, dsn.Offset + 8) << 32);
+    }
+}
+
+// Indexes File in match order. Entries whose blob is out of range are left
+// out, as CrSnapFileFind leaves them out.
+static CR_STATUS
+CrDiffSideInit(
+    _Out_ CR_DIFF_SIDE* Side,
+    _In_ PCR_SNAPFILE File,
+    _In_ uint32_t Flags
+)
+{
+    const CR_SNAPFILE_HEADER* header = CrSnapFileHeader(File);
+    const CR_SNAPFILE_ENTRY* entries = CrSnapFileEntries(File);
+    uint32_t i;
+    uint32_t run;
+
+    Side->File = File;
+    Side->Count = 0;
+    Side->Items = (CR_DIFF_ITEM*)CrAlloc(((size_t)header->EntryCount + 1) * sizeof(CR_DIFF_ITEM));
+    if (Side->Items == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    for (i = 0; i < header->EntryCount; i++) {
+        CR_DIFF_ITEM* item = &Side->Items[Side->Count];
+        uint32_t valid;
+
+        memset(item, 0, sizeof(*item));
+        item->Config = CrSnapFileFind(File, CrAddressFromKey(entries[i].Key), &valid);
+        if (item->Config == NULL) {
+            continue;
+        }
+        item->Key = entries[i].Key;
+        item->Ordinal = entries[i].Key;
+        item->ValidLength = valid;
+        if ((Flags & CR_DIFF_MATCH_IDENTITY) && valid >= 4) {
+            CrDiffIdentify(File, item);
+        }
+        Side->Count++;
+    }
+    if (Flags & CR_DIFF_MATCH_IDENTITY) {
+        // Ordinals by address within each identity, so functions of one
+        // multi-function device pair up in function order.
+        qsort(Side->Items, Side->Count, sizeof(CR_DIFF_ITEM), CrDiffItemCompare);
+        for (i = 0, run = 0; i < Side->Count; i++) {
+            if (i != 0 && (Side->Items[i].Identity != Side->Items[i - 1].Identity ||
+                Side->Items[i].Serial != Side->Items[i - 1].Serial)) {
+                run = 0;
+            }
+            Side->Items[i].Ordinal = run++;
+        }
+    }
+    return CR_OK;
+}
+
+static void
+CrDiffSideFree(
+    _Inout_ CR_DIFF_SIDE* Side
+)
+{
+    if (Side->Items != NULL) {
+        CrFree(Side->Items);
+        Side->Items = NULL;
+    }
+}
+
+//
+// Layout
+//
+
+static void
+CrDiffIgnore(
+    _Inout_ CR_DIFF_LAYOUT* Layout,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Width,
+    _In_ uint32_t Mask
+)
+{
+    uint32_t dword = Offset & ~3u;
+    uint32_t bits = (Mask & CrDiffWidthMask(Width)) << ((Offset & 3) * 8);
+    uint32_t i;
+
+    if (Offset + Width > CR_CONFIG_SPACE_SIZE) {
+        return;
+    }
+    for (i = 0; i < Layout->IgnoredCount; i++) {
+        if (Layout->IgnoredOffset[i] == dword) {
+            Layout->IgnoredBits[i] |= bits;
+            return;
+        }
+    }
+    if (Layout->IgnoredCount < CR_DIFF_MAX_IGNORED) {
+        Layout->IgnoredOffset[Layout->IgnoredCount] = (uint16_t)dword;
+        Layout->IgnoredBits[Layout->IgnoredCount++] = bits;
+    }
+}
+
+// Applies the capability-relative masks to every instance on one side.
+static void
+CrDiffIgnoreCaps(
+    _Inout_ CR_DIFF_LAYOUT* Layout,
+    _In_ const CR_DIFF_PLAN* Plan,
+    _In_reads_(CapCount) const CR_CAP_ENTRY* Caps,
+    _In_ uint32_t CapCount
+)
+{
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < Plan->MaskCount; i++) {
+        const CR_DIFF_MASK* mask = &Plan->Masks[i];
+        if (mask->Flags & CR_DIFF_MASK_ABSOLUTE) {
+            continue;
+        }
+        for (j = 0; j < CapCount; j++) {
+            if (Caps[j].Id == mask->CapabilityId &&
+                (Caps[j].Flags & CR_CAP_EXTENDED) == (mask->Flags & CR_CAP_EXTENDED)) {
+                CrDiffIgnore(Layout, (uint32_t)Caps[j].Offset + mask->Offset, mask->Width, mask->Mask);
+            }
+        }
+    }
+}
+
+static uint32_t
+CrDiffWalk(
+    _In_ const CR_DIFF_SIDE* Side,
+    _In_ const CR_DIFF_ITEM* Item,
+    _Out_writes_(CR_DIFF_MAX_CAPS) CR_CAP_ENTRY* Caps
+)
+{
+    uint32_t total = 0;
+
+    CrCapWalk(CrSnapFileBackend(Side->File), CrAddressFromKey(Item->Key), Caps, CR_DIFF_MAX_CAPS, &total);
+    return (total > CR_DIFF_MAX_CAPS) ? CR_DIFF_MAX_CAPS : total;
+}
+
+// Walks both sides' capabilities: masks follow each side's own layout, and
+// fields are attributed by Left's.
+static void
+CrDiffLayoutInit(
+    _Out_ CR_DIFF_LAYOUT* Layout,
+    _In_ const CR_DIFF_PLAN* Plan,
+    _In_ const CR_DIFF_SIDE* Left,
+    _In_ const CR_DIFF_ITEM* LeftItem,
+    _In_ const CR_DIFF_SIDE* Right,
+    _In_ const CR_DIFF_ITEM* RightItem
+)
+{
+    CR_CAP_ENTRY rightCaps[CR_DIFF_MAX_CAPS];
+    uint32_t rightCount;
+    uint32_t i;
+    uint32_t j;
+
+    Layout->IgnoredCount = 0;
+    for (i = 0; i < Plan->MaskCount; i++) {
+        if (Plan->Masks[i].Flags & CR_DIFF_MASK_ABSOLUTE) {
+            CrDiffIgnore(Layout, Plan->Masks[i].Offset, Plan->Masks[i].Width, Plan->Masks[i].Mask);
+        }
+    }
+    Layout->CapCount = CrDiffWalk(Left, LeftItem, Layout->Caps);
+    rightCount = CrDiffWalk(Right, RightItem, rightCaps);
+    CrDiffIgnoreCaps(Layout, Plan, Layout->Caps, Layout->CapCount);
+    CrDiffIgnoreCaps(Layout, Plan, rightCaps, rightCount);
+
+    // Insertion sort by offset; chains are short and mostly ascending.
+    for (i = 1; i < Layout->CapCount; i++) {
+        CR_CAP_ENTRY entry = Layout->Caps[i];
+        for (j = i; j > 0 && Layout->Caps[j - 1].Offset > entry.Offset; j--) {
+            Layout->Caps[j] = Layout->Caps[j - 1];
+        }
+        Layout->Caps[j] = entry;
+    }
+}
+
+CR_INLINE uint32_t CrDiffIgnored(_In_ const CR_DIFF_LAYOUT* Layout, _In_ uint32_t Offset)
+{
+    uint32_t i;
+
+    for (i = 0; i < Layout->IgnoredCount; i++) {
+        if (Layout->IgnoredOffset[i] == Offset) {
+            return Layout->IgnoredBits[i];
+        }
+    }
+    return 0;
+}
+
+// Nearest capability header at or below Offset in the same list.
+static const CR_CAP_ENTRY*
+CrDiffOwner(
+    _In_ const CR_DIFF_LAYOUT* Layout,
+    _In_ uint32_t Offset
+)
+{
+    const CR_CAP_ENTRY* owner = NULL;
+    uint32_t extended = (Offset >= CR_EXTENDED_CAPS_START) ? CR_CAP_EXTENDED : 0;
+    uint32_t i;
+
+    for (i = 0; i < Layout->CapCount && Layout->Caps[i].Offset <= Offset; i++) {
+        if ((Layout->Caps[i].Flags & CR_CAP_EXTENDED) == extended) {
+            owner = &Layout->Caps[i];
+        }
+    }
+    return owner;
+}
+
+//
+// Compare
+//
+
+static void
+CrDiffEmit(
+    _Inout_ CR_DIFF_OUTPUT* Output,
+    _In_ const CR_DIFF_ENTRY* Entry
+)
+{
+    if (Output->Count < Output->Capacity) {
+        Output->Entries[Output->Count] = *Entry;
+    }
+    Output->Count++;
+}
+
+static void
+CrDiffEmitFunction(
+    _Inout_ CR_DIFF_OUTPUT* Output,
+    _In_ uint32_t Kind,
+    _In_ const CR_DIFF_ITEM* Item
+)
+{
+    CR_DIFF_ENTRY entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.Kind = Kind;
+    if (Kind == CR_DIFF_REMOVED) {
+        entry.LeftKey = Item->Key;
+        Output->Summary->Removed++;
+    }
+    else {
+        entry.RightKey = Item->Key;
+        Output->Summary->Added++;
+    }
+    entry.HeaderType = Item->Config[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK;
+    CrDiffEmit(Output, &entry);
+}
+
+static const CR_CONFIG_FIELD*
+CrConfigFields(
+    _In_ uint8_t HeaderType,
+    _Out_ uint32_t* Count
+)
+{
+    switch (HeaderType) {
+    case 0:
+        *Count = CR_FIELD_COUNT(CrType0Fields);
+        return CrType0Fields;
+    case CR_HEADER_TYPE_BRIDGE:
+        *Count = CR_FIELD_COUNT(CrType1Fields);
+        return CrType1Fields;
+    case CR_HEADER_TYPE_CARDBUS:
+        *Count = CR_FIELD_COUNT(CrType2Fields);
+        return CrType2Fields;
+    default:
+        // Only the shared first sixteen bytes are known.
+        *Count = CR_COMMON_FIELD_COUNT;
+        return CrType0Fields;
+    }
+}
+
+const char*
+CrConfigFieldName(
+    _In_ uint8_t HeaderType,
+    _In_ uint32_t Offset
+)
+{
+    const CR_CONFIG_FIELD* fields;
+    uint32_t count;
+    uint32_t i;
+
+    fields = CrConfigFields(HeaderType, &count);
+    for (i = 0; i < count; i++) {
+        if (fields[i].Offset == Offset) {
+            return fields[i].Name;
+        }
+    }
+    return NULL;
+}
+
+// Reports the differing fields of one dword whose unmasked bits differ.
+static void
+CrDiffDword(
+    _Inout_ CR_DIFF_OUTPUT* Output,
+    _In_ const CR_DIFF_LAYOUT* Layout,
+    _Inout_ CR_DIFF_ENTRY* Entry,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Left,
+    _In_ uint32_t Right
+)
+{
+    const CR_CONFIG_FIELD* fields;
+    const CR_CAP_ENTRY* owner;
+    uint32_t count;
+    uint32_t i;
+
+    if (Offset < CR_CONFIG_HEADER_SIZE) {
+        fields = CrConfigFields(Entry->HeaderType, &count);
+        for (i = 0; i < count; i++) {
+            uint32_t shift = (fields[i].Offset - Offset) * 8;
+            uint32_t mask = CrDiffWidthMask(fields[i].Width);
+
+            if (fields[i].Offset < Offset || fields[i].Offset >= Offset + 4 ||
+                ((Left ^ Right) >> shift & mask) == 0) {
+                continue;
+            }
+            Entry->Offset = fields[i].Offset;
+            Entry->Width = fields[i].Width;
+            Entry->Left = Left >> shift & mask;
+            Entry->Right = Right >> shift & mask;
+            Output->Summary->Fields++;
+            CrDiffEmit(Output, Entry);
+        }
+        // Past the shared bytes of an unknown header type, fall through to
+        // whole dwords.
+        if (Offset < 0x10 || Entry->HeaderType <= CR_HEADER_TYPE_CARDBUS) {
+            return;
+        }
+    }
+
+    owner = CrDiffOwner(Layout, Offset);
+    Entry->Offset = (uint16_t)Offset;
+    Entry->Width = 4;
+    Entry->Left = Left;
+    Entry->Right = Right;
+    if (owner != NULL) {
+        Entry->CapabilityId = owner->Id;
+        Entry->CapabilityOffset = owner->Offset;
+        Entry->CapabilityFlags = owner->Flags;
+    }
+    Output->Summary->Fields++;
+    CrDiffEmit(Output, Entry);
+    Entry->CapabilityId = 0;
+    Entry->CapabilityOffset = 0;
+    Entry->CapabilityFlags = 0;
+}
+
+static void
+CrDiffPair(
+    _Inout_ CR_DIFF_OUTPUT* Output,
+    _In_ const CR_DIFF_PLAN* Plan,
+    _Inout_ CR_DIFF_LAYOUT* Layout,
+    _In_ const CR_DIFF_SIDE* Left,
+    _In_ const CR_DIFF_ITEM* LeftItem,
+    _In_ const CR_DIFF_SIDE* Right,
+    _In_ const CR_DIFF_ITEM* RightItem
+)
+{
+    uint32_t length = (LeftItem->ValidLength < RightItem->ValidLength) ? LeftItem->ValidLength : RightItem->ValidLength;
+    uint32_t fields = Output->Summary->Fields;
+    CR_DIFF_ENTRY entry;
+    uint64_t map;
+
+    Output->Summary->Matched++;
+    if (LeftItem->ValidLength != RightItem->ValidLength) {
+        memset(&entry, 0, sizeof(entry));
+        entry.Kind = CR_DIFF_TRUNCATED;
+        entry.LeftKey = LeftItem->Key;
+        entry.RightKey = RightItem->Key;
+        entry.HeaderType = LeftItem->Config[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK;
+        entry.Offset = (uint16_t)length;
+        entry.Left = LeftItem->ValidLength;
+        entry.Right = RightItem->ValidLength;
+        Output->Summary->Truncated++;
+        CrDiffEmit(Output, &entry);
+    }
+    // The index hash can only prove two blobs differ, never that they are
+    // equal, and the block compare is what finds where they differ anyway.
+    if (LeftItem->Config == RightItem->Config) {
+        return;
+    }
+    map = CrDiffBlocks(LeftItem->Config, RightItem->Config,
+        (length + CR_DIFF_BLOCK_SIZE - 1) / CR_DIFF_BLOCK_SIZE);
+    if (map == 0) {
+        return;
+    }
+
+    CrDiffLayoutInit(Layout, Plan, Left, LeftItem, Right, RightItem);
+    memset(&entry, 0, sizeof(entry));
+    entry.Kind = CR_DIFF_CHANGED;
+    entry.LeftKey = LeftItem->Key;
+    entry.RightKey = RightItem->Key;
+    entry.HeaderType = LeftItem->Config[CR_CFG_HEADER_TYPE] & CR_HEADER_TYPE_MASK;
+    while (map != 0) {
+        uint32_t block = 0;
+        uint32_t offset;
+        uint32_t end;
+
+        while (((map >> block) & 1) == 0) {
+            block++;
+        }
+        map &= map - 1;
+        offset = block * CR_DIFF_BLOCK_SIZE;
+        end = offset + CR_DIFF_BLOCK_SIZE;
+        for (; offset < end && offset + 4 <= length; offset += 4) {
+            uint32_t keep = ~CrDiffIgnored(Layout, offset);
+            uint32_t left = CrDiffLoad32(LeftItem->Config, offset) & keep;
+            uint32_t right = CrDiffLoad32(RightItem->Config, offset) & keep;
+            if (left != right) {
+                CrDiffDword(Output, Layout, &entry, offset, left, right);
+            }
+        }
+    }
+    if (Output->Summary->Fields != fields) {
+        Output->Summary->Changed++;
+    }
+}
+
+// Merges two sides in match order. Layout is scratch space, too large for
+// some worker stacks.
+static CR_STATUS
+CrDiffSides(
+    _In_ const CR_DIFF_PLAN* Plan,
+    _In_ const CR_DIFF_SIDE* Left,
+    _In_ const CR_DIFF_SIDE* Right,
+    _Out_writes_(Capacity) CR_DIFF_ENTRY* Entries,
+    _In_ uint32_t Capacity,
+    _Out_ PCR_DIFF_SUMMARY Summary
+)
+{
+    CR_DIFF_OUTPUT output;
+    CR_DIFF_LAYOUT* layout;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    memset(Summary, 0, sizeof(*Summary));
+    layout = (CR_DIFF_LAYOUT*)CrAlloc(sizeof(*layout));
+    if (layout == NULL) {
+        Summary->Status = CR_E_NO_MEMORY;
+        return CR_E_NO_MEMORY;
+    }
+    output.Entries = Entries;
+    output.Capacity = Capacity;
+    output.Count = 0;
+    output.Summary = Summary;
+
+    while (i < Left->Count || j < Right->Count) {
+        int order = (i == Left->Count) ? 1 : (j == Right->Count) ? -1 :
+            CrDiffItemCompare(&Left->Items[i], &Right->Items[j]);
+        if (order < 0) {
+            CrDiffEmitFunction(&output, CR_DIFF_REMOVED, &Left->Items[i++]);
+        }
+        else if (order > 0) {
+            CrDiffEmitFunction(&output, CR_DIFF_ADDED, &Right->Items[j++]);
+        }
+        else {
+            CrDiffPair(&output, Plan, layout, Left, &Left->Items[i++], Right, &Right->Items[j++]);
+        }
+    }
+    CrFree(layout);
+    Summary->Status = (output.Count > Capacity) ? CR_E_MORE_DATA : CR_OK;
+    return Summary->Status;
+}
+
+// Validates the caller's masks and appends the defaults.
+static CR_STATUS
+CrDiffPlanInit(
+    _Out_ CR_DIFF_PLAN* Plan,
+    _In_opt_ const CR_DIFF_OPTIONS* Options
+)
+{
+    uint32_t defaults = CR_FIELD_COUNT(CrDefaultMasks);
+    uint32_t count = 0;
+    uint32_t i;
+
+    memset(Plan, 0, sizeof(*Plan));
+    if (Options != NULL) {
+        Plan->Flags = Options->Flags;
+        count = Options->MaskCount;
+        if (count != 0 && Options->Masks == NULL) {
+            return CR_E_INVALID_PARAMETER;
+        }
+        for (i = 0; i < count; i++) {
+            const CR_DIFF_MASK* mask = &Options->Masks[i];
+            if ((mask->Width != 1 && mask->Width != 2 && mask->Width != 4) ||
+                (mask->Offset & 3) + mask->Width > 4 || mask->Offset >= CR_CONFIG_SPACE_SIZE) {
+                return CR_E_INVALID_PARAMETER;
+            }
+        }
+    }
+    if (Plan->Flags & CR_DIFF_NO_DEFAULT_MASKS) {
+        defaults = 0;
+    }
+    Plan->Masks = (CR_DIFF_MASK*)CrAlloc(((size_t)count + defaults + 1) * sizeof(CR_DIFF_MASK));
+    if (Plan->Masks == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    if (count != 0) {
+        memcpy(Plan->Masks, Options->Masks, (size_t)count * sizeof(CR_DIFF_MASK));
+    }
+    if (defaults != 0) {
+        memcpy(Plan->Masks + count, CrDefaultMasks, sizeof(CrDefaultMasks));
+    }
+    Plan->MaskCount = count + defaults;
+    return CR_OK;
+}
+
+CR_STATUS
+CrSnapDiff(
+    _In_ PCR_SNAPFILE Left,
+    _In_ PCR_SNAPFILE Right,
+    _In_opt_ const CR_DIFF_OPTIONS* Options,
+    _Out_writes_(Capacity) CR_DIFF_ENTRY* Entries,
+    _In_ uint32_t Capacity,
+    _Out_ PCR_DIFF_SUMMARY Summary
+)
+{
+    CR_DIFF_PLAN plan;
+    CR_DIFF_SIDE left = { 0 };
+    CR_DIFF_SIDE right = { 0 };
+    CR_STATUS status;
+
+    memset(Summary, 0, sizeof(*Summary));
+    if (Left == NULL || Right == NULL || (Capacity != 0 && Entries == NULL)) {
+        Summary->Status = CR_E_INVALID_PARAMETER;
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrDiffPlanInit(&plan, Options);
+    if (status == CR_OK) {
+        status = CrDiffSideInit(&left, Left, plan.Flags);
+    }
+    if (status == CR_OK) {
+        status = CrDiffSideInit(&right, Right, plan.Flags);
+    }
+    if (status == CR_OK) {
+        status = CrDiffSides(&plan, &left, &right, Entries, Capacity, Summary);
+    }
+    else {
+        Summary->Status = status;
+    }
+    CrDiffSideFree(&left);
+    CrDiffSideFree(&right);
+    if (plan.Masks != NULL) CrFree(plan.Masks);
+    return status;
+}
+
+//
+// Many files
+//
+
+typedef struct _CR_DIFF_FILES {
+    const CR_DIFF_PLAN* Plan;
+    const CR_DIFF_SIDE* Golden;
+    const char* const* Paths;
+    uint32_t Count;
+    CR_DIFF_SUMMARY* Summaries;
+    volatile uint32_t Next;
+} CR_DIFF_FILES;
+
+static void
+CrDiffFilesWorker(
+    _In_ void* Context
+)
+{
+    CR_DIFF_FILES* files = (CR_DIFF_FILES*)Context;
+    uint32_t index;
+
+    while ((index = CrAtomicIncrement32(&files->Next) - 1) < files->Count) {
+        PCR_DIFF_SUMMARY summary = &files->Summaries[index];
+        CR_DIFF_SIDE side = { 0 };
+        PCR_SNAPFILE file;
+        CR_STATUS status;
+
+        memset(summary, 0, sizeof(*summary));
+        status = (files->Paths[index] != NULL) ? CrSnapFileOpen(files->Paths[index], &file) : CR_E_INVALID_PARAMETER;
+        if (status != CR_OK) {
+            summary->Status = status;
+            continue;
+        }
+        status = CrDiffSideInit(&side, file, files->Plan->Flags);
+        if (status == CR_OK) {
+            // No entries are kept, so running out of room is expected.
+            status = CrDiffSides(files->Plan, files->Golden, &side, NULL, 0, summary);
+            summary->Status = (status == CR_E_MORE_DATA) ? CR_OK : status;
+        }
+        else {
+            summary->Status = status;
+        }
+        CrDiffSideFree(&side);
+        CrSnapFileClose(file);
+    }
+}
+
+CR_STATUS
+CrSnapDiffFiles(
+    _In_ PCR_SNAPFILE Golden,
+    _In_reads_(Count) const char* const* Paths,
+    _In_ uint32_t Count,
+    _In_opt_ const CR_DIFF_OPTIONS* Options,
+    _Out_writes_(Count) CR_DIFF_SUMMARY* Summaries
+)
+{
+    CR_DIFF_FILES files;
+    CR_DIFF_PLAN plan;
+    CR_DIFF_SIDE golden = { 0 };
+    uint32_t workers = 1;
+    CR_STATUS status;
+
+    if (Golden == NULL || (Count != 0 && (Paths == NULL || Summaries == NULL))) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrDiffPlanInit(&plan, Options);
+    if (status == CR_OK) {
+        status = CrDiffSideInit(&golden, Golden, plan.Flags);
+    }
+    if (status != CR_OK) {
+        goto Exit;
+    }
+
+    files.Plan = &plan;
+    files.Golden = &golden;
+    files.Paths = Paths;
+    files.Count = Count;
+    files.Summaries = Summaries;
+    files.Next = 0;
+    if (Options != NULL && Options->Executor != NULL) {
+        workers = Options->MaxWorkers ? Options->MaxWorkers : Options->Executor->MaxWorkers;
+        if (workers > Options->Executor->MaxWorkers) {
+            workers = Options->Executor->MaxWorkers;
+        }
+        if (workers > Count) {
+            workers = Count;
+        }
+    }
+    if (workers > 1) {
+        Options->Executor->Run(Options->Executor, workers, CrDiffFilesWorker, &files);
+    }
+    else {
+        CrDiffFilesWorker(&files);
+    }
+
+Exit:
+    CrDiffSideFree(&golden);
+    if (plan.Masks != NULL) CrFree(plan.Masks);
+    return status;
+}
+
+#endif // !_KERNEL_MODE
@@ -0,0 +1,574 @@
+// crsnapfile.c
+//
+// Snapshot files: full config-space dumps that readers map and query in
+// place. The writer deduplicates blobs by content, so a box full of
+// identical ports or virtual functions stores each distinct config space
+// once. User mode only.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "crinternal.h"
+
+#if !defined(_KERNEL_MODE)
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Config-space lengths CrSnapFileCapture tries, longest first.
+static const uint32_t CrCaptureLengths[] = { CR_SNAPFILE_BLOB_SIZE, 256, CR_CONFIG_HEADER_SIZE };
+
+struct _CR_SNAPFILE {
+    CR_CONFIG_BACKEND Base;
+    CR_MAPPED_FILE Map;
+    const CR_SNAPFILE_HEADER* Header;
+    const CR_SNAPFILE_ENTRY* Entries;
+    const uint8_t* Blobs;
+};
+
+typedef struct _CR_SNAPFILE_ORDER {
+    uint32_t Key;
+    uint32_t Input;          // Index into the caller's CR_SNAPFILE_INPUT array
+} CR_SNAPFILE_ORDER;
+
+typedef struct _CR_SNAPFILE_BLOB {
+    uint64_t Hash;
+    uint32_t Input;          // First input with this content
+} CR_SNAPFILE_BLOB;
+
+//
+// Writer
+//
+
+// Hash of the whole zero-padded blob, so inputs that differ only in how much
+// was captured still share a blob.
+static uint64_t
+CrHashBlob(
+    _In_ const CR_SNAPFILE_INPUT* Input
+)
+{
+    const uint8_t* config = (const uint8_t*)Input->Config;
+    uint64_t hash = CR_FNV_OFFSET_BASIS;
+    uint32_t i;
+
+    for (i = 0; i < Input->Length; i++) {
+        hash = (hash ^ config[i]) * CR_FNV_PRIME;
+    }
+    for (; i < CR_SNAPFILE_BLOB_SIZE; i++) {
+        hash *= CR_FNV_PRIME;
+    }
+    return hash;
+}
+
+CR_INLINE int CrIsZero(_In_reads_bytes_(Length) const uint8_t* Data, _In_ uint32_t Length)
+{
+    uint32_t i;
+
+    for (i = 0; i < Length; i++) {
+        if (Data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+CrBlobEqual(
+    _In_ const CR_SNAPFILE_INPUT* Left,
+    _In_ const CR_SNAPFILE_INPUT* Right
+)
+{
+    const CR_SNAPFILE_INPUT* shorter = (Left->Length <= Right->Length) ? Left : Right;
+    const CR_SNAPFILE_INPUT* longer = (shorter == Left) ? Right : Left;
+
+    return memcmp(shorter->Config, longer->Config, shorter->Length) == 0 &&
+        CrIsZero((const uint8_t*)longer->Config + shorter->Length, longer->Length - shorter->Length);
+}
+
+static int
+CrOrderCompare(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    uint32_t left = ((const CR_SNAPFILE_ORDER*)Left)->Key;
+    uint32_t right = ((const CR_SNAPFILE_ORDER*)Right)->Key;
+
+    return (left > right) - (left < right);
+}
+
+#if defined(_WIN32)
+typedef HANDLE CR_OUTPUT_FILE;
+#else
+typedef int CR_OUTPUT_FILE;
+#endif
+
+static CR_STATUS
+CrWriteAll(
+    _In_ CR_OUTPUT_FILE File,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length
+)
+{
+    const uint8_t* data = (const uint8_t*)Data;
+
+    while (Length != 0) {
+#if defined(_WIN32)
+        DWORD chunk = (Length > 0x40000000) ? 0x40000000 : (DWORD)Length;
+        DWORD written = 0;
+        if (!WriteFile(File, data, chunk, &written, NULL) || written == 0) {
+            return CR_E_IO;
+        }
+#else
+        ssize_t written = write(File, data, Length);
+        if (written <= 0) {
+            return CR_E_IO;
+        }
+#endif
+        data += written;
+        Length -= (size_t)written;
+    }
+    return CR_OK;
+}
+
+// Writes the prepared header, index and blobs. Page is a scratch buffer of
+// CR_SNAPFILE_BLOB_SIZE bytes.
+static CR_STATUS
+CrSnapFileEmit(
+    _In_ CR_OUTPUT_FILE File,
+    _In_ const CR_SNAPFILE_HEADER* Header,
+    _In_reads_(Header->EntryCount) const CR_SNAPFILE_ENTRY* Entries,
+    _In_ const CR_SNAPFILE_INPUT* Functions,
+    _In_reads_(Header->BlobCount) const CR_SNAPFILE_BLOB* Blobs,
+    _Out_writes_bytes_(CR_SNAPFILE_BLOB_SIZE) uint8_t* Page
+)
+{
+    size_t indexEnd = sizeof(*Header) + (size_t)Header->EntryCount * sizeof(CR_SNAPFILE_ENTRY);
+    CR_STATUS status;
+    uint32_t i;
+
+    status = CrWriteAll(File, Header, sizeof(*Header));
+    if (status == CR_OK) {
+        status = CrWriteAll(File, Entries, (size_t)Header->EntryCount * sizeof(CR_SNAPFILE_ENTRY));
+    }
+    if (status == CR_OK) {
+        memset(Page, 0, CR_SNAPFILE_BLOB_SIZE);
+        status = CrWriteAll(File, Page, (size_t)(Header->BlobOffset - indexEnd));
+    }
+    for (i = 0; i < Header->BlobCount && status == CR_OK; i++) {
+        const CR_SNAPFILE_INPUT* input = &Functions[Blobs[i].Input];
+        memcpy(Page, input->Config, input->Length);
+        memset(Page + input->Length, 0, CR_SNAPFILE_BLOB_SIZE - input->Length);
+        status = CrWriteAll(File, Page, CR_SNAPFILE_BLOB_SIZE);
+    }
+    return status;
+}
+
+CR_STATUS
+CrSnapFileWrite(
+    _In_ const char* Path,
+    _In_reads_(Count) const CR_SNAPFILE_INPUT* Functions,
+    _In_ uint32_t Count
+)
+{
+    CR_SNAPFILE_HEADER header;
+    CR_SNAPFILE_ORDER* order = NULL;
+    CR_SNAPFILE_ENTRY* entries = NULL;
+    CR_SNAPFILE_BLOB* blobs = NULL;
+    uint32_t* table = NULL;        // Open addressing over blobs, 0 = empty
+    uint8_t* page = NULL;
+    uint32_t tableMask;
+    uint32_t i;
+    CR_OUTPUT_FILE file;
+    CR_STATUS status = CR_E_NO_MEMORY;
+
+    if (Path == NULL || (Count != 0 && Functions == NULL) || Count > UINT32_MAX / 4) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    for (i = 0; i < Count; i++) {
+        if (Functions[i].Length > CR_SNAPFILE_BLOB_SIZE || (Functions[i].Length != 0 && Functions[i].Config == NULL)) {
+            return CR_E_INVALID_PARAMETER;
+        }
+    }
+
+    // At most half full, so probe sequences stay short.
+    for (tableMask = 1; tableMask < Count * 2; tableMask <<= 1) {
+    }
+    order = (CR_SNAPFILE_ORDER*)CrAlloc(((size_t)Count + 1) * sizeof(*order));
+    entries = (CR_SNAPFILE_ENTRY*)CrAlloc(((size_t)Count + 1) * sizeof(*entries));
+    blobs = (CR_SNAPFILE_BLOB*)CrAlloc(((size_t)Count + 1) * sizeof(*blobs));
+    table = (uint32_t*)CrAlloc((size_t)tableMask * sizeof(*table));
+    page = (uint8_t*)CrAlloc(CR_SNAPFILE_BLOB_SIZE);
+    tableMask--;
+    if (order == NULL || entries == NULL || blobs == NULL || table == NULL || page == NULL) {
+        goto Exit;
+    }
+    memset(table, 0, ((size_t)tableMask + 1) * sizeof(*table));
+
+    for (i = 0; i < Count; i++) {
+        order[i].Key = CrAddressKey(Functions[i].Address);
+        order[i].Input = i;
+    }
+    qsort(order, Count, sizeof(*order), CrOrderCompare);
+
+    memset(&header, 0, sizeof(header));
+    for (i = 0; i < Count; i++) {
+        const CR_SNAPFILE_INPUT* input = &Functions[order[i].Input];
+        uint64_t hash = CrHashBlob(input);
+        uint32_t slot = (uint32_t)hash & tableMask;
+
+        if (i != 0 && order[i].Key == order[i - 1].Key) {
+            status = CR_E_INVALID_PARAMETER;
+            goto Exit;
+        }
+        while (table[slot] != 0) {
+            CR_SNAPFILE_BLOB* blob = &blobs[table[slot] - 1];
+            if (blob->Hash == hash && CrBlobEqual(&Functions[blob->Input], input)) {
+                break;
+            }
+            slot = (slot + 1) & tableMask;
+        }
+        if (table[slot] == 0) {
+            blobs[header.BlobCount].Hash = hash;
+            blobs[header.BlobCount].Input = order[i].Input;
+            table[slot] = ++header.BlobCount;
+        }
+
+        memset(&entries[i], 0, sizeof(entries[i]));
+        entries[i].Key = order[i].Key;
+        entries[i].BlobIndex = table[slot] - 1;
+        entries[i].ValidLength = (uint16_t)input->Length;
+        entries[i].Hash = hash;
+    }
+
+    header.Magic = CR_SNAPFILE_MAGIC;
+    header.Version = CR_SNAPFILE_VERSION;
+    header.HeaderSize = sizeof(header);
+    header.EntrySize = sizeof(CR_SNAPFILE_ENTRY);
+    header.BlobSize = CR_SNAPFILE_BLOB_SIZE;
+    header.EntryCount = Count;
+    header.BlobOffset = (sizeof(header) + (uint64_t)Count * sizeof(CR_SNAPFILE_ENTRY) + CR_SNAPFILE_BLOB_SIZE - 1) &
+        ~(uint64_t)(CR_SNAPFILE_BLOB_SIZE - 1);
+    header.FileSize = header.BlobOffset + (uint64_t)header.BlobCount * CR_SNAPFILE_BLOB_SIZE;
+
+#if defined(_WIN32)
+    file = CreateFileA(Path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        status = CR_E_IO;
+        goto Exit;
+    }
+    status = CrSnapFileEmit(file, &header, entries, Functions, blobs, page);
+    CloseHandle(file);
+    if (status != CR_OK) {
+        DeleteFileA(Path);
+    }
+#else
+    file = open(Path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0) {
+        status = CR_E_IO;
+        goto Exit;
+    }
+    status = CrSnapFileEmit(file, &header, entries, Functions, blobs, page);
+    if (close(file) != 0 && status == CR_OK) {
+        status = CR_E_IO;
+    }
+    if (status != CR_OK) {
+        unlink(Path);
+    }
+#endif
+
+Exit:
+    if (order != NULL) CrFree(order);
+    if (entries != NULL) CrFree(entries);
+    if (blobs != NULL) CrFree(blobs);
+    if (table != NULL) CrFree(table);
+    if (page != NULL) CrFree(page);
+    return status;
+}
+
+CR_STATUS
+CrSnapFileCapture(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_ const char* Path
+)
+{
+    CR_SNAPSHOT snapshot;
+    CR_SNAPFILE_INPUT* inputs;
+    uint8_t* configs;
+    uint32_t i;
+    uint32_t j;
+    CR_STATUS status;
+
+    if (Backend == NULL || Path == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    status = CrSnapshotScan(Backend, Options, 0, &snapshot);
+    if (status != CR_OK) {
+        return status;
+    }
+    inputs = (CR_SNAPFILE_INPUT*)CrAlloc(((size_t)snapshot.Count + 1) * sizeof(*inputs));
+    configs = (uint8_t*)CrAlloc(((size_t)snapshot.Count + 1) * CR_SNAPFILE_BLOB_SIZE);
+    if (inputs == NULL || configs == NULL) {
+        status = CR_E_NO_MEMORY;
+        goto Exit;
+    }
+
+    for (i = 0; i < snapshot.Count; i++) {
+        const CR_FUNCTION_RECORD* record = &snapshot.Records[i];
+        uint8_t* config = configs + (size_t)i * CR_SNAPFILE_BLOB_SIZE;
+
+        inputs[i].Address.Segment = record->Segment;
+        inputs[i].Address.Bus = record->Bus;
+        inputs[i].Address.Device = record->Device;
+        inputs[i].Address.Function = record->Function;
+        inputs[i].Config = config;
+        // The scan already read the header; keep it if nothing longer works.
+        memcpy(config, record->Config, CR_CONFIG_HEADER_SIZE);
+        inputs[i].Length = CR_CONFIG_HEADER_SIZE;
+        for (j = 0; j < sizeof(CrCaptureLengths) / sizeof(CrCaptureLengths[0]); j++) {
+            if (CrConfigRead(Backend, inputs[i].Address, 0, config, CrCaptureLengths[j]) == CrCaptureLengths[j]) {
+                inputs[i].Length = CrCaptureLengths[j];
+                break;
+            }
+            memcpy(config, record->Config, CR_CONFIG_HEADER_SIZE);
+        }
+    }
+    status = CrSnapFileWrite(Path, inputs, snapshot.Count);
+
+Exit:
+    if (inputs != NULL) CrFree(inputs);
+    if (configs != NULL) CrFree(configs);
+    CrSnapshotFree(&snapshot);
+    return status;
+}
+
+//
+// Reader
+//
+
+static const CR_SNAPFILE_ENTRY*
+CrSnapFileLookup(
+    _In_ const CR_SNAPFILE* File,
+    _In_ uint32_t Key
+)
+{
+    uint32_t low = 0;
+    uint32_t high = File->Header->EntryCount;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (File->Entries[mid].Key < Key) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low == File->Header->EntryCount || File->Entries[low].Key != Key ||
+        File->Entries[low].BlobIndex >= File->Header->BlobCount) {
+        return NULL;
+    }
+    return &File->Entries[low];
+}
+
+const uint8_t*
+CrSnapFileFind(
+    _In_ const CR_SNAPFILE* File,
+    _In_ CR_ADDRESS Address,
+    _Out_opt_ uint32_t* ValidLength
+)
+{
+    const CR_SNAPFILE_ENTRY* entry = CrSnapFileLookup(File, CrAddressKey(Address));
+
+    if (ValidLength != NULL) {
+        *ValidLength = 0;
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (ValidLength != NULL) {
+        *ValidLength = (entry->ValidLength > CR_SNAPFILE_BLOB_SIZE) ? CR_SNAPFILE_BLOB_SIZE : entry->ValidLength;
+    }
+    return File->Blobs + (size_t)entry->BlobIndex * CR_SNAPFILE_BLOB_SIZE;
+}
+
+static uint32_t
+CrSnapFileRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    const uint8_t* config;
+    uint32_t valid;
+
+    if (Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        return 0;
+    }
+    config = CrSnapFileFind((const CR_SNAPFILE*)Backend, Address, &valid);
+    if (config == NULL) {
+        // Not captured: behave like a master abort.
+        memset(Buffer, 0xFF, Length);
+        return Length;
+    }
+    if (Offset >= valid) {
+        return 0;
+    }
+    if (Length > valid - Offset) {
+        Length = valid - Offset;
+    }
+    memcpy(Buffer, config + Offset, Length);
+    return Length;
+}
+
+static uint32_t
+CrSnapFileEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    const CR_SNAPFILE* file = (const CR_SNAPFILE*)Backend;
+    uint32_t count = 0;
+    uint32_t i;
+    uint16_t segment;
+
+    for (i = 0; i < file->Header->EntryCount; i++) {
+        segment = (uint16_t)(file->Entries[i].Key >> 16);
+        if (i != 0 && (uint16_t)(file->Entries[i - 1].Key >> 16) == segment) {
+            continue;
+        }
+        if (count < Capacity) {
+            Segments[count] = segment;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void
+CrSnapFileEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    const CR_SNAPFILE* file = (const CR_SNAPFILE*)Backend;
+    uint32_t bus;
+    uint32_t i;
+
+    for (i = 0; i < file->Header->EntryCount; i++) {
+        if ((uint16_t)(file->Entries[i].Key >> 16) != Segment) {
+            continue;
+        }
+        bus = (file->Entries[i].Key >> 8) & 0xFF;
+        Buses[bus >> 5] |= 1u << (bus & 31);
+    }
+}
+
+static void
+CrSnapFileBackendClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CrSnapFileClose((PCR_SNAPFILE)Backend);
+}
+
+CR_STATUS
+CrSnapFileOpen(
+    _In_ const char* Path,
+    _Out_ PCR_SNAPFILE* File
+)
+{
+    const CR_SNAPFILE_HEADER* header;
+    PCR_SNAPFILE file;
+    CR_STATUS status;
+
+    *File = NULL;
+    file = (PCR_SNAPFILE)CrAlloc(sizeof(*file));
+    if (file == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    status = CrMapFile(Path, sizeof(CR_SNAPFILE_HEADER), &file->Map);
+    if (status != CR_OK) {
+        CrFree(file);
+        return status;
+    }
+
+    // Everything a lookup touches is bounds checked once here.
+    header = (const CR_SNAPFILE_HEADER*)file->Map.View;
+    if (header->Magic != CR_SNAPFILE_MAGIC) {
+        status = CR_E_INVALID_PARAMETER;
+    }
+    else if (header->Version != CR_SNAPFILE_VERSION || header->HeaderSize != sizeof(CR_SNAPFILE_HEADER) ||
+        header->EntrySize != sizeof(CR_SNAPFILE_ENTRY) || header->BlobSize != CR_SNAPFILE_BLOB_SIZE) {
+        status = CR_E_UNSUPPORTED;
+    }
+    else if ((header->BlobOffset & (CR_SNAPFILE_BLOB_SIZE - 1)) != 0 ||
+        header->BlobOffset < sizeof(*header) + (uint64_t)header->EntryCount * sizeof(CR_SNAPFILE_ENTRY) ||
+        header->BlobOffset > file->Map.Length ||
+        (file->Map.Length - header->BlobOffset) / CR_SNAPFILE_BLOB_SIZE < header->BlobCount) {
+        status = CR_E_INVALID_PARAMETER;
+    }
+    if (status != CR_OK) {
+        CrUnmapFile(&file->Map);
+        CrFree(file);
+        return status;
+    }
+
+    file->Header = header;
+    file->Entries = (const CR_SNAPFILE_ENTRY*)(header + 1);
+    file->Blobs = file->Map.View + header->BlobOffset;
+    file->Base.Name = "snapfile";
+    file->Base.Read = CrSnapFileRead;
+    file->Base.Close = CrSnapFileBackendClose;
+    file->Base.EnumerateSegments = CrSnapFileEnumerateSegments;
+    file->Base.EnumerateBuses = CrSnapFileEnumerateBuses;
+    *File = file;
+    return CR_OK;
+}
+
+const CR_SNAPFILE_HEADER*
+CrSnapFileHeader(
+    _In_ const CR_SNAPFILE* File
+)
+{
+    return File->Header;
+}
+
+const CR_SNAPFILE_ENTRY*
+CrSnapFileEntries(
+    _In_ const CR_SNAPFILE* File
+)
+{
+    return File->Entries;
+}
+
+PCR_CONFIG_BACKEND
+CrSnapFileBackend(
+    _In_ PCR_SNAPFILE File
+)
+{
+    return &File->Base;
+}
+
+void
+CrSnapFileClose(
+    _In_ PCR_SNAPFILE File
+)
+{
+    if (File != NULL) {
+        CrUnmapFile(&File->Map);
+        CrFree(File);
+    }
+}
+
+#endif // !_KERNEL_MODE
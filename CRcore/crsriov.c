@@ -0,0 +1,191 @@
+// crsriov.c
+//
+// SR-IOV virtual function discovery. VFs do not answer vendor ID probes
+// (theirs reads as all ones) and a NIC can carry hundreds of them, so they
+// are computed from each physical function's SR-IOV capability instead of
+// being searched for, and reported as one range per PF.
+
+#include "crinternal.h"
+
+// SR-IOV capability registers, from the capability header.
+#define CR_SRIOV_CONTROL         0x08
+#define CR_SRIOV_REGISTERS_SIZE  0x14    // Control through VF Device ID
+#define CR_SRIOV_VF_ENABLE       0x0001
+
+// Offsets into the registers read from CR_SRIOV_CONTROL.
+#define CR_SRIOV_R_CONTROL       0x00
+#define CR_SRIOV_R_TOTAL_VFS     0x06
+#define CR_SRIOV_R_NUM_VFS       0x08
+#define CR_SRIOV_R_FIRST_OFFSET  0x0C
+#define CR_SRIOV_R_STRIDE        0x0E
+#define CR_SRIOV_R_VF_DEVICE_ID  0x12
+
+#define CR_MAX_ROUTING_ID        0xFFFF
+
+CR_INLINE uint16_t CrReadLe16(_In_reads_bytes_(2) const uint8_t* Bytes)
+{
+    return (uint16_t)(Bytes[0] | (Bytes[1] << 8));
+}
+
+// Fills Range from Record's SR-IOV capability. Returns 0 if the function
+// has none or no VFs enabled.
+static int
+CrReadVfRange(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ const CR_FUNCTION_RECORD* Record,
+    _Out_ PCR_VF_RANGE Range
+)
+{
+    uint8_t registers[CR_SRIOV_REGISTERS_SIZE];
+    uint8_t classDword[4];
+    CR_CAP_ENTRY sriov;
+    CR_ADDRESS address;
+    uint32_t firstRoutingId;
+    uint32_t numVfs;
+    uint32_t stride;
+
+    address.Segment = Record->Segment;
+    address.Bus = Record->Bus;
+    address.Device = Record->Device;
+    address.Function = Record->Function;
+    if (CrCapFind(Backend, address, CR_EXT_CAP_SRIOV, CR_CAP_EXTENDED, 0, &sriov) != CR_OK ||
+        CrConfigRead(Backend, address, sriov.Offset + CR_SRIOV_CONTROL, registers, sizeof(registers)) != sizeof(registers)) {
+        return 0;
+    }
+    numVfs = CrReadLe16(registers + CR_SRIOV_R_NUM_VFS);
+    if (!(CrReadLe16(registers + CR_SRIOV_R_CONTROL) & CR_SRIOV_VF_ENABLE) || numVfs == 0) {
+        return 0;
+    }
+
+    firstRoutingId = (((uint32_t)Record->Bus << 8) | ((uint32_t)Record->Device << 3) | Record->Function) +
+        CrReadLe16(registers + CR_SRIOV_R_FIRST_OFFSET);
+    stride = CrReadLe16(registers + CR_SRIOV_R_STRIDE);
+    if (firstRoutingId > CR_MAX_ROUTING_ID) {
+        return 0;
+    }
+    // VFs whose routing ID would run past bus 255 cannot exist; a zero
+    // stride leaves only the first one distinct.
+    if (stride == 0) {
+        numVfs = 1;
+    }
+    else if (numVfs > (CR_MAX_ROUTING_ID - firstRoutingId) / stride + 1) {
+        numVfs = (CR_MAX_ROUTING_ID - firstRoutingId) / stride + 1;
+    }
+
+    memset(Range, 0, sizeof(*Range));
+    Range->Segment = Record->Segment;
+    Range->Bus = Record->Bus;
+    Range->Device = Record->Device;
+    Range->Function = Record->Function;
+    Range->FirstRoutingId = (uint16_t)firstRoutingId;
+    Range->Stride = (uint16_t)stride;
+    Range->Count = (uint16_t)numVfs;
+    Range->TotalVFs = CrReadLe16(registers + CR_SRIOV_R_TOTAL_VFS);
+    Range->VendorId = Record->VendorId;
+    Range->DeviceId = CrReadLe16(registers + CR_SRIOV_R_VF_DEVICE_ID);
+    Range->CapOffset = sriov.Offset;
+
+    // Revision and class code are the one part of a VF header that is its own.
+    if (CrConfigRead(Backend, CrVfAddress(Range, 0), CR_CFG_REVISION_ID, classDword, 4) == 4) {
+        Range->RevisionId = classDword[0];
+        Range->ClassCode = ((uint32_t)classDword[3] << 16) | ((uint32_t)classDword[2] << 8) | classDword[1];
+    }
+    return 1;
+}
+
+CR_STATUS
+CrScanVirtualFunctions(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Out_writes_(Capacity) CR_VF_RANGE* Ranges,
+    _In_ uint32_t Capacity,
+    _Out_ uint32_t* Total,
+    _Out_opt_ uint32_t* FunctionCount
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+    CR_SNAPSHOT snapshot;
+    CR_VF_RANGE range;
+    uint32_t functions = 0;
+    uint32_t total = 0;
+    uint32_t i;
+    CR_STATUS status;
+
+    *Total = 0;
+    if (FunctionCount != NULL) {
+        *FunctionCount = 0;
+    }
+    if (Backend == NULL || (Capacity != 0 && Ranges == NULL)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (Options != NULL) {
+        options = *Options;
+    }
+    else {
+        memset(&options, 0, sizeof(options));
+    }
+    // A PF past function 7 of an ARI device is only found through the chain.
+    options.Flags |= CR_TOPOLOGY_ARI;
+
+    status = CrSnapshotScan(Backend, &options, 0, &snapshot);
+    if (status != CR_OK) {
+        return status;
+    }
+    // The snapshot is sorted, so the ranges come out sorted by PF.
+    for (i = 0; i < snapshot.Count; i++) {
+        if ((snapshot.Records[i].HeaderType & CR_HEADER_TYPE_MASK) != 0 ||
+            !CrReadVfRange(Backend, &snapshot.Records[i], &range)) {
+            continue;
+        }
+        if (total < Capacity) {
+            Ranges[total] = range;
+        }
+        total++;
+        functions += range.Count;
+    }
+    CrSnapshotFree(&snapshot);
+
+    *Total = total;
+    if (FunctionCount != NULL) {
+        *FunctionCount = functions;
+    }
+    return (total > Capacity) ? CR_E_MORE_DATA : CR_OK;
+}
+
+CR_STATUS
+CrScanVirtualFunctionsToBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_VF_HEADER* header = (CR_VF_HEADER*)Buffer;
+    size_t capacity;
+    uint32_t total;
+    uint32_t functions;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    if (Buffer == NULL || BufferLength < sizeof(CR_VF_HEADER)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    capacity = (BufferLength - sizeof(CR_VF_HEADER)) / sizeof(CR_VF_RANGE);
+    if (capacity > UINT32_MAX) {
+        capacity = UINT32_MAX;
+    }
+    status = CrScanVirtualFunctions(Backend, Options, (CR_VF_RANGE*)(header + 1), (uint32_t)capacity,
+        &total, &functions);
+    if (status != CR_OK && status != CR_E_MORE_DATA) {
+        return status;
+    }
+    header->Version = CR_PROTOCOL_VERSION;
+    header->RangeSize = sizeof(CR_VF_RANGE);
+    header->RangeCount = (total < capacity) ? total : (uint32_t)capacity;
+    header->TotalCount = total;
+    header->FunctionCount = functions;
+    header->Reserved = 0;
+    *BytesWritten = sizeof(CR_VF_HEADER) + (size_t)header->RangeCount * sizeof(CR_VF_RANGE);
+    return status;
+}
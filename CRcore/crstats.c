@@ -0,0 +1,278 @@
+// crstats.c
+//
+// Request and config-read statistics. Each CPU owns a cache-line aligned
+// slot laid out like CR_STATS_REPLY, so a query is a straight sum of every
+// slot's counters.
+
+#include "crinternal.h"
+
+#define CR_CACHE_LINE 64
+
+// The counters of a CR_STATS_REPLY: everything after the fixed header.
+#define CR_STATS_FIRST_COUNTER  (sizeof(uint32_t) * 4)
+#define CR_STATS_COUNTER_COUNT  ((sizeof(CR_STATS_REPLY) - CR_STATS_FIRST_COUNTER) / sizeof(uint64_t))
+
+struct _CR_STATS {
+    CR_STATS_HOST Host;
+    size_t Stride;           // Bytes per CPU slot, whole cache lines
+    uint8_t* Slots;          // Cache-line aligned inside Allocation
+    void* Allocation;
+};
+
+typedef struct _CR_STATS_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    PCR_STATS Stats;
+    PCR_CONFIG_BACKEND Inner;
+} CR_STATS_BACKEND;
+
+CR_INLINE PCR_STATS_REPLY CrStatsSlot(_In_ const CR_STATS* Stats)
+{
+    uint32_t cpu = Stats->Host.CurrentCpu();
+
+    if (cpu >= Stats->Host.CpuCount) {
+        cpu %= Stats->Host.CpuCount;
+    }
+    return (PCR_STATS_REPLY)(Stats->Slots + Stats->Stride * cpu);
+}
+
+static uint64_t
+CrTicksToNs(
+    _In_ const CR_STATS* Stats,
+    _In_ uint64_t Ticks
+)
+{
+    uint64_t frequency = Stats->Host.Frequency;
+
+    // Split so Ticks * 10^9 cannot overflow for long requests.
+    return (Ticks / frequency) * 1000000000ull + (Ticks % frequency) * 1000000000ull / frequency;
+}
+
+CR_INLINE uint32_t CrLatencyBucket(_In_ uint64_t Ns)
+{
+    uint32_t bucket = 0;
+
+    while (Ns > 1 && bucket < CR_STATS_BUCKETS - 1) {
+        Ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+CR_STATUS
+CrStatsCreate(
+    _In_ const CR_STATS_HOST* Host,
+    _Out_ PCR_STATS* Stats
+)
+{
+    PCR_STATS stats;
+    size_t stride = (sizeof(CR_STATS_REPLY) + CR_CACHE_LINE - 1) & ~(size_t)(CR_CACHE_LINE - 1);
+
+    *Stats = NULL;
+    if (Host == NULL || Host->Now == NULL || Host->Frequency == 0 || Host->CurrentCpu == NULL ||
+        Host->CpuCount == 0 || Host->CpuCount > 4096) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    stats = (PCR_STATS)CrAlloc(sizeof(*stats));
+    if (stats == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    stats->Allocation = CrAlloc(stride * Host->CpuCount + CR_CACHE_LINE);
+    if (stats->Allocation == NULL) {
+        CrFree(stats);
+        return CR_E_NO_MEMORY;
+    }
+    memset(stats->Allocation, 0, stride * Host->CpuCount + CR_CACHE_LINE);
+    stats->Host = *Host;
+    stats->Stride = stride;
+    stats->Slots = (uint8_t*)(((uintptr_t)stats->Allocation + CR_CACHE_LINE - 1) & ~(uintptr_t)(CR_CACHE_LINE - 1));
+    *Stats = stats;
+    return CR_OK;
+}
+
+void
+CrStatsFree(
+    _In_opt_ PCR_STATS Stats
+)
+{
+    if (Stats != NULL) {
+        CrFree(Stats->Allocation);
+        CrFree(Stats);
+    }
+}
+
+uint64_t
+CrStatsNow(
+    _In_ const CR_STATS* Stats
+)
+{
+    return Stats->Host.Now();
+}
+
+void
+CrStatsRecordRequest(
+    _In_ PCR_STATS Stats,
+    _In_ uint32_t IoControlCode,
+    _In_ uint64_t Start,
+    _In_ uint64_t BytesReturned,
+    _In_ int Failed
+)
+{
+    uint32_t index = CR_STATS_IOCTL_SLOT(IoControlCode);
+    uint64_t ns = CrTicksToNs(Stats, Stats->Host.Now() - Start);
+    PCR_STATS_IOCTL slot;
+
+    if (index >= CR_STATS_IOCTL_SLOTS) {
+        return;
+    }
+    slot = &CrStatsSlot(Stats)->Ioctls[index];
+    CrAtomicAdd64(&slot->Requests, 1);
+    if (Failed) {
+        CrAtomicAdd64(&slot->Failures, 1);
+    }
+    CrAtomicAdd64(&slot->BytesReturned, BytesReturned);
+    CrAtomicAdd64(&slot->TotalNs, ns);
+    CrAtomicAdd64(&slot->Latency[CrLatencyBucket(ns)], 1);
+}
+
+static uint32_t
+CrStatsRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    CR_STATS_BACKEND* wrapper = (CR_STATS_BACKEND*)Backend;
+    PCR_STATS stats = wrapper->Stats;
+    uint64_t start = stats->Host.Now();
+    uint32_t got = CrConfigRead(wrapper->Inner, Address, Offset, Buffer, Length);
+    uint64_t ns = CrTicksToNs(stats, stats->Host.Now() - start);
+    PCR_STATS_REPLY slot = CrStatsSlot(stats);
+
+    // The walker probes a function by reading its vendor/device dword alone.
+    if (Offset == 0 && Length == sizeof(uint32_t)) {
+        CrAtomicAdd64(&slot->FunctionsProbed, 1);
+    }
+    CrAtomicAdd64(&slot->ConfigReads, 1);
+    if (got < Length) {
+        CrAtomicAdd64(&slot->ConfigReadFailures, 1);
+    }
+    CrAtomicAdd64(&slot->ConfigReadBytes, got);
+    CrAtomicAdd64(&slot->ConfigReadNs, ns);
+    CrAtomicAdd64(&slot->ReadLatency[CrLatencyBucket(ns)], 1);
+    return got;
+}
+
+static uint32_t
+CrStatsEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    PCR_CONFIG_BACKEND inner = ((CR_STATS_BACKEND*)Backend)->Inner;
+
+    return inner->EnumerateSegments(inner, Segments, Capacity);
+}
+
+static void
+CrStatsEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    PCR_CONFIG_BACKEND inner = ((CR_STATS_BACKEND*)Backend)->Inner;
+
+    inner->EnumerateBuses(inner, Segment, Buses);
+}
+
+static void
+CrStatsClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CR_STATS_BACKEND* wrapper = (CR_STATS_BACKEND*)Backend;
+
+    CrBackendClose(wrapper->Inner);
+    CrFree(wrapper);
+}
+
+CR_STATUS
+CrStatsWrapBackend(
+    _In_ PCR_STATS Stats,
+    _In_ PCR_CONFIG_BACKEND Inner,
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_STATS_BACKEND* wrapper;
+
+    *Backend = NULL;
+    if (Stats == NULL || Inner == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    wrapper = (CR_STATS_BACKEND*)CrAlloc(sizeof(*wrapper));
+    if (wrapper == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    wrapper->Base.Name = Inner->Name;
+    wrapper->Base.Read = CrStatsRead;
+    wrapper->Base.Close = CrStatsClose;
+    wrapper->Base.EnumerateSegments = (Inner->EnumerateSegments != NULL) ? CrStatsEnumerateSegments : NULL;
+    wrapper->Base.EnumerateBuses = (Inner->EnumerateBuses != NULL) ? CrStatsEnumerateBuses : NULL;
+    wrapper->Stats = Stats;
+    wrapper->Inner = Inner;
+    *Backend = &wrapper->Base;
+    return CR_OK;
+}
+
+void
+CrStatsQuery(
+    _In_ const CR_STATS* Stats,
+    _Out_ PCR_STATS_REPLY Reply
+)
+{
+    uint64_t* total = (uint64_t*)((uint8_t*)Reply + CR_STATS_FIRST_COUNTER);
+    uint32_t cpu;
+    size_t i;
+
+    memset(Reply, 0, sizeof(*Reply));
+    Reply->Version = CR_PROTOCOL_VERSION;
+    Reply->IoctlSlots = CR_STATS_IOCTL_SLOTS;
+    Reply->BucketCount = CR_STATS_BUCKETS;
+    Reply->CpuCount = Stats->Host.CpuCount;
+    for (cpu = 0; cpu < Stats->Host.CpuCount; cpu++) {
+        uint64_t* counters = (uint64_t*)(Stats->Slots + Stats->Stride * cpu + CR_STATS_FIRST_COUNTER);
+        for (i = 0; i < CR_STATS_COUNTER_COUNT; i++) {
+            total[i] += CrAtomicLoad64(&counters[i]);
+        }
+    }
+}
+
+uint64_t
+CrStatsPercentile(
+    _In_reads_(CR_STATS_BUCKETS) const uint64_t* Buckets,
+    _In_ uint32_t Percent
+)
+{
+    uint64_t total = 0;
+    uint64_t target;
+    uint64_t seen = 0;
+    uint32_t i;
+
+    for (i = 0; i < CR_STATS_BUCKETS; i++) {
+        total += Buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    target = (total * Percent + 99) / 100;
+    for (i = 0; i < CR_STATS_BUCKETS - 1; i++) {
+        seen += Buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return (uint64_t)1 << (i + 1);
+}
@@ -0,0 +1,226 @@
+// crthread.c
+//
+// User-mode CR_EXECUTOR over Win32 threads or pthreads. CRdriver supplies its
+// own executor built on system threads.
+
+#include "crcore.h"
+
+#if !defined(_KERNEL_MODE)
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// WaitForMultipleObjects tops out at 64 handles.
+#define CR_MAX_THREADS 64
+
+typedef struct _CR_THREAD_START {
+    CR_WORK_ROUTINE Routine;
+    void* Context;
+} CR_THREAD_START;
+
+#if defined(_WIN32)
+static DWORD WINAPI
+CrThreadMain(
+    LPVOID Parameter
+)
+{
+    CR_THREAD_START* start = (CR_THREAD_START*)Parameter;
+    start->Routine(start->Context);
+    return 0;
+}
+#else
+static void*
+CrThreadMain(
+    void* Parameter
+)
+{
+    CR_THREAD_START* start = (CR_THREAD_START*)Parameter;
+    start->Routine(start->Context);
+    return NULL;
+}
+#endif
+
+static void
+CrThreadExecutorRun(
+    _In_ PCR_EXECUTOR Executor,
+    _In_ uint32_t Count,
+    _In_ CR_WORK_ROUTINE Routine,
+    _In_ void* Context
+)
+{
+    CR_THREAD_START start;
+    uint32_t started = 0;
+    uint32_t i;
+#if defined(_WIN32)
+    HANDLE threads[CR_MAX_THREADS];
+#else
+    pthread_t threads[CR_MAX_THREADS];
+#endif
+
+    if (Count > Executor->MaxWorkers) {
+        Count = Executor->MaxWorkers;
+    }
+    start.Routine = Routine;
+    start.Context = Context;
+
+    // The caller is worker 0.
+    for (i = 1; i < Count; i++) {
+#if defined(_WIN32)
+        threads[started] = CreateThread(NULL, 0, CrThreadMain, &start, 0, NULL);
+        if (threads[started] == NULL) {
+            break;
+        }
+#else
+        if (pthread_create(&threads[started], NULL, CrThreadMain, &start) != 0) {
+            break;
+        }
+#endif
+        started++;
+    }
+
+    Routine(Context);
+
+#if defined(_WIN32)
+    if (started != 0) {
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    }
+    for (i = 0; i < started; i++) {
+        CloseHandle(threads[i]);
+    }
+#else
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+}
+
+uint32_t
+CrOnlineCpuCount(void)
+{
+#if defined(_WIN32)
+    DWORD count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (count > 0) ? (uint32_t)count : 1;
+}
+
+void
+CrThreadExecutorInit(
+    _Out_ PCR_EXECUTOR Executor,
+    _In_ uint32_t MaxWorkers
+)
+{
+    if (MaxWorkers == 0) {
+        MaxWorkers = CrOnlineCpuCount();
+    }
+    Executor->Run = CrThreadExecutorRun;
+    Executor->MaxWorkers = (MaxWorkers > CR_MAX_THREADS) ? CR_MAX_THREADS : MaxWorkers;
+}
+
+#if !defined(_WIN32)
+struct _CR_SEMAPHORE_OBJECT {
+    pthread_mutex_t Mutex;
+    pthread_cond_t Available;
+    uint32_t Count;
+};
+#endif
+
+int
+CrSemaphoreInit(
+    _Out_ CR_SEMAPHORE* Semaphore
+)
+{
+#if defined(_WIN32)
+    *Semaphore = (CR_SEMAPHORE)CreateSemaphoreW(NULL, 0, MAXLONG, NULL);
+    return *Semaphore != NULL;
+#else
+    CR_SEMAPHORE semaphore = (CR_SEMAPHORE)CrAlloc(sizeof(*semaphore));
+
+    *Semaphore = NULL;
+    if (semaphore == NULL) {
+        return 0;
+    }
+    if (pthread_mutex_init(&semaphore->Mutex, NULL) != 0) {
+        CrFree(semaphore);
+        return 0;
+    }
+    if (pthread_cond_init(&semaphore->Available, NULL) != 0) {
+        pthread_mutex_destroy(&semaphore->Mutex);
+        CrFree(semaphore);
+        return 0;
+    }
+    *Semaphore = semaphore;
+    return 1;
+#endif
+}
+
+void
+CrSemaphoreDelete(
+    _Inout_ CR_SEMAPHORE* Semaphore
+)
+{
+#if defined(_WIN32)
+    CloseHandle((HANDLE)*Semaphore);
+#else
+    pthread_cond_destroy(&(*Semaphore)->Available);
+    pthread_mutex_destroy(&(*Semaphore)->Mutex);
+    CrFree(*Semaphore);
+#endif
+    *Semaphore = NULL;
+}
+
+void
+CrSemaphoreRelease(
+    _In_ CR_SEMAPHORE* Semaphore,
+    _In_ uint32_t Count
+)
+{
+#if defined(_WIN32)
+    ReleaseSemaphore((HANDLE)*Semaphore, (LONG)Count, NULL);
+#else
+    pthread_mutex_lock(&(*Semaphore)->Mutex);
+    (*Semaphore)->Count += Count;
+    if (Count == 1) {
+        pthread_cond_signal(&(*Semaphore)->Available);
+    }
+    else {
+        pthread_cond_broadcast(&(*Semaphore)->Available);
+    }
+    pthread_mutex_unlock(&(*Semaphore)->Mutex);
+#endif
+}
+
+void
+CrSemaphoreWait(
+    _In_ CR_SEMAPHORE* Semaphore
+)
+{
+#if defined(_WIN32)
+    WaitForSingleObject((HANDLE)*Semaphore, INFINITE);
+#else
+    pthread_mutex_lock(&(*Semaphore)->Mutex);
+    while ((*Semaphore)->Count == 0) {
+        pthread_cond_wait(&(*Semaphore)->Available, &(*Semaphore)->Mutex);
+    }
+    (*Semaphore)->Count--;
+    pthread_mutex_unlock(&(*Semaphore)->Mutex);
+#endif
+}
+
+void
+CrYield(void)
+{
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+#endif // !_KERNEL_MODE
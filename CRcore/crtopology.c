@@ -0,0 +1,334 @@
+// crtopology.c
+//
+// Whole-topology walk. Every bus is a work item: scanning it may discover
+// bridges, whose secondary buses are queued for whichever worker is free.
+// Subtrees behind different root ports therefore proceed in parallel.
+
+#include "crinternal.h"
+
+#define CR_BUS_COUNT 256
+
+typedef struct _CR_TOPOLOGY_WALK {
+    PCR_CONFIG_BACKEND Backend;
+    const CR_SCAN_OPTIONS* Scan;
+    CR_SCAN_OPTIONS ScanOptions; // Options->Scan plus flags implied by Options->Flags
+    PCR_SCAN_OUTPUT Output;
+    uint16_t Segment;
+    CR_SEMAPHORE Idle;           // Parked workers wait here; see Waiting
+
+    CR_SPIN_LOCK Lock;           // Guards everything below; never held across a read or a wait
+    uint32_t Pending;            // Queued plus in-progress buses
+    uint32_t Waiting;            // Parked workers not yet released
+    uint32_t Head;
+    uint32_t Tail;
+    uint8_t Queue[CR_BUS_COUNT]; // Each bus is queued at most once, so no wrap
+    uint32_t Visited[CR_BUS_COUNT / 32];
+    uint32_t Covered[CR_BUS_COUNT / 32];  // Inside some bridge's forwarding range
+} CR_TOPOLOGY_WALK;
+
+#define CR_BIT_TEST(Bitmap, Bit) (((Bitmap)[(Bit) >> 5] >> ((Bit) & 31)) & 1)
+#define CR_BIT_SET(Bitmap, Bit)  ((Bitmap)[(Bit) >> 5] |= 1u << ((Bit) & 31))
+
+// Caller holds Walk->Lock. Returns how many parked workers to release once
+// the lock is dropped.
+static uint32_t
+CrQueueBus(
+    _Inout_ CR_TOPOLOGY_WALK* Walk,
+    _In_ uint8_t Bus
+)
+{
+    if (CR_BIT_TEST(Walk->Visited, Bus)) {
+        return 0;
+    }
+    CR_BIT_SET(Walk->Visited, Bus);
+    Walk->Queue[Walk->Tail++] = Bus;
+    Walk->Pending++;
+    if (Walk->Waiting == 0) {
+        return 0;
+    }
+    Walk->Waiting--;
+    return 1;
+}
+
+static void
+CrTopologyBridgeFound(
+    _In_ void* Context,
+    _In_ CR_ADDRESS Address,
+    _In_ uint8_t SecondaryBus,
+    _In_ uint8_t SubordinateBus
+)
+{
+    CR_TOPOLOGY_WALK* walk = (CR_TOPOLOGY_WALK*)Context;
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    uint32_t bus;
+    uint32_t wake;
+
+    // Unconfigured bridges read 0/0; anything pointing backwards would loop.
+    if (SecondaryBus <= Address.Bus || SubordinateBus < SecondaryBus) {
+        return;
+    }
+
+    CrSpinLockAcquire(&walk->Lock, &lockHandle);
+    for (bus = SecondaryBus; bus <= SubordinateBus; bus++) {
+        CR_BIT_SET(walk->Covered, bus);
+    }
+    wake = CrQueueBus(walk, SecondaryBus);
+    CrSpinLockRelease(&lockHandle);
+    if (wake != 0) {
+        CrSemaphoreRelease(&walk->Idle, wake);
+    }
+}
+
+static void
+CrTopologyWorker(
+    _In_ void* Context
+)
+{
+    CR_TOPOLOGY_WALK* walk = (CR_TOPOLOGY_WALK*)Context;
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    uint32_t wake;
+    uint8_t bus;
+
+    for (;;) {
+        CrSpinLockAcquire(&walk->Lock, &lockHandle);
+        if (walk->Head < walk->Tail) {
+            bus = walk->Queue[walk->Head++];
+            CrSpinLockRelease(&lockHandle);
+
+            CrWalkBus(walk->Backend, walk->Segment, bus, walk->Scan, walk->Output,
+                CrTopologyBridgeFound, walk);
+
+            CrSpinLockAcquire(&walk->Lock, &lockHandle);
+            wake = 0;
+            if (--walk->Pending == 0) {
+                // Nothing left that could queue more: let every parked worker return.
+                wake = walk->Waiting;
+                walk->Waiting = 0;
+            }
+            CrSpinLockRelease(&lockHandle);
+            if (wake != 0) {
+                CrSemaphoreRelease(&walk->Idle, wake);
+            }
+            continue;
+        }
+        if (walk->Pending == 0) {
+            CrSpinLockRelease(&lockHandle);
+            return;
+        }
+        // Queue is empty but another worker may still find bridges. Park
+        // until one is queued or the walk is over. A release that lands
+        // before the wait is counted, so it cannot be missed.
+        walk->Waiting++;
+        CrSpinLockRelease(&lockHandle);
+        CrSemaphoreWait(&walk->Idle);
+    }
+}
+
+static void
+CrRunTopologyWorkers(
+    _Inout_ CR_TOPOLOGY_WALK* Walk,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options
+)
+{
+    uint32_t workers = 1;
+
+    if (Options != NULL && Options->Executor != NULL) {
+        workers = Options->MaxWorkers ? Options->MaxWorkers : Options->Executor->MaxWorkers;
+        if (workers > Options->Executor->MaxWorkers) {
+            workers = Options->Executor->MaxWorkers;
+        }
+    }
+    // A single worker never finds the queue empty with work outstanding, so
+    // it needs no semaphore; neither does a walk that could not create one.
+    if (workers > 1 && CrSemaphoreInit(&Walk->Idle)) {
+        Options->Executor->Run(Options->Executor, workers, CrTopologyWorker, Walk);
+        CrSemaphoreDelete(&Walk->Idle);
+    }
+    else {
+        CrTopologyWorker(Walk);
+    }
+}
+
+static void
+CrScanSegment(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _In_ uint16_t Segment,
+    _Inout_ PCR_SCAN_OUTPUT Output
+)
+{
+    CR_TOPOLOGY_WALK walk;
+    uint32_t populated[CR_BUS_MAP_WORDS];
+    uint32_t bus;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.Backend = Backend;
+    if (Options != NULL) {
+        walk.ScanOptions = Options->Scan;
+        if (Options->Flags & CR_TOPOLOGY_ARI) {
+            walk.ScanOptions.Flags |= CR_SCAN_ARI;
+        }
+        walk.Scan = &walk.ScanOptions;
+    }
+    walk.Output = Output;
+    walk.Segment = Segment;
+
+    CrQueueBus(&walk, 0);
+    CrRunTopologyWorkers(&walk, Options);
+
+    if (Options != NULL && (Options->Flags & CR_TOPOLOGY_BRIDGES_ONLY)) {
+        return;
+    }
+
+    // Multi-socket and multi-host-bridge systems have root buses that no
+    // bridge on bus 0 points at. Probe every bus not already accounted for,
+    // unless the backend can say which buses hold anything at all; buses
+    // reached from these new roots are still scanned only once.
+    if (Backend->EnumerateBuses != NULL) {
+        memset(populated, 0, sizeof(populated));
+        Backend->EnumerateBuses(Backend, Segment, populated);
+    }
+    else {
+        memset(populated, 0xFF, sizeof(populated));
+    }
+    for (bus = 1; bus < CR_BUS_COUNT; bus++) {
+        if (!CR_BIT_TEST(walk.Covered, bus) && CR_BIT_TEST(populated, bus)) {
+            (void)CrQueueBus(&walk, (uint8_t)bus);
+        }
+    }
+    if (walk.Pending != 0) {
+        CrRunTopologyWorkers(&walk, Options);
+    }
+}
+
+static int
+CrRecordLess(
+    _In_ const CR_FUNCTION_RECORD* Left,
+    _In_ const CR_FUNCTION_RECORD* Right
+)
+{
+    if (Left->Segment != Right->Segment) return Left->Segment < Right->Segment;
+    if (Left->Bus != Right->Bus) return Left->Bus < Right->Bus;
+    if (Left->Device != Right->Device) return Left->Device < Right->Device;
+    return Left->Function < Right->Function;
+}
+
+static void
+CrSiftDown(
+    _Inout_updates_(Count) CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Root,
+    _In_ uint32_t Count
+)
+{
+    CR_FUNCTION_RECORD swap;
+    uint32_t child;
+
+    while ((child = 2 * Root + 1) < Count) {
+        if (child + 1 < Count && CrRecordLess(&Records[child], &Records[child + 1])) {
+            child++;
+        }
+        if (!CrRecordLess(&Records[Root], &Records[child])) {
+            return;
+        }
+        swap = Records[Root];
+        Records[Root] = Records[child];
+        Records[child] = swap;
+        Root = child;
+    }
+}
+
+// Heapsort: no recursion and no scratch memory, so it is fine in the driver.
+void
+CrSortRecords(
+    _Inout_updates_(Count) CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count
+)
+{
+    CR_FUNCTION_RECORD swap;
+    uint32_t i;
+
+    if (Count < 2) {
+        return;
+    }
+    for (i = Count / 2; i-- > 0;) {
+        CrSiftDown(Records, i, Count);
+    }
+    for (i = Count - 1; i > 0; i--) {
+        swap = Records[0];
+        Records[0] = Records[i];
+        Records[i] = swap;
+        CrSiftDown(Records, 0, i);
+    }
+}
+
+CR_STATUS
+CrScanTopology(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Inout_ PCR_SCAN_OUTPUT Output
+)
+{
+    uint16_t* segments = NULL;
+    uint32_t segmentCount = 1;
+    uint32_t i;
+    CR_STATUS status;
+
+    if (Backend == NULL || Output == NULL || (Output->Records == NULL && Output->Capacity != 0)) {
+        return CR_E_INVALID_PARAMETER;
+    }
+
+    if (Options != NULL && (Options->Flags & CR_TOPOLOGY_ALL_SEGMENTS) && Backend->EnumerateSegments != NULL) {
+        segmentCount = Backend->EnumerateSegments(Backend, NULL, 0);
+        if (segmentCount == 0) {
+            return CrFinishOutput(Output);
+        }
+        segments = (uint16_t*)CrAlloc((size_t)segmentCount * sizeof(uint16_t));
+        if (segments == NULL) {
+            return CR_E_NO_MEMORY;
+        }
+        i = Backend->EnumerateSegments(Backend, segments, segmentCount);
+        if (i < segmentCount) {
+            segmentCount = i;
+        }
+        for (i = 0; i < segmentCount; i++) {
+            CrScanSegment(Backend, Options, segments[i], Output);
+        }
+        CrFree(segments);
+    }
+    else {
+        uint16_t segment = 0;
+        if (Options != NULL && !(Options->Flags & CR_TOPOLOGY_ALL_SEGMENTS)) {
+            segment = Options->Segment;
+        }
+        CrScanSegment(Backend, Options, segment, Output);
+    }
+
+    status = CrFinishOutput(Output);
+    CrSortRecords(Output->Records, Output->Count);
+    return status;
+}
+
+CR_STATUS
+CrScanTopologyToBuffer(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_opt_ const CR_TOPOLOGY_OPTIONS* Options,
+    _Out_writes_bytes_to_(BufferLength, *BytesWritten) void* Buffer,
+    _In_ size_t BufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    CR_SCAN_OUTPUT output;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    status = CrOutputFromBuffer(&output, Buffer, BufferLength);
+    if (status != CR_OK) {
+        return status;
+    }
+    status = CrScanTopology(Backend, Options, &output);
+    if (status != CR_OK && status != CR_E_MORE_DATA) {
+        return status;
+    }
+    CrCompleteBuffer(&output, Buffer, BytesWritten);
+    return status;
+}
@@ -0,0 +1,771 @@
+// crtrace.c
+//
+// Config-access traces. The recorder sits between a scan and a live backend
+// and logs every read with its data and latency; the replay backend serves
+// the scan core from such a log, so a slow or odd production topology can be
+// scanned again on any build host and its reads counted and profiled. User
+// mode only.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // clock_gettime under strict -std=c11
+#endif
+
+#include "crinternal.h"
+
+#if !defined(_KERNEL_MODE)
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Records are appended to chunks of this size; one never straddles two.
+#define CR_TRACE_CHUNK_SIZE (1u << 20)
+
+CR_STATIC_ASSERT(TraceChunkFitsRecord, CR_TRACE_CHUNK_SIZE >= CR_TRACE_RECORD_SPAN(CR_CONFIG_SPACE_SIZE));
+
+// Monotonic nanoseconds.
+static uint64_t
+CrTraceNow(void)
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    uint64_t ticks;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    ticks = (uint64_t)now.QuadPart;
+    return (ticks / (uint64_t)frequency.QuadPart) * 1000000000ull +
+        (ticks % (uint64_t)frequency.QuadPart) * 1000000000ull / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+//
+// Recorder
+//
+
+typedef struct _CR_TRACE_CHUNK {
+    struct _CR_TRACE_CHUNK* Next;
+    uint32_t Used;
+    uint32_t Reserved;
+    uint8_t Data[CR_TRACE_CHUNK_SIZE];
+} CR_TRACE_CHUNK;
+
+struct _CR_TRACE_RECORDER {
+    CR_CONFIG_BACKEND Base;
+    PCR_CONFIG_BACKEND Inner;
+    CR_SPIN_LOCK Lock;           // Guards everything below
+    int Failed;                  // A record was dropped for lack of memory
+    uint32_t RecordCount;
+    CR_TRACE_CHUNK* First;
+    CR_TRACE_CHUNK* Last;
+    uint64_t DataSize;
+    uint64_t LatencyNs;
+    uint64_t FirstStart;         // 0 until the first record
+    uint64_t LastEnd;
+};
+
+// Claims Span bytes for one record. Called with the lock held; the caller
+// fills them in after dropping it. Chunks start zeroed, so padding is too.
+static uint8_t*
+CrTraceReserve(
+    _Inout_ PCR_TRACE_RECORDER Recorder,
+    _In_ uint32_t Span
+)
+{
+    CR_TRACE_CHUNK* chunk = Recorder->Last;
+    uint8_t* slot;
+
+    if (chunk == NULL || CR_TRACE_CHUNK_SIZE - chunk->Used < Span) {
+        chunk = (CR_TRACE_CHUNK*)CrAlloc(sizeof(*chunk));
+        if (chunk == NULL) {
+            return NULL;
+        }
+        if (Recorder->Last != NULL) {
+            Recorder->Last->Next = chunk;
+        }
+        else {
+            Recorder->First = chunk;
+        }
+        Recorder->Last = chunk;
+    }
+    slot = chunk->Data + chunk->Used;
+    chunk->Used += Span;
+    return slot;
+}
+
+static uint32_t
+CrTraceRecorderRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    PCR_TRACE_RECORDER recorder = (PCR_TRACE_RECORDER)Backend;
+    CR_SPIN_LOCK_HANDLE lockHandle;
+    uint64_t start = CrTraceNow();
+    uint32_t got = CrConfigRead(recorder->Inner, Address, Offset, Buffer, Length);
+    uint64_t end = CrTraceNow();
+    CR_TRACE_RECORD record;
+    uint8_t* slot;
+
+    // Nothing outside config space can be read, or expressed in a record.
+    if (Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        return got;
+    }
+    record.Key = CrAddressKey(Address);
+    record.Offset = (uint16_t)Offset;
+    record.Length = (uint16_t)Length;
+    record.Returned = (uint16_t)((got < Length) ? got : Length);
+    record.Reserved = 0;
+    record.LatencyNs = (end - start > UINT32_MAX) ? UINT32_MAX : (uint32_t)(end - start);
+
+    CrSpinLockAcquire(&recorder->Lock, &lockHandle);
+    slot = CrTraceReserve(recorder, CR_TRACE_RECORD_SPAN(record.Returned));
+    if (slot != NULL) {
+        recorder->RecordCount++;
+        recorder->DataSize += CR_TRACE_RECORD_SPAN(record.Returned);
+        recorder->LatencyNs += record.LatencyNs;
+        if (recorder->FirstStart == 0 || start < recorder->FirstStart) {
+            recorder->FirstStart = start;
+        }
+        if (end > recorder->LastEnd) {
+            recorder->LastEnd = end;
+        }
+    }
+    else {
+        recorder->Failed = 1;
+    }
+    CrSpinLockRelease(&lockHandle);
+
+    if (slot != NULL) {
+        memcpy(slot, &record, sizeof(record));
+        memcpy(slot + sizeof(record), Buffer, record.Returned);
+    }
+    return got;
+}
+
+static uint32_t
+CrTraceRecorderEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    PCR_CONFIG_BACKEND inner = ((PCR_TRACE_RECORDER)Backend)->Inner;
+
+    return inner->EnumerateSegments(inner, Segments, Capacity);
+}
+
+static void
+CrTraceRecorderEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    PCR_CONFIG_BACKEND inner = ((PCR_TRACE_RECORDER)Backend)->Inner;
+
+    inner->EnumerateBuses(inner, Segment, Buses);
+}
+
+static void
+CrTraceRecorderClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    (void)Backend;
+}
+
+CR_STATUS
+CrTraceRecorderCreate(
+    _In_ PCR_CONFIG_BACKEND Inner,
+    _Out_ PCR_TRACE_RECORDER* Recorder
+)
+{
+    PCR_TRACE_RECORDER recorder;
+
+    *Recorder = NULL;
+    if (Inner == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    recorder = (PCR_TRACE_RECORDER)CrAlloc(sizeof(*recorder));
+    if (recorder == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    recorder->Base.Name = Inner->Name;
+    recorder->Base.Read = CrTraceRecorderRead;
+    recorder->Base.Close = CrTraceRecorderClose;
+    recorder->Base.EnumerateSegments = (Inner->EnumerateSegments != NULL) ? CrTraceRecorderEnumerateSegments : NULL;
+    recorder->Base.EnumerateBuses = (Inner->EnumerateBuses != NULL) ? CrTraceRecorderEnumerateBuses : NULL;
+    recorder->Inner = Inner;
+    *Recorder = recorder;
+    return CR_OK;
+}
+
+PCR_CONFIG_BACKEND
+CrTraceRecorderBackend(
+    _In_ PCR_TRACE_RECORDER Recorder
+)
+{
+    return &Recorder->Base;
+}
+
+CR_STATUS
+CrTraceRecorderSave(
+    _In_ PCR_TRACE_RECORDER Recorder,
+    _In_ const char* Path
+)
+{
+    PCR_TRACE_HEADER header;
+    const CR_TRACE_CHUNK* chunk;
+    uint8_t* image;
+    size_t length;
+    size_t used;
+    CR_STATUS status;
+
+    if (Path == NULL) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    if (Recorder->Failed) {
+        return CR_E_NO_MEMORY;
+    }
+    if (Recorder->DataSize > SIZE_MAX - sizeof(*header)) {
+        return CR_E_UNSUPPORTED;
+    }
+    length = sizeof(*header) + (size_t)Recorder->DataSize;
+    image = (uint8_t*)CrAlloc(length);
+    if (image == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+
+    header = (PCR_TRACE_HEADER)image;
+    header->Magic = CR_TRACE_MAGIC;
+    header->Version = CR_TRACE_VERSION;
+    header->HeaderSize = sizeof(*header);
+    header->RecordSize = sizeof(CR_TRACE_RECORD);
+    header->RecordCount = Recorder->RecordCount;
+    header->DataSize = Recorder->DataSize;
+    header->DurationNs = Recorder->LastEnd - Recorder->FirstStart;
+    header->LatencyNs = Recorder->LatencyNs;
+    used = sizeof(*header);
+    for (chunk = Recorder->First; chunk != NULL; chunk = chunk->Next) {
+        memcpy(image + used, chunk->Data, chunk->Used);
+        used += chunk->Used;
+    }
+
+    status = CrWriteFile(Path, image, length);
+    CrFree(image);
+    return status;
+}
+
+void
+CrTraceRecorderFree(
+    _In_opt_ PCR_TRACE_RECORDER Recorder
+)
+{
+    CR_TRACE_CHUNK* chunk;
+
+    if (Recorder == NULL) {
+        return;
+    }
+    while (Recorder->First != NULL) {
+        chunk = Recorder->First;
+        Recorder->First = chunk->Next;
+        CrFree(chunk);
+    }
+    CrFree(Recorder);
+}
+
+//
+// Replay
+//
+
+#define CR_TRACE_FUNCTION_PRESENT     0x00000001  // Some byte read back other than 0xFF
+#define CR_TRACE_FUNCTION_UNREACHABLE 0x00000002  // Some read of it failed outright
+
+// Config space of a present function, then one bit per byte that was read.
+#define CR_TRACE_IMAGE_SIZE (CR_CONFIG_SPACE_SIZE + CR_CONFIG_SPACE_SIZE / 8)
+
+typedef struct _CR_TRACE_FUNCTION {
+    uint32_t Key;
+    uint32_t Flags;          // CR_TRACE_FUNCTION_*
+    uint8_t* Image;          // CR_TRACE_IMAGE_SIZE bytes; NULL unless present
+} CR_TRACE_FUNCTION;
+
+// A recorded read, for answering a repeat of it exactly.
+typedef struct _CR_TRACE_ACCESS {
+    uint32_t Key;
+    uint16_t Offset;
+    uint16_t Length;
+    uint32_t Returned;
+    uint32_t LatencyNs;
+} CR_TRACE_ACCESS;
+
+struct _CR_TRACE {
+    CR_CONFIG_BACKEND Base;
+    CR_MAPPED_FILE Map;
+    const CR_TRACE_HEADER* Header;
+    uint32_t Flags;              // CR_TRACE_REALTIME
+    uint32_t MeanLatencyNs;
+    CR_TRACE_FUNCTION* Functions;    // Sorted by Key
+    uint32_t FunctionCount;
+    uint32_t AccessCount;
+    CR_TRACE_ACCESS* Accesses;       // Sorted by Key, Offset, Length
+    uint8_t* Images;
+    CR_TRACE_REPLAY_STATS Stats;     // Updated atomically
+};
+
+CR_INLINE const uint8_t* CrTraceData(_In_ const CR_TRACE_RECORD* Record)
+{
+    return (const uint8_t*)(Record + 1);
+}
+
+static int
+CrTraceAccessCompare(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    const CR_TRACE_ACCESS* left = (const CR_TRACE_ACCESS*)Left;
+    const CR_TRACE_ACCESS* right = (const CR_TRACE_ACCESS*)Right;
+
+    if (left->Key != right->Key) {
+        return (left->Key > right->Key) ? 1 : -1;
+    }
+    if (left->Offset != right->Offset) {
+        return (left->Offset > right->Offset) ? 1 : -1;
+    }
+    return (left->Length > right->Length) - (left->Length < right->Length);
+}
+
+static CR_TRACE_FUNCTION*
+CrTraceFindFunction(
+    _In_ const CR_TRACE* Trace,
+    _In_ uint32_t Key
+)
+{
+    uint32_t low = 0;
+    uint32_t high = Trace->FunctionCount;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (Trace->Functions[mid].Key < Key) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return (low < Trace->FunctionCount && Trace->Functions[low].Key == Key) ? &Trace->Functions[low] : NULL;
+}
+
+static const CR_TRACE_ACCESS*
+CrTraceFindAccess(
+    _In_ const CR_TRACE* Trace,
+    _In_ uint32_t Key,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Length
+)
+{
+    uint32_t low = 0;
+    uint32_t high = Trace->AccessCount;
+    const CR_TRACE_ACCESS* access;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        access = &Trace->Accesses[mid];
+        if (access->Key < Key || (access->Key == Key &&
+            (access->Offset < Offset || (access->Offset == Offset && access->Length < Length)))) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low == Trace->AccessCount) {
+        return NULL;
+    }
+    access = &Trace->Accesses[low];
+    return (access->Key == Key && access->Offset == Offset && access->Length == Length) ? access : NULL;
+}
+
+// Whether every byte in [Offset, Offset + Length) was read at some point.
+static int
+CrTraceKnown(
+    _In_ const CR_TRACE_FUNCTION* Function,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Length
+)
+{
+    const uint8_t* known = Function->Image + CR_CONFIG_SPACE_SIZE;
+    uint32_t end = Offset + Length;
+
+    // Whole bitmap bytes where possible; scans mostly ask for aligned dwords or more.
+    while (Offset < end && (Offset & 7) != 0) {
+        if (!((known[Offset >> 3] >> (Offset & 7)) & 1)) {
+            return 0;
+        }
+        Offset++;
+    }
+    while (end - Offset >= 8) {
+        if (known[Offset >> 3] != 0xFF) {
+            return 0;
+        }
+        Offset += 8;
+    }
+    while (Offset < end) {
+        if (!((known[Offset >> 3] >> (Offset & 7)) & 1)) {
+            return 0;
+        }
+        Offset++;
+    }
+    return 1;
+}
+
+static uint32_t
+CrTraceRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    PCR_TRACE trace = (PCR_TRACE)Backend;
+    uint64_t start = (trace->Flags & CR_TRACE_REALTIME) ? CrTraceNow() : 0;
+    uint32_t key = CrAddressKey(Address);
+    uint32_t latency = trace->MeanLatencyNs;
+    const CR_TRACE_FUNCTION* function;
+    const CR_TRACE_ACCESS* access;
+    uint32_t got;
+
+    if (Offset >= CR_CONFIG_SPACE_SIZE || Length > CR_CONFIG_SPACE_SIZE - Offset) {
+        return 0;
+    }
+    CrAtomicAdd64(&trace->Stats.Reads, 1);
+    function = CrTraceFindFunction(trace, key);
+    access = CrTraceFindAccess(trace, key, Offset, Length);
+    if (access != NULL) {
+        CrAtomicAdd64(&trace->Stats.Matched, 1);
+        latency = access->LatencyNs;
+        got = access->Returned;
+    }
+    else if (function == NULL || function->Flags == 0) {
+        // Never seen, or only ever as all-ones: absent.
+        got = Length;
+    }
+    else if (function->Image != NULL && CrTraceKnown(function, Offset, Length)) {
+        got = Length;
+    }
+    else if (function->Flags == CR_TRACE_FUNCTION_UNREACHABLE) {
+        got = 0;
+    }
+    else {
+        CrAtomicAdd64(&trace->Stats.Misses, 1);
+        got = 0;
+    }
+
+    if (function != NULL && function->Image != NULL) {
+        memcpy(Buffer, function->Image + Offset, got);
+    }
+    else {
+        memset(Buffer, 0xFF, got);
+    }
+    CrAtomicAdd64(&trace->Stats.Bytes, got);
+
+    if (trace->Flags & CR_TRACE_REALTIME) {
+        while (CrTraceNow() - start < latency) {
+            CrCpuRelax();
+        }
+    }
+    return got;
+}
+
+static uint32_t
+CrTraceEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    PCR_TRACE trace = (PCR_TRACE)Backend;
+    uint32_t count = 0;
+    uint32_t i;
+    uint16_t segment;
+
+    for (i = 0; i < trace->FunctionCount; i++) {
+        segment = (uint16_t)(trace->Functions[i].Key >> 16);
+        if (i != 0 && (uint16_t)(trace->Functions[i - 1].Key >> 16) == segment) {
+            continue;
+        }
+        if (count < Capacity) {
+            Segments[count] = segment;
+        }
+        count++;
+    }
+    return count;
+}
+
+static void
+CrTraceEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    PCR_TRACE trace = (PCR_TRACE)Backend;
+    uint32_t bus;
+    uint32_t i;
+
+    // Functions only ever read as all ones replay as absent either way.
+    for (i = 0; i < trace->FunctionCount; i++) {
+        if ((uint16_t)(trace->Functions[i].Key >> 16) != Segment || trace->Functions[i].Flags == 0) {
+            continue;
+        }
+        bus = (trace->Functions[i].Key >> 8) & 0xFF;
+        Buses[bus >> 5] |= 1u << (bus & 31);
+    }
+}
+
+static void
+CrTraceBackendClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CrTraceClose((PCR_TRACE)Backend);
+}
+
+// Checks every record against the file and collects them into
+// Trace->Accesses, in file order.
+static CR_STATUS
+CrTraceIndexRecords(
+    _Inout_ PCR_TRACE Trace
+)
+{
+    const CR_TRACE_HEADER* header = Trace->Header;
+    const uint8_t* next = (const uint8_t*)(header + 1);
+    const uint8_t* end = next + header->DataSize;
+    uint32_t i;
+
+    Trace->Accesses = (CR_TRACE_ACCESS*)CrAlloc(((size_t)header->RecordCount + 1) * sizeof(CR_TRACE_ACCESS));
+    if (Trace->Accesses == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    for (i = 0; i < header->RecordCount; i++) {
+        const CR_TRACE_RECORD* record = (const CR_TRACE_RECORD*)next;
+        CR_TRACE_ACCESS* access = &Trace->Accesses[i];
+
+        if ((size_t)(end - next) < sizeof(*record) ||
+            (size_t)(end - next) < CR_TRACE_RECORD_SPAN(record->Returned) ||
+            record->Returned > record->Length || record->Offset >= CR_CONFIG_SPACE_SIZE ||
+            record->Length > CR_CONFIG_SPACE_SIZE - record->Offset) {
+            return CR_E_INVALID_PARAMETER;
+        }
+        access->Key = record->Key;
+        access->Offset = record->Offset;
+        access->Length = record->Length;
+        access->Returned = record->Returned;
+        access->LatencyNs = record->LatencyNs;
+        next += CR_TRACE_RECORD_SPAN(record->Returned);
+    }
+    if (next != end) {
+        return CR_E_INVALID_PARAMETER;
+    }
+    Trace->AccessCount = header->RecordCount;
+    return CR_OK;
+}
+
+// Builds the function table from the sorted accesses, then replays the
+// records in order into the images of the functions that answered.
+static CR_STATUS
+CrTraceBuildFunctions(
+    _Inout_ PCR_TRACE Trace
+)
+{
+    const CR_TRACE_RECORD* record;
+    CR_TRACE_FUNCTION* function;
+    uint32_t present = 0;
+    uint32_t i;
+    uint32_t j;
+
+    Trace->Functions = (CR_TRACE_FUNCTION*)CrAlloc(((size_t)Trace->AccessCount + 1) * sizeof(CR_TRACE_FUNCTION));
+    if (Trace->Functions == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    for (i = 0; i < Trace->AccessCount; i++) {
+        if (i == 0 || Trace->Accesses[i].Key != Trace->Accesses[i - 1].Key) {
+            Trace->Functions[Trace->FunctionCount++].Key = Trace->Accesses[i].Key;
+        }
+    }
+
+    for (record = CrTraceNext(Trace, NULL); record != NULL; record = CrTraceNext(Trace, record)) {
+        const uint8_t* data = CrTraceData(record);
+
+        function = CrTraceFindFunction(Trace, record->Key);
+        if (record->Returned == 0) {
+            function->Flags |= CR_TRACE_FUNCTION_UNREACHABLE;
+            continue;
+        }
+        for (j = 0; j < record->Returned && !(function->Flags & CR_TRACE_FUNCTION_PRESENT); j++) {
+            if (data[j] != 0xFF) {
+                function->Flags |= CR_TRACE_FUNCTION_PRESENT;
+                present++;
+            }
+        }
+    }
+
+    Trace->Images = (uint8_t*)CrAlloc((size_t)present * CR_TRACE_IMAGE_SIZE + 1);
+    if (Trace->Images == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    present = 0;
+    for (i = 0; i < Trace->FunctionCount; i++) {
+        function = &Trace->Functions[i];
+        if (function->Flags & CR_TRACE_FUNCTION_PRESENT) {
+            function->Image = Trace->Images + (size_t)present++ * CR_TRACE_IMAGE_SIZE;
+        }
+    }
+
+    for (record = CrTraceNext(Trace, NULL); record != NULL; record = CrTraceNext(Trace, record)) {
+        uint8_t* known;
+
+        function = CrTraceFindFunction(Trace, record->Key);
+        if (function->Image == NULL) {
+            continue;
+        }
+        memcpy(function->Image + record->Offset, CrTraceData(record), record->Returned);
+        known = function->Image + CR_CONFIG_SPACE_SIZE;
+        for (j = record->Offset; j < (uint32_t)record->Offset + record->Returned; j++) {
+            known[j >> 3] |= (uint8_t)(1u << (j & 7));
+        }
+    }
+    return CR_OK;
+}
+
+CR_STATUS
+CrTraceOpen(
+    _In_ const char* Path,
+    _In_ uint32_t Flags,
+    _Out_ PCR_TRACE* Trace
+)
+{
+    const CR_TRACE_HEADER* header;
+    PCR_TRACE trace;
+    CR_STATUS status = CR_OK;
+
+    *Trace = NULL;
+    trace = (PCR_TRACE)CrAlloc(sizeof(*trace));
+    if (trace == NULL) {
+        return CR_E_NO_MEMORY;
+    }
+    status = CrMapFile(Path, sizeof(CR_TRACE_HEADER), &trace->Map);
+    if (status != CR_OK) {
+        CrFree(trace);
+        return status;
+    }
+
+    header = (const CR_TRACE_HEADER*)trace->Map.View;
+    if (header->Magic != CR_TRACE_MAGIC) {
+        status = CR_E_INVALID_PARAMETER;
+    }
+    else if (header->Version != CR_TRACE_VERSION || header->HeaderSize != sizeof(CR_TRACE_HEADER) ||
+        header->RecordSize != sizeof(CR_TRACE_RECORD)) {
+        status = CR_E_UNSUPPORTED;
+    }
+    else if (header->DataSize != trace->Map.Length - sizeof(*header) ||
+        header->RecordCount > header->DataSize / sizeof(CR_TRACE_RECORD)) {
+        status = CR_E_INVALID_PARAMETER;
+    }
+    trace->Header = header;
+    trace->Flags = Flags;
+    if (status == CR_OK) {
+        status = CrTraceIndexRecords(trace);
+    }
+    if (status == CR_OK) {
+        qsort(trace->Accesses, trace->AccessCount, sizeof(CR_TRACE_ACCESS), CrTraceAccessCompare);
+        status = CrTraceBuildFunctions(trace);
+    }
+    if (status != CR_OK) {
+        CrTraceClose(trace);
+        return status;
+    }
+
+    trace->MeanLatencyNs = (header->RecordCount == 0) ? 0 : (uint32_t)(header->LatencyNs / header->RecordCount);
+    trace->Base.Name = "replay";
+    trace->Base.Read = CrTraceRead;
+    trace->Base.Close = CrTraceBackendClose;
+    trace->Base.EnumerateSegments = CrTraceEnumerateSegments;
+    trace->Base.EnumerateBuses = CrTraceEnumerateBuses;
+    *Trace = trace;
+    return CR_OK;
+}
+
+const CR_TRACE_HEADER*
+CrTraceHeader(
+    _In_ const CR_TRACE* Trace
+)
+{
+    return Trace->Header;
+}
+
+const CR_TRACE_RECORD*
+CrTraceNext(
+    _In_ const CR_TRACE* Trace,
+    _In_opt_ const CR_TRACE_RECORD* Record
+)
+{
+    const uint8_t* end = (const uint8_t*)(Trace->Header + 1) + Trace->Header->DataSize;
+    const uint8_t* next;
+
+    // Opening checked that the records exactly fill the data.
+    next = (Record == NULL) ? (const uint8_t*)(Trace->Header + 1) :
+        (const uint8_t*)Record + CR_TRACE_RECORD_SPAN(Record->Returned);
+    return (next < end) ? (const CR_TRACE_RECORD*)next : NULL;
+}
+
+PCR_CONFIG_BACKEND
+CrTraceBackend(
+    _In_ PCR_TRACE Trace
+)
+{
+    return &Trace->Base;
+}
+
+void
+CrTraceReplayStats(
+    _In_ const CR_TRACE* Trace,
+    _Out_ PCR_TRACE_REPLAY_STATS Stats
+)
+{
+    Stats->Reads = CrAtomicLoad64(&Trace->Stats.Reads);
+    Stats->Matched = CrAtomicLoad64(&Trace->Stats.Matched);
+    Stats->Misses = CrAtomicLoad64(&Trace->Stats.Misses);
+    Stats->Bytes = CrAtomicLoad64(&Trace->Stats.Bytes);
+}
+
+void
+CrTraceClose(
+    _In_ PCR_TRACE Trace
+)
+{
+    if (Trace != NULL) {
+        CrUnmapFile(&Trace->Map);
+        if (Trace->Images != NULL) CrFree(Trace->Images);
+        if (Trace->Functions != NULL) CrFree(Trace->Functions);
+        if (Trace->Accesses != NULL) CrFree(Trace->Accesses);
+        CrFree(Trace);
+    }
+}
+
+#endif // !_KERNEL_MODE
@@ -0,0 +1,258 @@
+// CRdiff.c
+//
+// Snapshot diff tool. With two files it lists every field that differs;
+// with more, the first is the golden configuration and each other file gets
+// one summary line, compared on all CPUs.
+//
+//   CRdiff [-i] [-a] [-j WORKERS] LEFT.snap RIGHT.snap
+//   CRdiff [-i] [-a] [-j WORKERS] GOLDEN.snap HOST1.snap HOST2.snap ...
+//
+// -i pairs functions by vendor, device and serial number instead of address,
+// for hosts whose bus numbering differs. -a compares volatile status bits
+// too. Exits 1 if anything differs, 2 on errors.
+
+#include "../CRcore/crcore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIFF_ENTRY_CAPACITY 4096
+
+static const char*
+DiffStatus(
+    _In_ CR_STATUS Status
+)
+{
+    switch (Status) {
+    case CR_OK:                  return "success";
+    case CR_E_MORE_DATA:         return "more data";
+    case CR_E_INVALID_PARAMETER: return "invalid or corrupt file";
+    case CR_E_NO_MEMORY:         return "out of memory";
+    case CR_E_NOT_FOUND:         return "not found";
+    case CR_E_IO:                return "I/O error";
+    case CR_E_UNSUPPORTED:       return "unsupported version or size";
+    default:                     return "unknown error";
+    }
+}
+
+static void
+DiffPrintAddress(
+    _In_ uint32_t Key
+)
+{
+    CR_ADDRESS address = CrAddressFromKey(Key);
+    printf("%04X:%02X:%02X.%u", address.Segment, address.Bus, address.Device, address.Function);
+}
+
+static void
+DiffPrintEntry(
+    _In_ const CR_DIFF_ENTRY* Entry
+)
+{
+    const char* name;
+
+    switch (Entry->Kind) {
+    case CR_DIFF_REMOVED:
+        printf("- ");
+        DiffPrintAddress(Entry->LeftKey);
+        printf("\n");
+        return;
+    case CR_DIFF_ADDED:
+        printf("+ ");
+        DiffPrintAddress(Entry->RightKey);
+        printf("\n");
+        return;
+    case CR_DIFF_TRUNCATED:
+        printf("! ");
+        DiffPrintAddress(Entry->LeftKey);
+        if (Entry->RightKey != Entry->LeftKey) {
+            printf(" -> ");
+            DiffPrintAddress(Entry->RightKey);
+        }
+        printf("  captured %u -> %u bytes, compared up to %03X\n", Entry->Left, Entry->Right, Entry->Offset);
+        return;
+    default:
+        break;
+    }
+
+    printf("~ ");
+    DiffPrintAddress(Entry->LeftKey);
+    if (Entry->RightKey != Entry->LeftKey) {
+        printf(" -> ");
+        DiffPrintAddress(Entry->RightKey);
+    }
+    printf("  %03X", Entry->Offset);
+    name = (Entry->Offset < CR_CONFIG_HEADER_SIZE) ? CrConfigFieldName(Entry->HeaderType, Entry->Offset) : NULL;
+    if (name != NULL) {
+        printf(" %-24s", name);
+    }
+    else if (Entry->CapabilityOffset != 0) {
+        printf(" %s cap %04X@%03X +%02X", (Entry->CapabilityFlags & CR_CAP_EXTENDED) ? "ext" : "std",
+            Entry->CapabilityId, Entry->CapabilityOffset, Entry->Offset - Entry->CapabilityOffset);
+    }
+    else {
+        printf(" %-24s", "");
+    }
+    printf("  %0*X -> %0*X\n", Entry->Width * 2, Entry->Left, Entry->Width * 2, Entry->Right);
+}
+
+static int
+DiffPair(
+    _In_ const char* LeftPath,
+    _In_ const char* RightPath,
+    _In_ const CR_DIFF_OPTIONS* Options
+)
+{
+    PCR_SNAPFILE left = NULL;
+    PCR_SNAPFILE right = NULL;
+    CR_DIFF_ENTRY* entries;
+    CR_DIFF_SUMMARY summary;
+    CR_STATUS status;
+    uint32_t shown;
+    uint32_t i;
+    int result = 2;
+
+    entries = (CR_DIFF_ENTRY*)malloc(DIFF_ENTRY_CAPACITY * sizeof(*entries));
+    if (entries == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    status = CrSnapFileOpen(LeftPath, &left);
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", LeftPath, DiffStatus(status));
+        goto Exit;
+    }
+    status = CrSnapFileOpen(RightPath, &right);
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", RightPath, DiffStatus(status));
+        goto Exit;
+    }
+    status = CrSnapDiff(left, right, Options, entries, DIFF_ENTRY_CAPACITY, &summary);
+    if (status != CR_OK && status != CR_E_MORE_DATA) {
+        fprintf(stderr, "Could not diff %s and %s: %s\n", LeftPath, RightPath, DiffStatus(status));
+        goto Exit;
+    }
+
+    shown = summary.Removed + summary.Added + summary.Fields + summary.Truncated;
+    if (shown > DIFF_ENTRY_CAPACITY) {
+        shown = DIFF_ENTRY_CAPACITY;
+    }
+    for (i = 0; i < shown; i++) {
+        DiffPrintEntry(&entries[i]);
+    }
+    if (status == CR_E_MORE_DATA) {
+        printf("... %u more\n", summary.Removed + summary.Added + summary.Fields + summary.Truncated - shown);
+    }
+    printf("%u matched, %u changed, %u field(s), %u removed, %u added, %u truncated\n",
+        summary.Matched, summary.Changed, summary.Fields, summary.Removed, summary.Added, summary.Truncated);
+    result = (summary.Changed != 0 || summary.Removed != 0 || summary.Added != 0 || summary.Truncated != 0) ? 1 : 0;
+
+Exit:
+    if (left != NULL) CrSnapFileClose(left);
+    if (right != NULL) CrSnapFileClose(right);
+    free(entries);
+    return result;
+}
+
+static int
+DiffMany(
+    _In_ const char* GoldenPath,
+    _In_reads_(Count) const char* const* Paths,
+    _In_ uint32_t Count,
+    _In_ const CR_DIFF_OPTIONS* Options
+)
+{
+    PCR_SNAPFILE golden;
+    CR_DIFF_SUMMARY* summaries;
+    CR_STATUS status;
+    uint32_t differing = 0;
+    uint32_t failed = 0;
+    uint32_t i;
+
+    summaries = (CR_DIFF_SUMMARY*)malloc((size_t)Count * sizeof(*summaries));
+    if (summaries == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+    status = CrSnapFileOpen(GoldenPath, &golden);
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", GoldenPath, DiffStatus(status));
+        free(summaries);
+        return 2;
+    }
+    status = CrSnapDiffFiles(golden, Paths, Count, Options, summaries);
+    CrSnapFileClose(golden);
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not diff against %s: %s\n", GoldenPath, DiffStatus(status));
+        free(summaries);
+        return 2;
+    }
+
+    for (i = 0; i < Count; i++) {
+        const CR_DIFF_SUMMARY* s = &summaries[i];
+        if (s->Status != CR_OK) {
+            printf("%s: %s\n", Paths[i], DiffStatus(s->Status));
+            failed++;
+            continue;
+        }
+        if (s->Changed == 0 && s->Removed == 0 && s->Added == 0 && s->Truncated == 0) {
+            printf("%s: identical (%u functions)\n", Paths[i], s->Matched);
+            continue;
+        }
+        printf("%s: %u changed, %u field(s), %u removed, %u added, %u truncated\n",
+            Paths[i], s->Changed, s->Fields, s->Removed, s->Added, s->Truncated);
+        differing++;
+    }
+    printf("%u of %u file(s) differ from %s\n", differing, Count - failed, GoldenPath);
+    free(summaries);
+    return (failed != 0) ? 2 : (differing != 0) ? 1 : 0;
+}
+
+static void
+DiffUsage(void)
+{
+    fprintf(stderr,
+        "Usage: CRdiff [-i] [-a] [-j WORKERS] LEFT RIGHT\n"
+        "       CRdiff [-i] [-a] [-j WORKERS] GOLDEN FILE FILE...\n");
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    CR_DIFF_OPTIONS options;
+    CR_EXECUTOR executor;
+    uint32_t workers = 0;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-i") == 0) {
+            options.Flags |= CR_DIFF_MATCH_IDENTITY;
+        }
+        else if (strcmp(argv[i], "-a") == 0) {
+            options.Flags |= CR_DIFF_NO_DEFAULT_MASKS;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workers = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else {
+            DiffUsage();
+            return 2;
+        }
+    }
+    if (argc - i < 2) {
+        DiffUsage();
+        return 2;
+    }
+    if (argc - i == 2) {
+        return DiffPair(argv[i], argv[i + 1], &options);
+    }
+
+    CrThreadExecutorInit(&executor, workers);
+    options.Executor = &executor;
+    return DiffMany(argv[i], (const char* const*)&argv[i + 1], (uint32_t)(argc - i - 1), &options);
+}
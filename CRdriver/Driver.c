@@ -9,7 +9,6 @@ DRIVER_INITIALIZE DriverEntry;
 // EVT_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd; // No longer needed as a primary callback
 EVT_WDF_DRIVER_UNLOAD EvtDriverUnload;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl;
-NTSTATUS MyPciScannerScanBus0AndPrint(WDFDEVICE Device);
 
 // Minimal stub for EvtDriverDeviceAdd if WDF_DRIVER_CONFIG_INIT still needs a non-NULL function pointer.
 // However, for WDF_NO_EVENT_CALLBACK, this might not even be referenced.
@@ -30,10 +29,12 @@ DriverEntry(
     WDF_DRIVER_CONFIG config;
     WDFDRIVER hDriver;
     WDF_OBJECT_ATTRIBUTES driverAttributes;
+    WDF_OBJECT_ATTRIBUTES requestAttributes;
     PWDFDEVICE_INIT pDeviceInit = NULL;
     WDFDEVICE hControlDevice = NULL;
     PDRIVER_CONTEXT driverContext = NULL;
     WDF_IO_QUEUE_CONFIG ioQueueConfig;
+    WDF_FILEOBJECT_CONFIG fileConfig;
     WDFQUEUE hQueue = NULL;
 
     DECLARE_CONST_UNICODE_STRING(ntDeviceName, L"\\Device\\MyPciScanner");
@@ -66,6 +67,17 @@ DriverEntry(
 
     driverContext = WdfGetDriverContext(hDriver);
     driverContext->ControlDevice = NULL;
+    driverContext->Backend = NULL;
+    driverContext->Cache = NULL;
+    driverContext->Stats = NULL;
+    MyPciScannerInitExecutor(&driverContext->Executor);
+
+    status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &driverContext->SamplingLock);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: WdfWaitLockCreate failed %!STATUS!\n", status));
+        return status;
+    }
 
     pDeviceInit = WdfControlDeviceInitAllocate(hDriver, &sddlString);
     if (pDeviceInit == NULL) {
@@ -89,6 +101,17 @@ DriverEntry(
     WdfDeviceInitSetCharacteristics(pDeviceInit, FILE_DEVICE_SECURE_OPEN, TRUE);
     WdfDeviceInitSetDeviceType(pDeviceInit, FILE_DEVICE_UNKNOWN);
 
+    // Sampling maps a ring into the requesting process, so those IOCTLs are
+    // handled in the caller's context and torn down on handle cleanup.
+    WdfDeviceInitSetIoInCallerContextCallback(pDeviceInit, EvtIoInCallerContext);
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK, EvtFileCleanup);
+    WdfDeviceInitSetFileObjectConfig(pDeviceInit, &fileConfig, WDF_NO_OBJECT_ATTRIBUTES);
+
+    // A coalesced topology request is completed by whichever request ran the
+    // scan, so its output buffer and start time travel with the request.
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, MYPCISCANNER_REQUEST_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(pDeviceInit, &requestAttributes);
+
     // Note: WdfDeviceSetPnpCapabilities is typically for PnP devices or if you need to
     // fine-tune capabilities. For a basic non-PnP control device primarily identified
     // by WdfDriverInitNonPnpDriver, explicitly setting Removable=WdfTrue might not be
@@ -117,7 +140,8 @@ DriverEntry(
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
         "MyPciScannerDriver: Symbolic link created\n"));
 
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig, WdfIoQueueDispatchSequential);
+    // Scans and batch reads only read shared state, so they run in parallel.
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig, WdfIoQueueDispatchParallel);
     ioQueueConfig.EvtIoDeviceControl = EvtIoDeviceControl;
     status = WdfIoQueueCreate(hControlDevice, &ioQueueConfig, WDF_NO_OBJECT_ATTRIBUTES, &hQueue);
     if (!NT_SUCCESS(status)) {
@@ -126,9 +150,81 @@ DriverEntry(
         // Let EvtDriverUnload handle deletion
         return status;
     }
+
+    // Delta scans update the snapshots in the driver context and are
+    // forwarded here to run one at a time.
+    WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchSequential);
+    ioQueueConfig.EvtIoDeviceControl = EvtIoDeviceControl;
+    status = WdfIoQueueCreate(hControlDevice, &ioQueueConfig, WDF_NO_OBJECT_ATTRIBUTES, &driverContext->DeltaQueue);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: WdfIoQueueCreate (delta) failed %!STATUS!\n", status));
+        return status;
+    }
+
+    status = MyPciScannerCreateWatch(hControlDevice);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: Topology watch creation failed %!STATUS!\n", status));
+        return status;
+    }
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
         "MyPciScannerDriver: I/O queue created\n"));
 
+    status = MyPciScannerCreateDefaultFilter(&driverContext->DefaultFilter);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: Default filter compilation failed %!STATUS!\n", status));
+        return status;
+    }
+
+#if MYPCISCANNER_SIMULATE
+    status = MyPciScannerCreateSimBackend(&driverContext->Backend);
+#else
+    // Prefer the memory-mapped ECAM windows; the HAL path stays as a fallback
+    // for firmware without an MCFG table.
+    status = MyPciScannerCreateEcamBackend(&driverContext->Backend);
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+            "MyPciScannerDriver: ECAM unavailable (%!STATUS!), falling back to HAL config access\n", status));
+        status = MyPciScannerCreateHalBackend(&driverContext->Backend);
+    }
+#endif
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: Config-space backend creation failed %!STATUS!\n", status));
+        return status;
+    }
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MyPciScannerDriver: Using '%s' config-space backend\n", driverContext->Backend->Name));
+
+    status = MyPciScannerCreateStats(&driverContext->Stats);
+    if (NT_SUCCESS(status)) {
+        PCR_CONFIG_BACKEND counted;
+
+        // Every config read, from scans and the sampling timer alike, is
+        // counted and timed by the wrapper.
+        status = MyPciScannerStatusFromCr(CrStatsWrapBackend(driverContext->Stats, driverContext->Backend, &counted));
+        if (NT_SUCCESS(status)) {
+            driverContext->Backend = counted;
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: Statistics setup failed %!STATUS!\n", status));
+        return status;
+    }
+
+    // Above the counting wrapper, so reads the cache answers do not show up
+    // as config reads.
+    status = MyPciScannerStatusFromCr(CrCacheCreate(driverContext->Backend,
+        MYPCISCANNER_CACHE_SLOTS, MYPCISCANNER_CACHE_FUNCTIONS, &driverContext->Cache));
+    if (!NT_SUCCESS(status)) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: Config-space cache creation failed %!STATUS!\n", status));
+        return status;
+    }
+
     WdfControlFinishInitializing(hControlDevice);
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
         "MyPciScannerDriver: Control device initialization finished\n"));
@@ -165,6 +261,10 @@ EvtDriverUnload(
     PDRIVER_CONTEXT driverContext = WdfGetDriverContext(Driver);
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: EvtDriverUnload - IN\n"));
 
+    if (driverContext != NULL && driverContext->WatchTimer != NULL) {
+        // Waits for a running check, which uses the queue deleted below.
+        WdfTimerStop(driverContext->WatchTimer, TRUE);
+    }
     if (driverContext != NULL && driverContext->ControlDevice != NULL) {
         KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
             "MyPciScannerDriver: EvtDriverUnload - Deleting control device (Handle: %p)\n", driverContext->ControlDevice));
@@ -175,11 +275,28 @@ EvtDriverUnload(
         KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
             "MyPciScannerDriver: EvtDriverUnload - ControlDevice handle in context is NULL or context is NULL (nothing to delete here).\n"));
     }
+
+    // The control device (and its queue) is gone, so no scan can still be using the backend.
+    if (driverContext != NULL) {
+        CrCacheFree(driverContext->Cache);
+        driverContext->Cache = NULL;
+    }
+    if (driverContext != NULL && driverContext->Backend != NULL) {
+        CrBackendClose(driverContext->Backend);
+        driverContext->Backend = NULL;
+    }
+    if (driverContext != NULL) {
+        CrDeltaFree(&driverContext->Delta);
+        CrDeltaFree(&driverContext->Watch);
+        CrFilterFree(driverContext->DefaultFilter);
+        driverContext->DefaultFilter = NULL;
+        // After the backend: the wrapper counts into Stats until it is closed.
+        CrStatsFree(driverContext->Stats);
+        driverContext->Stats = NULL;
+    }
     KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: EvtDriverUnload - OUT\n"));
 }
 
-// EvtIoDeviceControl and MyPciScannerScanBus0AndPrint remain the same as your last working version.
-// Ensure they are present below.
 VOID
 EvtIoDeviceControl(
     _In_ WDFQUEUE   Queue,
@@ -191,99 +308,501 @@ EvtIoDeviceControl(
 {
     NTSTATUS status = STATUS_SUCCESS;
     WDFDEVICE device = WdfIoQueueGetDevice(Queue);
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PVOID inputBuffer = NULL;
+    PVOID outputBuffer = NULL;
+    size_t inputLength = 0;
+    size_t outputLength = 0;
+    size_t bytesWritten = 0;
+    // Measured from dispatch, so time spent queued behind other requests is
+    // not included.
+    uint64_t start = CrStatsNow(driverContext->Stats);
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
 
-    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
-        "MyPciScannerDriver: EvtIoDeviceControl - IN (IoControlCode=0x%X)\n", IoControlCode));
+    switch (IoControlCode) {
+    case IOCTL_MYPCISCANNER_SCAN_BUS0:
+        if (InputBufferLength != 0) {
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_FILTER_SPEC), &inputBuffer, &inputLength);
+        }
+        // Anything smaller than the header cannot even carry the size probe answer.
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_SCAN_HEADER), &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerScanBus0(device, (PCR_FILTER_SPEC)inputBuffer, inputLength,
+                (PCR_SCAN_HEADER)outputBuffer, outputLength, &bytesWritten);
+        }
+        break;
 
-    if (IoControlCode == IOCTL_MYPCISCANNER_SCAN_BUS0) {
-        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
-            "MyPciScannerDriver: Scan bus 0 IOCTL received.\n")); // Corrected string
-        status = MyPciScannerScanBus0AndPrint(device);
-        WdfRequestCompleteWithInformation(Request, status, 0);
-    }
-    else {
+    case IOCTL_MYPCISCANNER_SCAN_TOPOLOGY:
+        if (InputBufferLength != 0) {
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_TOPOLOGY_REQUEST), &inputBuffer, &inputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_SCAN_HEADER), &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            // METHOD_BUFFERED shares one system buffer for input and output;
+            // results are only written once the scan is over.
+            status = MyPciScannerScanTopology(Request, (PCR_TOPOLOGY_REQUEST)inputBuffer, inputLength,
+                (PCR_SCAN_HEADER)outputBuffer, outputLength, start);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_SCAN_VFS:
+        if (InputBufferLength != 0) {
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_TOPOLOGY_REQUEST), &inputBuffer, &inputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_VF_HEADER), &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerScanVfs((PCR_TOPOLOGY_REQUEST)inputBuffer, inputLength,
+                (PCR_VF_HEADER)outputBuffer, outputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_SCAN_DELTA:
+        if (Queue != driverContext->DeltaQueue) {
+            status = WdfRequestForwardToIoQueue(Request, driverContext->DeltaQueue);
+            if (NT_SUCCESS(status)) {
+                return;
+            }
+            break;
+        }
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_DELTA_REQUEST), &inputBuffer, NULL);
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_DELTA_HEADER), &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerScanDelta(device, (PCR_DELTA_REQUEST)inputBuffer,
+                (PCR_DELTA_HEADER)outputBuffer, outputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_WAIT_CHANGE:
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_DELTA_REQUEST), &inputBuffer, NULL);
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_DELTA_HEADER), &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerWaitChange(Request, (PCR_DELTA_REQUEST)inputBuffer,
+                (PCR_DELTA_HEADER)outputBuffer, outputLength, start);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_READ_BATCH:
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_BATCH_HEADER), &inputBuffer, &inputLength);
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_BATCH_HEADER), &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerReadBatch(device, (PCR_BATCH_HEADER)inputBuffer, inputLength,
+                (PCR_BATCH_HEADER)outputBuffer, outputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_QUERY_CAPS:
+    case IOCTL_MYPCISCANNER_READ_CAP:
+        status = WdfRequestRetrieveInputBuffer(Request,
+            (IoControlCode == IOCTL_MYPCISCANNER_READ_CAP) ? sizeof(CR_CAP_READ_REQUEST) : sizeof(CR_CAP_REQUEST),
+            &inputBuffer, &inputLength);
+        if (NT_SUCCESS(status)) {
+            status = WdfRequestRetrieveOutputBuffer(Request,
+                (IoControlCode == IOCTL_MYPCISCANNER_READ_CAP) ? sizeof(CR_CAP_READ_REPLY) : sizeof(CR_CAP_HEADER),
+                &outputBuffer, &outputLength);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerCapabilities(IoControlCode, inputBuffer, inputLength,
+                outputBuffer, outputLength, &bytesWritten);
+        }
+        break;
+
+    case IOCTL_MYPCISCANNER_FLUSH_CACHE:
+        if (InputBufferLength != 0) {
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_CACHE_FLUSH_REQUEST), &inputBuffer, NULL);
+        }
+        if (NT_SUCCESS(status)) {
+            status = MyPciScannerFlushCache((PCR_CACHE_FLUSH_REQUEST)inputBuffer);
+        }
+        break;
+
+    default:
         KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
             "MyPciScannerDriver: Unknown IOCTL 0x%X\n", IoControlCode));
         status = STATUS_INVALID_DEVICE_REQUEST;
-        WdfRequestComplete(Request, status);
+        break;
     }
 
-    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
-        "MyPciScannerDriver: EvtIoDeviceControl - OUT (Status=%!STATUS!)\n", status));
+    if (status == STATUS_PENDING) {
+        // Owned by a coalesced scan or the topology watch, which completes it.
+        return;
+    }
+    MyPciScannerCompleteRequest(Request, IoControlCode, start, status, bytesWritten);
 }
 
+// Completes Request and counts it. STATUS_BUFFER_OVERFLOW is a warning: the
+// I/O manager still copies BytesWritten back, so the caller sees TotalCount
+// and can resize.
+VOID
+MyPciScannerCompleteRequest(
+    _In_ WDFREQUEST Request,
+    _In_ ULONG IoControlCode,
+    _In_ uint64_t Start,
+    _In_ NTSTATUS Status,
+    _In_ size_t BytesWritten
+)
+{
+    if (NT_ERROR(Status)) {
+        BytesWritten = 0;
+    }
+    CrStatsRecordRequest(WdfGetDriverContext(WdfGetDriver())->Stats, IoControlCode, Start,
+        BytesWritten, NT_ERROR(Status));
+    WdfRequestCompleteWithInformation(Request, Status, BytesWritten);
+}
+
+// What a scan reports when the caller sends no filter: the vendors this tool
+// was written for.
+static const CR_FILTER_RULE MyPciScannerDefaultRules[] = {
+    { PCI_VENDOR_ID_INTEL,   CR_FILTER_ANY_ID, 0, 0, 0, 255, 0 },
+    { PCI_VENDOR_ID_AMD,     CR_FILTER_ANY_ID, 0, 0, 0, 255, 0 },
+    { PCI_VENDOR_ID_ATI_AMD, CR_FILTER_ANY_ID, 0, 0, 0, 255, 0 },
+};
+
 NTSTATUS
-MyPciScannerScanBus0AndPrint(
-    _In_ WDFDEVICE Device
+MyPciScannerCreateDefaultFilter(
+    _Out_ PCR_FILTER* Filter
+)
+{
+    return MyPciScannerStatusFromCr(CrFilterCompile(MyPciScannerDefaultRules,
+        ARRAYSIZE(MyPciScannerDefaultRules), Filter));
+}
+
+// Scans bus 0 and writes one CR_FUNCTION_RECORD per matching function straight
+// into the caller's METHOD_BUFFERED output buffer. Functions that do not fit are
+// still counted in TotalCount so the caller can size its next attempt.
+NTSTATUS
+MyPciScannerScanBus0(
+    _In_ WDFDEVICE Device,
+    _In_reads_bytes_opt_(FilterLength) PCR_FILTER_SPEC FilterSpec,
+    _In_ size_t FilterLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_SCAN_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten
 )
 {
     UNREFERENCED_PARAMETER(Device);
 
-    NTSTATUS status = STATUS_SUCCESS;
-    PCI_COMMON_CONFIG pciConfig;
-    ULONG busNumber = 0;
-    ULONG deviceNumber;
-    ULONG functionNumber;
-    ULONG bytesRead = 0;
-
-    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: MyPciScannerScanBus0AndPrint - IN\n"));
-    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: Starting scan of PCI Bus %d\n", busNumber));
-
-    for (deviceNumber = 0; deviceNumber < PCI_MAX_DEVICES; deviceNumber++)
-    {
-        for (functionNumber = 0; functionNumber < PCI_MAX_FUNCTIONS; functionNumber++)
-        {
-            RtlZeroMemory(&pciConfig, sizeof(PCI_COMMON_CONFIG));
-            pciConfig.VendorID = PCI_INVALID_VENDORID;
-            bytesRead = 0;
-
-            // ** SIMULATION / TESTING HOOK **
-            if (busNumber == 0 && deviceNumber == 2 && functionNumber == 0) {
-                pciConfig.VendorID = PCI_VENDOR_ID_INTEL;
-                pciConfig.DeviceID = 0x1234;
-                pciConfig.HeaderType = 0x00;
-                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: SIMULATING Intel device at 0:%d:%d\n", deviceNumber, functionNumber));
-                bytesRead = sizeof(PCI_COMMON_CONFIG);
-            }
-            else if (busNumber == 0 && deviceNumber == 3 && functionNumber == 0) {
-                pciConfig.VendorID = PCI_VENDOR_ID_AMD;
-                pciConfig.DeviceID = 0x5678;
-                pciConfig.HeaderType = 0x00;
-                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: SIMULATING AMD device at 0:%d:%d\n", deviceNumber, functionNumber));
-                bytesRead = sizeof(PCI_COMMON_CONFIG);
-            }
-            // ** END SIMULATION / TESTING HOOK **
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    CR_SCAN_OPTIONS options;
+    PCR_FILTER filter = NULL;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    RtlZeroMemory(&options, sizeof(options));
+    options.Match = driverContext->DefaultFilter;
+    if (FilterSpec != NULL) {
+        // Compiling copies the spec out of the shared system buffer before
+        // any results are written over it.
+        status = CrFilterCompileSpec(FilterSpec, FilterLength, &filter, NULL);
+        if (status != CR_OK) {
+            return MyPciScannerStatusFromCr(status);
+        }
+        options.Match = filter;
+    }
 
-            if (bytesRead == 0 || pciConfig.VendorID == PCI_INVALID_VENDORID) {
-                if (functionNumber == 0) {
-                    break;
-                }
-                continue;
-            }
+    status = CrScanBusToBuffer(CrCacheBackend(driverContext->Cache), 0, 0, &options, Output, OutputBufferLength, BytesWritten);
+    CrFilterFree(filter);
+    return MyPciScannerStatusFromCr(status);
+}
 
-            if (pciConfig.VendorID == PCI_VENDOR_ID_INTEL ||
-                pciConfig.VendorID == PCI_VENDOR_ID_AMD ||
-                pciConfig.VendorID == PCI_VENDOR_ID_ATI_AMD)
-            {
-                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
-                    "MyPciScannerDriver: Found Device on Bus %d, Device %d, Function %d\n",
-                    busNumber, deviceNumber, functionNumber));
-                KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
-                    "  VendorID: 0x%04X, DeviceID: 0x%04X\n",
-                    pciConfig.VendorID, pciConfig.DeviceID));
-            }
+// Called once per coalesced request, on the thread that ran the scan.
+static VOID
+MyPciScannerTopologyComplete(
+    _In_ PCR_FLIGHT_WAITER Waiter,
+    _In_ CR_STATUS Status,
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count
+)
+{
+    PMYPCISCANNER_REQUEST_CONTEXT requestContext = CONTAINING_RECORD(Waiter, MYPCISCANNER_REQUEST_CONTEXT, Waiter);
+    size_t bytesWritten = 0;
 
-            if (functionNumber == 0 && !(pciConfig.HeaderType & 0x80)) {
-                break;
-            }
+    if (Status == CR_OK) {
+        Status = CrRecordsToBuffer(Records, Count, requestContext->Output, requestContext->OutputLength, &bytesWritten);
+    }
+    MyPciScannerCompleteRequest((WDFREQUEST)WdfObjectContextGetObject(requestContext),
+        IOCTL_MYPCISCANNER_SCAN_TOPOLOGY, requestContext->Start, MyPciScannerStatusFromCr(Status), bytesWritten);
+}
+
+// Fills Options from an optional CR_TOPOLOGY_REQUEST. A filter spec in the
+// request is compiled into *Filter, which the caller frees once the scan is
+// over; otherwise the default vendor set applies.
+static NTSTATUS
+MyPciScannerTopologyOptions(
+    _In_reads_bytes_opt_(InputLength) PCR_TOPOLOGY_REQUEST Input,
+    _In_ size_t InputLength,
+    _Out_ PCR_TOPOLOGY_OPTIONS Options,
+    _Out_ PCR_FILTER* Filter
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    CR_STATUS status;
+
+    *Filter = NULL;
+    RtlZeroMemory(Options, sizeof(*Options));
+    Options->Scan.Match = driverContext->DefaultFilter;
+    Options->Executor = &driverContext->Executor;
+    if (Input == NULL) {
+        return STATUS_SUCCESS;
+    }
+    if (Input->Version != CR_PROTOCOL_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    Options->Flags = Input->Flags;
+    Options->Segment = Input->Segment;
+    Options->MaxWorkers = Input->MaxWorkers;
+    if (Input->Flags & CR_TOPOLOGY_FILTER) {
+        status = CrFilterCompileSpec(Input + 1, InputLength - sizeof(*Input), Filter, NULL);
+        if (status != CR_OK) {
+            return MyPciScannerStatusFromCr(status);
         }
+        Options->Scan.Match = *Filter;
     }
+    return STATUS_SUCCESS;
+}
 
-    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: PCI Bus %d scan complete.\n", busNumber));
-    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: MyPciScannerScanBus0AndPrint - OUT\n"));
+// Walks every bus reachable through bridges (and, unless the caller asks for
+// bridges only, every other root bus) on the requested segment(s). Requests
+// with identical input that arrive while a scan is running share it, so a
+// burst of agents polling at once costs one enumeration. Returns
+// STATUS_PENDING once the request belongs to a scan; any other status means
+// the caller still owns and completes it.
+NTSTATUS
+MyPciScannerScanTopology(
+    _In_ WDFREQUEST Request,
+    _In_reads_bytes_opt_(InputLength) PCR_TOPOLOGY_REQUEST Input,
+    _In_ size_t InputLength,
+    _In_ PCR_SCAN_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _In_ uint64_t Start
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PMYPCISCANNER_REQUEST_CONTEXT requestContext = MyPciScannerGetRequestContext(Request);
+    CR_TOPOLOGY_OPTIONS options;
+    PCR_FILTER filter = NULL;
+    NTSTATUS status;
+
+    status = MyPciScannerTopologyOptions(Input, InputLength, &options, &filter);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    requestContext->Waiter.Complete = MyPciScannerTopologyComplete;
+    requestContext->Output = Output;
+    requestContext->OutputLength = OutputBufferLength;
+    requestContext->Start = Start;
+    // The whole input, filter spec included, is the coalescing key. It is
+    // copied or compared before any output lands in the shared system buffer.
+    (VOID)CrScanCoalesced(&driverContext->Flights, CrCacheBackend(driverContext->Cache), &options,
+        Input, (uint32_t)InputLength, &requestContext->Waiter);
+    CrFilterFree(filter);
+    return STATUS_PENDING;
+}
+
+// Reports the enabled SR-IOV virtual functions under every matching
+// physical function as one CR_VF_RANGE per PF, so a host with thousands of
+// VFs answers in a few kilobytes. The request's filter selects PFs.
+NTSTATUS
+MyPciScannerScanVfs(
+    _In_reads_bytes_opt_(InputLength) PCR_TOPOLOGY_REQUEST Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_VF_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    CR_TOPOLOGY_OPTIONS options;
+    PCR_FILTER filter;
+    NTSTATUS status;
+
+    *BytesWritten = 0;
+    // Parsed before the scan writes ranges over the shared system buffer.
+    status = MyPciScannerTopologyOptions(Input, InputLength, &options, &filter);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    status = MyPciScannerStatusFromCr(CrScanVirtualFunctionsToBuffer(CrCacheBackend(driverContext->Cache),
+        &options, Output, OutputBufferLength, BytesWritten));
+    CrFilterFree(filter);
     return status;
 }
 
+// Rescans the whole topology and reports only what changed since the
+// generation the caller already holds. The snapshots live in the driver
+// context; the delta queue keeps them from being refreshed concurrently.
+// Change detection has to see the hardware, so this goes through the
+// cache's refresh view and every slot it probes is relearned.
+NTSTATUS
+MyPciScannerScanDelta(
+    _In_ WDFDEVICE Device,
+    _In_ PCR_DELTA_REQUEST Request,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_DELTA_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    UNREFERENCED_PARAMETER(Device);
+
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    CR_TOPOLOGY_OPTIONS options;
+    uint64_t baseGeneration;
+    CR_STATUS status;
+
+    *BytesWritten = 0;
+    if (Request->Version != CR_PROTOCOL_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    // Request and Output share the METHOD_BUFFERED system buffer.
+    baseGeneration = Request->BaseGeneration;
+
+    RtlZeroMemory(&options, sizeof(options));
+    options.Scan.Match = driverContext->DefaultFilter;
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    options.Executor = &driverContext->Executor;
+    status = CrDeltaRefresh(&driverContext->Delta, CrCacheRefreshBackend(driverContext->Cache), &options);
+    if (status == CR_OK) {
+        status = CrDeltaToBuffer(&driverContext->Delta, baseGeneration, Output, OutputBufferLength, BytesWritten);
+    }
+    return MyPciScannerStatusFromCr(status);
+}
+
+// Reads an arbitrary list of registers in one round trip. Results come back in
+// request order with a status each; the core sorts and coalesces the reads.
+NTSTATUS
+MyPciScannerReadBatch(
+    _In_ WDFDEVICE Device,
+    _In_reads_bytes_(InputBufferLength) PCR_BATCH_HEADER Input,
+    _In_ size_t InputBufferLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_BATCH_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    UNREFERENCED_PARAMETER(Device);
+
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    CR_STATUS status;
+
+    if (Input->Version != CR_PROTOCOL_VERSION) {
+        *BytesWritten = 0;
+        return STATUS_REVISION_MISMATCH;
+    }
+    // Input and Output are the same system buffer; CrReadBatchBuffer handles that.
+    status = CrReadBatchBuffer(CrCacheBackend(driverContext->Cache), Input, InputBufferLength,
+        Output, OutputBufferLength, BytesWritten);
+    return MyPciScannerStatusFromCr(status);
+}
+
+// Serves the capability index and capability reads. Both walk the lists
+// through the cache, so after the first walk of a function only the
+// requested bytes of a READ_CAP reach hardware.
+NTSTATUS
+MyPciScannerCapabilities(
+    _In_ ULONG IoControlCode,
+    _In_reads_bytes_(InputBufferLength) PVOID Input,
+    _In_ size_t InputBufferLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PVOID Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PCR_CONFIG_BACKEND backend = CrCacheBackend(driverContext->Cache);
+    CR_STATUS status;
+
+    // Input and Output are the same system buffer; the core copes with that.
+    if (IoControlCode == IOCTL_MYPCISCANNER_READ_CAP) {
+        status = CrCapReadBuffer(backend, Input, InputBufferLength, Output, OutputBufferLength, BytesWritten);
+    }
+    else {
+        status = CrCapWalkBuffer(backend, Input, InputBufferLength, Output, OutputBufferLength, BytesWritten);
+    }
+    if (status == CR_E_UNSUPPORTED) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    return MyPciScannerStatusFromCr(status);
+}
+
+// Drops one function from the config-space cache, or all of them. Nothing
+// is read here; the next access to a dropped function goes to hardware.
+NTSTATUS
+MyPciScannerFlushCache(
+    _In_opt_ PCR_CACHE_FLUSH_REQUEST Input
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    CR_ADDRESS address;
+
+    if (Input != NULL && Input->Version != CR_PROTOCOL_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    if (Input == NULL || (Input->Flags & CR_CACHE_FLUSH_ALL)) {
+        CrCacheFlush(driverContext->Cache);
+        return STATUS_SUCCESS;
+    }
+    if (Input->Device >= CR_MAX_DEVICES || Input->Function >= CR_MAX_FUNCTIONS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    address.Segment = Input->Segment;
+    address.Bus = Input->Bus;
+    address.Device = Input->Device;
+    address.Function = Input->Function;
+    CrCacheInvalidate(driverContext->Cache, address);
+    return STATUS_SUCCESS;
+}
+
+// The testing topology the driver has always reported: an Intel device at
+// 0:2.0 and an AMD device at 0:3.0.
+NTSTATUS
+MyPciScannerCreateSimBackend(
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_ADDRESS address = { 0 };
+    CR_STATUS status;
+
+    status = CrSimCreate(2, Backend);
+    if (status == CR_OK) {
+        address.Device = 2;
+        status = CrSimAddDevice(*Backend, address, PCI_VENDOR_ID_INTEL, 0x1234, 0x000000, 0x00);
+    }
+    if (status == CR_OK) {
+        address.Device = 3;
+        status = CrSimAddDevice(*Backend, address, PCI_VENDOR_ID_AMD, 0x5678, 0x000000, 0x00);
+    }
+    if (status != CR_OK) {
+        CrBackendClose(*Backend);
+        *Backend = NULL;
+    }
+    return MyPciScannerStatusFromCr(status);
+}
+
+NTSTATUS
+MyPciScannerStatusFromCr(
+    _In_ CR_STATUS Status
+)
+{
+    switch (Status) {
+    case CR_OK:                  return STATUS_SUCCESS;
+    case CR_E_MORE_DATA:         return STATUS_BUFFER_OVERFLOW;
+    case CR_E_INVALID_PARAMETER: return STATUS_INVALID_PARAMETER;
+    case CR_E_NO_MEMORY:         return STATUS_INSUFFICIENT_RESOURCES;
+    case CR_E_NOT_FOUND:         return STATUS_NOT_FOUND;
+    case CR_E_UNSUPPORTED:       return STATUS_NOT_SUPPORTED;
+    default:                     return STATUS_UNSUCCESSFUL;
+    }
+}
@@ -0,0 +1,96 @@
+// EcamBackend.c
+//
+// Builds the portable ECAM backend from the firmware's ACPI MCFG table and
+// maps every window once as uncached, read-only I/O space.
+
+#include <ntddk.h>
+#include <wdf.h>
+#include <aux_klib.h>
+#include "driver.h"
+
+#define MYPCISCANNER_MAX_ECAM_REGIONS 64
+
+// Firmware table signatures are passed as little-endian multi-character constants.
+#define MYPCISCANNER_ACPI_PROVIDER 'ACPI'
+#define MYPCISCANNER_MCFG_TABLE_ID 'GFCM'
+
+static void*
+MyPciScannerEcamMap(
+    _In_opt_ void* Context,
+    _In_ uint64_t PhysicalAddress,
+    _In_ size_t Length
+)
+{
+    PHYSICAL_ADDRESS address;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    address.QuadPart = (LONGLONG)PhysicalAddress;
+    return MmMapIoSpaceEx(address, Length, PAGE_READONLY | PAGE_NOCACHE);
+}
+
+static void
+MyPciScannerEcamUnmap(
+    _In_opt_ void* Context,
+    _In_ void* Mapping,
+    _In_ size_t Length
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    MmUnmapIoSpace(Mapping, Length);
+}
+
+// Returns STATUS_NOT_FOUND when the firmware publishes no MCFG table, in which
+// case the caller falls back to the HAL backend.
+NTSTATUS
+MyPciScannerCreateEcamBackend(
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    CR_ECAM_REGION regions[MYPCISCANNER_MAX_ECAM_REGIONS];
+    CR_ECAM_MAPPER mapper;
+    PVOID table = NULL;
+    ULONG tableLength = 0;
+    ULONG regionCount;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *Backend = NULL;
+    status = AuxKlibInitialize();
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = AuxKlibGetSystemFirmwareTable(MYPCISCANNER_ACPI_PROVIDER, MYPCISCANNER_MCFG_TABLE_ID,
+        NULL, 0, &tableLength);
+    if (tableLength == 0) {
+        return STATUS_NOT_FOUND;
+    }
+    table = ExAllocatePool2(POOL_FLAG_PAGED, tableLength, CR_POOL_TAG);
+    if (table == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    status = AuxKlibGetSystemFirmwareTable(MYPCISCANNER_ACPI_PROVIDER, MYPCISCANNER_MCFG_TABLE_ID,
+        table, tableLength, &tableLength);
+    if (!NT_SUCCESS(status)) {
+        ExFreePoolWithTag(table, CR_POOL_TAG);
+        return status;
+    }
+
+    regionCount = CrParseMcfg(table, tableLength, regions, MYPCISCANNER_MAX_ECAM_REGIONS);
+    ExFreePoolWithTag(table, CR_POOL_TAG);
+    if (regionCount == 0) {
+        return STATUS_NOT_FOUND;
+    }
+    if (regionCount > MYPCISCANNER_MAX_ECAM_REGIONS) {
+        regionCount = MYPCISCANNER_MAX_ECAM_REGIONS;
+    }
+
+    mapper.Map = MyPciScannerEcamMap;
+    mapper.Unmap = MyPciScannerEcamUnmap;
+    mapper.Context = NULL;
+    mapper.Flags = 0; // Real MMIO: dword accesses only
+    return MyPciScannerStatusFromCr(CrEcamCreate(regions, regionCount, &mapper, Backend));
+}
@@ -0,0 +1,84 @@
+// Executor.c
+//
+// CR_EXECUTOR over short-lived system threads, used by the topology scan to
+// walk independent subtrees concurrently. Threads only live for the duration
+// of one scan, so nothing is left running when the driver unloads.
+
+#include <ntddk.h>
+#include <wdf.h>
+#include "driver.h"
+
+typedef struct _MYPCISCANNER_WORKER_START {
+    CR_WORK_ROUTINE Routine;
+    void* Context;
+} MYPCISCANNER_WORKER_START, * PMYPCISCANNER_WORKER_START;
+
+static KSTART_ROUTINE MyPciScannerWorkerThread;
+
+static VOID
+MyPciScannerWorkerThread(
+    _In_ PVOID StartContext
+)
+{
+    PMYPCISCANNER_WORKER_START start = (PMYPCISCANNER_WORKER_START)StartContext;
+
+    start->Routine(start->Context);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static void
+MyPciScannerExecutorRun(
+    _In_ PCR_EXECUTOR Executor,
+    _In_ uint32_t Count,
+    _In_ CR_WORK_ROUTINE Routine,
+    _In_ void* Context
+)
+{
+    MYPCISCANNER_WORKER_START start;
+    OBJECT_ATTRIBUTES objectAttributes;
+    HANDLE threads[MYPCISCANNER_MAX_SCAN_WORKERS];
+    ULONG started = 0;
+    ULONG i;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (Count > Executor->MaxWorkers) {
+        Count = Executor->MaxWorkers;
+    }
+    start.Routine = Routine;
+    start.Context = Context;
+    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    // The requesting thread is worker 0. If a thread cannot be created the
+    // remaining workers simply pick up its share.
+    for (i = 1; i < Count; i++) {
+        status = PsCreateSystemThread(&threads[started], THREAD_ALL_ACCESS, &objectAttributes,
+            NULL, NULL, MyPciScannerWorkerThread, &start);
+        if (!NT_SUCCESS(status)) {
+            KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+                "MyPciScannerDriver: PsCreateSystemThread failed %!STATUS!, continuing with %lu workers\n",
+                status, started + 1));
+            break;
+        }
+        started++;
+    }
+
+    Routine(Context);
+
+    for (i = 0; i < started; i++) {
+        ZwWaitForSingleObject(threads[i], FALSE, NULL);
+        ZwClose(threads[i]);
+    }
+}
+
+VOID
+MyPciScannerInitExecutor(
+    _Out_ PCR_EXECUTOR Executor
+)
+{
+    ULONG processors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    Executor->Run = MyPciScannerExecutorRun;
+    Executor->MaxWorkers = min(processors, MYPCISCANNER_MAX_SCAN_WORKERS);
+}
@@ -0,0 +1,82 @@
+// HalBackend.c
+//
+// CR_CONFIG_BACKEND over the legacy HAL bus-data interface. One call per read,
+// segment 0 only, and no extended (>= 256) config space. The HAL returns 0 for
+// a bus that does not exist and 2 bytes of PCI_INVALID_VENDORID for an empty
+// slot. The first is unreachable and the second reads as a master abort.
+
+#include <ntddk.h>
+#include <wdf.h>
+#include "driver.h"
+
+typedef struct _MYPCISCANNER_HAL_BACKEND {
+    CR_CONFIG_BACKEND Base;
+} MYPCISCANNER_HAL_BACKEND, * PMYPCISCANNER_HAL_BACKEND;
+
+static uint32_t
+MyPciScannerHalRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    PCI_SLOT_NUMBER slot;
+    ULONG bytes;
+    USHORT vendorId;
+
+    UNREFERENCED_PARAMETER(Backend);
+
+    if (Address.Segment != 0 || Offset >= 256 || Length > 256 - Offset) {
+        return 0;
+    }
+
+    slot.u.AsULONG = 0;
+    slot.u.bits.DeviceNumber = Address.Device;
+    slot.u.bits.FunctionNumber = Address.Function;
+
+#pragma warning(push)
+#pragma warning(disable: 4996) // HalGetBusDataByOffset is deprecated but is the only non-PnP path
+    bytes = HalGetBusDataByOffset(PCIConfiguration, Address.Bus, slot.u.AsULONG, Buffer, Offset, Length);
+    if (bytes != 0 && bytes < Length) {
+        // A short read from a bus that exists: an empty slot, whatever the
+        // offset asked for. Confirm from the vendor ID so a scan walks on past
+        // an empty device 0 instead of taking the bus for absent.
+        vendorId = 0;
+        if (HalGetBusDataByOffset(PCIConfiguration, Address.Bus, slot.u.AsULONG, &vendorId, 0, sizeof(vendorId)) ==
+                sizeof(vendorId) &&
+            vendorId == PCI_INVALID_VENDORID) {
+            RtlFillMemory(Buffer, Length, 0xFF);
+            bytes = Length;
+        }
+    }
+#pragma warning(pop)
+    return bytes;
+}
+
+static void
+MyPciScannerHalClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    CrFree(Backend);
+}
+
+NTSTATUS
+MyPciScannerCreateHalBackend(
+    _Out_ PCR_CONFIG_BACKEND* Backend
+)
+{
+    PMYPCISCANNER_HAL_BACKEND hal = (PMYPCISCANNER_HAL_BACKEND)CrAlloc(sizeof(*hal));
+
+    *Backend = NULL;
+    if (hal == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    hal->Base.Name = "hal";
+    hal->Base.Read = MyPciScannerHalRead;
+    hal->Base.Close = MyPciScannerHalClose;
+    *Backend = &hal->Base;
+    return STATUS_SUCCESS;
+}
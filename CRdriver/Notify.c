@@ -0,0 +1,182 @@
+// Notify.c
+//
+// Topology change notification. Clients leave IOCTL_MYPCISCANNER_WAIT_CHANGE
+// pending on a manual queue and a one-shot passive-level timer runs a
+// presence check over the last full scan, a few config reads per function.
+// Only when that check disagrees is the topology rescanned, and every
+// waiter is then completed with its delta. The timer is armed only while
+// requests wait, so an idle driver touches no hardware.
+
+#include <ntddk.h>
+#include <wdf.h>
+#include "driver.h"
+
+// Rescans into Watch and reports whether its generation moved. Caller holds
+// WatchLock.
+static BOOLEAN
+MyPciScannerRefreshWatch(
+    _In_ PDRIVER_CONTEXT DriverContext,
+    _Out_ CR_STATUS* Status
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+    uint64_t generation = DriverContext->Watch.Current.Generation;
+
+    // Unfiltered: the presence check needs every bridge, whatever its vendor.
+    RtlZeroMemory(&options, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    options.Executor = &DriverContext->Executor;
+    *Status = CrDeltaRefresh(&DriverContext->Watch, CrCacheRefreshBackend(DriverContext->Cache), &options);
+    return DriverContext->Watch.Current.Generation != generation;
+}
+
+// Writes the delta a waiter asked for. Caller holds WatchLock.
+static VOID
+MyPciScannerCompleteWaiter(
+    _In_ PDRIVER_CONTEXT DriverContext,
+    _In_ WDFREQUEST Request
+)
+{
+    PMYPCISCANNER_REQUEST_CONTEXT requestContext = MyPciScannerGetRequestContext(Request);
+    size_t bytesWritten = 0;
+    CR_STATUS status;
+
+    status = CrDeltaToBuffer(&DriverContext->Watch, requestContext->BaseGeneration,
+        requestContext->Output, requestContext->OutputLength, &bytesWritten);
+    MyPciScannerCompleteRequest(Request, IOCTL_MYPCISCANNER_WAIT_CHANGE, requestContext->Start,
+        MyPciScannerStatusFromCr(status), bytesWritten);
+}
+
+// Arms the timer unless it already is. A request arriving while the
+// callback runs arms it again, so no waiter is left without a check.
+static VOID
+MyPciScannerArmWatch(
+    _In_ PDRIVER_CONTEXT DriverContext
+)
+{
+    if (CrAtomicExchange32(&DriverContext->WatchArmed, 1) == 0) {
+        WdfTimerStart(DriverContext->WatchTimer, WDF_REL_TIMEOUT_IN_MS(MYPCISCANNER_WATCH_INTERVAL_MS));
+    }
+}
+
+static EVT_WDF_TIMER MyPciScannerWatchTimer;
+
+static VOID
+MyPciScannerWatchTimer(
+    _In_ WDFTIMER Timer
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    WDFREQUEST request;
+    WDF_IO_QUEUE_STATE queueState;
+    ULONG queuedRequests = 0;
+    CR_STATUS status = CR_OK;
+
+    UNREFERENCED_PARAMETER(Timer);
+    PAGED_CODE();
+
+    CrAtomicStore32(&driverContext->WatchArmed, 0);
+
+    WdfWaitLockAcquire(driverContext->WatchLock, NULL);
+    // Through the live backend: the cache would answer from what it learned.
+    if (CrSnapshotProbe(driverContext->Backend, &driverContext->Watch.Current) &&
+        MyPciScannerRefreshWatch(driverContext, &status)) {
+        while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(driverContext->NotifyQueue, &request))) {
+            MyPciScannerCompleteWaiter(driverContext, request);
+        }
+    }
+    WdfWaitLockRelease(driverContext->WatchLock);
+    if (status != CR_OK) {
+        KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL,
+            "MyPciScannerDriver: Topology watch rescan failed (%d)\n", status));
+    }
+
+    queueState = WdfIoQueueGetState(driverContext->NotifyQueue, &queuedRequests, NULL);
+    if (WDF_IO_QUEUE_READY(queueState) && queuedRequests != 0) {
+        MyPciScannerArmWatch(driverContext);
+    }
+}
+
+NTSTATUS
+MyPciScannerCreateWatch(
+    _In_ WDFDEVICE Device
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    WDF_IO_QUEUE_CONFIG ioQueueConfig;
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &driverContext->WatchLock);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Waiters sit here until the timer retrieves them; the framework
+    // cancels them when their handle closes.
+    WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchManual);
+    status = WdfIoQueueCreate(Device, &ioQueueConfig, WDF_NO_OBJECT_ATTRIBUTES, &driverContext->NotifyQueue);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Passive level because a rescan allocates and waits for its workers,
+    // which also means one-shot: KMDF has no periodic passive timers.
+    WDF_TIMER_CONFIG_INIT(&timerConfig, MyPciScannerWatchTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Device;
+    attributes.ExecutionLevel = WdfExecutionLevelPassive;
+    return WdfTimerCreate(&timerConfig, &attributes, &driverContext->WatchTimer);
+}
+
+// Completes the request at once when the topology has already moved past
+// BaseGeneration, otherwise parks it for the timer. The first request also
+// takes the initial scan the presence check compares against.
+NTSTATUS
+MyPciScannerWaitChange(
+    _In_ WDFREQUEST Request,
+    _In_ PCR_DELTA_REQUEST Input,
+    _In_ PCR_DELTA_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _In_ uint64_t Start
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PMYPCISCANNER_REQUEST_CONTEXT requestContext = MyPciScannerGetRequestContext(Request);
+    CR_STATUS crStatus = CR_OK;
+    NTSTATUS status;
+
+    if (Input->Version != CR_PROTOCOL_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    // Input and Output share the METHOD_BUFFERED system buffer.
+    requestContext->BaseGeneration = Input->BaseGeneration;
+    requestContext->Output = Output;
+    requestContext->OutputLength = OutputBufferLength;
+    requestContext->Start = Start;
+
+    WdfWaitLockAcquire(driverContext->WatchLock, NULL);
+    if (driverContext->Watch.Current.Generation == 0) {
+        (VOID)MyPciScannerRefreshWatch(driverContext, &crStatus);
+    }
+    if (crStatus != CR_OK) {
+        status = MyPciScannerStatusFromCr(crStatus);
+    }
+    else if (requestContext->BaseGeneration != driverContext->Watch.Current.Generation) {
+        MyPciScannerCompleteWaiter(driverContext, Request);
+        status = STATUS_PENDING;
+    }
+    else {
+        // Under the lock, so a change cannot slip in between the generation
+        // check and the request being queued.
+        status = WdfRequestForwardToIoQueue(Request, driverContext->NotifyQueue);
+        if (NT_SUCCESS(status)) {
+            MyPciScannerArmWatch(driverContext);
+            status = STATUS_PENDING;
+        }
+    }
+    WdfWaitLockRelease(driverContext->WatchLock);
+    return status;
+}
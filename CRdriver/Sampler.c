@@ -0,0 +1,260 @@
+// Sampler.c
+//
+// High-rate register sampling into a ring shared with the client process.
+// The ring lives in nonpaged pool and is mapped into the caller with an MDL,
+// so the client drains it without any further IOCTLs. Start and stop run in
+// the caller's context because the user mapping belongs to that process.
+
+#include <ntddk.h>
+#include <wdf.h>
+#include "driver.h"
+
+struct _MYPCISCANNER_SAMPLING {
+    WDFFILEOBJECT Owner;     // Handle that started sampling
+    PEPROCESS Process;       // Process the ring is mapped into
+    PEX_TIMER Timer;
+    PCR_SAMPLER Sampler;
+    PVOID Ring;
+    SIZE_T RingSize;         // Whole pages, so nothing else shares the mapping
+    PMDL Mdl;
+    PVOID UserAddress;
+};
+
+// Runs at DISPATCH_LEVEL. Both the HAL and the ECAM backend allow config
+// reads there, and CrSamplerTick does not allocate.
+static EXT_CALLBACK MyPciScannerSampleTimer;
+
+static VOID
+MyPciScannerSampleTimer(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID Context
+)
+{
+    PMYPCISCANNER_SAMPLING sampling = (PMYPCISCANNER_SAMPLING)Context;
+
+    UNREFERENCED_PARAMETER(Timer);
+
+    CrSamplerTick(sampling->Sampler, (uint64_t)KeQueryPerformanceCounter(NULL).QuadPart);
+}
+
+// Tears down a session. Must run in the owning process so the user mapping
+// can be removed.
+static VOID
+MyPciScannerFreeSampling(
+    _In_ PMYPCISCANNER_SAMPLING Sampling
+)
+{
+    PAGED_CODE();
+
+    if (Sampling->Timer != NULL) {
+        // Cancels the timer and waits for a running callback to return.
+        ExDeleteTimer(Sampling->Timer, TRUE, TRUE, NULL);
+    }
+    if (Sampling->UserAddress != NULL) {
+        MmUnmapLockedPages(Sampling->UserAddress, Sampling->Mdl);
+    }
+    if (Sampling->Mdl != NULL) {
+        IoFreeMdl(Sampling->Mdl);
+    }
+    CrSamplerFree(Sampling->Sampler);
+    if (Sampling->Ring != NULL) {
+        ExFreePoolWithTag(Sampling->Ring, CR_POOL_TAG);
+    }
+    ExFreePoolWithTag(Sampling, CR_POOL_TAG);
+}
+
+static NTSTATUS
+MyPciScannerStartSampling(
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* BytesWritten
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PCR_SAMPLE_REQUEST input;
+    PCR_SAMPLE_MAPPING output;
+    CR_SAMPLE_REQUEST request;
+    CR_READ_ENTRY registers[CR_MAX_SAMPLE_REGISTERS];
+    PMYPCISCANNER_SAMPLING sampling = NULL;
+    LARGE_INTEGER frequency;
+    size_t inputLength;
+    size_t ringSize;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *BytesWritten = 0;
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(CR_SAMPLE_REQUEST), (PVOID*)&input, &inputLength);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_SAMPLE_MAPPING), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Input and output share the system buffer; take everything out first.
+    request = *input;
+    if (request.Version != CR_PROTOCOL_VERSION) {
+        return STATUS_REVISION_MISMATCH;
+    }
+    ringSize = CrRingSize(request.RegisterCount, request.Capacity);
+    if (ringSize == 0 || request.IntervalUs < MYPCISCANNER_MIN_SAMPLE_INTERVAL_US ||
+        inputLength - sizeof(request) < request.RegisterCount * sizeof(CR_READ_ENTRY)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    RtlCopyMemory(registers, input + 1, request.RegisterCount * sizeof(CR_READ_ENTRY));
+
+    WdfWaitLockAcquire(driverContext->SamplingLock, NULL);
+    if (driverContext->Sampling != NULL) {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    sampling = (PMYPCISCANNER_SAMPLING)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(*sampling), CR_POOL_TAG);
+    if (sampling == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    sampling->Owner = WdfRequestGetFileObject(Request);
+    sampling->Process = PsGetCurrentProcess();
+    sampling->RingSize = ROUND_TO_PAGES(ringSize);
+    // Page-sized pool allocations are page aligned and zeroed, so the user
+    // mapping exposes nothing but the ring.
+    sampling->Ring = ExAllocatePool2(POOL_FLAG_NON_PAGED, sampling->RingSize, CR_POOL_TAG);
+    if (sampling->Ring == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+    status = MyPciScannerStatusFromCr(CrSamplerCreate(driverContext->Backend, registers, request.RegisterCount,
+        request.Capacity, (uint64_t)frequency.QuadPart, sampling->Ring, sampling->RingSize, &sampling->Sampler));
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    sampling->Mdl = IoAllocateMdl(sampling->Ring, (ULONG)sampling->RingSize, FALSE, FALSE, NULL);
+    if (sampling->Mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    MmBuildMdlForNonPagedPool(sampling->Mdl);
+    __try {
+        sampling->UserAddress = MmMapLockedPagesSpecifyCache(sampling->Mdl, UserMode, MmCached, NULL, FALSE,
+            NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        sampling->UserAddress = NULL;
+    }
+    if (sampling->UserAddress == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    sampling->Timer = ExAllocateTimer(MyPciScannerSampleTimer, sampling, EX_TIMER_HIGH_RESOLUTION);
+    if (sampling->Timer == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    // Due time is relative (negative); both values are in 100 ns units.
+    ExSetTimer(sampling->Timer, -(LONGLONG)request.IntervalUs * 10, (LONGLONG)request.IntervalUs * 10, NULL);
+
+    output->RingAddress = (uint64_t)(ULONG_PTR)sampling->UserAddress;
+    output->RingSize = sampling->RingSize;
+    *BytesWritten = sizeof(*output);
+    driverContext->Sampling = sampling;
+    sampling = NULL;
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL,
+        "MyPciScannerDriver: Sampling %lu register(s) every %lu us\n", request.RegisterCount, request.IntervalUs));
+
+Exit:
+    WdfWaitLockRelease(driverContext->SamplingLock);
+    if (sampling != NULL) {
+        MyPciScannerFreeSampling(sampling);
+    }
+    return status;
+}
+
+// Stops the session if FileObject owns it (any session when FileObject is NULL
+// and the caller is the owning process).
+static NTSTATUS
+MyPciScannerStopSampling(
+    _In_opt_ WDFFILEOBJECT FileObject
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PMYPCISCANNER_SAMPLING sampling;
+
+    PAGED_CODE();
+
+    WdfWaitLockAcquire(driverContext->SamplingLock, NULL);
+    sampling = driverContext->Sampling;
+    if (sampling == NULL || (FileObject != NULL && sampling->Owner != FileObject) ||
+        sampling->Process != PsGetCurrentProcess()) {
+        WdfWaitLockRelease(driverContext->SamplingLock);
+        return STATUS_NOT_FOUND;
+    }
+    driverContext->Sampling = NULL;
+    WdfWaitLockRelease(driverContext->SamplingLock);
+
+    MyPciScannerFreeSampling(sampling);
+    KdPrintEx((DPFLTR_IHVDRIVER_ID, DPFLTR_INFO_LEVEL, "MyPciScannerDriver: Sampling stopped\n"));
+    return STATUS_SUCCESS;
+}
+
+// Sampling and statistics requests are handled right here, in the requesting
+// process; every other request goes to the default queue.
+VOID
+EvtIoInCallerContext(
+    _In_ WDFDEVICE  Device,
+    _In_ WDFREQUEST Request
+)
+{
+    WDF_REQUEST_PARAMETERS params;
+    uint64_t start = CrStatsNow(WdfGetDriverContext(WdfGetDriver())->Stats);
+    size_t bytesWritten = 0;
+    ULONG ioControlCode;
+    NTSTATUS status;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+    if (params.Type == WdfRequestTypeDeviceControl) {
+        ioControlCode = params.Parameters.DeviceIoControl.IoControlCode;
+        switch (ioControlCode) {
+        case IOCTL_MYPCISCANNER_SAMPLE_START:
+            status = MyPciScannerStartSampling(Request, &bytesWritten);
+            break;
+
+        case IOCTL_MYPCISCANNER_SAMPLE_STOP:
+            status = MyPciScannerStopSampling(WdfRequestGetFileObject(Request));
+            break;
+
+        case IOCTL_MYPCISCANNER_QUERY_STATS:
+            status = MyPciScannerQueryStats(Request, &bytesWritten);
+            break;
+
+        default:
+            goto Enqueue;
+        }
+        MyPciScannerCompleteRequest(Request, ioControlCode, start, status, bytesWritten);
+        return;
+    }
+
+Enqueue:
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status)) {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+// Cleanup arrives in the context of the process closing its last handle, so
+// a client that exits without SAMPLE_STOP still gets its mapping removed.
+VOID
+EvtFileCleanup(
+    _In_ WDFFILEOBJECT FileObject
+)
+{
+    PAGED_CODE();
+
+    (VOID)MyPciScannerStopSampling(FileObject);
+}
@@ -0,0 +1,57 @@
+// Stats.c
+//
+// Host side of the core's statistics: the performance counter as the clock
+// and one counter slot per logical processor across all groups. The query is
+// answered in the caller's context so it never waits behind a long scan.
+
+#include <ntddk.h>
+#include <wdf.h>
+#include "driver.h"
+
+static uint64_t
+MyPciScannerStatsNow(void)
+{
+    return (uint64_t)KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+static uint32_t
+MyPciScannerStatsCpu(void)
+{
+    return KeGetCurrentProcessorNumberEx(NULL);
+}
+
+NTSTATUS
+MyPciScannerCreateStats(
+    _Out_ PCR_STATS* Stats
+)
+{
+    CR_STATS_HOST host;
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+    host.Now = MyPciScannerStatsNow;
+    host.Frequency = (uint64_t)frequency.QuadPart;
+    host.CurrentCpu = MyPciScannerStatsCpu;
+    host.CpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    return MyPciScannerStatusFromCr(CrStatsCreate(&host, Stats));
+}
+
+NTSTATUS
+MyPciScannerQueryStats(
+    _In_ WDFREQUEST Request,
+    _Out_ size_t* BytesWritten
+)
+{
+    PDRIVER_CONTEXT driverContext = WdfGetDriverContext(WdfGetDriver());
+    PCR_STATS_REPLY output;
+    NTSTATUS status;
+
+    *BytesWritten = 0;
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CR_STATS_REPLY), (PVOID*)&output, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    CrStatsQuery(driverContext->Stats, output);
+    *BytesWritten = sizeof(*output);
+    return STATUS_SUCCESS;
+}
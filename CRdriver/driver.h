@@ -7,34 +7,139 @@
 #include <initguid.h>
 #include <devioctl.h> // For CTL_CODE
 
-// IOCTL Definition
-#define MYPCISCANNER_DEVICE_TYPE 0x8000
-#define IOCTL_MYPCISCANNER_SCAN_BUS0 CTL_CODE( \
-    MYPCISCANNER_DEVICE_TYPE, \
-    0x800, \
-    METHOD_BUFFERED, \
-    FILE_ANY_ACCESS \
-)
+#include "../CRcommon/crprotocol.h" // IOCTL codes and record layouts shared with CRconsole
+#include "../CRcore/crcore.h"         // Portable enumeration core and backend interface
+
+// Set to 1 to serve scans from the synthetic topology (the Intel device at
+// 0:2.0 and the AMD device at 0:3.0) instead of reading hardware.
+#ifndef MYPCISCANNER_SIMULATE
+#define MYPCISCANNER_SIMULATE 0
+#endif
+
+// Upper bound on concurrent topology-scan workers. The HAL serializes legacy
+// config cycles internally, so more threads mainly help faster backends.
+#define MYPCISCANNER_MAX_SCAN_WORKERS 8
+
+// Config-space cache sizing. Every probed slot is remembered, empty ones
+// included, but only present functions take a full entry.
+#define MYPCISCANNER_CACHE_SLOTS     16384
+#define MYPCISCANNER_CACHE_FUNCTIONS 1024
+
+// How often the topology watch checks for hotplug while a client waits in
+// IOCTL_MYPCISCANNER_WAIT_CHANGE.
+#define MYPCISCANNER_WATCH_INTERVAL_MS 50
+
+// Shortest sampling period accepted by IOCTL_MYPCISCANNER_SAMPLE_START (10 kHz).
+#define MYPCISCANNER_MIN_SAMPLE_INTERVAL_US 100
 
 // PCI Vendor IDs
 #define PCI_VENDOR_ID_INTEL 0x8086
 #define PCI_VENDOR_ID_AMD   0x1022
 #define PCI_VENDOR_ID_ATI_AMD 0x1002 
-#define PCI_MAX_DEVICES       32
-#define PCI_MAX_FUNCTIONS     8
-#define PCI_INVALID_VENDORID  0xFFFF
+
+// Active sampling session (Sampler.c)
+typedef struct _MYPCISCANNER_SAMPLING MYPCISCANNER_SAMPLING, * PMYPCISCANNER_SAMPLING;
 
 // NEW: Define a context structure for the WDFDRIVER object
 typedef struct _DRIVER_CONTEXT {
     WDFDEVICE ControlDevice; // To store the handle of our control device
+    WDFQUEUE DeltaQueue;        // Sequential; serializes access to Delta
+    PCR_CONFIG_BACKEND Backend; // Live config-space access; the sampler reads through it
+    PCR_CACHE Cache;            // Immutable fields over Backend, used by scans and batch reads
+    CR_EXECUTOR Executor;       // Worker threads for topology scans
+    CR_DELTA_STATE Delta;       // Snapshots behind IOCTL_MYPCISCANNER_SCAN_DELTA
+    CR_SCAN_FLIGHTS Flights;    // Topology scans in flight, shared by identical requests
+    PCR_FILTER DefaultFilter;   // Used when a scan request carries no filter spec
+    PCR_STATS Stats;            // Request and config-read counters; Backend reports into it
+    WDFWAITLOCK SamplingLock;   // Guards Sampling
+    PMYPCISCANNER_SAMPLING Sampling;
+    WDFQUEUE NotifyQueue;       // Manual; IOCTL_MYPCISCANNER_WAIT_CHANGE requests waiting for a change
+    WDFTIMER WatchTimer;        // One-shot presence check, armed while NotifyQueue has requests
+    WDFWAITLOCK WatchLock;      // Guards Watch
+    CR_DELTA_STATE Watch;       // Unfiltered snapshots behind WAIT_CHANGE (Notify.c)
+    volatile uint32_t WatchArmed;
 } DRIVER_CONTEXT, * PDRIVER_CONTEXT;
 
 // NEW: Declare an accessor function for the driver context
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DRIVER_CONTEXT, WdfGetDriverContext)
 
+// Per-request state for requests completed after EvtIoDeviceControl returns.
+typedef struct _MYPCISCANNER_REQUEST_CONTEXT {
+    CR_FLIGHT_WAITER Waiter;    // Joined to a coalesced topology scan
+    PVOID Output;
+    size_t OutputLength;
+    uint64_t Start;             // CrStatsNow when dispatched
+    uint64_t BaseGeneration;    // Waiting for the watch to move past this
+} MYPCISCANNER_REQUEST_CONTEXT, * PMYPCISCANNER_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MYPCISCANNER_REQUEST_CONTEXT, MyPciScannerGetRequestContext)
+
 // Forward declarations
 DRIVER_INITIALIZE DriverEntry;
 // EVT_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd;
 EVT_WDF_DRIVER_UNLOAD EvtDriverUnload;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl;
-NTSTATUS MyPciScannerScanBus0AndPrint(WDFDEVICE Device);
\ No newline at end of file
+EVT_WDF_IO_IN_CALLER_CONTEXT EvtIoInCallerContext;
+EVT_WDF_FILE_CLEANUP EvtFileCleanup;
+NTSTATUS MyPciScannerScanBus0(
+    _In_ WDFDEVICE Device,
+    _In_reads_bytes_opt_(FilterLength) PCR_FILTER_SPEC FilterSpec,
+    _In_ size_t FilterLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_SCAN_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten);
+NTSTATUS MyPciScannerScanTopology(
+    _In_ WDFREQUEST Request,
+    _In_reads_bytes_opt_(InputLength) PCR_TOPOLOGY_REQUEST Input,
+    _In_ size_t InputLength,
+    _In_ PCR_SCAN_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _In_ uint64_t Start);
+NTSTATUS MyPciScannerScanVfs(
+    _In_reads_bytes_opt_(InputLength) PCR_TOPOLOGY_REQUEST Input,
+    _In_ size_t InputLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_VF_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten);
+NTSTATUS MyPciScannerScanDelta(
+    _In_ WDFDEVICE Device,
+    _In_ PCR_DELTA_REQUEST Request,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_DELTA_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten);
+NTSTATUS MyPciScannerWaitChange(
+    _In_ WDFREQUEST Request,
+    _In_ PCR_DELTA_REQUEST Input,
+    _In_ PCR_DELTA_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _In_ uint64_t Start);
+NTSTATUS MyPciScannerCapabilities(
+    _In_ ULONG IoControlCode,
+    _In_reads_bytes_(InputBufferLength) PVOID Input,
+    _In_ size_t InputBufferLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PVOID Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten);
+NTSTATUS MyPciScannerFlushCache(_In_opt_ PCR_CACHE_FLUSH_REQUEST Input);
+NTSTATUS MyPciScannerReadBatch(
+    _In_ WDFDEVICE Device,
+    _In_reads_bytes_(InputBufferLength) PCR_BATCH_HEADER Input,
+    _In_ size_t InputBufferLength,
+    _Out_writes_bytes_to_(OutputBufferLength, *BytesWritten) PCR_BATCH_HEADER Output,
+    _In_ size_t OutputBufferLength,
+    _Out_ size_t* BytesWritten);
+VOID MyPciScannerInitExecutor(_Out_ PCR_EXECUTOR Executor);
+NTSTATUS MyPciScannerCreateWatch(_In_ WDFDEVICE Device);
+NTSTATUS MyPciScannerCreateDefaultFilter(_Out_ PCR_FILTER* Filter);
+NTSTATUS MyPciScannerCreateEcamBackend(_Out_ PCR_CONFIG_BACKEND* Backend);
+NTSTATUS MyPciScannerCreateHalBackend(_Out_ PCR_CONFIG_BACKEND* Backend);
+NTSTATUS MyPciScannerCreateSimBackend(_Out_ PCR_CONFIG_BACKEND* Backend);
+NTSTATUS MyPciScannerCreateStats(_Out_ PCR_STATS* Stats);
+NTSTATUS MyPciScannerQueryStats(_In_ WDFREQUEST Request, _Out_ size_t* BytesWritten);
+VOID MyPciScannerCompleteRequest(
+    _In_ WDFREQUEST Request,
+    _In_ ULONG IoControlCode,
+    _In_ uint64_t Start,
+    _In_ NTSTATUS Status,
+    _In_ size_t BytesWritten);
+NTSTATUS MyPciScannerStatusFromCr(_In_ CR_STATUS Status);
@@ -0,0 +1,169 @@
+// CRnames.c
+//
+// Name database tool. Compiles pci.ids into the binary table CRconsole and
+// offline tools map with CrNameDbOpen, and looks names up in one, so a
+// freshly built table can be checked against the text it came from.
+//
+//   CRnames pci.ids crnames.bin
+//   CRnames -l crnames.bin VVVV[:DDDD[:SSSS:SSSS]] | cCCCCCC ...
+//
+// A lookup argument is a vendor, vendor:device or vendor:device:subvendor:
+// subdevice in hex, or 'c' and a 6-digit class code.
+
+#include "../CRcore/crcore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char*
+NamesStatus(
+    _In_ CR_STATUS Status
+)
+{
+    switch (Status) {
+    case CR_OK:                  return "success";
+    case CR_E_MORE_DATA:         return "more data";
+    case CR_E_INVALID_PARAMETER: return "invalid or corrupt file";
+    case CR_E_NO_MEMORY:         return "out of memory";
+    case CR_E_NOT_FOUND:         return "not found";
+    case CR_E_IO:                return "I/O error";
+    case CR_E_UNSUPPORTED:       return "unsupported version or size";
+    default:                     return "unknown error";
+    }
+}
+
+static const char*
+NamesOrUnknown(
+    _In_opt_ const char* Name
+)
+{
+    return (Name != NULL) ? Name : "(unknown)";
+}
+
+// Parses up to Capacity hex IDs of at most 4 digits separated by ':'.
+// Returns how many there were, or 0 if the text is malformed.
+static int
+NamesParseIds(
+    _In_ const char* Text,
+    _Out_writes_(Capacity) unsigned long* Ids,
+    _In_ int Capacity
+)
+{
+    int count = 0;
+    char* end;
+
+    for (;;) {
+        if (count == Capacity) {
+            return 0;
+        }
+        Ids[count] = strtoul(Text, &end, 16);
+        if (end == Text || end - Text > 4) {
+            return 0;
+        }
+        count++;
+        if (*end == '\0') {
+            return count;
+        }
+        if (*end != ':') {
+            return 0;
+        }
+        Text = end + 1;
+    }
+}
+
+static int
+NamesLookup(
+    _In_ const CR_NAMEDB* Db,
+    _In_ const char* Argument
+)
+{
+    unsigned long ids[4];
+    char* end;
+
+    if (Argument[0] == 'c') {
+        uint32_t classCode = (uint32_t)strtoul(Argument + 1, &end, 16);
+        if (end == Argument + 1 || *end != '\0' || end - Argument > 7) {
+            return 0;
+        }
+        printf("%06X  %s / %s / %s\n", classCode,
+            NamesOrUnknown(CrNameDbClass(Db, classCode, CR_NAMEDB_CLASS_BASE)),
+            NamesOrUnknown(CrNameDbClass(Db, classCode, CR_NAMEDB_CLASS_SUB)),
+            NamesOrUnknown(CrNameDbClass(Db, classCode, CR_NAMEDB_CLASS_PROGIF)));
+        return 1;
+    }
+
+    switch (NamesParseIds(Argument, ids, 4)) {
+    case 1:
+        printf("%04lX  %s\n", ids[0], NamesOrUnknown(CrNameDbVendor(Db, (uint16_t)ids[0])));
+        return 1;
+    case 2:
+        printf("%04lX:%04lX  %s %s\n", ids[0], ids[1],
+            NamesOrUnknown(CrNameDbVendor(Db, (uint16_t)ids[0])),
+            NamesOrUnknown(CrNameDbDevice(Db, (uint16_t)ids[0], (uint16_t)ids[1])));
+        return 1;
+    case 4:
+        printf("%04lX:%04lX:%04lX:%04lX  %s\n", ids[0], ids[1], ids[2], ids[3],
+            NamesOrUnknown(CrNameDbSubsystem(Db, (uint16_t)ids[0], (uint16_t)ids[1],
+                (uint16_t)ids[2], (uint16_t)ids[3])));
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void
+NamesUsage(void)
+{
+    fprintf(stderr,
+        "Usage: CRnames pci.ids crnames.bin\n"
+        "       CRnames -l crnames.bin VVVV[:DDDD[:SSSS:SSSS]] | cCCCCCC ...\n");
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    const CR_NAMEDB_HEADER* header;
+    PCR_NAMEDB db = NULL;
+    CR_STATUS status;
+    int i;
+
+    if (argc >= 4 && strcmp(argv[1], "-l") == 0) {
+        status = CrNameDbOpen(argv[2], &db);
+        if (status != CR_OK) {
+            fprintf(stderr, "Could not open %s: %s\n", argv[2], NamesStatus(status));
+            return 1;
+        }
+        for (i = 3; i < argc; i++) {
+            if (!NamesLookup(db, argv[i])) {
+                fprintf(stderr, "Bad lookup '%s'\n", argv[i]);
+                CrNameDbClose(db);
+                return 2;
+            }
+        }
+        CrNameDbClose(db);
+        return 0;
+    }
+    if (argc != 3 || argv[1][0] == '-') {
+        NamesUsage();
+        return 2;
+    }
+
+    status = CrNameDbBuild(argv[1], argv[2]);
+    if (status == CR_OK) {
+        status = CrNameDbOpen(argv[2], &db);
+    }
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not build %s from %s: %s\n", argv[2], argv[1], NamesStatus(status));
+        return 1;
+    }
+    header = CrNameDbHeader(db);
+    printf("%s: %u vendors, %u devices, %u subsystems, %u classes, %u bytes of names, %u bytes total\n",
+        argv[2], header->VendorCount, header->DeviceCount, header->SubsystemCount, header->ClassCount,
+        header->StringSize, header->FileSize);
+    CrNameDbClose(db);
+    return 0;
+}
@@ -0,0 +1,496 @@
+// CRtrace.c
+//
+// Config-access trace tool. Records every read a topology scan makes, then
+// replays the scan from the trace on any machine, as fast as possible or at
+// the recorded pace, and reports how many reads the current scan code needs
+// against how many were recorded.
+//
+//   CRtrace record [-j WORKERS] [-s SNAPSHOT | -e IMAGE | -r SYSFS-ROOT] TRACE
+//   CRtrace replay [-p] [-j WORKERS] [-n ITERATIONS] TRACE
+//   CRtrace show TRACE
+//
+// record scans through sysfs on Linux, or through a snapshot file or ECAM
+// image anywhere. replay -p takes each read's recorded latency. replay exits
+// 1 if the scan read anything the trace does not have. show profiles the
+// recorded reads by width, region and function.
+
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // clock_gettime under strict -std=c11
+#endif
+
+#include "../CRcore/crcore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define TRACE_MAX_RECORDS   65536
+#define TRACE_TOP_FUNCTIONS 10
+
+static uint64_t
+TraceNowNs(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER now;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static const char*
+TraceStatus(
+    _In_ CR_STATUS Status
+)
+{
+    switch (Status) {
+    case CR_OK:                  return "success";
+    case CR_E_MORE_DATA:         return "more data";
+    case CR_E_INVALID_PARAMETER: return "invalid or corrupt file";
+    case CR_E_NO_MEMORY:         return "out of memory";
+    case CR_E_NOT_FOUND:         return "not found";
+    case CR_E_IO:                return "I/O error";
+    case CR_E_UNSUPPORTED:       return "unsupported version or size";
+    default:                     return "unknown error";
+    }
+}
+
+// Scans everything Backend serves, Workers at a time. Output->Total is the
+// number of functions found.
+static CR_STATUS
+TraceScan(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint32_t Workers,
+    _Inout_ CR_SCAN_OUTPUT* Output
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+    CR_EXECUTOR executor;
+    CR_STATUS status;
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    if (Workers > 1) {
+        CrThreadExecutorInit(&executor, Workers);
+        options.Executor = &executor;
+        options.MaxWorkers = Workers;
+    }
+    Output->Count = 0;
+    Output->Total = 0;
+    status = CrScanTopology(Backend, &options, Output);
+    // Only the count matters here.
+    return (status == CR_E_MORE_DATA) ? CR_OK : status;
+}
+
+//
+// record
+//
+
+static int
+TraceRecord(
+    _In_ const char* Path,
+    _In_opt_ const char* SnapshotPath,
+    _In_opt_ const char* ImagePath,
+    _In_opt_ const char* SysfsRoot,
+    _In_ uint32_t Workers
+)
+{
+    PCR_CONFIG_BACKEND source = NULL;
+    PCR_SNAPFILE snapshot = NULL;
+    PCR_TRACE_RECORDER recorder = NULL;
+    CR_SCAN_OUTPUT output;
+    CR_STATUS status;
+    uint64_t start;
+    uint64_t elapsed = 0;
+    int result = 2;
+
+    memset(&output, 0, sizeof(output));
+    if (SnapshotPath != NULL) {
+        status = CrSnapFileOpen(SnapshotPath, &snapshot);
+        source = (status == CR_OK) ? CrSnapFileBackend(snapshot) : NULL;
+    }
+    else if (ImagePath != NULL) {
+        status = CrEcamOpenImage(ImagePath, 0, 0, &source);
+    }
+    else {
+#if defined(__linux__)
+        status = CrSysfsOpen(SysfsRoot, &source);
+#else
+        (void)SysfsRoot;
+        fprintf(stderr, "Give a snapshot (-s) or ECAM image (-e) to record from\n");
+        return 2;
+#endif
+    }
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not open the source: %s\n", TraceStatus(status));
+        return 2;
+    }
+
+    output.Records = (CR_FUNCTION_RECORD*)malloc(TRACE_MAX_RECORDS * sizeof(CR_FUNCTION_RECORD));
+    output.Capacity = TRACE_MAX_RECORDS;
+    status = (output.Records != NULL) ? CrTraceRecorderCreate(source, &recorder) : CR_E_NO_MEMORY;
+    if (status == CR_OK) {
+        start = TraceNowNs();
+        status = TraceScan(CrTraceRecorderBackend(recorder), Workers, &output);
+        elapsed = TraceNowNs() - start;
+    }
+    if (status == CR_OK) {
+        status = CrTraceRecorderSave(recorder, Path);
+    }
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not record %s: %s\n", Path, TraceStatus(status));
+        goto Exit;
+    }
+
+    {
+        PCR_TRACE trace;
+
+        // Read it back, which also checks what was written.
+        status = CrTraceOpen(Path, 0, &trace);
+        if (status != CR_OK) {
+            fprintf(stderr, "Could not reopen %s: %s\n", Path, TraceStatus(status));
+            goto Exit;
+        }
+        printf("Recorded %u read(s) of %s while finding %u function(s) in %.1f ms to %s\n",
+            CrTraceHeader(trace)->RecordCount, source->Name, output.Total, elapsed / 1e6, Path);
+        CrTraceClose(trace);
+    }
+    result = 0;
+
+Exit:
+    CrTraceRecorderFree(recorder);
+    if (snapshot != NULL) {
+        CrSnapFileClose(snapshot);
+    }
+    else {
+        CrBackendClose(source);
+    }
+    free(output.Records);
+    return result;
+}
+
+//
+// replay
+//
+
+static int
+TraceReplay(
+    _In_ const char* Path,
+    _In_ uint32_t Flags,
+    _In_ uint32_t Workers,
+    _In_ uint32_t Iterations
+)
+{
+    const CR_TRACE_HEADER* header;
+    CR_TRACE_REPLAY_STATS stats;
+    CR_SCAN_OUTPUT output;
+    PCR_TRACE trace;
+    CR_STATUS status = CR_OK;
+    uint64_t start;
+    uint64_t elapsed;
+    uint32_t i;
+
+    status = CrTraceOpen(Path, Flags, &trace);
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", Path, TraceStatus(status));
+        return 2;
+    }
+    header = CrTraceHeader(trace);
+    memset(&output, 0, sizeof(output));
+    output.Records = (CR_FUNCTION_RECORD*)malloc(TRACE_MAX_RECORDS * sizeof(CR_FUNCTION_RECORD));
+    output.Capacity = TRACE_MAX_RECORDS;
+    if (output.Records == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        CrTraceClose(trace);
+        return 2;
+    }
+
+    start = TraceNowNs();
+    for (i = 0; i < Iterations && status == CR_OK; i++) {
+        status = TraceScan(CrTraceBackend(trace), Workers, &output);
+    }
+    elapsed = TraceNowNs() - start;
+    free(output.Records);
+    if (status != CR_OK) {
+        fprintf(stderr, "Replay of %s failed: %s\n", Path, TraceStatus(status));
+        CrTraceClose(trace);
+        return 2;
+    }
+
+    CrTraceReplayStats(trace, &stats);
+    printf("%u function(s), %.1f read(s) per scan (recorded %u), %.1f matched, %.1f missed\n",
+        output.Total, (double)stats.Reads / Iterations, header->RecordCount,
+        (double)stats.Matched / Iterations, (double)stats.Misses / Iterations);
+    printf("%.3f ms per scan%s (recorded %.3f ms)\n", elapsed / 1e6 / Iterations,
+        (Flags & CR_TRACE_REALTIME) ? " at the recorded pace" : "", header->DurationNs / 1e6);
+    CrTraceClose(trace);
+    return (stats.Misses != 0) ? 1 : 0;
+}
+
+//
+// show
+//
+
+typedef struct _TRACE_FUNCTION_COST {
+    uint32_t Key;
+    uint32_t Reads;
+    uint64_t LatencyNs;
+} TRACE_FUNCTION_COST;
+
+static int
+TraceCompareKeys(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    uint32_t left = ((const TRACE_FUNCTION_COST*)Left)->Key;
+    uint32_t right = ((const TRACE_FUNCTION_COST*)Right)->Key;
+
+    return (left > right) - (left < right);
+}
+
+// Most expensive first.
+static int
+TraceCompareCosts(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    uint64_t left = ((const TRACE_FUNCTION_COST*)Left)->LatencyNs;
+    uint64_t right = ((const TRACE_FUNCTION_COST*)Right)->LatencyNs;
+
+    return (left < right) - (left > right);
+}
+
+static uint32_t
+TraceLatencyBucket(
+    _In_ uint64_t Ns
+)
+{
+    uint32_t bucket = 0;
+
+    while (Ns > 1 && bucket < CR_STATS_BUCKETS - 1) {
+        Ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Reads grouped by where they land and how wide they are.
+typedef struct _TRACE_CLASS {
+    const char* Name;
+    uint64_t Reads;
+    uint64_t Bytes;
+    uint64_t LatencyNs;
+} TRACE_CLASS;
+
+static void
+TracePrintClass(
+    _In_ const TRACE_CLASS* Class,
+    _In_ const CR_TRACE_HEADER* Header
+)
+{
+    if (Class->Reads == 0) {
+        return;
+    }
+    printf("  %-14s %9llu %6.1f%% %11llu %10.3f ms %6.1f%%\n", Class->Name, (unsigned long long)Class->Reads,
+        100.0 * Class->Reads / Header->RecordCount, (unsigned long long)Class->Bytes, Class->LatencyNs / 1e6,
+        Header->LatencyNs ? 100.0 * Class->LatencyNs / Header->LatencyNs : 0.0);
+}
+
+static int
+TraceShow(
+    _In_ const char* Path
+)
+{
+    static const char* const widthNames[] = { "byte", "word", "dword", "header (64)", "256 bytes", "4 KB", "other" };
+    TRACE_CLASS widths[7];
+    TRACE_CLASS regions[3];
+    uint64_t histogram[CR_STATS_BUCKETS];
+    const CR_TRACE_HEADER* header;
+    const CR_TRACE_RECORD* record;
+    TRACE_FUNCTION_COST* costs;
+    uint32_t functions = 0;
+    uint32_t failed = 0;
+    uint32_t n = 0;
+    uint32_t i;
+    PCR_TRACE trace;
+    CR_STATUS status;
+
+    status = CrTraceOpen(Path, 0, &trace);
+    if (status != CR_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", Path, TraceStatus(status));
+        return 2;
+    }
+    header = CrTraceHeader(trace);
+    costs = (TRACE_FUNCTION_COST*)malloc(((size_t)header->RecordCount + 1) * sizeof(*costs));
+    if (costs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        CrTraceClose(trace);
+        return 2;
+    }
+
+    memset(widths, 0, sizeof(widths));
+    memset(regions, 0, sizeof(regions));
+    memset(histogram, 0, sizeof(histogram));
+    for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        widths[i].Name = widthNames[i];
+    }
+    regions[0].Name = "header";
+    regions[1].Name = "capabilities";
+    regions[2].Name = "extended";
+
+    for (record = CrTraceNext(trace, NULL); record != NULL; record = CrTraceNext(trace, record)) {
+        TRACE_CLASS* width;
+        TRACE_CLASS* region;
+
+        switch (record->Length) {
+        case 1:    width = &widths[0]; break;
+        case 2:    width = &widths[1]; break;
+        case 4:    width = &widths[2]; break;
+        case 64:   width = &widths[3]; break;
+        case 256:  width = &widths[4]; break;
+        case 4096: width = &widths[5]; break;
+        default:   width = &widths[6]; break;
+        }
+        region = (record->Offset < CR_CONFIG_HEADER_SIZE) ? &regions[0] : (record->Offset < 0x100) ? &regions[1] : &regions[2];
+        width->Reads++;
+        width->Bytes += record->Length;
+        width->LatencyNs += record->LatencyNs;
+        region->Reads++;
+        region->Bytes += record->Length;
+        region->LatencyNs += record->LatencyNs;
+        histogram[TraceLatencyBucket(record->LatencyNs)]++;
+        if (record->Returned < record->Length) {
+            failed++;
+        }
+        costs[n].Key = record->Key;
+        costs[n].Reads = 1;
+        costs[n].LatencyNs = record->LatencyNs;
+        n++;
+    }
+
+    // Fold the reads into one entry per function.
+    qsort(costs, n, sizeof(*costs), TraceCompareKeys);
+    for (i = 0; i < n; i++) {
+        if (functions != 0 && costs[functions - 1].Key == costs[i].Key) {
+            costs[functions - 1].Reads++;
+            costs[functions - 1].LatencyNs += costs[i].LatencyNs;
+        }
+        else {
+            costs[functions++] = costs[i];
+        }
+    }
+    qsort(costs, functions, sizeof(*costs), TraceCompareCosts);
+
+    printf("%u read(s) of %u address(es), %u short; %.3f ms scan, %.3f ms in the backend\n",
+        header->RecordCount, functions, failed, header->DurationNs / 1e6, header->LatencyNs / 1e6);
+    if (header->RecordCount == 0) {
+        free(costs);
+        CrTraceClose(trace);
+        return 0;
+    }
+    printf("Latency: mean %.0f ns, p50 < %llu ns, p90 < %llu ns, p99 < %llu ns\n",
+        (double)header->LatencyNs / header->RecordCount,
+        (unsigned long long)CrStatsPercentile(histogram, 50),
+        (unsigned long long)CrStatsPercentile(histogram, 90),
+        (unsigned long long)CrStatsPercentile(histogram, 99));
+
+    printf("\n  %-14s %9s %7s %11s %13s %7s\n", "Width", "Reads", "", "Bytes", "Time", "");
+    for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        TracePrintClass(&widths[i], header);
+    }
+    printf("\n  %-14s %9s %7s %11s %13s %7s\n", "Region", "Reads", "", "Bytes", "Time", "");
+    for (i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        TracePrintClass(&regions[i], header);
+    }
+
+    printf("\n  %-14s %9s %13s\n", "Function", "Reads", "Time");
+    for (i = 0; i < functions && i < TRACE_TOP_FUNCTIONS; i++) {
+        CR_ADDRESS address = CrAddressFromKey(costs[i].Key);
+        printf("  %04X:%02X:%02X.%u   %9u %10.3f ms\n", address.Segment, address.Bus, address.Device,
+            address.Function, costs[i].Reads, costs[i].LatencyNs / 1e6);
+    }
+
+    free(costs);
+    CrTraceClose(trace);
+    return 0;
+}
+
+static void
+TraceUsage(void)
+{
+    fprintf(stderr,
+        "Usage: CRtrace record [-j WORKERS] [-s SNAPSHOT | -e IMAGE | -r SYSFS-ROOT] TRACE\n"
+        "       CRtrace replay [-p] [-j WORKERS] [-n ITERATIONS] TRACE\n"
+        "       CRtrace show TRACE\n");
+}
+
+int
+main(
+    int argc,
+    char** argv
+)
+{
+    const char* snapshotPath = NULL;
+    const char* imagePath = NULL;
+    const char* sysfsRoot = NULL;
+    uint32_t flags = 0;
+    uint32_t workers = 1;
+    uint32_t iterations = 1;
+    int i;
+
+    if (argc < 3) {
+        TraceUsage();
+        return 2;
+    }
+    for (i = 2; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            flags |= CR_TRACE_REALTIME;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc - 1) {
+            workers = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc - 1) {
+            iterations = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc - 1) {
+            snapshotPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc - 1) {
+            imagePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc - 1) {
+            sysfsRoot = argv[++i];
+        }
+        else {
+            TraceUsage();
+            return 2;
+        }
+    }
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    if (strcmp(argv[1], "record") == 0) {
+        return TraceRecord(argv[argc - 1], snapshotPath, imagePath, sysfsRoot, workers);
+    }
+    if (strcmp(argv[1], "replay") == 0) {
+        return TraceReplay(argv[argc - 1], flags, workers, iterations);
+    }
+    if (strcmp(argv[1], "show") == 0 && argc == 3) {
+        return TraceShow(argv[argc - 1]);
+    }
+    TraceUsage();
+    return 2;
+}
@@ -0,0 +1,390 @@
+// crtest.c
+//
+// Check reporting, synthetic topologies and the counting backend shared by
+// the behavior tests.
+
+#include "crtest.h"
+
+#define CR_TEST_INTEL  0x8086
+
+#define CR_CFG_STATUS             0x06
+#define CR_STATUS_CAPABILITIES    0x0010
+
+unsigned CrTestFailures;
+
+void
+CrTestFail(
+    _In_z_ const char* File,
+    _In_ int Line,
+    _In_z_ const char* Expression
+)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", File, Line, Expression);
+    CrTestFailures++;
+}
+
+int
+CrTestRun(
+    _In_reads_(Count) const CR_TEST* Tests,
+    _In_ uint32_t Count
+)
+{
+    uint32_t failedTests = 0;
+    uint32_t i;
+
+    for (i = 0; i < Count; i++) {
+        unsigned before = CrTestFailures;
+
+        Tests[i].Run();
+        if (CrTestFailures != before) {
+            failedTests++;
+        }
+        printf("%-40s %s\n", Tests[i].Name, (CrTestFailures != before) ? "FAILED" : "ok");
+    }
+    printf("%u of %u tests passed\n", Count - failedTests, Count);
+    return (failedTests != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+CR_ADDRESS
+CrTestAddress(
+    _In_ uint16_t Segment,
+    _In_ uint8_t Bus,
+    _In_ uint8_t Device,
+    _In_ uint8_t Function
+)
+{
+    CR_ADDRESS address;
+
+    address.Segment = Segment;
+    address.Bus = Bus;
+    address.Device = Device;
+    address.Function = Function;
+    return address;
+}
+
+//
+// Synthetic topologies
+//
+
+typedef struct _CR_TEST_BUILDER {
+    PCR_CONFIG_BACKEND Sim;
+    uint32_t Count;
+} CR_TEST_BUILDER;
+
+static CR_STATUS
+CrTestAddDevice(
+    _Inout_ CR_TEST_BUILDER* Builder,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ uint8_t HeaderType
+)
+{
+    Builder->Count++;
+    return CrSimAddDevice(Builder->Sim, Address, VendorId, DeviceId, ClassCode, HeaderType);
+}
+
+static CR_STATUS
+CrTestAddBridge(
+    _Inout_ CR_TEST_BUILDER* Builder,
+    _In_ CR_ADDRESS Address,
+    _In_ uint8_t SecondaryBus,
+    _In_ uint8_t SubordinateBus
+)
+{
+    Builder->Count++;
+    return CrSimAddBridge(Builder->Sim, Address, CR_TEST_INTEL, 0x7A38, SecondaryBus, SubordinateBus);
+}
+
+static CR_STATUS
+CrTestBuildFlat(
+    _Inout_ CR_TEST_BUILDER* Builder
+)
+{
+    CR_STATUS status = CrTestAddDevice(Builder, CrTestAddress(0, 0, 0, 0), CR_TEST_INTEL, 0x4660, 0x060000, 0);
+    uint8_t device;
+    uint8_t function;
+
+    for (device = 1; device < CR_MAX_DEVICES && status == CR_OK; device++) {
+        for (function = 0; function < CR_MAX_FUNCTIONS && status == CR_OK; function++) {
+            status = CrTestAddDevice(Builder, CrTestAddress(0, 0, device, function), CR_TEST_INTEL,
+                (uint16_t)(0x7A00 + device), 0x0C0330, CR_HEADER_TYPE_MULTIFUNCTION);
+        }
+    }
+    return status;
+}
+
+#define CR_TEST_SWITCH_FANOUT 4
+#define CR_TEST_SWITCH_DEPTH  3
+
+// Buses a switch uses below its upstream port's own bus.
+static uint32_t
+CrTestSwitchBuses(
+    _In_ uint32_t Depth
+)
+{
+    return 1 + CR_TEST_SWITCH_FANOUT * (1 + ((Depth > 1) ? CrTestSwitchBuses(Depth - 1) : 0));
+}
+
+static CR_STATUS
+CrTestAddSwitch(
+    _Inout_ CR_TEST_BUILDER* Builder,
+    _In_ uint8_t Bus,
+    _In_ uint32_t Depth
+)
+{
+    uint8_t internal = (uint8_t)(Bus + 1);
+    uint8_t next = (uint8_t)(internal + 1);
+    uint32_t below = (Depth > 1) ? CrTestSwitchBuses(Depth - 1) : 0;
+    uint8_t port;
+    CR_STATUS status;
+
+    status = CrTestAddBridge(Builder, CrTestAddress(0, Bus, 0, 0), internal, (uint8_t)(Bus + CrTestSwitchBuses(Depth)));
+    for (port = 0; port < CR_TEST_SWITCH_FANOUT && status == CR_OK; port++) {
+        status = CrTestAddBridge(Builder, CrTestAddress(0, internal, port, 0), next, (uint8_t)(next + below));
+        if (status != CR_OK) {
+            break;
+        }
+        status = (Depth > 1) ?
+            CrTestAddSwitch(Builder, next, Depth - 1) :
+            CrTestAddDevice(Builder, CrTestAddress(0, next, 0, 0), 0x144D, 0xA80A, 0x010802, 0);
+        next = (uint8_t)(next + 1 + below);
+    }
+    return status;
+}
+
+static CR_STATUS
+CrTestBuildDeep(
+    _Inout_ CR_TEST_BUILDER* Builder
+)
+{
+    CR_STATUS status = CrTestAddDevice(Builder, CrTestAddress(0, 0, 0, 0), CR_TEST_INTEL, 0x4660, 0x060000, 0);
+
+    if (status == CR_OK) {
+        status = CrTestAddBridge(Builder, CrTestAddress(0, 0, 1, 0), 1,
+            (uint8_t)(1 + CrTestSwitchBuses(CR_TEST_SWITCH_DEPTH)));
+    }
+    return (status == CR_OK) ? CrTestAddSwitch(Builder, 1, CR_TEST_SWITCH_DEPTH) : status;
+}
+
+#define CR_TEST_SRIOV_PFS  16
+#define CR_TEST_SRIOV_VFS  255
+
+// VFs carry the PF's vendor ID, as an OS-enumerated view shows them.
+static CR_STATUS
+CrTestBuildSriov(
+    _Inout_ CR_TEST_BUILDER* Builder
+)
+{
+    CR_STATUS status = CrTestAddDevice(Builder, CrTestAddress(0, 0, 0, 0), CR_TEST_INTEL, 0x4660, 0x060000, 0);
+    uint32_t pf;
+    uint32_t vf;
+
+    for (pf = 0; pf < CR_TEST_SRIOV_PFS && status == CR_OK; pf++) {
+        uint8_t bus = (uint8_t)(1 + pf);
+
+        status = CrTestAddBridge(Builder, CrTestAddress(0, 0, (uint8_t)(1 + pf), 0), bus, bus);
+        if (status == CR_OK) {
+            status = CrTestAddDevice(Builder, CrTestAddress(0, bus, 0, 0), CR_TEST_INTEL, 0x1593, 0x020000,
+                CR_HEADER_TYPE_MULTIFUNCTION);
+        }
+        for (vf = 1; vf <= CR_TEST_SRIOV_VFS && status == CR_OK; vf++) {
+            status = CrTestAddDevice(Builder, CrTestAddress(0, bus, (uint8_t)(vf >> 3), (uint8_t)(vf & 7)),
+                CR_TEST_INTEL, 0x1889, 0x020000, CR_HEADER_TYPE_MULTIFUNCTION);
+        }
+    }
+    return status;
+}
+
+static CR_STATUS
+CrTestBuildSparse(
+    _Inout_ CR_TEST_BUILDER* Builder
+)
+{
+    static const uint16_t segments[] = { 0, 1, 0x10, 0x20 };
+    static const uint8_t buses[] = { 0x20, 0x80, 0xE0 };
+    CR_STATUS status = CR_OK;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < sizeof(segments) / sizeof(segments[0]) && status == CR_OK; i++) {
+        status = CrTestAddDevice(Builder, CrTestAddress(segments[i], 0, 0, 0), CR_TEST_INTEL, 0x09A2, 0x060000, 0);
+        for (j = 0; j < sizeof(buses) / sizeof(buses[0]) && status == CR_OK; j++) {
+            status = CrTestAddDevice(Builder, CrTestAddress(segments[i], buses[j], 0, 0), 0x15B3, 0x101D,
+                0x020000, 0);
+            if (status == CR_OK) {
+                status = CrTestAddDevice(Builder, CrTestAddress(segments[i], buses[j], 0x1F, 0), 0x144D, 0xA80A,
+                    0x010802, 0);
+            }
+        }
+    }
+    return status;
+}
+
+static const struct {
+    const char* Name;
+    uint32_t MaxFunctions;
+    CR_STATUS (*Build)(_Inout_ CR_TEST_BUILDER* Builder);
+} CrTestTopologies[CrTestTopologyCount] = {
+    { "flat", 256, CrTestBuildFlat },
+    { "deep", 256, CrTestBuildDeep },
+    { "sriov", 8192, CrTestBuildSriov },
+    { "sparse", 64, CrTestBuildSparse },
+};
+
+CR_STATUS
+CrTestBuild(
+    _In_ CR_TEST_TOPOLOGY Type,
+    _Out_ PCR_CONFIG_BACKEND* Backend,
+    _Out_ uint32_t* Count
+)
+{
+    CR_TEST_BUILDER builder;
+    CR_STATUS status;
+
+    *Backend = NULL;
+    *Count = 0;
+    builder.Count = 0;
+    status = CrSimCreate(CrTestTopologies[Type].MaxFunctions, &builder.Sim);
+    if (status != CR_OK) {
+        return status;
+    }
+    status = CrTestTopologies[Type].Build(&builder);
+    if (status != CR_OK) {
+        CrBackendClose(builder.Sim);
+        return status;
+    }
+    *Backend = builder.Sim;
+    *Count = builder.Count;
+    return CR_OK;
+}
+
+const char*
+CrTestTopologyName(
+    _In_ CR_TEST_TOPOLOGY Type
+)
+{
+    return CrTestTopologies[Type].Name;
+}
+
+//
+// Counting backend
+//
+
+static uint32_t
+CrTestBackendRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    CR_TEST_BACKEND* test = (CR_TEST_BACKEND*)Backend;
+
+    test->Reads++;
+    test->Bytes += Length;
+    if (test->OnRead != NULL) {
+        test->OnRead(test, Address, Offset);
+    }
+    return CrConfigRead(test->Inner, Address, Offset, Buffer, Length);
+}
+
+static uint32_t
+CrTestBackendEnumerateSegments(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(Capacity) uint16_t* Segments,
+    _In_ uint32_t Capacity
+)
+{
+    PCR_CONFIG_BACKEND inner = ((CR_TEST_BACKEND*)Backend)->Inner;
+
+    return inner->EnumerateSegments(inner, Segments, Capacity);
+}
+
+static void
+CrTestBackendEnumerateBuses(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint16_t Segment,
+    _Inout_updates_(CR_BUS_MAP_WORDS) uint32_t* Buses
+)
+{
+    PCR_CONFIG_BACKEND inner = ((CR_TEST_BACKEND*)Backend)->Inner;
+
+    inner->EnumerateBuses(inner, Segment, Buses);
+}
+
+static void
+CrTestBackendClose(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    (void)Backend;
+}
+
+void
+CrTestWrap(
+    _In_ PCR_CONFIG_BACKEND Inner,
+    _Out_ CR_TEST_BACKEND* Backend
+)
+{
+    memset(Backend, 0, sizeof(*Backend));
+    Backend->Base.Name = Inner->Name;
+    Backend->Base.Read = CrTestBackendRead;
+    Backend->Base.Close = CrTestBackendClose;
+    Backend->Base.EnumerateSegments = (Inner->EnumerateSegments != NULL) ? CrTestBackendEnumerateSegments : NULL;
+    Backend->Base.EnumerateBuses = (Inner->EnumerateBuses != NULL) ? CrTestBackendEnumerateBuses : NULL;
+    Backend->Inner = Inner;
+}
+
+int
+CrTestRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length
+)
+{
+    return CrConfigRead(Backend, Address, Offset, Buffer, Length) == Length;
+}
+
+void
+CrTestPut16(
+    _Out_writes_bytes_(2) uint8_t* Config,
+    _In_ uint32_t Offset,
+    _In_ uint16_t Value
+)
+{
+    Config[Offset] = (uint8_t)Value;
+    Config[Offset + 1] = (uint8_t)(Value >> 8);
+}
+
+void
+CrTestPut32(
+    _Out_writes_bytes_(4) uint8_t* Config,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Value
+)
+{
+    CrTestPut16(Config, Offset, (uint16_t)Value);
+    CrTestPut16(Config, Offset + 2, (uint16_t)(Value >> 16));
+}
+
+void
+CrTestHeader(
+    _Out_writes_bytes_(CR_CONFIG_SPACE_SIZE) uint8_t* Config,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ uint8_t CapabilityPointer
+)
+{
+    memset(Config, 0, CR_CONFIG_SPACE_SIZE);
+    CrTestPut16(Config, CR_CFG_VENDOR_ID, VendorId);
+    CrTestPut16(Config, CR_CFG_DEVICE_ID, DeviceId);
+    CrTestPut16(Config, CR_CFG_STATUS, (CapabilityPointer != 0) ? CR_STATUS_CAPABILITIES : 0);
+    CrTestPut32(Config, CR_CFG_REVISION_ID, (ClassCode << 8) | 0x01);
+    Config[CR_CFG_CAPABILITIES] = CapabilityPointer;
+}
@@ -0,0 +1,115 @@
+// crtest.h
+//
+// Shared pieces of the behavior tests: check macros, the synthetic
+// topologies CRbench measures, and a backend wrapper that counts reads.
+// Each test program runs its cases in order and exits nonzero if any check
+// failed, which is all CTest looks at.
+
+#pragma once
+
+#include "../CRcore/crcore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern unsigned CrTestFailures;
+
+void CrTestFail(_In_z_ const char* File, _In_ int Line, _In_z_ const char* Expression);
+
+// Records a failure and carries on, so one run reports every broken check.
+#define CR_CHECK(Expression) \
+    do { \
+        if (!(Expression)) { \
+            CrTestFail(__FILE__, __LINE__, #Expression); \
+        } \
+    } while (0)
+
+// Values are evaluated once, before comparing, and printed on a mismatch.
+#define CR_CHECK_EQ(Actual, Expected) \
+    do { \
+        unsigned long long crActual = (unsigned long long)(Actual); \
+        unsigned long long crExpected = (unsigned long long)(Expected); \
+        if (crActual != crExpected) { \
+            fprintf(stderr, "    %s = %llu (0x%llx), expected %llu (0x%llx)\n", #Actual, \
+                crActual, crActual, crExpected, crExpected); \
+            CrTestFail(__FILE__, __LINE__, #Actual " == " #Expected); \
+        } \
+    } while (0)
+
+typedef void (*CR_TEST_CASE)(void);
+
+typedef struct _CR_TEST {
+    const char* Name;
+    CR_TEST_CASE Run;
+} CR_TEST;
+
+// Runs every test and returns the process exit code.
+int CrTestRun(_In_reads_(Count) const CR_TEST* Tests, _In_ uint32_t Count);
+
+CR_ADDRESS CrTestAddress(_In_ uint16_t Segment, _In_ uint8_t Bus, _In_ uint8_t Device, _In_ uint8_t Function);
+
+//
+// Synthetic topologies, the same shapes CRbench uses
+//
+
+typedef enum _CR_TEST_TOPOLOGY {
+    CrTestFlat,              // Bus 0: a host bridge and 31 eight-function devices
+    CrTestDeep,              // A root port feeding three levels of four-port switches
+    CrTestSriov,             // 16 PFs behind their own root ports, 255 VFs each
+    CrTestSparse,            // 4 segments with three far-apart root buses each
+    CrTestTopologyCount
+} CR_TEST_TOPOLOGY;
+
+// Builds Type in a new simulated backend. *Count is the number of functions
+// added, every one of which a full scan should report.
+CR_STATUS CrTestBuild(_In_ CR_TEST_TOPOLOGY Type, _Out_ PCR_CONFIG_BACKEND* Backend, _Out_ uint32_t* Count);
+
+const char* CrTestTopologyName(_In_ CR_TEST_TOPOLOGY Type);
+
+//
+// Counting backend
+//
+
+// Wraps Inner, counting reads. OnRead, if set, runs before each read is
+// passed on. Not thread safe. Closing the wrapper does not close Inner.
+typedef struct _CR_TEST_BACKEND {
+    CR_CONFIG_BACKEND Base;
+    PCR_CONFIG_BACKEND Inner;
+    uint32_t Reads;
+    uint64_t Bytes;
+    void (*OnRead)(_Inout_ struct _CR_TEST_BACKEND* Backend, _In_ CR_ADDRESS Address, _In_ uint32_t Offset);
+    void* Context;
+} CR_TEST_BACKEND;
+
+void CrTestWrap(_In_ PCR_CONFIG_BACKEND Inner, _Out_ CR_TEST_BACKEND* Backend);
+
+// Reads Length bytes of Address into Buffer and returns nonzero if all of
+// them came back.
+int CrTestRead(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset,
+    _Out_writes_bytes_(Length) void* Buffer,
+    _In_ uint32_t Length);
+
+// Little-endian stores into a config-space image.
+void CrTestPut16(_Out_writes_bytes_(2) uint8_t* Config, _In_ uint32_t Offset, _In_ uint16_t Value);
+void CrTestPut32(_Out_writes_bytes_(4) uint8_t* Config, _In_ uint32_t Offset, _In_ uint32_t Value);
+
+// Fills the start of Config with a type 0 header that has the Capabilities
+// List status bit set and CapabilityPointer in place.
+void CrTestHeader(
+    _Out_writes_bytes_(CR_CONFIG_SPACE_SIZE) uint8_t* Config,
+    _In_ uint16_t VendorId,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ uint8_t CapabilityPointer);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,122 @@
+// crtest_backend.c
+//
+// Config backends on their own: what the simulated and file-image backends
+// return for present, absent and unreachable functions, and a bus scan over
+// each.
+
+#include "crtest.h"
+
+#define BACKEND_IMAGE "crtest_backend.img"
+
+static uint8_t BackendConfig[CR_CONFIG_SPACE_SIZE];
+
+static CR_STATUS
+BackendScanBus(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint8_t Bus,
+    _Out_writes_(Capacity) CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Capacity,
+    _Out_ PCR_SCAN_OUTPUT Output
+)
+{
+    Output->Records = Records;
+    Output->Capacity = Capacity;
+    Output->Count = 0;
+    Output->Total = 0;
+    return CrScanBus(Backend, 0, Bus, NULL, Output);
+}
+
+static void
+TestBackendSim(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    uint32_t value;
+
+    CR_CHECK_EQ(CrSimCreate(0, &sim), CR_E_INVALID_PARAMETER);
+    CR_CHECK(sim == NULL);
+    CR_CHECK_EQ(CrSimCreate(2, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+
+    CR_CHECK(CrTestRead(sim, CrTestAddress(0, 0, 0, 0), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0x46608086);
+    // Past the header that was supplied, config space reads as zeroes.
+    CR_CHECK(CrTestRead(sim, CrTestAddress(0, 0, 0, 0), 0xFFC, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0);
+    // An empty slot answers like a master abort.
+    CR_CHECK(CrTestRead(sim, CrTestAddress(0, 7, 3, 2), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0xFFFFFFFF);
+    // Reads that leave config space fail.
+    CR_CHECK_EQ(CrConfigRead(sim, CrTestAddress(0, 0, 0, 0), 0xFFE, &value, sizeof(value)), 0);
+    CR_CHECK_EQ(CrConfigRead(sim, CrTestAddress(0, 0, 0, 0), CR_CONFIG_SPACE_SIZE, &value, 1), 0);
+
+    // Adding an address again replaces the function.
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4661, 0x060000, 0), CR_OK);
+    CR_CHECK(CrTestRead(sim, CrTestAddress(0, 0, 0, 0), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0x46618086);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 1, 0), 0x8086, 0x1533, 0x020000, 0), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 2, 0), 0x8086, 0x1533, 0x020000, 0), CR_E_NO_MEMORY);
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 0, 1, 0), BackendConfig, CR_CONFIG_SPACE_SIZE + 1),
+        CR_E_INVALID_PARAMETER);
+    CrBackendClose(sim);
+}
+
+// An image of bus 2 that ends after 2:3.1. Slots past the end of the file
+// cannot be reached, which a scan treats like empty ones.
+static void
+TestBackendFileImage(void)
+{
+    static CR_FUNCTION_RECORD records[8];
+    PCR_CONFIG_BACKEND image;
+    CR_SCAN_OUTPUT output;
+    FILE* file;
+    uint32_t value;
+
+    file = fopen(BACKEND_IMAGE, "wb");
+    CR_CHECK(file != NULL);
+    if (file == NULL) {
+        return;
+    }
+    CrTestHeader(BackendConfig, 0x8086, 0x7A38, 0x060400, 0);
+    fwrite(BackendConfig, 1, sizeof(BackendConfig), file);
+    memset(BackendConfig, 0, sizeof(BackendConfig));
+    fseek(file, 3 << 15, SEEK_SET);
+    CrTestHeader(BackendConfig, 0x8086, 0x1572, 0x020000, 0);
+    BackendConfig[CR_CFG_HEADER_TYPE] = CR_HEADER_TYPE_MULTIFUNCTION;
+    fwrite(BackendConfig, 1, sizeof(BackendConfig), file);
+    BackendConfig[CR_CFG_HEADER_TYPE] = 0;
+    fwrite(BackendConfig, 1, sizeof(BackendConfig), file);
+    fclose(file);
+
+    CR_CHECK_EQ(CrFileImageOpen(BACKEND_IMAGE, 0, 2, &image), CR_OK);
+    CR_CHECK(CrTestRead(image, CrTestAddress(0, 2, 0, 0), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0x7A388086);
+    CR_CHECK(CrTestRead(image, CrTestAddress(0, 2, 3, 1), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0x15728086);
+    CR_CHECK_EQ(CrConfigRead(image, CrTestAddress(0, 2, 3, 2), 0, &value, sizeof(value)), 0);
+    CR_CHECK_EQ(CrConfigRead(image, CrTestAddress(0, 1, 0, 0), 0, &value, sizeof(value)), 0);
+    CR_CHECK_EQ(CrConfigRead(image, CrTestAddress(1, 2, 0, 0), 0, &value, sizeof(value)), 0);
+
+    CR_CHECK_EQ(BackendScanBus(image, 2, records, 8, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, 3);
+    CR_CHECK_EQ(records[0].DeviceId, 0x7A38);
+    CR_CHECK_EQ(records[1].Device, 3);
+    CR_CHECK_EQ(records[2].Function, 1);
+    // The bus before the image is not there at all.
+    CR_CHECK_EQ(BackendScanBus(image, 1, records, 8, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, 0);
+    CrBackendClose(image);
+
+    CR_CHECK(CrFileImageOpen("crtest_backend_missing.img", 0, 0, &image) != CR_OK);
+    remove(BACKEND_IMAGE);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "backend sim", TestBackendSim },
+        { "backend file image", TestBackendFileImage },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
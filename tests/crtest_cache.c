@@ -0,0 +1,301 @@
+// crtest_cache.c
+//
+// Config-space cache: repeat walks are answered from memory, presence is
+// always read from the hardware, and devices added, removed or replaced
+// behind the cache's back are noticed. Fields the cache treats as immutable
+// are only re-read after an invalidation, a flush or a refresh-view read.
+
+#include "crtest.h"
+
+#define CACHE_ID_PM     0x01
+#define CACHE_ID_MSI    0x05
+#define CACHE_ID_PCIE   0x10
+
+static uint8_t CacheConfig[CR_CONFIG_SPACE_SIZE];
+
+// Adds (or replaces) 0:2.0 with a PM -> PCIe list, or PM -> MSI -> PCIe with
+// Msi, and AER as the one extended capability.
+static void
+CacheAddDevice(
+    _In_ PCR_CONFIG_BACKEND Sim,
+    _In_ uint16_t DeviceId,
+    _In_ uint32_t ClassCode,
+    _In_ int Msi
+)
+{
+    CrTestHeader(CacheConfig, 0x8086, DeviceId, ClassCode, 0x40);
+    CacheConfig[0x40] = CACHE_ID_PM;
+    CacheConfig[0x41] = Msi ? 0x50 : 0x60;
+    CacheConfig[0x50] = CACHE_ID_MSI;
+    CacheConfig[0x51] = 0x60;
+    CacheConfig[0x60] = CACHE_ID_PCIE;
+    CacheConfig[0x61] = 0x00;
+    CrTestPut32(CacheConfig, CR_EXTENDED_CAPS_START, 0x0001 | (2u << 16));
+    CR_CHECK_EQ(CrSimAddFunction(Sim, CrTestAddress(0, 0, 2, 0), CacheConfig, sizeof(CacheConfig)), CR_OK);
+}
+
+typedef struct _CACHE_FIXTURE {
+    PCR_CONFIG_BACKEND Sim;
+    CR_TEST_BACKEND Inner;   // Counts what reaches the hardware
+    PCR_CACHE Cache;
+    PCR_CONFIG_BACKEND Cached;
+} CACHE_FIXTURE;
+
+static void
+CacheSetUp(
+    _Out_ CACHE_FIXTURE* Fixture
+)
+{
+    memset(Fixture, 0, sizeof(*Fixture));
+    CR_CHECK_EQ(CrSimCreate(8, &Fixture->Sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(Fixture->Sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    CacheAddDevice(Fixture->Sim, 0x1593, 0x020000, 0);
+    CrTestWrap(Fixture->Sim, &Fixture->Inner);
+    CR_CHECK_EQ(CrCacheCreate(&Fixture->Inner.Base, 64, 16, &Fixture->Cache), CR_OK);
+    Fixture->Cached = CrCacheBackend(Fixture->Cache);
+}
+
+static void
+CacheTearDown(
+    _Inout_ CACHE_FIXTURE* Fixture
+)
+{
+    CrCacheFree(Fixture->Cache);
+    CrBackendClose(Fixture->Sim);
+}
+
+static uint32_t
+CacheWalk(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(8) CR_CAP_ENTRY* Entries
+)
+{
+    uint32_t total = 0;
+
+    CR_CHECK_EQ(CrCapWalk(Backend, CrTestAddress(0, 0, 2, 0), Entries, 8, &total), CR_OK);
+    return total;
+}
+
+static uint32_t
+CacheClassCode(
+    _In_ PCR_CONFIG_BACKEND Backend
+)
+{
+    uint8_t dword[4] = { 0 };
+
+    CR_CHECK(CrTestRead(Backend, CrTestAddress(0, 0, 2, 0), CR_CFG_REVISION_ID, dword, 4));
+    return ((uint32_t)dword[3] << 16) | ((uint32_t)dword[2] << 8) | dword[1];
+}
+
+// A repeat walk reads only the ID dword from the hardware.
+static void
+TestCacheRepeatWalk(void)
+{
+    CACHE_FIXTURE fixture;
+    CR_CAP_ENTRY first[8];
+    CR_CAP_ENTRY second[8];
+    uint32_t firstReads;
+
+    CacheSetUp(&fixture);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, first), 3);
+    firstReads = fixture.Inner.Reads;
+    CR_CHECK(firstReads > 1);
+
+    fixture.Inner.Reads = 0;
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, second), 3);
+    CR_CHECK_EQ(fixture.Inner.Reads, 1);
+    CR_CHECK(memcmp(first, second, 3 * sizeof(CR_CAP_ENTRY)) == 0);
+
+    // The immutable header fields are served too.
+    fixture.Inner.Reads = 0;
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020000);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020000);
+    CR_CHECK(fixture.Inner.Reads <= 1);
+    CacheTearDown(&fixture);
+}
+
+// Absence is never answered from memory: a device that appears after its
+// empty slot was seen is found on the next read.
+static void
+TestCacheHotAdd(void)
+{
+    CACHE_FIXTURE fixture;
+    CR_CAP_ENTRY entries[8];
+    uint8_t ids[4];
+    uint32_t total;
+
+    CacheSetUp(&fixture);
+    CR_CHECK(CrTestRead(fixture.Cached, CrTestAddress(0, 0, 5, 0), 0, ids, 4));
+    CR_CHECK_EQ(ids[0] | (ids[1] << 8), CR_INVALID_VENDOR_ID);
+    CR_CHECK_EQ(CrCapWalk(fixture.Cached, CrTestAddress(0, 0, 5, 0), entries, 8, &total), CR_E_NOT_FOUND);
+
+    CR_CHECK_EQ(CrSimAddDevice(fixture.Sim, CrTestAddress(0, 0, 5, 0), 0x144D, 0xA80A, 0x010802, 0), CR_OK);
+    CR_CHECK(CrTestRead(fixture.Cached, CrTestAddress(0, 0, 5, 0), 0, ids, 4));
+    CR_CHECK_EQ(ids[0] | (ids[1] << 8), 0x144D);
+    CR_CHECK_EQ(ids[2] | (ids[3] << 8), 0xA80A);
+    CR_CHECK_EQ(CrCapWalk(fixture.Cached, CrTestAddress(0, 0, 5, 0), entries, 8, &total), CR_OK);
+    CacheTearDown(&fixture);
+}
+
+static void
+TestCacheHotRemove(void)
+{
+    CACHE_FIXTURE fixture;
+    CR_CAP_ENTRY entries[8];
+    uint8_t ids[4];
+    uint32_t total;
+
+    CacheSetUp(&fixture);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 3);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020000);
+
+    memset(CacheConfig, 0xFF, sizeof(CacheConfig));
+    CR_CHECK_EQ(CrSimAddFunction(fixture.Sim, CrTestAddress(0, 0, 2, 0), CacheConfig, sizeof(CacheConfig)), CR_OK);
+    CR_CHECK_EQ(CrCapWalk(fixture.Cached, CrTestAddress(0, 0, 2, 0), entries, 8, &total), CR_E_NOT_FOUND);
+    CR_CHECK(CrTestRead(fixture.Cached, CrTestAddress(0, 0, 2, 0), 0, ids, 4));
+    CR_CHECK_EQ(ids[0] | (ids[1] << 8), CR_INVALID_VENDOR_ID);
+    // A read that includes the ID dword does not get the departed device's fields.
+    CR_CHECK(CrTestRead(fixture.Cached, CrTestAddress(0, 0, 2, 0), 0, CacheConfig, CR_CONFIG_HEADER_SIZE));
+    CR_CHECK_EQ(CacheConfig[CR_CFG_BASE_CLASS], 0xFF);
+    CacheTearDown(&fixture);
+}
+
+// A different device in the same slot drops everything learned about the old one.
+static void
+TestCacheReplace(void)
+{
+    CACHE_FIXTURE fixture;
+    CR_CAP_ENTRY entries[8];
+
+    CacheSetUp(&fixture);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 3);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020000);
+
+    CacheAddDevice(fixture.Sim, 0x1594, 0x010802, 1);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 4);
+    CR_CHECK_EQ(entries[1].Id, CACHE_ID_MSI);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x010802);
+
+    // And back to a shorter list: nothing of the longer one survives.
+    CacheAddDevice(fixture.Sim, 0x1595, 0x030000, 0);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 3);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x030000);
+    CacheTearDown(&fixture);
+}
+
+// A firmware update that keeps the IDs is only seen after an invalidation,
+// a flush, or a refresh-view read of offset 0. Each step walks first, so the
+// class code read after it is learned by a slot known to be present.
+static void
+TestCacheInvalidate(void)
+{
+    CACHE_FIXTURE fixture;
+    CR_CAP_ENTRY entries[8];
+
+    CacheSetUp(&fixture);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 3);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020000);
+
+    CacheAddDevice(fixture.Sim, 0x1593, 0x020080, 1);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020000);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 3);
+
+    CrCacheInvalidate(fixture.Cache, CrTestAddress(0, 0, 2, 0));
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 4);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020080);
+
+    CacheAddDevice(fixture.Sim, 0x1593, 0x020081, 0);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020080);
+    CrCacheFlush(fixture.Cache);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 3);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020081);
+
+    CacheAddDevice(fixture.Sim, 0x1593, 0x020082, 1);
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020081);
+    CR_CHECK(CrTestRead(CrCacheRefreshBackend(fixture.Cache), CrTestAddress(0, 0, 2, 0), 0, CacheConfig,
+        CR_CONFIG_HEADER_SIZE));
+    CR_CHECK_EQ(CacheClassCode(fixture.Cached), 0x020082);
+    CR_CHECK_EQ(CacheWalk(fixture.Cached, entries), 4);
+    CacheTearDown(&fixture);
+}
+
+// Scans through either view match a scan of the hardware.
+static void
+TestCacheScan(void)
+{
+    static CR_FUNCTION_RECORD direct[256];
+    static CR_FUNCTION_RECORD cached[256];
+    PCR_CONFIG_BACKEND sim;
+    PCR_CACHE cache;
+    CR_SCAN_OUTPUT output;
+    uint32_t count;
+    uint32_t pass;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &count), CR_OK);
+    CR_CHECK_EQ(CrCacheCreate(sim, 4096, 256, &cache), CR_OK);
+    output.Records = direct;
+    output.Capacity = 256;
+    output.Count = output.Total = 0;
+    CR_CHECK_EQ(CrScanTopology(sim, NULL, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, count);
+
+    for (pass = 0; pass < 3; pass++) {
+        output.Records = cached;
+        output.Count = output.Total = 0;
+        CR_CHECK_EQ(CrScanTopology((pass == 1) ? CrCacheRefreshBackend(cache) : CrCacheBackend(cache), NULL, &output),
+            CR_OK);
+        CR_CHECK_EQ(output.Count, count);
+        CR_CHECK(memcmp(direct, cached, (size_t)count * sizeof(CR_FUNCTION_RECORD)) == 0);
+    }
+    CrCacheFree(cache);
+    CrBackendClose(sim);
+}
+
+// A full table stops caching new functions; reads still work.
+static void
+TestCacheFull(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    PCR_CACHE cache;
+    CR_TEST_BACKEND inner;
+    CR_CAP_ENTRY entries[8];
+    uint32_t total;
+    uint32_t reads;
+
+    CR_CHECK_EQ(CrSimCreate(8, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    CacheAddDevice(sim, 0x1593, 0x020000, 1);
+    CrTestWrap(sim, &inner);
+    CR_CHECK_EQ(CrCacheCreate(&inner.Base, 64, 1, &cache), CR_OK);
+
+    CR_CHECK_EQ(CacheWalk(CrCacheBackend(cache), entries), 4);
+    CR_CHECK_EQ(CrCapWalk(CrCacheBackend(cache), CrTestAddress(0, 0, 0, 0), entries, 8, &total), CR_OK);
+
+    // 0:2.0 came first and holds the only entry, so 0:0.0 is read through each time.
+    inner.Reads = 0;
+    CR_CHECK_EQ(CrCapWalk(CrCacheBackend(cache), CrTestAddress(0, 0, 0, 0), entries, 8, &total), CR_OK);
+    reads = inner.Reads;
+    CR_CHECK(reads > 1);
+    CR_CHECK_EQ(CacheClassCode(CrCacheBackend(cache)), 0x020000);
+    inner.Reads = 0;
+    CR_CHECK_EQ(CacheWalk(CrCacheBackend(cache), entries), 4);
+    CR_CHECK_EQ(inner.Reads, 1);
+    CrCacheFree(cache);
+    CrBackendClose(sim);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "cache repeat walk", TestCacheRepeatWalk },
+        { "cache hot add", TestCacheHotAdd },
+        { "cache hot remove", TestCacheHotRemove },
+        { "cache replace", TestCacheReplace },
+        { "cache invalidate", TestCacheInvalidate },
+        { "cache scan", TestCacheScan },
+        { "cache full", TestCacheFull },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
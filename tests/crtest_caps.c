@@ -0,0 +1,234 @@
+// crtest_caps.c
+//
+// Capability list walks: chain order, the end of each list, and walks over
+// broken lists (loops, pointers into the header or past the list's range)
+// that must still terminate.
+
+#include "crtest.h"
+
+#define CAPS_ID_PM        0x01
+#define CAPS_ID_MSI       0x05
+#define CAPS_ID_VENDOR    0x09
+#define CAPS_ID_PCIE      0x10
+#define CAPS_EXT_AER      0x0001
+#define CAPS_EXT_DSN      0x0003
+
+static uint8_t CapsConfig[CR_CONFIG_SPACE_SIZE];
+
+static void
+CapsStandard(
+    _In_ uint32_t Offset,
+    _In_ uint8_t Id,
+    _In_ uint8_t Next
+)
+{
+    CapsConfig[Offset] = Id;
+    CapsConfig[Offset + 1] = Next;
+}
+
+static void
+CapsExtended(
+    _In_ uint32_t Offset,
+    _In_ uint16_t Id,
+    _In_ uint8_t Version,
+    _In_ uint32_t Next
+)
+{
+    CrTestPut32(CapsConfig, Offset, (uint32_t)Id | ((uint32_t)Version << 16) | (Next << 20));
+}
+
+// A fresh simulated backend holding CapsConfig at 0:0.0.
+static PCR_CONFIG_BACKEND
+CapsBackend(void)
+{
+    PCR_CONFIG_BACKEND sim = NULL;
+
+    CR_CHECK_EQ(CrSimCreate(4, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 0, 0, 0), CapsConfig, sizeof(CapsConfig)), CR_OK);
+    return sim;
+}
+
+// Walks 0:0.0 and returns the count, checking the walk succeeded.
+static uint32_t
+CapsWalk(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(16) CR_CAP_ENTRY* Entries
+)
+{
+    uint32_t total = 0;
+
+    CR_CHECK_EQ(CrCapWalk(Backend, CrTestAddress(0, 0, 0, 0), Entries, 16, &total), CR_OK);
+    return total;
+}
+
+static void
+TestCapsChain(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_CAP_ENTRY entries[16];
+    CR_CAP_ENTRY entry;
+    uint32_t total;
+
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0x43);   // Low bits are reserved
+    CapsStandard(0x40, CAPS_ID_PM, 0x50);
+    CapsStandard(0x50, CAPS_ID_MSI, 0x70);
+    CapsStandard(0x70, CAPS_ID_PCIE, 0x00);
+    CapsExtended(0x100, CAPS_EXT_AER, 2, 0x150);
+    CapsExtended(0x150, CAPS_EXT_DSN, 1, 0x200);
+    CapsExtended(0x200, 0, 0, 0x300);                           // Placeholder, only links on
+    CapsExtended(0x300, CR_EXT_CAP_SRIOV, 1, 0);
+    sim = CapsBackend();
+
+    total = CapsWalk(sim, entries);
+    CR_CHECK_EQ(total, 6);
+    CR_CHECK_EQ(entries[0].Id, CAPS_ID_PM);
+    CR_CHECK_EQ(entries[0].Offset, 0x40);
+    CR_CHECK_EQ(entries[0].Flags, 0);
+    CR_CHECK_EQ(entries[1].Id, CAPS_ID_MSI);
+    CR_CHECK_EQ(entries[2].Id, CAPS_ID_PCIE);
+    CR_CHECK_EQ(entries[2].Offset, 0x70);
+    CR_CHECK_EQ(entries[3].Id, CAPS_EXT_AER);
+    CR_CHECK_EQ(entries[3].Offset, 0x100);
+    CR_CHECK_EQ(entries[3].Version, 2);
+    CR_CHECK_EQ(entries[3].Flags, CR_CAP_EXTENDED);
+    CR_CHECK_EQ(entries[4].Id, CAPS_EXT_DSN);
+    CR_CHECK_EQ(entries[5].Id, CR_EXT_CAP_SRIOV);
+    CR_CHECK_EQ(entries[5].Offset, 0x300);
+
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CR_EXT_CAP_SRIOV, CR_CAP_EXTENDED, 0, &entry), CR_OK);
+    CR_CHECK_EQ(entry.Offset, 0x300);
+    // 0x10 is PCI Express in the standard list and SR-IOV in the extended one.
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CAPS_ID_PCIE, 0, 0, &entry), CR_OK);
+    CR_CHECK_EQ(entry.Offset, 0x70);
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CAPS_ID_PCIE, 0, 1, &entry), CR_E_NOT_FOUND);
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CAPS_ID_VENDOR, 0, 0, &entry), CR_E_NOT_FOUND);
+    CrBackendClose(sim);
+}
+
+static void
+TestCapsInstances(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_CAP_ENTRY entry;
+
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0x40);
+    CapsStandard(0x40, CAPS_ID_VENDOR, 0x48);
+    CapsStandard(0x48, CAPS_ID_PM, 0x60);
+    CapsStandard(0x60, CAPS_ID_VENDOR, 0x00);
+    sim = CapsBackend();
+
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CAPS_ID_VENDOR, 0, 0, &entry), CR_OK);
+    CR_CHECK_EQ(entry.Offset, 0x40);
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CAPS_ID_VENDOR, 0, 1, &entry), CR_OK);
+    CR_CHECK_EQ(entry.Offset, 0x60);
+    CR_CHECK_EQ(CrCapFind(sim, CrTestAddress(0, 0, 0, 0), CAPS_ID_VENDOR, 0, 2, &entry), CR_E_NOT_FOUND);
+    CrBackendClose(sim);
+}
+
+// Each list ends at the first offset it has already visited.
+static void
+TestCapsLoops(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_CAP_ENTRY entries[16];
+
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0x40);
+    CapsStandard(0x40, CAPS_ID_PM, 0x50);
+    CapsStandard(0x50, CAPS_ID_MSI, 0x40);
+    CapsExtended(0x100, CAPS_EXT_AER, 2, 0x140);
+    CapsExtended(0x140, CAPS_EXT_DSN, 1, 0x100);
+    sim = CapsBackend();
+    CR_CHECK_EQ(CapsWalk(sim, entries), 4);
+    CR_CHECK_EQ(entries[1].Offset, 0x50);
+    CR_CHECK_EQ(entries[3].Offset, 0x140);
+    CrBackendClose(sim);
+
+    // A capability that points at itself, and an extended one likewise.
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0x40);
+    CapsStandard(0x40, CAPS_ID_PM, 0x40);
+    CapsExtended(0x100, CAPS_EXT_AER, 2, 0x100);
+    sim = CapsBackend();
+    CR_CHECK_EQ(CapsWalk(sim, entries), 2);
+    CrBackendClose(sim);
+
+    // A placeholder loop has no entries to report but must still end.
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0);
+    CapsExtended(0x100, 0, 0, 0x180);
+    CapsExtended(0x180, 0, 0, 0x100);
+    sim = CapsBackend();
+    CR_CHECK_EQ(CapsWalk(sim, entries), 0);
+    CrBackendClose(sim);
+}
+
+// Pointers outside a list's range end that list.
+static void
+TestCapsBounds(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_CAP_ENTRY entries[16];
+
+    // Into the header: no standard capabilities, the extended list still walks.
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0x20);
+    CapsExtended(0x100, CAPS_EXT_AER, 2, 0);
+    sim = CapsBackend();
+    CR_CHECK_EQ(CapsWalk(sim, entries), 1);
+    CR_CHECK_EQ(entries[0].Flags, CR_CAP_EXTENDED);
+    CrBackendClose(sim);
+
+    // The top of the standard range, and an all-ones extended header.
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0xF8);
+    CapsStandard(0xF8, CAPS_ID_PM, 0xFC);
+    CapsStandard(0xFC, CAPS_ID_MSI, 0x00);
+    CapsExtended(0x100, 0xFFFF, 0xF, 0xFFF);   // All-ones: an unreadable list
+    sim = CapsBackend();
+    CR_CHECK_EQ(CapsWalk(sim, entries), 2);
+    CR_CHECK_EQ(entries[1].Offset, 0xFC);
+    CrBackendClose(sim);
+
+    // The last dword of config space is a valid place for a capability.
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0);
+    CapsExtended(0x100, CAPS_EXT_AER, 2, 0xFFC);
+    CapsExtended(0xFFC, CAPS_EXT_DSN, 1, 0);
+    sim = CapsBackend();
+    CR_CHECK_EQ(CapsWalk(sim, entries), 2);
+    CR_CHECK_EQ(entries[1].Offset, 0xFFC);
+    CrBackendClose(sim);
+}
+
+static void
+TestCapsStatus(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_CAP_ENTRY entries[2];
+    uint32_t total;
+
+    CrTestHeader(CapsConfig, 0x8086, 0x1593, 0x020000, 0x40);
+    CapsStandard(0x40, CAPS_ID_PM, 0x50);
+    CapsStandard(0x50, CAPS_ID_MSI, 0x60);
+    CapsStandard(0x60, CAPS_ID_PCIE, 0x00);
+    sim = CapsBackend();
+
+    CR_CHECK_EQ(CrCapWalk(sim, CrTestAddress(0, 0, 0, 0), entries, 2, &total), CR_E_MORE_DATA);
+    CR_CHECK_EQ(total, 3);
+    CR_CHECK_EQ(entries[1].Id, CAPS_ID_MSI);
+    CR_CHECK_EQ(CrCapWalk(sim, CrTestAddress(0, 0, 0, 0), NULL, 0, &total), CR_E_MORE_DATA);
+    CR_CHECK_EQ(total, 3);
+    CR_CHECK_EQ(CrCapWalk(sim, CrTestAddress(0, 0, 1, 0), entries, 2, &total), CR_E_NOT_FOUND);
+    CR_CHECK_EQ(total, 0);
+    CR_CHECK_EQ(CrCapWalk(sim, CrTestAddress(0, 0, 32, 0), entries, 2, &total), CR_E_INVALID_PARAMETER);
+    CrBackendClose(sim);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "caps chain", TestCapsChain },
+        { "caps instances", TestCapsInstances },
+        { "caps loops", TestCapsLoops },
+        { "caps bounds", TestCapsBounds },
+        { "caps status", TestCapsStatus },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,186 @@
+// crtest_client.cpp
+//
+// Client side over the portable core: typed requests through a loopback
+// transport, including WAIT_CHANGE blocking until the topology moves, and
+// the health collector reading link state through them.
+
+#include "crtest.h"
+#include "../CRclient/crclient.h"
+
+#define CLIENT_PCIE_CAP      0x40
+#define CLIENT_ROOT_PORT     0x0042     // Version 2, Device/Port Type 4
+#define CLIENT_ENDPOINT      0x0002     // Version 2, Device/Port Type 0
+#define CLIENT_LINK(Speed, Width) ((uint16_t)((Speed) | ((Width) << 4)))
+
+static uint8_t ClientConfig[CR_CONFIG_SPACE_SIZE];
+
+// Adds a function with nothing but a PCI Express capability. A nonzero
+// SecondaryBus makes it a bridge to that bus.
+static CR_STATUS
+ClientAddPcie(
+    _In_ PCR_CONFIG_BACKEND Sim,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t PortType,
+    _In_ uint8_t SecondaryBus,
+    _In_ uint16_t LinkCapabilities,
+    _In_ uint16_t LinkStatus
+)
+{
+    memset(ClientConfig, 0, sizeof(ClientConfig));
+    CrTestHeader(ClientConfig, 0x8086, SecondaryBus != 0 ? 0x7A38 : 0x1572,
+        SecondaryBus != 0 ? 0x060400 : 0x020000, CLIENT_PCIE_CAP);
+    if (SecondaryBus != 0) {
+        ClientConfig[CR_CFG_HEADER_TYPE] = CR_HEADER_TYPE_BRIDGE;
+        ClientConfig[CR_CFG_PRIMARY_BUS] = Address.Bus;
+        ClientConfig[CR_CFG_SECONDARY_BUS] = SecondaryBus;
+        ClientConfig[CR_CFG_SUBORDINATE_BUS] = SecondaryBus;
+    }
+    ClientConfig[CLIENT_PCIE_CAP] = 0x10;
+    CrTestPut16(ClientConfig, CLIENT_PCIE_CAP + 0x02, PortType);
+    CrTestPut32(ClientConfig, CLIENT_PCIE_CAP + 0x0C, LinkCapabilities);
+    CrTestPut16(ClientConfig, CLIENT_PCIE_CAP + 0x12, LinkStatus);
+    return CrSimAddFunction(Sim, Address, ClientConfig, sizeof(ClientConfig));
+}
+
+static void
+TestClientLoopbackScan(void)
+{
+    static CR_FUNCTION_RECORD direct[512];
+    PCR_CONFIG_BACKEND sim;
+    CR_TOPOLOGY_OPTIONS options;
+    CR_SCAN_OUTPUT output;
+    CR_TOPOLOGY_REQUEST request;
+    std::vector<CR_FUNCTION_RECORD> records;
+    uint32_t count;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestSparse, &sim, &count), CR_OK);
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    memset(&output, 0, sizeof(output));
+    output.Records = direct;
+    output.Capacity = 512;
+    CR_CHECK_EQ(CrScanTopology(sim, &options, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, count);
+
+    CrLoopbackTransport transport;
+    CR_CHECK_EQ(transport.Open(sim), CR_OK);
+    CrClient client(&transport);
+
+    memset(&request, 0, sizeof(request));
+    request.Version = CR_PROTOCOL_VERSION;
+    request.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    CR_CHECK_EQ(client.ScanTopology(&request, sizeof(request), records), CR_OK);
+    CR_CHECK_EQ(records.size(), count);
+    CR_CHECK(records.size() == count && memcmp(records.data(), direct, count * sizeof(CR_FUNCTION_RECORD)) == 0);
+
+    // Once more, now that the client knows the reply size.
+    CR_CHECK_EQ(client.ScanTopology(&request, sizeof(request), records), CR_OK);
+    CR_CHECK_EQ(records.size(), count);
+
+    // Without CR_TOPOLOGY_ALL_SEGMENTS, segment 0 only.
+    request.Flags = 0;
+    CR_CHECK_EQ(client.ScanTopology(&request, sizeof(request), records), CR_OK);
+    CR_CHECK(records.size() < count);
+    CR_CHECK(!records.empty() && records.back().Segment == 0);
+    transport.Close();
+}
+
+// WAIT_CHANGE returns at once for an old generation, times out with an
+// empty delta, and otherwise blocks until the topology moves.
+static void
+TestClientLoopbackWait(void)
+{
+    uint8_t removed[CR_CONFIG_HEADER_SIZE];
+    PCR_CONFIG_BACKEND sim;
+    CR_DELTA_HEADER header;
+    std::vector<CR_FUNCTION_RECORD> records;
+    uint64_t generation;
+    uint32_t count;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestFlat, &sim, &count), CR_OK);
+    CrLoopbackTransport transport;
+    CR_CHECK_EQ(transport.Open(sim), CR_OK);
+    CrClient client(&transport);
+
+    CR_CHECK_EQ(client.Delta(IOCTL_MYPCISCANNER_WAIT_CHANGE, 0, &header, records), CR_OK);
+    CR_CHECK(header.Flags & CR_DELTA_FULL);
+    CR_CHECK_EQ(header.RecordCount, count);
+    CR_CHECK_EQ(records.size(), count);
+    generation = header.Generation;
+    CR_CHECK(generation != 0);
+
+    transport.SetWaitTimeout(20);
+    CR_CHECK_EQ(client.Delta(IOCTL_MYPCISCANNER_WAIT_CHANGE, generation, &header, records), CR_OK);
+    CR_CHECK_EQ(header.Generation, generation);
+    CR_CHECK_EQ(header.RecordCount, 0);
+    CR_CHECK_EQ(header.Flags & CR_DELTA_FULL, 0);
+    CR_CHECK(records.empty());
+
+    // The removal is seen by the next presence check.
+    memset(removed, 0xFF, sizeof(removed));
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 0, 5, 3), removed, sizeof(removed)), CR_OK);
+    transport.SetWaitTimeout(10000);
+    CR_CHECK_EQ(client.Delta(IOCTL_MYPCISCANNER_WAIT_CHANGE, generation, &header, records), CR_OK);
+    CR_CHECK(header.Generation > generation);
+    CR_CHECK_EQ(header.RecordCount, 1);
+    CR_CHECK(records.size() == 1 && records[0].Device == 5 && records[0].Function == 3 &&
+        (records[0].Flags & CR_RECORD_REMOVED) != 0);
+
+    // SCAN_DELTA keeps generations of its own.
+    CR_CHECK_EQ(client.Delta(IOCTL_MYPCISCANNER_SCAN_DELTA, 0, &header, records), CR_OK);
+    CR_CHECK(header.Flags & CR_DELTA_FULL);
+    CR_CHECK_EQ(records.size(), count - 1);
+    transport.Close();
+}
+
+// A x16 device in a x4 root port has trained as wide as the link allows.
+// Degraded means below what both ends support, so only a narrower link counts,
+// and it counts at both ends.
+static void
+TestClientHealthDegraded(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_TOPOLOGY_REQUEST request;
+    std::vector<CR_FUNCTION_RECORD> records;
+
+    CR_CHECK_EQ(CrSimCreate(8, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    CR_CHECK_EQ(ClientAddPcie(sim, CrTestAddress(0, 0, 1, 0), CLIENT_ROOT_PORT, 1, CLIENT_LINK(4, 4),
+        CLIENT_LINK(4, 4)), CR_OK);
+    CR_CHECK_EQ(ClientAddPcie(sim, CrTestAddress(0, 1, 0, 0), CLIENT_ENDPOINT, 0, CLIENT_LINK(4, 16),
+        CLIENT_LINK(4, 4)), CR_OK);
+
+    CrLoopbackTransport transport;
+    CR_CHECK_EQ(transport.Open(sim), CR_OK);
+    CrClient client(&transport);
+    memset(&request, 0, sizeof(request));
+    request.Version = CR_PROTOCOL_VERSION;
+    CR_CHECK_EQ(client.ScanTopology(&request, sizeof(request), records), CR_OK);
+    CR_CHECK_EQ(records.size(), 3);
+
+    CrHealthCollector health(&client);
+    CR_CHECK_EQ(health.Init(records.data(), (uint32_t)records.size(), "crtest_client_health.prom"), CR_OK);
+    CR_CHECK_EQ(health.FunctionCount(), 2);
+    CR_CHECK_EQ(health.Collect(), CR_OK);
+    CR_CHECK_EQ(health.DegradedCount(), 0);
+
+    CR_CHECK_EQ(ClientAddPcie(sim, CrTestAddress(0, 1, 0, 0), CLIENT_ENDPOINT, 0, CLIENT_LINK(4, 16),
+        CLIENT_LINK(4, 2)), CR_OK);
+    CR_CHECK_EQ(ClientAddPcie(sim, CrTestAddress(0, 0, 1, 0), CLIENT_ROOT_PORT, 1, CLIENT_LINK(4, 4),
+        CLIENT_LINK(4, 2)), CR_OK);
+    CR_CHECK_EQ(health.Collect(), CR_OK);
+    CR_CHECK_EQ(health.DegradedCount(), 2);
+    transport.Close();
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "client loopback scan", TestClientLoopbackScan },
+        { "client loopback wait", TestClientLoopbackWait },
+        { "client health degraded", TestClientHealthDegraded },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
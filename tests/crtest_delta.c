@@ -0,0 +1,214 @@
+// crtest_delta.c
+//
+// Generation-numbered deltas: what changed between two scans, what a caller
+// holding an old or unknown generation gets back, and the cheap hotplug
+// probe that says whether a rescan is needed at all.
+
+#include "crtest.h"
+
+#define DELTA_MAX_RECORDS 512
+
+static uint8_t DeltaBuffer[sizeof(CR_DELTA_HEADER) + DELTA_MAX_RECORDS * sizeof(CR_FUNCTION_RECORD)];
+static uint8_t DeltaConfig[CR_CONFIG_SPACE_SIZE];
+
+static const CR_DELTA_HEADER*
+DeltaGet(
+    _In_ const CR_DELTA_STATE* State,
+    _In_ uint64_t BaseGeneration
+)
+{
+    size_t written = 0;
+
+    CR_CHECK_EQ(CrDeltaToBuffer(State, BaseGeneration, DeltaBuffer, sizeof(DeltaBuffer), &written), CR_OK);
+    CR_CHECK_EQ(written, sizeof(CR_DELTA_HEADER) +
+        (size_t)((const CR_DELTA_HEADER*)DeltaBuffer)->RecordCount * sizeof(CR_FUNCTION_RECORD));
+    return (const CR_DELTA_HEADER*)DeltaBuffer;
+}
+
+static const CR_FUNCTION_RECORD*
+DeltaRecords(void)
+{
+    return (const CR_FUNCTION_RECORD*)(DeltaBuffer + sizeof(CR_DELTA_HEADER));
+}
+
+static void
+TestDeltaGenerations(void)
+{
+    CR_DELTA_STATE state;
+    PCR_CONFIG_BACKEND sim;
+    const CR_DELTA_HEADER* header;
+    uint32_t count;
+    uint32_t i;
+
+    memset(&state, 0, sizeof(state));
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &count), CR_OK);
+
+    // The first scan is generation 1; without a base everything is added.
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 0);
+    CR_CHECK_EQ(header->Generation, 1);
+    CR_CHECK_EQ(header->Flags, CR_DELTA_FULL);
+    CR_CHECK_EQ(header->RecordCount, count);
+    CR_CHECK_EQ(header->TotalCount, count);
+    for (i = 0; i < header->RecordCount; i++) {
+        CR_CHECK_EQ(DeltaRecords()[i].Flags, CR_RECORD_ADDED);
+    }
+
+    // Nothing moved: same generation, empty delta.
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 1);
+    CR_CHECK_EQ(header->Generation, 1);
+    CR_CHECK_EQ(header->Flags, 0);
+    CR_CHECK_EQ(header->RecordCount, 0);
+
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 5, 0), 0x10DE, 0x2330, 0x030200, 0), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 1);
+    CR_CHECK_EQ(header->Generation, 2);
+    CR_CHECK_EQ(header->RecordCount, 1);
+    CR_CHECK_EQ(DeltaRecords()[0].Flags, CR_RECORD_ADDED);
+    CR_CHECK_EQ(DeltaRecords()[0].Device, 5);
+    CR_CHECK_EQ(DeltaRecords()[0].VendorId, 0x10DE);
+
+    // The generation before the current one is still answered, so a caller
+    // that probed for the size gets its delta on the retry.
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 5, 0), 0x10DE, 0x2331, 0x030200, 0), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 2);
+    CR_CHECK_EQ(header->Generation, 3);
+    CR_CHECK_EQ(header->RecordCount, 1);
+    CR_CHECK_EQ(DeltaRecords()[0].Flags, CR_RECORD_CHANGED);
+    CR_CHECK_EQ(DeltaRecords()[0].DeviceId, 0x2331);
+
+    // Anything older gets the full list again.
+    header = DeltaGet(&state, 1);
+    CR_CHECK_EQ(header->Flags, CR_DELTA_FULL);
+    CR_CHECK_EQ(header->RecordCount, count + 1);
+
+    memset(DeltaConfig, 0xFF, sizeof(DeltaConfig));
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 0, 5, 0), DeltaConfig, sizeof(DeltaConfig)), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 3);
+    CR_CHECK_EQ(header->Generation, 4);
+    CR_CHECK_EQ(header->RecordCount, 1);
+    CR_CHECK_EQ(DeltaRecords()[0].Flags, CR_RECORD_REMOVED);
+    // A removed record holds the last contents seen.
+    CR_CHECK_EQ(DeltaRecords()[0].DeviceId, 0x2331);
+    header = DeltaGet(&state, 4);
+    CR_CHECK_EQ(header->RecordCount, 0);
+
+    CrDeltaFree(&state);
+    CrBackendClose(sim);
+}
+
+// Status register bits come and go on their own and are not a change.
+static void
+TestDeltaIgnoresStatus(void)
+{
+    CR_DELTA_STATE state;
+    PCR_CONFIG_BACKEND sim;
+    const CR_DELTA_HEADER* header;
+    uint32_t count;
+
+    memset(&state, 0, sizeof(state));
+    CR_CHECK_EQ(CrTestBuild(CrTestFlat, &sim, &count), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+
+    CR_CHECK(CrTestRead(sim, CrTestAddress(0, 0, 3, 1), 0, DeltaConfig, sizeof(DeltaConfig)));
+    DeltaConfig[0x07] |= 0xF9;   // Error bits set
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 0, 3, 1), DeltaConfig, sizeof(DeltaConfig)), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 1);
+    CR_CHECK_EQ(header->Generation, 1);
+    CR_CHECK_EQ(header->RecordCount, 0);
+
+    // The command register is not masked.
+    DeltaConfig[0x04] |= 0x06;
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 0, 3, 1), DeltaConfig, sizeof(DeltaConfig)), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    header = DeltaGet(&state, 1);
+    CR_CHECK_EQ(header->Generation, 2);
+    CR_CHECK_EQ(header->RecordCount, 1);
+    CR_CHECK_EQ(DeltaRecords()[0].Flags, CR_RECORD_CHANGED);
+    CrDeltaFree(&state);
+    CrBackendClose(sim);
+}
+
+// A buffer with room for the header only reports the size needed.
+static void
+TestDeltaOverflow(void)
+{
+    CR_DELTA_STATE state;
+    PCR_CONFIG_BACKEND sim;
+    CR_DELTA_HEADER header;
+    size_t written;
+    uint32_t count;
+
+    memset(&state, 0, sizeof(state));
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &count), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    CR_CHECK_EQ(CrDeltaToBuffer(&state, 0, &header, sizeof(header), &written), CR_E_MORE_DATA);
+    CR_CHECK_EQ(written, sizeof(header));
+    CR_CHECK_EQ(header.RecordCount, 0);
+    CR_CHECK_EQ(header.TotalCount, count);
+    CR_CHECK_EQ(header.Generation, 1);
+    CR_CHECK_EQ(CrDeltaToBuffer(&state, 0, &header, sizeof(header) - 1, &written), CR_E_INVALID_PARAMETER);
+    CrDeltaFree(&state);
+    CrBackendClose(sim);
+}
+
+// The probe notices devices coming and going without a rescan.
+static void
+TestDeltaProbe(void)
+{
+    CR_DELTA_STATE state;
+    PCR_CONFIG_BACKEND sim;
+    CR_TEST_BACKEND counting;
+
+    memset(&state, 0, sizeof(state));
+    CR_CHECK_EQ(CrSimCreate(16, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    CR_CHECK_EQ(CrSimAddBridge(sim, CrTestAddress(0, 0, 1, 0), 0x8086, 0x7A38, 1, 1), CR_OK);
+    CR_CHECK_EQ(CrSimAddBridge(sim, CrTestAddress(0, 0, 2, 0), 0x8086, 0x7A38, 2, 2), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 2, 0, 0), 0x144D, 0xA80A, 0x010802, 0), CR_OK);
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    CR_CHECK_EQ(state.Current.Count, 4);
+
+    CrTestWrap(sim, &counting);
+    CR_CHECK(!CrSnapshotProbe(&counting.Base, &state.Current));
+    // IDs of the four functions, bus numbers of the two bridges, and bus 1's empty slot.
+    CR_CHECK(counting.Reads <= 8);
+
+    // A drive in the empty slot behind 0:1.0.
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 1, 0, 0), 0x144D, 0xA80A, 0x010802, 0), CR_OK);
+    CR_CHECK(CrSnapshotProbe(sim, &state.Current));
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    CR_CHECK(!CrSnapshotProbe(sim, &state.Current));
+
+    // The drive behind 0:2.0 pulled.
+    memset(DeltaConfig, 0xFF, sizeof(DeltaConfig));
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 2, 0, 0), DeltaConfig, sizeof(DeltaConfig)), CR_OK);
+    CR_CHECK(CrSnapshotProbe(sim, &state.Current));
+
+    // A bridge renumbered.
+    CR_CHECK_EQ(CrDeltaRefresh(&state, sim, NULL), CR_OK);
+    CR_CHECK(!CrSnapshotProbe(sim, &state.Current));
+    CR_CHECK_EQ(CrSimAddBridge(sim, CrTestAddress(0, 0, 2, 0), 0x8086, 0x7A38, 3, 3), CR_OK);
+    CR_CHECK(CrSnapshotProbe(sim, &state.Current));
+    CR_CHECK_EQ(state.Current.Generation, 3);
+    CrDeltaFree(&state);
+    CrBackendClose(sim);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "delta generations", TestDeltaGenerations },
+        { "delta ignores status", TestDeltaIgnoresStatus },
+        { "delta overflow", TestDeltaOverflow },
+        { "delta probe", TestDeltaProbe },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
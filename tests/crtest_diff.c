@@ -0,0 +1,175 @@
+// crtest_diff.c
+//
+// Diffing two snapshot files field by field: matching by address or by
+// identity, masked status bits, truncated captures, and an entry buffer
+// that runs out. Files are written to the working directory and removed
+// afterwards.
+
+#include "crtest.h"
+
+#define DIFF_LEFT  "crtest_diff_left.snap"
+#define DIFF_RIGHT "crtest_diff_right.snap"
+
+#define DIFF_MAX_ENTRIES 16
+#define DIFF_STATUS      0x06
+
+static uint8_t DiffConfig[3][CR_CONFIG_SPACE_SIZE];
+
+static void
+DiffInput(
+    _Out_ CR_SNAPFILE_INPUT* Input,
+    _In_ uint8_t Device,
+    _In_ const uint8_t* Config,
+    _In_ uint32_t Length
+)
+{
+    Input->Address = CrTestAddress(0, 0, Device, 0);
+    Input->Config = Config;
+    Input->Length = Length;
+}
+
+static CR_STATUS
+DiffFiles(
+    _In_ uint32_t Flags,
+    _Out_writes_(DIFF_MAX_ENTRIES) CR_DIFF_ENTRY* Entries,
+    _Out_ PCR_DIFF_SUMMARY Summary
+)
+{
+    CR_DIFF_OPTIONS options;
+    PCR_SNAPFILE left = NULL;
+    PCR_SNAPFILE right = NULL;
+    CR_STATUS status;
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = Flags;
+    memset(Summary, 0, sizeof(*Summary));
+    status = CrSnapFileOpen(DIFF_LEFT, &left);
+    if (status == CR_OK) {
+        status = CrSnapFileOpen(DIFF_RIGHT, &right);
+    }
+    if (status == CR_OK) {
+        status = CrSnapDiff(left, right, &options, Entries, DIFF_MAX_ENTRIES, Summary);
+    }
+    if (right != NULL) CrSnapFileClose(right);
+    if (left != NULL) CrSnapFileClose(left);
+    return status;
+}
+
+// Left has 0:0.0, 0:1.0 and 0:2.0. Right has 0:0.0 captured to 4 KB
+// instead of 256 bytes, 0:1.0 with a new device ID and a status error bit,
+// and 0:3.0 instead of 0:2.0.
+static void
+TestDiffFields(void)
+{
+    CR_SNAPFILE_INPUT inputs[3];
+    CR_DIFF_ENTRY entries[DIFF_MAX_ENTRIES];
+    CR_DIFF_SUMMARY summary;
+
+    CrTestHeader(DiffConfig[0], 0x8086, 0x4660, 0x060000, 0);
+    CrTestHeader(DiffConfig[1], 0x8086, 0x1533, 0x020000, 0);
+    CrTestHeader(DiffConfig[2], 0x10DE, 0x2204, 0x030000, 0);
+    DiffInput(&inputs[0], 0, DiffConfig[0], 256);
+    DiffInput(&inputs[1], 1, DiffConfig[1], 256);
+    DiffInput(&inputs[2], 2, DiffConfig[2], 256);
+    CR_CHECK_EQ(CrSnapFileWrite(DIFF_LEFT, inputs, 3), CR_OK);
+
+    // Identical files differ in nothing.
+    CR_CHECK_EQ(CrSnapFileWrite(DIFF_RIGHT, inputs, 3), CR_OK);
+    CR_CHECK_EQ(DiffFiles(0, entries, &summary), CR_OK);
+    CR_CHECK_EQ(summary.Matched, 3);
+    CR_CHECK_EQ(summary.Changed + summary.Removed + summary.Added + summary.Fields + summary.Truncated, 0);
+
+    CrTestPut16(DiffConfig[1], CR_CFG_DEVICE_ID, 0x1539);
+    CrTestPut16(DiffConfig[1], DIFF_STATUS, 0x8000);
+    DiffInput(&inputs[0], 0, DiffConfig[0], CR_CONFIG_SPACE_SIZE);
+    DiffInput(&inputs[2], 3, DiffConfig[2], 256);
+    CR_CHECK_EQ(CrSnapFileWrite(DIFF_RIGHT, inputs, 3), CR_OK);
+
+    CR_CHECK_EQ(DiffFiles(0, entries, &summary), CR_OK);
+    CR_CHECK_EQ(summary.Matched, 2);
+    CR_CHECK_EQ(summary.Changed, 1);
+    CR_CHECK_EQ(summary.Removed, 1);
+    CR_CHECK_EQ(summary.Added, 1);
+    CR_CHECK_EQ(summary.Fields, 1);
+    CR_CHECK_EQ(summary.Truncated, 1);
+
+    CR_CHECK_EQ(entries[0].Kind, CR_DIFF_TRUNCATED);
+    CR_CHECK_EQ(entries[0].LeftKey, CrAddressKey(CrTestAddress(0, 0, 0, 0)));
+    CR_CHECK_EQ(entries[0].Offset, 256);
+    CR_CHECK_EQ(entries[0].Left, 256);
+    CR_CHECK_EQ(entries[0].Right, CR_CONFIG_SPACE_SIZE);
+
+    CR_CHECK_EQ(entries[1].Kind, CR_DIFF_CHANGED);
+    CR_CHECK_EQ(entries[1].LeftKey, CrAddressKey(CrTestAddress(0, 0, 1, 0)));
+    CR_CHECK_EQ(entries[1].Offset, CR_CFG_DEVICE_ID);
+    CR_CHECK_EQ(entries[1].Width, 2);
+    CR_CHECK_EQ(entries[1].Left, 0x1533);
+    CR_CHECK_EQ(entries[1].Right, 0x1539);
+
+    CR_CHECK_EQ(entries[2].Kind, CR_DIFF_REMOVED);
+    CR_CHECK_EQ(entries[2].LeftKey, CrAddressKey(CrTestAddress(0, 0, 2, 0)));
+    CR_CHECK_EQ(entries[3].Kind, CR_DIFF_ADDED);
+    CR_CHECK_EQ(entries[3].RightKey, CrAddressKey(CrTestAddress(0, 0, 3, 0)));
+
+    // Without the default masks the error bit is a change of its own.
+    CR_CHECK_EQ(DiffFiles(CR_DIFF_NO_DEFAULT_MASKS, entries, &summary), CR_OK);
+    CR_CHECK_EQ(summary.Fields, 2);
+    CR_CHECK_EQ(entries[2].Kind, CR_DIFF_CHANGED);
+    CR_CHECK_EQ(entries[2].Offset, DIFF_STATUS);
+    CR_CHECK_EQ(entries[2].Left, 0x0000);
+    CR_CHECK_EQ(entries[2].Right, 0x8000);
+
+    // Matched by identity, the function that moved is the same one and the
+    // one with a new device ID is not.
+    CR_CHECK_EQ(DiffFiles(CR_DIFF_MATCH_IDENTITY, entries, &summary), CR_OK);
+    CR_CHECK_EQ(summary.Matched, 2);
+    CR_CHECK_EQ(summary.Removed, 1);
+    CR_CHECK_EQ(summary.Added, 1);
+    CR_CHECK_EQ(summary.Fields, 0);
+    CR_CHECK_EQ(summary.Truncated, 1);
+
+    remove(DIFF_LEFT);
+    remove(DIFF_RIGHT);
+}
+
+// An entry buffer too small for the differences still counts them all.
+static void
+TestDiffOverflow(void)
+{
+    CR_SNAPFILE_INPUT inputs[2];
+    CR_DIFF_ENTRY entries[1];
+    CR_DIFF_SUMMARY summary;
+    PCR_SNAPFILE left;
+    PCR_SNAPFILE right;
+
+    CrTestHeader(DiffConfig[0], 0x8086, 0x4660, 0x060000, 0);
+    DiffInput(&inputs[0], 0, DiffConfig[0], 256);
+    CR_CHECK_EQ(CrSnapFileWrite(DIFF_LEFT, inputs, 1), CR_OK);
+    DiffInput(&inputs[0], 1, DiffConfig[0], 256);
+    DiffInput(&inputs[1], 2, DiffConfig[0], 256);
+    CR_CHECK_EQ(CrSnapFileWrite(DIFF_RIGHT, inputs, 2), CR_OK);
+
+    CR_CHECK_EQ(CrSnapFileOpen(DIFF_LEFT, &left), CR_OK);
+    CR_CHECK_EQ(CrSnapFileOpen(DIFF_RIGHT, &right), CR_OK);
+    CR_CHECK_EQ(CrSnapDiff(left, right, NULL, entries, 1, &summary), CR_E_MORE_DATA);
+    CR_CHECK_EQ(summary.Status, CR_E_MORE_DATA);
+    CR_CHECK_EQ(summary.Removed, 1);
+    CR_CHECK_EQ(summary.Added, 2);
+    CR_CHECK_EQ(entries[0].Kind, CR_DIFF_REMOVED);
+    CrSnapFileClose(right);
+    CrSnapFileClose(left);
+
+    remove(DIFF_LEFT);
+    remove(DIFF_RIGHT);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "diff fields", TestDiffFields },
+        { "diff overflow", TestDiffOverflow },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,236 @@
+// crtest_flight.c
+//
+// Single-flight coalescing of topology scans: requests with the same key
+// made while a scan runs join it instead of starting their own.
+
+#include "crtest.h"
+
+#define FLIGHT_KEY "topology"
+
+typedef struct _FLIGHT_REQUEST {
+    CR_FLIGHT_WAITER Base;
+    CR_STATUS Status;
+    uint32_t Count;
+    uint32_t Completions;
+} FLIGHT_REQUEST;
+
+static void
+FlightComplete(
+    _In_ PCR_FLIGHT_WAITER Waiter,
+    _In_ CR_STATUS Status,
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count
+)
+{
+    FLIGHT_REQUEST* waiter = (FLIGHT_REQUEST*)Waiter;
+
+    (void)Records;
+    waiter->Status = Status;
+    waiter->Count = Count;
+    CrAtomicIncrement32(&waiter->Completions);
+}
+
+static void
+FlightInitWaiter(
+    _Out_ FLIGHT_REQUEST* Waiter
+)
+{
+    memset(Waiter, 0, sizeof(*Waiter));
+    Waiter->Base.Complete = FlightComplete;
+    Waiter->Status = CR_E_IO;
+}
+
+// The joining request is made from inside the leader's scan, so it always
+// finds the flight open.
+typedef struct _FLIGHT_JOIN {
+    PCR_SCAN_FLIGHTS Flights;
+    const void* Key;
+    uint32_t KeyLength;
+    FLIGHT_REQUEST Waiter;
+    int Armed;
+    int Led;
+} FLIGHT_JOIN;
+
+static void
+FlightJoinOnRead(
+    _Inout_ CR_TEST_BACKEND* Backend,
+    _In_ CR_ADDRESS Address,
+    _In_ uint32_t Offset
+)
+{
+    FLIGHT_JOIN* join = (FLIGHT_JOIN*)Backend->Context;
+
+    (void)Address;
+    (void)Offset;
+    if (join->Armed) {
+        join->Armed = 0;
+        join->Led = CrScanCoalesced(join->Flights, &Backend->Base, NULL, join->Key, join->KeyLength,
+            &join->Waiter.Base);
+    }
+}
+
+static void
+TestFlightJoin(void)
+{
+    CR_SCAN_FLIGHTS flights;
+    PCR_CONFIG_BACKEND sim;
+    CR_TEST_BACKEND counting;
+    FLIGHT_REQUEST leader;
+    FLIGHT_JOIN join;
+    uint32_t count;
+
+    memset(&flights, 0, sizeof(flights));
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &count), CR_OK);
+    CrTestWrap(sim, &counting);
+    memset(&join, 0, sizeof(join));
+    join.Flights = &flights;
+    join.Key = FLIGHT_KEY;
+    join.KeyLength = sizeof(FLIGHT_KEY);
+    join.Armed = 1;
+    FlightInitWaiter(&join.Waiter);
+    counting.OnRead = FlightJoinOnRead;
+    counting.Context = &join;
+
+    FlightInitWaiter(&leader);
+    CR_CHECK(CrScanCoalesced(&flights, &counting.Base, NULL, FLIGHT_KEY, sizeof(FLIGHT_KEY), &leader.Base));
+    CR_CHECK(!join.Led);
+    CR_CHECK_EQ(leader.Completions, 1);
+    CR_CHECK_EQ(leader.Status, CR_OK);
+    CR_CHECK_EQ(leader.Count, count);
+    CR_CHECK_EQ(join.Waiter.Completions, 1);
+    CR_CHECK_EQ(join.Waiter.Status, CR_OK);
+    CR_CHECK_EQ(join.Waiter.Count, count);
+    CR_CHECK_EQ(flights.Scans, 1);
+    CR_CHECK_EQ(flights.Joined, 1);
+    CR_CHECK_EQ(flights.LastCount, count);
+
+    // Once the scan is done, the next request starts a fresh one.
+    FlightInitWaiter(&leader);
+    CR_CHECK(CrScanCoalesced(&flights, &counting.Base, NULL, FLIGHT_KEY, sizeof(FLIGHT_KEY), &leader.Base));
+    CR_CHECK_EQ(leader.Completions, 1);
+    CR_CHECK_EQ(flights.Scans, 2);
+    CR_CHECK_EQ(flights.Joined, 1);
+    CrBackendClose(sim);
+}
+
+// Different keys, and keys too long to compare, never share a scan.
+static void
+TestFlightKeys(void)
+{
+    static uint8_t longKey[CR_FLIGHT_MAX_KEY + 1];
+    CR_SCAN_FLIGHTS flights;
+    PCR_CONFIG_BACKEND sim;
+    CR_TEST_BACKEND counting;
+    FLIGHT_REQUEST leader;
+    FLIGHT_JOIN join;
+    uint32_t count;
+
+    memset(&flights, 0, sizeof(flights));
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &count), CR_OK);
+    CrTestWrap(sim, &counting);
+    counting.OnRead = FlightJoinOnRead;
+    counting.Context = &join;
+
+    memset(&join, 0, sizeof(join));
+    join.Flights = &flights;
+    join.Key = "other";
+    join.KeyLength = sizeof("other");
+    join.Armed = 1;
+    FlightInitWaiter(&join.Waiter);
+    FlightInitWaiter(&leader);
+    CR_CHECK(CrScanCoalesced(&flights, &counting.Base, NULL, FLIGHT_KEY, sizeof(FLIGHT_KEY), &leader.Base));
+    CR_CHECK(join.Led);
+    CR_CHECK_EQ(join.Waiter.Completions, 1);
+    CR_CHECK_EQ(join.Waiter.Count, count);
+    CR_CHECK_EQ(leader.Completions, 1);
+    CR_CHECK_EQ(flights.Scans, 2);
+    CR_CHECK_EQ(flights.Joined, 0);
+
+    memset(longKey, 'k', sizeof(longKey));
+    join.Key = longKey;
+    join.KeyLength = sizeof(longKey);
+    join.Armed = 1;
+    FlightInitWaiter(&join.Waiter);
+    FlightInitWaiter(&leader);
+    CR_CHECK(CrScanCoalesced(&flights, &counting.Base, NULL, longKey, sizeof(longKey), &leader.Base));
+    CR_CHECK(join.Led);
+    CR_CHECK_EQ(join.Waiter.Completions, 1);
+    CR_CHECK_EQ(leader.Completions, 1);
+    CR_CHECK_EQ(leader.Count, count);
+    CR_CHECK_EQ(flights.Scans, 4);
+    CR_CHECK_EQ(flights.Joined, 0);
+    CrBackendClose(sim);
+}
+
+#define FLIGHT_CLIENTS  8
+#define FLIGHT_REQUESTS 50
+
+typedef struct _FLIGHT_STORM {
+    CR_SCAN_FLIGHTS Flights;
+    PCR_CONFIG_BACKEND Backend;
+    FLIGHT_REQUEST Waiters[FLIGHT_CLIENTS][FLIGHT_REQUESTS];
+    volatile uint32_t NextClient;
+} FLIGHT_STORM;
+
+static void
+FlightStormClient(
+    _In_ void* Context
+)
+{
+    FLIGHT_STORM* storm = (FLIGHT_STORM*)Context;
+    uint32_t client = CrAtomicFetchAdd32(&storm->NextClient, 1);
+    uint32_t i;
+
+    if (client >= FLIGHT_CLIENTS) {
+        return;
+    }
+    for (i = 0; i < FLIGHT_REQUESTS; i++) {
+        CrScanCoalesced(&storm->Flights, storm->Backend, NULL, FLIGHT_KEY, sizeof(FLIGHT_KEY),
+            &storm->Waiters[client][i].Base);
+    }
+}
+
+// Clients polling at once: every request is completed exactly once with the
+// full topology, and each is either a scan or a join.
+static void
+TestFlightStorm(void)
+{
+    static FLIGHT_STORM storm;
+    CR_EXECUTOR executor;
+    uint32_t count;
+    uint32_t client;
+    uint32_t i;
+
+    memset(&storm, 0, sizeof(storm));
+    CR_CHECK_EQ(CrTestBuild(CrTestFlat, &storm.Backend, &count), CR_OK);
+    for (client = 0; client < FLIGHT_CLIENTS; client++) {
+        for (i = 0; i < FLIGHT_REQUESTS; i++) {
+            FlightInitWaiter(&storm.Waiters[client][i]);
+        }
+    }
+    CrThreadExecutorInit(&executor, FLIGHT_CLIENTS);
+    executor.Run(&executor, FLIGHT_CLIENTS, FlightStormClient, &storm);
+
+    CR_CHECK_EQ(storm.NextClient, FLIGHT_CLIENTS);
+    CR_CHECK_EQ(storm.Flights.Scans + storm.Flights.Joined, FLIGHT_CLIENTS * FLIGHT_REQUESTS);
+    for (client = 0; client < FLIGHT_CLIENTS; client++) {
+        for (i = 0; i < FLIGHT_REQUESTS; i++) {
+            CR_CHECK_EQ(storm.Waiters[client][i].Completions, 1);
+            CR_CHECK_EQ(storm.Waiters[client][i].Status, CR_OK);
+            CR_CHECK_EQ(storm.Waiters[client][i].Count, count);
+        }
+    }
+    CrBackendClose(storm.Backend);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "flight join", TestFlightJoin },
+        { "flight keys", TestFlightKeys },
+        { "flight storm", TestFlightStorm },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
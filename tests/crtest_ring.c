@@ -0,0 +1,236 @@
+// crtest_ring.c
+//
+// Sampling ring: slot layout, wraparound, drop accounting when the consumer
+// falls behind, and a producer that never trusts the shared header.
+
+#include "crtest.h"
+
+#define RING_CAPACITY   4
+#define RING_REGISTERS  3
+#define RING_GUARD      64
+#define RING_GUARD_BYTE 0xA5
+
+static uint64_t RingMemory[(sizeof(CR_RING_HEADER) + RING_CAPACITY * 32 + RING_GUARD) / sizeof(uint64_t)];
+static uint8_t RingSamples[8 * 32];
+
+static const CR_SAMPLE*
+RingSample(
+    _In_ uint32_t Index
+)
+{
+    return (const CR_SAMPLE*)(RingSamples + (size_t)Index * 32);
+}
+
+static uint32_t
+RingValue(
+    _In_ uint32_t Index,
+    _In_ uint32_t Register
+)
+{
+    return ((const uint32_t*)(RingSample(Index) + 1))[Register];
+}
+
+static void
+TestRingSize(void)
+{
+    CR_CHECK_EQ(CrRingSize(0, 4), 0);
+    CR_CHECK_EQ(CrRingSize(CR_MAX_SAMPLE_REGISTERS + 1, 4), 0);
+    CR_CHECK_EQ(CrRingSize(1, 1), 0);
+    CR_CHECK_EQ(CrRingSize(1, 6), 0);
+    CR_CHECK_EQ(CrRingSize(CR_MAX_SAMPLE_REGISTERS, 0x10000), 0);
+    // 16-byte sample header plus three values, rounded up to 8.
+    CR_CHECK_EQ(CrRingSize(RING_REGISTERS, RING_CAPACITY), sizeof(CR_RING_HEADER) + RING_CAPACITY * 32);
+    CR_CHECK_EQ(CrRingSize(2, 2), sizeof(CR_RING_HEADER) + 2 * 24);
+}
+
+typedef struct _RING_FIXTURE {
+    PCR_CONFIG_BACKEND Sim;
+    PCR_SAMPLER Sampler;
+    PCR_RING_HEADER Ring;
+} RING_FIXTURE;
+
+// Samples 0:0.0's ID dword, its class byte, and a register past the end of
+// config space that can never be read.
+static void
+RingSetUp(
+    _Out_ RING_FIXTURE* Fixture
+)
+{
+    CR_READ_ENTRY registers[RING_REGISTERS];
+    size_t size = CrRingSize(RING_REGISTERS, RING_CAPACITY);
+
+    memset(Fixture, 0, sizeof(*Fixture));
+    memset(registers, 0, sizeof(registers));
+    registers[0].Width = 4;
+    registers[0].Offset = CR_CFG_VENDOR_ID;
+    registers[1].Width = 1;
+    registers[1].Offset = CR_CFG_BASE_CLASS;
+    registers[2].Width = 4;
+    registers[2].Offset = CR_CONFIG_SPACE_SIZE;
+
+    CR_CHECK_EQ(CrSimCreate(1, &Fixture->Sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(Fixture->Sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    memset(RingMemory, RING_GUARD_BYTE, sizeof(RingMemory));
+    Fixture->Ring = (PCR_RING_HEADER)RingMemory;
+    CR_CHECK_EQ(CrSamplerCreate(Fixture->Sim, registers, RING_REGISTERS, RING_CAPACITY, 1000, RingMemory, size,
+        &Fixture->Sampler), CR_OK);
+}
+
+static void
+RingTearDown(
+    _Inout_ RING_FIXTURE* Fixture
+)
+{
+    const uint8_t* guard = (const uint8_t*)RingMemory + CrRingSize(RING_REGISTERS, RING_CAPACITY);
+    uint32_t i;
+
+    // Nothing was ever written past the ring.
+    for (i = 0; i < RING_GUARD; i++) {
+        if (guard[i] != RING_GUARD_BYTE) {
+            CR_CHECK_EQ(guard[i], RING_GUARD_BYTE);
+            break;
+        }
+    }
+    CrSamplerFree(Fixture->Sampler);
+    CrBackendClose(Fixture->Sim);
+}
+
+static void
+TestRingSamples(void)
+{
+    RING_FIXTURE fixture;
+    uint32_t i;
+
+    RingSetUp(&fixture);
+    CR_CHECK_EQ(fixture.Ring->Version, CR_PROTOCOL_VERSION);
+    CR_CHECK_EQ(fixture.Ring->SampleSize, 32);
+    CR_CHECK_EQ(fixture.Ring->Capacity, RING_CAPACITY);
+    CR_CHECK_EQ(fixture.Ring->RegisterCount, RING_REGISTERS);
+    CR_CHECK_EQ(fixture.Ring->TimestampFrequency, 1000);
+    CR_CHECK_EQ(fixture.Ring->DataOffset, sizeof(CR_RING_HEADER));
+    CR_CHECK_EQ(CrRingConsume(fixture.Ring, RingSamples, 8), 0);
+
+    for (i = 0; i < 3; i++) {
+        CrSamplerTick(fixture.Sampler, 100 + i);
+    }
+    CR_CHECK_EQ(fixture.Ring->Tail, 3);
+    CR_CHECK_EQ(CrRingConsume(fixture.Ring, RingSamples, 8), 3);
+    CR_CHECK_EQ(fixture.Ring->Head, 3);
+    for (i = 0; i < 3; i++) {
+        CR_CHECK_EQ(RingSample(i)->Timestamp, 100 + i);
+        CR_CHECK_EQ(RingSample(i)->Sequence, i);
+        CR_CHECK_EQ(RingSample(i)->FailedMask, 1u << 2);
+        CR_CHECK_EQ(RingValue(i, 0), 0x46608086);
+        CR_CHECK_EQ(RingValue(i, 1), 0x06);
+    }
+    CR_CHECK_EQ(fixture.Ring->Dropped, 0);
+    RingTearDown(&fixture);
+}
+
+// A consumer that falls behind loses the newest samples, counted in Dropped
+// and visible as a gap in Sequence; slots are reused across the wrap.
+static void
+TestRingWrapAndDrops(void)
+{
+    RING_FIXTURE fixture;
+    uint32_t round;
+    uint32_t i;
+
+    RingSetUp(&fixture);
+    for (round = 0; round < 3; round++) {
+        uint32_t first = round * 6;
+
+        for (i = 0; i < 6; i++) {
+            CrSamplerTick(fixture.Sampler, first + i);
+        }
+        CR_CHECK_EQ(fixture.Ring->Tail, (round + 1) * RING_CAPACITY);
+        CR_CHECK_EQ(fixture.Ring->Dropped, (round + 1) * 2);
+
+        // Half now and half later, so the reads straddle the wrap.
+        CR_CHECK_EQ(CrRingConsume(fixture.Ring, RingSamples, 3), 3);
+        CR_CHECK_EQ(CrRingConsume(fixture.Ring, RingSamples + 3 * 32, 8), 1);
+        CR_CHECK_EQ(CrRingConsume(fixture.Ring, RingSamples, 8), 0);
+        for (i = 0; i < RING_CAPACITY; i++) {
+            CR_CHECK_EQ(RingSample(i)->Sequence, first + i);
+            CR_CHECK_EQ(RingSample(i)->Timestamp, first + i);
+        }
+    }
+    RingTearDown(&fixture);
+}
+
+// The header is mapped writable into the consumer. Geometry scribbled over
+// is ignored, and a Head that makes no sense only drops samples.
+static void
+TestRingUntrustedHeader(void)
+{
+    RING_FIXTURE fixture;
+    CR_RING_HEADER saved;
+    uint32_t i;
+
+    RingSetUp(&fixture);
+    saved = *fixture.Ring;
+    fixture.Ring->Capacity = 0x10000;
+    fixture.Ring->SampleSize = 0x1000;
+    fixture.Ring->DataOffset = 0x100000;
+    fixture.Ring->RegisterCount = CR_MAX_SAMPLE_REGISTERS;
+    for (i = 0; i < 10; i++) {
+        CrSamplerTick(fixture.Sampler, i);
+        fixture.Ring->Head = fixture.Ring->Tail;
+    }
+    CR_CHECK_EQ(fixture.Ring->Tail, 10);
+    CR_CHECK_EQ(fixture.Ring->Dropped, 0);
+
+    // Head ahead of Tail, or too far behind it.
+    fixture.Ring->Head = fixture.Ring->Tail + 1;
+    CrSamplerTick(fixture.Sampler, 10);
+    fixture.Ring->Head = fixture.Ring->Tail - RING_CAPACITY - 1;
+    CrSamplerTick(fixture.Sampler, 11);
+    CR_CHECK_EQ(fixture.Ring->Tail, 10);
+    CR_CHECK_EQ(fixture.Ring->Dropped, 2);
+
+    // Back in order, sampling resumes where it left off.
+    fixture.Ring->Capacity = saved.Capacity;
+    fixture.Ring->SampleSize = saved.SampleSize;
+    fixture.Ring->DataOffset = saved.DataOffset;
+    fixture.Ring->RegisterCount = saved.RegisterCount;
+    fixture.Ring->Head = fixture.Ring->Tail;
+    CrSamplerTick(fixture.Sampler, 12);
+    CR_CHECK_EQ(CrRingConsume(fixture.Ring, RingSamples, 8), 1);
+    CR_CHECK_EQ(RingSample(0)->Sequence, 12);
+    CR_CHECK_EQ(RingValue(0, 0), 0x46608086);
+    RingTearDown(&fixture);
+}
+
+static void
+TestRingCreate(void)
+{
+    CR_READ_ENTRY registers[1];
+    PCR_CONFIG_BACKEND sim;
+    PCR_SAMPLER sampler;
+
+    memset(registers, 0, sizeof(registers));
+    registers[0].Width = 4;
+    CR_CHECK_EQ(CrSimCreate(1, &sim), CR_OK);
+    CR_CHECK_EQ(CrSamplerCreate(sim, registers, 1, 3, 1000, RingMemory, sizeof(RingMemory), &sampler),
+        CR_E_INVALID_PARAMETER);
+    CR_CHECK(sampler == NULL);
+    CR_CHECK_EQ(CrSamplerCreate(sim, registers, 1, 4, 1000, RingMemory, CrRingSize(1, 4) - 1, &sampler),
+        CR_E_INVALID_PARAMETER);
+    CR_CHECK_EQ(CrSamplerCreate(sim, registers, 1, 4, 1000, RingMemory, CrRingSize(1, 4), &sampler), CR_OK);
+    CrSamplerFree(sampler);
+    CrBackendClose(sim);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "ring size", TestRingSize },
+        { "ring samples", TestRingSamples },
+        { "ring wrap and drops", TestRingWrapAndDrops },
+        { "ring untrusted header", TestRingUntrustedHeader },
+        { "ring create", TestRingCreate },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
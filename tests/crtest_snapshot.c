@@ -0,0 +1,131 @@
+// crtest_snapshot.c
+//
+// Snapshot files: writing, validating and looking functions up in the
+// mapped index, and scanning a captured file as a backend. Files are
+// written to the working directory and removed afterwards.
+
+#include "crtest.h"
+
+#define SNAPSHOT_WRITTEN "crtest_snapshot_written.snap"
+#define SNAPSHOT_CAPTURE "crtest_snapshot_capture.snap"
+
+#define SNAPSHOT_MAX_RECORDS 1024
+
+static uint8_t SnapshotConfig[2][CR_CONFIG_SPACE_SIZE];
+static CR_FUNCTION_RECORD SnapshotRecords[SNAPSHOT_MAX_RECORDS];
+static CR_FUNCTION_RECORD SnapshotReplayed[SNAPSHOT_MAX_RECORDS];
+
+static CR_STATUS
+SnapshotScan(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(SNAPSHOT_MAX_RECORDS) CR_FUNCTION_RECORD* Records,
+    _Out_ uint32_t* Count
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+    CR_SCAN_OUTPUT output;
+    CR_STATUS status;
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    memset(&output, 0, sizeof(output));
+    output.Records = Records;
+    output.Capacity = SNAPSHOT_MAX_RECORDS;
+    status = CrScanTopology(Backend, &options, &output);
+    *Count = output.Count;
+    return status;
+}
+
+// Functions go in out of order and come back sorted, each with the length
+// that was captured of it.
+static void
+TestSnapshotWrite(void)
+{
+    CR_SNAPFILE_INPUT inputs[3];
+    const CR_SNAPFILE_ENTRY* entries;
+    const uint8_t* config;
+    PCR_SNAPFILE file;
+    uint32_t length;
+    uint32_t value;
+
+    CrTestHeader(SnapshotConfig[0], 0x8086, 0x4660, 0x060000, 0);
+    CrTestHeader(SnapshotConfig[1], 0x8086, 0x1533, 0x020000, 0);
+    inputs[0].Address = CrTestAddress(1, 4, 0, 0);
+    inputs[0].Config = SnapshotConfig[1];
+    inputs[0].Length = 256;
+    inputs[1].Address = CrTestAddress(0, 0, 0, 0);
+    inputs[1].Config = SnapshotConfig[0];
+    inputs[1].Length = CR_CONFIG_SPACE_SIZE;
+    inputs[2] = inputs[1];
+
+    CR_CHECK_EQ(CrSnapFileWrite(SNAPSHOT_WRITTEN, inputs, 3), CR_E_INVALID_PARAMETER);
+    inputs[2].Length = CR_CONFIG_SPACE_SIZE + 1;
+    inputs[2].Address = CrTestAddress(0, 0, 1, 0);
+    CR_CHECK_EQ(CrSnapFileWrite(SNAPSHOT_WRITTEN, inputs, 3), CR_E_INVALID_PARAMETER);
+    CR_CHECK_EQ(CrSnapFileWrite(SNAPSHOT_WRITTEN, inputs, 2), CR_OK);
+
+    CR_CHECK_EQ(CrSnapFileOpen(SNAPSHOT_WRITTEN, &file), CR_OK);
+    CR_CHECK_EQ(CrSnapFileHeader(file)->Magic, CR_SNAPFILE_MAGIC);
+    CR_CHECK_EQ(CrSnapFileHeader(file)->EntryCount, 2);
+    entries = CrSnapFileEntries(file);
+    CR_CHECK_EQ(entries[0].Key, CrAddressKey(CrTestAddress(0, 0, 0, 0)));
+    CR_CHECK_EQ(entries[1].Key, CrAddressKey(CrTestAddress(1, 4, 0, 0)));
+
+    config = CrSnapFileFind(file, CrTestAddress(1, 4, 0, 0), &length);
+    CR_CHECK(config != NULL && memcmp(config, SnapshotConfig[1], 256) == 0);
+    CR_CHECK_EQ(length, 256);
+    CR_CHECK(CrSnapFileFind(file, CrTestAddress(1, 4, 0, 1), &length) == NULL);
+    CR_CHECK_EQ(length, 0);
+
+    // As a backend: missing functions abort, bytes past the capture fail.
+    CR_CHECK(CrTestRead(CrSnapFileBackend(file), CrTestAddress(1, 4, 0, 0), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0x15338086);
+    CR_CHECK(!CrTestRead(CrSnapFileBackend(file), CrTestAddress(1, 4, 0, 0), 0x100, &value, sizeof(value)));
+    CR_CHECK(CrTestRead(CrSnapFileBackend(file), CrTestAddress(1, 4, 0, 1), 0, &value, sizeof(value)));
+    CR_CHECK_EQ(value, 0xFFFFFFFF);
+    CrSnapFileClose(file);
+
+    remove(SNAPSHOT_WRITTEN);
+    CR_CHECK(CrSnapFileOpen(SNAPSHOT_WRITTEN, &file) != CR_OK);
+}
+
+// A captured file scans like the backend it was captured from.
+static void
+TestSnapshotCapture(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    PCR_SNAPFILE file;
+    uint32_t expected;
+    uint32_t count;
+    uint32_t replayed;
+    uint32_t length;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &expected), CR_OK);
+    CR_CHECK_EQ(SnapshotScan(sim, SnapshotRecords, &count), CR_OK);
+    CR_CHECK_EQ(count, expected);
+    CR_CHECK_EQ(CrSnapFileCapture(sim, NULL, SNAPSHOT_CAPTURE), CR_OK);
+    CrBackendClose(sim);
+
+    CR_CHECK_EQ(CrSnapFileOpen(SNAPSHOT_CAPTURE, &file), CR_OK);
+    CR_CHECK_EQ(CrSnapFileHeader(file)->EntryCount, expected);
+    CR_CHECK(CrSnapFileFind(file, CrTestAddress(0, 0, 0, 0), &length) != NULL);
+    CR_CHECK_EQ(length, CR_CONFIG_SPACE_SIZE);
+    CR_CHECK(CrSnapFileFind(file, CrTestAddress(0, 0, 31, 7), &length) == NULL);
+    CR_CHECK_EQ(SnapshotScan(CrSnapFileBackend(file), SnapshotReplayed, &replayed), CR_OK);
+    CR_CHECK_EQ(replayed, count);
+    CR_CHECK(memcmp(SnapshotRecords, SnapshotReplayed, count * sizeof(CR_FUNCTION_RECORD)) == 0);
+    CrSnapFileClose(file);
+
+    remove(SNAPSHOT_CAPTURE);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "snapshot write", TestSnapshotWrite },
+        { "snapshot capture", TestSnapshotCapture },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
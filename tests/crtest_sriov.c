@@ -0,0 +1,168 @@
+// crtest_sriov.c
+//
+// SR-IOV virtual function enumeration: ranges come from each PF's SR-IOV
+// capability, clipped to routing IDs that can exist, without probing VFs.
+
+#include "crtest.h"
+
+#define SRIOV_CAP            0x100
+#define SRIOV_CONTROL        0x08
+#define SRIOV_TOTAL_VFS      0x0E
+#define SRIOV_NUM_VFS        0x10
+#define SRIOV_FIRST_OFFSET   0x14
+#define SRIOV_STRIDE         0x16
+#define SRIOV_VF_DEVICE_ID   0x1A
+#define SRIOV_VF_ENABLE      0x0001
+
+static uint8_t SriovConfig[CR_CONFIG_SPACE_SIZE];
+
+static void
+SriovAddPf(
+    _In_ PCR_CONFIG_BACKEND Sim,
+    _In_ CR_ADDRESS Address,
+    _In_ uint16_t Control,
+    _In_ uint16_t NumVfs,
+    _In_ uint16_t FirstOffset,
+    _In_ uint16_t Stride
+)
+{
+    CrTestHeader(SriovConfig, 0x8086, 0x1593, 0x020000, 0);
+    CrTestPut32(SriovConfig, SRIOV_CAP, CR_EXT_CAP_SRIOV | (1u << 16));
+    CrTestPut16(SriovConfig, SRIOV_CAP + SRIOV_CONTROL, Control);
+    CrTestPut16(SriovConfig, SRIOV_CAP + SRIOV_TOTAL_VFS, 64);
+    CrTestPut16(SriovConfig, SRIOV_CAP + SRIOV_NUM_VFS, NumVfs);
+    CrTestPut16(SriovConfig, SRIOV_CAP + SRIOV_FIRST_OFFSET, FirstOffset);
+    CrTestPut16(SriovConfig, SRIOV_CAP + SRIOV_STRIDE, Stride);
+    CrTestPut16(SriovConfig, SRIOV_CAP + SRIOV_VF_DEVICE_ID, 0x1889);
+    CR_CHECK_EQ(CrSimAddFunction(Sim, Address, SriovConfig, sizeof(SriovConfig)), CR_OK);
+}
+
+// Host bridge and four root ports, each with a PF on its own bus:
+//   1:0.0  8 VFs from routing ID 0x180, stride 2; only the first VF exists
+//   2:0.0  VFs configured but not enabled
+//   3:0.0  16 VFs from 0xFFF0, stride 4; only 4 fit below 0xFFFF
+//   4:0.0  stride 0, so every VF would share the first routing ID
+static PCR_CONFIG_BACKEND
+SriovBuild(void)
+{
+    PCR_CONFIG_BACKEND sim = NULL;
+    uint8_t bus;
+
+    CR_CHECK_EQ(CrSimCreate(16, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    for (bus = 1; bus <= 4; bus++) {
+        CR_CHECK_EQ(CrSimAddBridge(sim, CrTestAddress(0, 0, bus, 0), 0x8086, 0x7A38, bus, bus), CR_OK);
+    }
+    SriovAddPf(sim, CrTestAddress(0, 1, 0, 0), SRIOV_VF_ENABLE, 8, 0x80, 2);
+    SriovAddPf(sim, CrTestAddress(0, 2, 0, 0), 0, 8, 0x80, 2);
+    SriovAddPf(sim, CrTestAddress(0, 3, 0, 0), SRIOV_VF_ENABLE, 16, 0xFFF0 - 0x300, 4);
+    SriovAddPf(sim, CrTestAddress(0, 4, 0, 0), SRIOV_VF_ENABLE, 8, 0x08, 0);
+
+    // The first VF of 1:0.0, whose class code and revision the range reports.
+    CrTestHeader(SriovConfig, 0x8086, 0x1889, 0x020000, 0);
+    SriovConfig[CR_CFG_REVISION_ID] = 0x05;
+    CR_CHECK_EQ(CrSimAddFunction(sim, CrTestAddress(0, 1, 0x10, 0), SriovConfig, CR_CONFIG_HEADER_SIZE), CR_OK);
+    return sim;
+}
+
+static void
+TestSriovRanges(void)
+{
+    PCR_CONFIG_BACKEND sim = SriovBuild();
+    CR_VF_RANGE ranges[8];
+    CR_ADDRESS address;
+    uint32_t total;
+    uint32_t functions;
+
+    CR_CHECK_EQ(CrScanVirtualFunctions(sim, NULL, ranges, 8, &total, &functions), CR_OK);
+    CR_CHECK_EQ(total, 3);
+    CR_CHECK_EQ(functions, 8 + 4 + 1);
+
+    CR_CHECK_EQ(ranges[0].Bus, 1);
+    CR_CHECK_EQ(ranges[0].FirstRoutingId, 0x180);
+    CR_CHECK_EQ(ranges[0].Stride, 2);
+    CR_CHECK_EQ(ranges[0].Count, 8);
+    CR_CHECK_EQ(ranges[0].TotalVFs, 64);
+    CR_CHECK_EQ(ranges[0].VendorId, 0x8086);
+    CR_CHECK_EQ(ranges[0].DeviceId, 0x1889);
+    CR_CHECK_EQ(ranges[0].CapOffset, SRIOV_CAP);
+    CR_CHECK_EQ(ranges[0].ClassCode, 0x020000);
+    CR_CHECK_EQ(ranges[0].RevisionId, 0x05);
+
+    // VFs that were never added still come out of the arithmetic.
+    address = CrVfAddress(&ranges[0], 7);
+    CR_CHECK_EQ(address.Bus, 1);
+    CR_CHECK_EQ(address.Device, 0x11);
+    CR_CHECK_EQ(address.Function, 6);
+
+    CR_CHECK_EQ(ranges[1].Bus, 3);
+    CR_CHECK_EQ(ranges[1].FirstRoutingId, 0xFFF0);
+    CR_CHECK_EQ(ranges[1].Count, 4);
+    address = CrVfAddress(&ranges[1], 3);
+    CR_CHECK_EQ(address.Bus, 0xFF);
+    CR_CHECK_EQ(address.Device, 0x1F);
+    CR_CHECK_EQ(address.Function, 4);
+    // No VF there to read a class code from.
+    CR_CHECK_EQ(ranges[1].ClassCode, 0xFFFFFF);
+
+    CR_CHECK_EQ(ranges[2].Bus, 4);
+    CR_CHECK_EQ(ranges[2].FirstRoutingId, 0x408);
+    CR_CHECK_EQ(ranges[2].Stride, 0);
+    CR_CHECK_EQ(ranges[2].Count, 1);
+    CrBackendClose(sim);
+}
+
+static void
+TestSriovOverflow(void)
+{
+    PCR_CONFIG_BACKEND sim = SriovBuild();
+    CR_VF_RANGE ranges[1];
+    uint8_t buffer[sizeof(CR_VF_HEADER) + 2 * sizeof(CR_VF_RANGE)];
+    const CR_VF_HEADER* header = (const CR_VF_HEADER*)buffer;
+    const CR_VF_RANGE* wire = (const CR_VF_RANGE*)(header + 1);
+    uint32_t total;
+    uint32_t functions;
+    size_t written;
+
+    CR_CHECK_EQ(CrScanVirtualFunctions(sim, NULL, ranges, 1, &total, &functions), CR_E_MORE_DATA);
+    CR_CHECK_EQ(total, 3);
+    CR_CHECK_EQ(functions, 13);
+    CR_CHECK_EQ(ranges[0].Bus, 1);
+
+    CR_CHECK_EQ(CrScanVirtualFunctionsToBuffer(sim, NULL, buffer, sizeof(buffer), &written), CR_E_MORE_DATA);
+    CR_CHECK_EQ(written, sizeof(buffer));
+    CR_CHECK_EQ(header->RangeSize, sizeof(CR_VF_RANGE));
+    CR_CHECK_EQ(header->RangeCount, 2);
+    CR_CHECK_EQ(header->TotalCount, 3);
+    CR_CHECK_EQ(header->FunctionCount, 13);
+    CR_CHECK_EQ(wire[1].Bus, 3);
+    CrBackendClose(sim);
+}
+
+// The sriov topology's VFs are plain functions without the capability.
+static void
+TestSriovWithoutCapability(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    uint32_t count;
+    uint32_t total;
+    uint32_t functions;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestSriov, &sim, &count), CR_OK);
+    CR_CHECK_EQ(CrScanVirtualFunctions(sim, NULL, NULL, 0, &total, &functions), CR_OK);
+    CR_CHECK_EQ(total, 0);
+    CR_CHECK_EQ(functions, 0);
+    CrBackendClose(sim);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "sriov ranges", TestSriovRanges },
+        { "sriov overflow", TestSriovOverflow },
+        { "sriov without capability", TestSriovWithoutCapability },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
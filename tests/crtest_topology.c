@@ -0,0 +1,244 @@
+// crtest_topology.c
+//
+// Topology scans of the synthetic topologies: every function is found once,
+// in order, whatever the worker count, and the probing of root buses stays
+// within the buses the backend reports populated.
+
+#include "crtest.h"
+
+#define TOPOLOGY_MAX_RECORDS 8192
+
+static CR_FUNCTION_RECORD TopologyRecords[TOPOLOGY_MAX_RECORDS];
+static CR_FUNCTION_RECORD TopologyParallel[TOPOLOGY_MAX_RECORDS];
+
+static CR_STATUS
+TopologyScan(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _In_ uint32_t Flags,
+    _In_ uint16_t Segment,
+    _In_opt_ PCR_EXECUTOR Executor,
+    _Out_writes_(Capacity) CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Capacity,
+    _Out_ PCR_SCAN_OUTPUT Output
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = Flags;
+    options.Segment = Segment;
+    options.Executor = Executor;
+    Output->Records = Records;
+    Output->Capacity = Capacity;
+    Output->Count = 0;
+    Output->Total = 0;
+    return CrScanTopology(Backend, &options, Output);
+}
+
+static void
+TopologyCheckSorted(
+    _In_reads_(Count) const CR_FUNCTION_RECORD* Records,
+    _In_ uint32_t Count
+)
+{
+    uint32_t i;
+
+    for (i = 1; i < Count; i++) {
+        uint64_t previous = ((uint64_t)Records[i - 1].Segment << 16) | ((uint32_t)Records[i - 1].Bus << 8) |
+            ((uint32_t)Records[i - 1].Device << 3) | Records[i - 1].Function;
+        uint64_t current = ((uint64_t)Records[i].Segment << 16) | ((uint32_t)Records[i].Bus << 8) |
+            ((uint32_t)Records[i].Device << 3) | Records[i].Function;
+
+        if (previous >= current) {
+            CR_CHECK(previous < current);
+            return;
+        }
+    }
+}
+
+// Every function is reported exactly once, and a parallel walk returns the
+// same records as the sequential one.
+static void
+TestScanTopologies(void)
+{
+    CR_EXECUTOR executor;
+    uint32_t type;
+
+    CrThreadExecutorInit(&executor, 4);
+    for (type = 0; type < CrTestTopologyCount; type++) {
+        PCR_CONFIG_BACKEND sim;
+        CR_SCAN_OUTPUT sequential;
+        CR_SCAN_OUTPUT parallel;
+        uint32_t count;
+        CR_STATUS status;
+
+        CR_CHECK_EQ(CrTestBuild((CR_TEST_TOPOLOGY)type, &sim, &count), CR_OK);
+        if (sim == NULL) {
+            continue;
+        }
+        status = TopologyScan(sim, CR_TOPOLOGY_ALL_SEGMENTS, 0, NULL, TopologyRecords, TOPOLOGY_MAX_RECORDS,
+            &sequential);
+        if (status != CR_OK || sequential.Count != count) {
+            fprintf(stderr, "    topology %s\n", CrTestTopologyName((CR_TEST_TOPOLOGY)type));
+        }
+        CR_CHECK_EQ(status, CR_OK);
+        CR_CHECK_EQ(sequential.Count, count);
+        CR_CHECK_EQ(sequential.Total, count);
+        TopologyCheckSorted(TopologyRecords, sequential.Count);
+
+        status = TopologyScan(sim, CR_TOPOLOGY_ALL_SEGMENTS, 0, &executor, TopologyParallel, TOPOLOGY_MAX_RECORDS,
+            &parallel);
+        CR_CHECK_EQ(status, CR_OK);
+        CR_CHECK_EQ(parallel.Count, sequential.Count);
+        CR_CHECK(memcmp(TopologyParallel, TopologyRecords, (size_t)sequential.Count * sizeof(CR_FUNCTION_RECORD)) == 0);
+        CrBackendClose(sim);
+    }
+}
+
+static void
+TestScanFlatDecode(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_SCAN_OUTPUT output;
+    uint32_t count;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestFlat, &sim, &count), CR_OK);
+    CR_CHECK_EQ(count, 1 + 31 * 8);
+    CR_CHECK_EQ(TopologyScan(sim, 0, 0, NULL, TopologyRecords, TOPOLOGY_MAX_RECORDS, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, count);
+    CR_CHECK_EQ(TopologyRecords[0].VendorId, 0x8086);
+    CR_CHECK_EQ(TopologyRecords[0].BaseClass, 0x06);
+    // 0:1.0 comes right after the host bridge and is a multifunction USB controller.
+    CR_CHECK_EQ(TopologyRecords[1].Device, 1);
+    CR_CHECK_EQ(TopologyRecords[1].Function, 0);
+    CR_CHECK_EQ(TopologyRecords[1].DeviceId, 0x7A01);
+    CR_CHECK_EQ(TopologyRecords[1].BaseClass, 0x0C);
+    CR_CHECK_EQ(TopologyRecords[1].SubClass, 0x03);
+    CR_CHECK_EQ(TopologyRecords[1].ProgIf, 0x30);
+    CR_CHECK_EQ(TopologyRecords[1].HeaderType, CR_HEADER_TYPE_MULTIFUNCTION);
+    CR_CHECK_EQ(TopologyRecords[1].Flags, 0);
+    CrBackendClose(sim);
+}
+
+// Buses reached only through bridges, and one segment at a time.
+static void
+TestScanSegmentsAndBridges(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_SCAN_OUTPUT output;
+    uint32_t count;
+    uint32_t i;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestSparse, &sim, &count), CR_OK);
+    CR_CHECK_EQ(count, 4 * 7);
+
+    // Nothing hangs off a bridge, so only each segment's host bridge is found.
+    CR_CHECK_EQ(TopologyScan(sim, CR_TOPOLOGY_ALL_SEGMENTS | CR_TOPOLOGY_BRIDGES_ONLY, 0, NULL, TopologyRecords,
+        TOPOLOGY_MAX_RECORDS, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, 4);
+    for (i = 0; i < output.Count; i++) {
+        CR_CHECK_EQ(TopologyRecords[i].Bus, 0);
+    }
+
+    CR_CHECK_EQ(TopologyScan(sim, 0, 0x10, NULL, TopologyRecords, TOPOLOGY_MAX_RECORDS, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, 7);
+    for (i = 0; i < output.Count; i++) {
+        CR_CHECK_EQ(TopologyRecords[i].Segment, 0x10);
+    }
+    CR_CHECK_EQ(TopologyRecords[1].Bus, 0x20);
+    CR_CHECK_EQ(TopologyRecords[6].Bus, 0xE0);
+    CR_CHECK_EQ(TopologyRecords[6].Device, 0x1F);
+    CrBackendClose(sim);
+}
+
+// An empty device 0 on a bus behind a bridge answers like a master abort,
+// and the devices further up the bus are still found.
+static void
+TestScanEmptyDeviceZero(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_SCAN_OUTPUT output;
+
+    CR_CHECK_EQ(CrSimCreate(8, &sim), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 0, 0, 0), 0x8086, 0x4660, 0x060000, 0), CR_OK);
+    CR_CHECK_EQ(CrSimAddBridge(sim, CrTestAddress(0, 0, 1, 0), 0x8086, 0x7A38, 1, 1), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 1, 3, 0), 0x8086, 0x1533, 0x020000, 0), CR_OK);
+    CR_CHECK_EQ(CrSimAddDevice(sim, CrTestAddress(0, 1, 0x1C, 0), 0x144D, 0xA80A, 0x010802, 0), CR_OK);
+
+    CR_CHECK_EQ(TopologyScan(sim, 0, 0, NULL, TopologyRecords, TOPOLOGY_MAX_RECORDS, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, 4);
+    TopologyCheckSorted(TopologyRecords, output.Count);
+    CR_CHECK_EQ(TopologyRecords[2].Bus, 1);
+    CR_CHECK_EQ(TopologyRecords[2].Device, 3);
+    CR_CHECK_EQ(TopologyRecords[3].Device, 0x1C);
+    CrBackendClose(sim);
+}
+
+// With EnumerateBuses, empty root buses are not probed: a sparse scan costs
+// far less than the one device-0 read per bus a blind sweep would need.
+static void
+TestScanSparseProbing(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_TEST_BACKEND counting;
+    CR_SCAN_OUTPUT output;
+    uint32_t count;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestSparse, &sim, &count), CR_OK);
+    CR_CHECK(sim->EnumerateBuses != NULL);
+    CrTestWrap(sim, &counting);
+    CR_CHECK_EQ(TopologyScan(&counting.Base, CR_TOPOLOGY_ALL_SEGMENTS, 0, NULL, TopologyRecords,
+        TOPOLOGY_MAX_RECORDS, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, count);
+    CR_CHECK(counting.Reads < 4 * 256);
+
+    // Without the hook every bus is a candidate, and the result is the same.
+    counting.Base.EnumerateBuses = NULL;
+    counting.Reads = 0;
+    CR_CHECK_EQ(TopologyScan(&counting.Base, CR_TOPOLOGY_ALL_SEGMENTS, 0, NULL, TopologyParallel,
+        TOPOLOGY_MAX_RECORDS, &output), CR_OK);
+    CR_CHECK_EQ(output.Count, count);
+    CR_CHECK(counting.Reads >= 4 * 256);
+    CR_CHECK(memcmp(TopologyParallel, TopologyRecords, (size_t)count * sizeof(CR_FUNCTION_RECORD)) == 0);
+    CrBackendClose(sim);
+}
+
+// A short output keeps Count at Capacity and Total counting on.
+static void
+TestScanOverflow(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    CR_SCAN_OUTPUT output;
+    uint32_t count;
+    size_t written;
+    uint8_t buffer[sizeof(CR_SCAN_HEADER) + 3 * sizeof(CR_FUNCTION_RECORD)];
+    const CR_SCAN_HEADER* header = (const CR_SCAN_HEADER*)buffer;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &count), CR_OK);
+    CR_CHECK_EQ(TopologyScan(sim, 0, 0, NULL, TopologyRecords, 10, &output), CR_E_MORE_DATA);
+    CR_CHECK_EQ(output.Count, 10);
+    CR_CHECK_EQ(output.Total, count);
+
+    CR_CHECK_EQ(CrScanTopologyToBuffer(sim, NULL, buffer, sizeof(buffer), &written), CR_E_MORE_DATA);
+    CR_CHECK_EQ(header->Version, CR_PROTOCOL_VERSION);
+    CR_CHECK_EQ(header->RecordSize, sizeof(CR_FUNCTION_RECORD));
+    CR_CHECK_EQ(header->RecordCount, 3);
+    CR_CHECK_EQ(header->TotalCount, count);
+    CR_CHECK_EQ(written, sizeof(buffer));
+    CrBackendClose(sim);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "scan topologies", TestScanTopologies },
+        { "scan flat decode", TestScanFlatDecode },
+        { "scan segments and bridges", TestScanSegmentsAndBridges },
+        { "scan empty device zero", TestScanEmptyDeviceZero },
+        { "scan sparse probing", TestScanSparseProbing },
+        { "scan overflow", TestScanOverflow },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
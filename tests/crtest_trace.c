@@ -0,0 +1,91 @@
+// crtest_trace.c
+//
+// Recorded config-space traces: a scan through the recorder, saved and
+// replayed as a backend. The trace is written to the working directory and
+// removed afterwards.
+
+#include "crtest.h"
+
+#define TRACE_FILE "crtest_trace.trace"
+
+#define TRACE_MAX_RECORDS 1024
+
+static CR_FUNCTION_RECORD TraceRecords[TRACE_MAX_RECORDS];
+static CR_FUNCTION_RECORD TraceReplayed[TRACE_MAX_RECORDS];
+
+static CR_STATUS
+TraceScan(
+    _In_ PCR_CONFIG_BACKEND Backend,
+    _Out_writes_(TRACE_MAX_RECORDS) CR_FUNCTION_RECORD* Records,
+    _Out_ uint32_t* Count
+)
+{
+    CR_TOPOLOGY_OPTIONS options;
+    CR_SCAN_OUTPUT output;
+    CR_STATUS status;
+
+    memset(&options, 0, sizeof(options));
+    options.Flags = CR_TOPOLOGY_ALL_SEGMENTS;
+    memset(&output, 0, sizeof(output));
+    output.Records = Records;
+    output.Capacity = TRACE_MAX_RECORDS;
+    status = CrScanTopology(Backend, &options, &output);
+    *Count = output.Count;
+    return status;
+}
+
+// A scan recorded through the recorder replays to the same records without
+// a single miss; reads the trace never saw fail.
+static void
+TestTraceReplay(void)
+{
+    PCR_CONFIG_BACKEND sim;
+    PCR_TRACE_RECORDER recorder;
+    PCR_TRACE trace;
+    CR_TRACE_REPLAY_STATS stats;
+    const CR_TRACE_RECORD* record;
+    uint32_t expected;
+    uint32_t count;
+    uint32_t replayed;
+    uint32_t records = 0;
+    uint32_t value;
+
+    CR_CHECK_EQ(CrTestBuild(CrTestDeep, &sim, &expected), CR_OK);
+    CR_CHECK_EQ(CrTraceRecorderCreate(sim, &recorder), CR_OK);
+    CR_CHECK_EQ(TraceScan(CrTraceRecorderBackend(recorder), TraceRecords, &count), CR_OK);
+    CR_CHECK_EQ(count, expected);
+    CR_CHECK_EQ(CrTraceRecorderSave(recorder, TRACE_FILE), CR_OK);
+    CrTraceRecorderFree(recorder);
+    CrBackendClose(sim);
+
+    CR_CHECK_EQ(CrTraceOpen(TRACE_FILE, 0, &trace), CR_OK);
+    for (record = CrTraceNext(trace, NULL); record != NULL; record = CrTraceNext(trace, record)) {
+        records++;
+    }
+    CR_CHECK(records != 0);
+
+    CR_CHECK_EQ(TraceScan(CrTraceBackend(trace), TraceReplayed, &replayed), CR_OK);
+    CR_CHECK_EQ(replayed, count);
+    CR_CHECK(memcmp(TraceRecords, TraceReplayed, count * sizeof(CR_FUNCTION_RECORD)) == 0);
+    CrTraceReplayStats(trace, &stats);
+    CR_CHECK_EQ(stats.Misses, 0);
+    CR_CHECK_EQ(stats.Matched, stats.Reads);
+    CR_CHECK(stats.Reads >= records);
+
+    CR_CHECK(!CrTestRead(CrTraceBackend(trace), CrTestAddress(0, 0, 0, 0), 0x200, &value, sizeof(value)));
+    CrTraceReplayStats(trace, &stats);
+    CR_CHECK_EQ(stats.Misses, 1);
+    CrTraceClose(trace);
+
+    remove(TRACE_FILE);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "trace replay", TestTraceReplay },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}
@@ -0,0 +1,170 @@
+// crtest_writer.cpp
+//
+// The record writer's three formats: NDJSON and CSV text, and binary frames
+// that carry records byte for byte whatever the buffer size.
+
+#include "crtest.h"
+#include "../CRclient/crclient.h"
+
+#include <string>
+
+static std::string
+WriterContents(
+    _In_ FILE* Stream
+)
+{
+    std::string text;
+    char chunk[4096];
+    size_t read;
+
+    rewind(Stream);
+    while ((read = fread(chunk, 1, sizeof(chunk), Stream)) != 0) {
+        text.append(chunk, read);
+    }
+    return text;
+}
+
+static void
+WriterRecords(
+    _Out_writes_(2) CR_FUNCTION_RECORD* Records
+)
+{
+    memset(Records, 0, 2 * sizeof(CR_FUNCTION_RECORD));
+    Records[0].VendorId = 0x8086;
+    Records[0].DeviceId = 0x4660;
+    Records[0].BaseClass = 0x06;
+    Records[0].RevisionId = 0x01;
+    Records[1].Segment = 0x10;
+    Records[1].Bus = 0xA3;
+    Records[1].Device = 0x1F;
+    Records[1].Function = 7;
+    Records[1].HeaderType = 0x80;
+    Records[1].VendorId = 0x10DE;
+    Records[1].DeviceId = 0x2204;
+    Records[1].BaseClass = 0x03;
+    Records[1].ProgIf = 0x01;
+    Records[1].Flags = CR_RECORD_REMOVED;
+}
+
+static void
+TestWriterText(void)
+{
+    CR_FUNCTION_RECORD records[2];
+    CR_DELTA_HEADER delta;
+
+    WriterRecords(records);
+    memset(&delta, 0, sizeof(delta));
+    delta.Generation = 7;
+    delta.RecordCount = 1;
+
+    FILE* stream = tmpfile();
+    CR_CHECK(stream != NULL);
+    if (stream == NULL) {
+        return;
+    }
+    {
+        CrRecordWriter writer(stream, CrOutputJson);
+        CR_CHECK_EQ(writer.WriteScan(records, 2), CR_OK);
+        CR_CHECK_EQ(writer.WriteDelta(&delta, &records[1]), CR_OK);
+        // Nothing is written before a flush.
+        CR_CHECK_EQ(WriterContents(stream).size(), 0);
+        CR_CHECK_EQ(writer.Flush(), CR_OK);
+    }
+    CR_CHECK(WriterContents(stream) ==
+        "{\"type\":\"function\",\"address\":\"0000:00:00.0\",\"vendor\":\"8086\",\"device\":\"4660\","
+            "\"class\":\"060000\",\"revision\":\"01\",\"header_type\":\"00\"}\n"
+        "{\"type\":\"function\",\"address\":\"0010:a3:1f.7\",\"vendor\":\"10de\",\"device\":\"2204\","
+            "\"class\":\"030001\",\"revision\":\"00\",\"header_type\":\"80\"}\n"
+        "{\"type\":\"delta\",\"generation\":7,\"full\":0,\"changes\":1}\n"
+        "{\"type\":\"change\",\"generation\":7,\"change\":\"removed\",\"address\":\"0010:a3:1f.7\","
+            "\"vendor\":\"10de\",\"device\":\"2204\",\"class\":\"030001\",\"revision\":\"00\",\"header_type\":\"80\"}\n");
+    fclose(stream);
+
+    // CSV names the columns again only when they change.
+    stream = tmpfile();
+    CR_CHECK(stream != NULL);
+    if (stream == NULL) {
+        return;
+    }
+    {
+        CrRecordWriter writer(stream, CrOutputCsv);
+        CR_CHECK_EQ(writer.WriteScan(records, 1), CR_OK);
+        CR_CHECK_EQ(writer.WriteScan(&records[1], 1), CR_OK);
+        CR_CHECK_EQ(writer.WriteDelta(&delta, &records[1]), CR_OK);
+        CR_CHECK_EQ(writer.WriteScan(records, 1), CR_OK);
+    }
+    CR_CHECK(WriterContents(stream) ==
+        "type,address,vendor,device,class,revision,header_type\n"
+        "function,0000:00:00.0,8086,4660,060000,01,00\n"
+        "function,0010:a3:1f.7,10de,2204,030001,00,80\n"
+        "type,generation,full,changes\n"
+        "delta,7,0,1\n"
+        "type,generation,change,address,vendor,device,class,revision,header_type\n"
+        "change,7,removed,0010:a3:1f.7,10de,2204,030001,00,80\n"
+        "type,address,vendor,device,class,revision,header_type\n"
+        "function,0000:00:00.0,8086,4660,060000,01,00\n");
+    fclose(stream);
+}
+
+// Binary frames carry the records byte for byte, and a small buffer only
+// changes how they reach the stream.
+static void
+TestWriterBinary(void)
+{
+    CR_FUNCTION_RECORD records[2];
+    CR_DELTA_HEADER delta;
+    CR_STREAM_FRAME frame;
+
+    WriterRecords(records);
+    records[0].Config[0x3F] = 0x5A;
+    memset(&delta, 0, sizeof(delta));
+    delta.Version = CR_PROTOCOL_VERSION;
+    delta.RecordSize = sizeof(CR_FUNCTION_RECORD);
+    delta.RecordCount = 2;
+    delta.Flags = CR_DELTA_FULL;
+    delta.Generation = 3;
+
+    FILE* stream = tmpfile();
+    CR_CHECK(stream != NULL);
+    if (stream == NULL) {
+        return;
+    }
+    {
+        CrRecordWriter writer(stream, CrOutputBinary, 64);
+        CR_CHECK_EQ(writer.WriteScan(records, 2), CR_OK);
+        CR_CHECK_EQ(writer.WriteDelta(&delta, records), CR_OK);
+    }
+
+    std::string data = WriterContents(stream);
+    size_t scanSize = sizeof(frame) + sizeof(records);
+    CR_CHECK_EQ(data.size(), scanSize + sizeof(frame) + sizeof(delta) + sizeof(records));
+    if (data.size() == scanSize + sizeof(frame) + sizeof(delta) + sizeof(records)) {
+        memcpy(&frame, data.data(), sizeof(frame));
+        CR_CHECK_EQ(frame.Magic, CR_STREAM_MAGIC);
+        CR_CHECK_EQ(frame.Kind, CR_STREAM_SCAN);
+        CR_CHECK_EQ(frame.HeaderSize, 0);
+        CR_CHECK_EQ(frame.ItemSize, sizeof(CR_FUNCTION_RECORD));
+        CR_CHECK_EQ(frame.ItemCount, 2);
+        CR_CHECK(memcmp(data.data() + sizeof(frame), records, sizeof(records)) == 0);
+
+        memcpy(&frame, data.data() + scanSize, sizeof(frame));
+        CR_CHECK_EQ(frame.Magic, CR_STREAM_MAGIC);
+        CR_CHECK_EQ(frame.Kind, CR_STREAM_DELTA);
+        CR_CHECK_EQ(frame.HeaderSize, sizeof(delta));
+        CR_CHECK_EQ(frame.ItemCount, 2);
+        CR_CHECK(memcmp(data.data() + scanSize + sizeof(frame), &delta, sizeof(delta)) == 0);
+        CR_CHECK(memcmp(data.data() + scanSize + sizeof(frame) + sizeof(delta), records, sizeof(records)) == 0);
+    }
+    fclose(stream);
+}
+
+int
+main(void)
+{
+    static const CR_TEST tests[] = {
+        { "writer text", TestWriterText },
+        { "writer binary", TestWriterBinary },
+    };
+
+    return CrTestRun(tests, sizeof(tests) / sizeof(tests[0]));
+}